@@ -14,37 +14,13 @@ namespace vmpattack
         //
         if ( expression )
         {
-            // Try to get operation descriptor for the current instruction
+            // If the instruction writes to the expression target register, and has an operation
+            // descriptor, add it to the expression.
             //
-            if ( auto operation_desc = operation_desc_from_instruction( instruction ) )
+            if ( instruction->writes_base( expression_register_base ) )
             {
-                uint8_t read_count = 0, write_count = 0;
-                cs_regs read_regs, write_regs;
-
-                // Fetch registers read/written to by instruction
-                //
-                cs_regs_access( disassembler::get().get_handle(), &instruction->ins, read_regs, &read_count, write_regs, &write_count );
-
-                // Flip flag if expression target register is being written to
-                //
-                bool writes_to_reg = false;
-                for ( int i = 0; i < write_count; i++ )
-                {
-                    if ( register_base_equal( ( x86_reg )write_regs[ i ], expression_register ) )
-                    {
-                        writes_to_reg = true;
-                        break;
-                    }
-                }
-
-                // If it does write to the register, add it to the expression
-                //
-                if ( writes_to_reg )
-                {
-                    if ( auto operation = arithmetic_operation::from_instruction( instruction ) )
-                        expression->operations.push_back( *operation );
-
-                }
+                if ( auto operation = arithmetic_operation::from_instruction( instruction ) )
+                    expression->operations.push_back( *operation );
             }
         }
 
@@ -52,8 +28,8 @@ namespace vmpattack
         // to update them using the current instruction.
         //
         if ( tracked_registers.size() > 0
-          && ( instruction->ins.id == X86_INS_MOV
-          || instruction->ins.id == X86_INS_XCHG ) )
+          && ( instruction->id == X86_INS_MOV
+          || instruction->id == X86_INS_XCHG ) )
         {
             // If both operands are registers.
             //
@@ -64,14 +40,14 @@ namespace vmpattack
                 //
                 for ( x86_reg* tracked_reg : tracked_registers )
                 {
-                    if ( instruction->ins.id == X86_INS_MOV )
+                    if ( instruction->id == X86_INS_MOV )
                     {
                         // operand( 0 ) = operand( 1 )
                         //
                         if ( instruction->operand( 1 ).reg == *tracked_reg )
                             *tracked_reg = instruction->operand( 0 ).reg;
                     }
-                    else if ( instruction->ins.id == X86_INS_XCHG )
+                    else if ( instruction->id == X86_INS_XCHG )
                     {
                         // operand ( 0 ) = operand( 1 ) && operand( 1 ) = operand( 0 )
                         //
@@ -88,12 +64,12 @@ namespace vmpattack
         //
         if ( pushed_registers )
         {
-            if ( instruction->ins.id == X86_INS_PUSH
+            if ( instruction->id == X86_INS_PUSH
               && instruction->operand( 0 ).type == X86_OP_REG )
                 pushed_registers->push_back( instruction->operand( 0 ).reg );
-            else if ( instruction->ins.id == X86_INS_PUSHFQ
-                   || instruction->ins.id == X86_INS_PUSHFD
-                   || instruction->ins.id == X86_INS_PUSHF )
+            else if ( instruction->id == X86_INS_PUSHFQ
+                   || instruction->id == X86_INS_PUSHFD
+                   || instruction->id == X86_INS_PUSHF )
                 pushed_registers->push_back( X86_REG_EFLAGS );
         }
 
@@ -101,12 +77,12 @@ namespace vmpattack
         //
         if ( popped_registers )
         {
-            if ( instruction->ins.id == X86_INS_POP
+            if ( instruction->id == X86_INS_POP
                  && instruction->operand( 0 ).type == X86_OP_REG )
                 popped_registers->push_back( instruction->operand( 0 ).reg );
-            else if ( instruction->ins.id == X86_INS_POPFQ
-                      || instruction->ins.id == X86_INS_POPFD
-                      || instruction->ins.id == X86_INS_POPF )
+            else if ( instruction->id == X86_INS_POPFQ
+                      || instruction->id == X86_INS_POPFD
+                      || instruction->id == X86_INS_POPF )
                 popped_registers->push_back( X86_REG_EFLAGS );
         }
     }
@@ -2,6 +2,10 @@
 #include <cstdint>
 #include <memory>
 #include <tuple>
+#include <utility>
+#include <concepts>
+#include <functional>
+#include <type_traits>
 #include "instruction_stream.hpp"
 #include "arithmetic_expression.hpp"
 #include "arithmetic_operations.hpp"
@@ -10,17 +14,133 @@
 
 namespace vmpattack
 {
-    // Allows specification if the argument is an _in_ or _out_ argument.
-    // If .second is true, it behaves as an _in_ variable.
-    // Otherwise, it behaves as an _out_ variable.
+    // An _in_ argument: the matched value must equal the bound value.
+    // After a successful match, the bound value is updated to the matched one, unless it is const.
+    // This matters when comparing via bases, or when the template normalizes the value.
     //
-    // While this behaviour is indeed only useful at compile time, and could very 
-    // possibly be implemented via templates and metaprogramming, this std::pair
-    // runtime approach was chosen as it is believed that, in this particular case,
-    // its simplicity is more important than any minor performance losses.
+    template <typename T>
+    struct in
+    {
+        static constexpr bool constrained = true;
+
+        T& value;
+
+        explicit in( T& value )
+            : value( value )
+        {}
+
+        // Determines whether the matched value satisfies the constraint, using the given comparison.
+        //
+        template <typename U, typename F = std::equal_to<>>
+        bool accepts( const U& matched, F equal = {} ) const
+        {
+            return equal( matched, value );
+        }
+
+        // Writes the matched value back to the bound value.
+        //
+        template <typename U>
+        void assign( const U& matched ) const
+        {
+            if constexpr ( !std::is_const_v<T> )
+                value = ( T )matched;
+        }
+    };
+
+    // An _out_ argument: any value is matched, and written to the bound value.
     //
     template <typename T>
-    using inout = std::pair<T&, bool>;
+    struct out
+    {
+        static constexpr bool constrained = false;
+
+        T& value;
+
+        explicit out( T& value )
+            : value( value )
+        {}
+
+        // Any matched value satisfies an _out_ argument.
+        //
+        template <typename U, typename F = std::equal_to<>>
+        constexpr bool accepts( const U& matched, F equal = {} ) const
+        {
+            return true;
+        }
+
+        // Writes the matched value to the bound value.
+        //
+        template <typename U>
+        void assign( const U& matched ) const
+        {
+            value = ( T )matched;
+        }
+    };
+
+    // Satisfied by the in / out argument bindings.
+    // The direction of each binding is known at compile time, so the checks of _out_ arguments
+    // fold away entirely.
+    //
+    template <typename T>
+    concept binding = requires( const T& argument )
+    {
+        { T::constrained } -> std::convertible_to<bool>;
+        argument.value;
+    };
+
+    // Compares two registers, either via their bases or strictly.
+    //
+    template <bool match_bases>
+    inline bool registers_equal( x86_reg first, x86_reg second )
+    {
+        if constexpr ( match_bases )
+            return register_base_equal( first, second );
+        else
+            return first == second;
+    }
+
+    class analysis_context;
+
+    // The result of a chain of analysis_context templates, and the means of continuing it.
+    // Once any template in the chain fails, the remaining ones are skipped, and the chain
+    // converts to false.
+    //
+    template <typename T>
+    class analysis_chain
+    {
+    private:
+        // The context the chain operates on.
+        // Non-owning.
+        //
+        T* context;
+
+        // Whether or not every template in the chain so far has matched.
+        //
+        bool succeeded;
+
+    public:
+        // Constructs the chain's state from the context, after the last template was applied.
+        //
+        analysis_chain( T* context )
+            : context( context ), succeeded( !context->has_failed() )
+        {}
+
+        // Converts a chain over a derived context into a chain over the base context.
+        //
+        template <typename U> requires std::derived_from<U, T>
+        analysis_chain( const analysis_chain<U>& other )
+            : context( other.get() ), succeeded( other )
+        {}
+
+        // Continues the chain.
+        //
+        T* operator->() const { return context; }
+
+        // Getters.
+        //
+        T*  get()               const { return context; }
+        operator bool()         const { return succeeded; }
+    };
 
     // This class walks over instruction_stream to provide analysis
     // capabilities. These include template pattern matching, arithmetic expresion
@@ -45,6 +165,10 @@ namespace vmpattack
         //
         x86_reg expression_register;
 
+        // The base of the expression's target register, as per get_register_base.
+        //
+        x86_reg expression_register_base;
+
         // The registers used for simple tracking among MOV / XCHG %reg, %reg.
         //
         std::vector<x86_reg*> tracked_registers;
@@ -57,25 +181,36 @@ namespace vmpattack
         //
         std::vector<x86_reg>* popped_registers;
 
+        // Whether or not a template failed to match since the context was created, or last rewound.
+        // Any further templates are skipped until then.
+        //
+        bool failed;
+
         // Processes the instruction, updating any properties that the instruction
         // may change.
         //
         void process( const instruction* instruction );
 
+        // Determines whether the instruction's operands are exactly of the given types.
+        // X86_OP_INVALID matches any type.
+        //
+        template <x86_op_type... operand_types, size_t... indices>
+        static bool has_operand_types( const instruction* instruction, std::index_sequence<indices...> )
+        {
+            return ( ( operand_types == X86_OP_INVALID || instruction->operand_type( indices ) == operand_types ) && ... );
+        }
+
     protected:
         // A helper to pattern match the instruction for a given lambda template.
-        // Allows for specification of optional operand count / type filters.
-        // If specified, parameter operand_types size must match num_operands.
+        // If any operand types are specified, only instructions with exactly that many operands, of
+        // those types, are passed to the lambda. The filter is resolved at compile time.
         //
-        template <typename T>
-        analysis_context* match( T match, std::optional<uint32_t> num_operands = {}, std::vector<std::optional<x86_op_type>> operand_types = {} )
+        template <x86_op_type... operand_types, typename T>
+        analysis_chain<analysis_context> match( T&& match )
         {
-            fassert( operand_types.size() == 0 || operand_types.size() == num_operands && "A type (even empty) must be specified for each operand." );
-
-            // If we are in an invalid/dead chain, just return nullptr until we
-            // reach the end.
+            // If we are in an invalid/dead chain, skip until we reach the end.
             //
-            if ( this == nullptr ) return nullptr;
+            if ( failed ) return this;
 
             while ( auto instruction = stream->next() )
             {
@@ -83,35 +218,12 @@ namespace vmpattack
                 //
                 process( instruction );
 
-                // Filtering only required if num_operands is specified
+                // Filtering only required if operand types are specified.
                 //
-                if ( num_operands )
+                if constexpr ( sizeof...( operand_types ) != 0 )
                 {
-                    // Make sure number of operands matches
-                    //
-                    if ( instruction->operand_count() != *num_operands )
-                        continue;
-
-                    // Make sure operand types, if specified, match
-                    //
-                    bool operand_type_mismatch = false;
-                    for ( uint32_t i = 0; i < *num_operands; i++ )
-                    {
-                        auto& target_type = operand_types[ i ];
-
-                        // If type is specified, and does not match
-                        //
-                        if ( target_type && target_type != instruction->operand_type( i ) )
-                        {
-                            // Flip flag to skip the instruction
-                            //
-                            operand_type_mismatch = true;
-                            break;
-                        }
-                    }
-
-                    // Skip instruction is flag flipped
-                    if ( operand_type_mismatch )
+                    if ( instruction->operand_count() != sizeof...( operand_types )
+                         || !has_operand_types<operand_types...>( instruction, std::make_index_sequence<sizeof...( operand_types )>{} ) )
                         continue;
                 }
 
@@ -122,9 +234,11 @@ namespace vmpattack
                     return this;
             }
 
-            // No match found - return nullptr, indicating a failed chain.
+            // No match found - mark the chain as failed.
             //
-            return nullptr;
+            failed = true;
+
+            return this;
         }
 
     public:
@@ -132,20 +246,46 @@ namespace vmpattack
         // The pointer must stay valid for the lifetime of the object.
         //
         analysis_context( instruction_stream* stream )
-            : stream( stream ), expression( nullptr ), expression_register( X86_REG_INVALID ), tracked_registers{}, pushed_registers( nullptr ), popped_registers( nullptr )
+            : stream( stream ), expression( nullptr ), expression_register( X86_REG_INVALID ), expression_register_base( X86_REG_INVALID ), tracked_registers{}, pushed_registers( nullptr ), popped_registers( nullptr ), failed( false )
         {}
 
+        // Returns the current stream position, which can later be restored via rewind.
+        // This allows trying several patterns over the same span without copying the stream.
+        //
+        uint32_t mark() const
+        {
+            return stream->mark();
+        }
+
+        // Restores a stream position previously returned by mark, and revives the context
+        // so that a new chain can be started.
+        //
+        analysis_chain<analysis_context> rewind( uint32_t position )
+        {
+            stream->rewind( position );
+            failed = false;
+
+            return this;
+        }
+
+        // Returns whether or not the current chain failed.
+        //
+        bool has_failed() const
+        {
+            return failed;
+        }
+
         // Tracks the given registers along simple MOV / XCHG %reg, %reg instructions.
         // Updates the given registers on assignment during instruction step.
         //
         template <typename T>
-        analysis_context* simple_track_registers( std::vector<x86_reg*> target_regs, T func )
+        analysis_chain<analysis_context> simple_track_registers( std::vector<x86_reg*> target_regs, T func )
         {
-            if ( this == nullptr ) return nullptr;
+            if ( failed ) return this;
 
             tracked_registers = target_regs;
 
-            analysis_context* result = func();
+            analysis_chain<analysis_context> result = func();
 
             tracked_registers.clear();
 
@@ -156,16 +296,19 @@ namespace vmpattack
         // recording the given register's arithmetic operations. Then invokes the
         // provided function, and removes the tracking for the expression after execution.
         //
-        analysis_context* record_expression( x86_reg target_reg, arithmetic_expression* expr, std::function<analysis_context*()> func )
+        template <typename T>
+        analysis_chain<analysis_context> record_expression( x86_reg target_reg, arithmetic_expression* expr, T func )
         {
-            if ( this == nullptr ) return nullptr;
+            if ( failed ) return this;
 
             expression_register = target_reg;
+            expression_register_base = get_register_base( target_reg );
             expression = expr;
 
-            analysis_context* result = func();
+            analysis_chain<analysis_context> result = func();
 
             expression_register = X86_REG_INVALID;
+            expression_register_base = X86_REG_INVALID;
             expression = nullptr;
 
             return result;
@@ -175,13 +318,13 @@ namespace vmpattack
         // Uses the EFLAGS registers for PUSHFQ/PUSHFD/PUSHF.
         //
         template <typename T>
-        analysis_context* track_register_pushes( std::vector<x86_reg>* in_pushed_registers, T func )
+        analysis_chain<analysis_context> track_register_pushes( std::vector<x86_reg>* in_pushed_registers, T func )
         {
-            if ( this == nullptr ) return nullptr;
+            if ( failed ) return this;
 
             pushed_registers = in_pushed_registers;
 
-            analysis_context* result = func();
+            analysis_chain<analysis_context> result = func();
 
             pushed_registers = nullptr;
 
@@ -192,13 +335,13 @@ namespace vmpattack
         // Uses the EFLAGS registers for PUSHFQ/PUSHFD/PUSHF.
         //
         template <typename T>
-        analysis_context* track_register_pops( std::vector<x86_reg>* in_popped_registers, T func )
+        analysis_chain<analysis_context> track_register_pops( std::vector<x86_reg>* in_popped_registers, T func )
         {
-            if ( this == nullptr ) return nullptr;
+            if ( failed ) return this;
 
             popped_registers = in_popped_registers;
 
-            analysis_context* result = func();
+            analysis_chain<analysis_context> result = func();
 
             popped_registers = nullptr;
 
@@ -206,19 +349,19 @@ namespace vmpattack
         }
 
 
-        // Attempts to dynamic_cast the object to the given type.
+        // Casts the object to the given derived pointer type, continuing the chain.
         //
         template <typename T>
-        T cast()
+        analysis_chain<std::remove_pointer_t<T>> cast()
         {
             return static_cast< T >( this );
         }
 
         // Aligns a given uint64_t to the given modulus.
         //
-        analysis_context* align( uint64_t& val, uint64_t mod = 2 )
+        analysis_chain<analysis_context> align( uint64_t& val, uint64_t mod = 2 )
         {
-            if ( this == nullptr ) return nullptr;
+            if ( failed ) return this;
 
             uint64_t dif = val % mod;
 
@@ -230,12 +373,12 @@ namespace vmpattack
         // Match via instruction id.
         // Optionally returns a non-owning pointer to the instruction.
         //
-        analysis_context* id( x86_insn id, const instruction** ins = nullptr )
+        analysis_chain<analysis_context> id( x86_insn id, const instruction** ins = nullptr )
         {
             return match( [&]( const instruction* instruction )
                           {
-                              bool match = instruction->ins.id == id;
-                              
+                              bool match = instruction->id == id;
+
                               if ( match && ins )
                                   *ins = instruction;
 
@@ -246,202 +389,184 @@ namespace vmpattack
         // Matches for a PUSH %reg instruction.
         // Constraints: %reg:   the register pushed.
         //
-        analysis_context* push( inout<x86_reg> reg )
+        template <binding Reg>
+        analysis_chain<analysis_context> push( Reg reg )
         {
             // PUSH %reg
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != X86_INS_PUSH )
-                                  return false;
+            return match<X86_OP_REG>( [&]( const instruction* instruction )
+                                      {
+                                          if ( instruction->id != X86_INS_PUSH )
+                                              return false;
 
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( instruction->operand( 0 ).reg != reg.first )
-                                      return false;
+                                          // %reg == reg
+                                          //
+                                          if ( !reg.accepts( instruction->operand( 0 ).reg ) )
+                                              return false;
 
-                              reg.first = instruction->operand( 0 ).reg;
+                                          reg.assign( instruction->operand( 0 ).reg );
 
-                              return true;
-                          }, 1, { X86_OP_REG } );
+                                          return true;
+                                      } );
         }
 
         // Matches for a generic instruciton with 1 register operand.
-        // If argument match_bases is true, reigster comparison is done via bases. Otherwise, it is done via
+        // If match_bases is true, reigster comparison is done via bases. Otherwise, it is done via
         // a strict == comparison.
         // Constraints: id:     the instruction's id.
         //              reg:    the first operand's register. Comparison via base.
         //
-        analysis_context* generic_reg( x86_insn id, inout<x86_reg> reg, bool match_bases )
+        template <bool match_bases, binding Reg>
+        analysis_chain<analysis_context> generic_reg( x86_insn id, Reg reg )
         {
             // %id %reg, %reg1
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != id )
-                                  return false;
+            return match<X86_OP_REG>( [&]( const instruction* instruction )
+                                      {
+                                          if ( instruction->id != id )
+                                              return false;
 
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( match_bases 
-                                       ? !register_base_equal( instruction->operand( 0 ).reg, reg.first ) 
-                                       : instruction->operand( 0 ).reg != reg.first )
-                                      return false;
+                                          // %reg == reg
+                                          //
+                                          if ( !reg.accepts( instruction->operand( 0 ).reg, registers_equal<match_bases> ) )
+                                              return false;
 
-                              reg.first = instruction->operand( 0 ).reg;
+                                          reg.assign( instruction->operand( 0 ).reg );
 
-                              return true;
-                          }, 1, { X86_OP_REG } );
+                                          return true;
+                                      } );
         }
 
         // Templates for single register-operand instructions.
         //
-        analysis_context* not_reg( inout<x86_reg> dst, bool match_bases = true )     { return generic_reg( X86_INS_NOT, dst, match_bases ); }
-        analysis_context* div_reg( inout<x86_reg> dst, bool match_bases = true )     { return generic_reg( X86_INS_DIV, dst, match_bases ); }
-        analysis_context* idiv_reg( inout<x86_reg> dst, bool match_bases = true )    { return generic_reg( X86_INS_IDIV, dst, match_bases ); }
-        analysis_context* mul_reg( inout<x86_reg> dst, bool match_bases = true )     { return generic_reg( X86_INS_MUL, dst, match_bases ); }
-        analysis_context* imul_reg( inout<x86_reg> dst, bool match_bases = true )    { return generic_reg( X86_INS_IMUL, dst, match_bases ); }
+        template <bool match_bases = true, binding Dst> analysis_chain<analysis_context> not_reg( Dst dst )     { return generic_reg<match_bases>( X86_INS_NOT, dst ); }
+        template <bool match_bases = true, binding Dst> analysis_chain<analysis_context> div_reg( Dst dst )     { return generic_reg<match_bases>( X86_INS_DIV, dst ); }
+        template <bool match_bases = true, binding Dst> analysis_chain<analysis_context> idiv_reg( Dst dst )    { return generic_reg<match_bases>( X86_INS_IDIV, dst ); }
+        template <bool match_bases = true, binding Dst> analysis_chain<analysis_context> mul_reg( Dst dst )     { return generic_reg<match_bases>( X86_INS_MUL, dst ); }
+        template <bool match_bases = true, binding Dst> analysis_chain<analysis_context> imul_reg( Dst dst )    { return generic_reg<match_bases>( X86_INS_IMUL, dst ); }
 
         // Matches for a generic instruciton with 2 register operands.
-        // If argument match_bases is true, reigster comparison is done via bases. Otherwise, it is done via
+        // If match_bases is true, reigster comparison is done via bases. Otherwise, it is done via
         // a strict == comparison.
         // Constraints: id:     the instruction's id.
         //              reg:    the first operand's register. Comparison via base.
         //              reg1:   the second operand's register. Comparison via base.
         //
-        analysis_context* generic_reg_reg( x86_insn id, inout<x86_reg> reg, inout<x86_reg> reg1, bool match_bases )
+        template <bool match_bases, binding Reg, binding Reg1>
+        analysis_chain<analysis_context> generic_reg_reg( x86_insn id, Reg reg, Reg1 reg1 )
         {
             // %id %reg, %reg1
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != id )
-                                  return false;
-
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( match_bases
-                                       ? !register_base_equal( instruction->operand( 0 ).reg, reg.first )
-                                       : instruction->operand( 0 ).reg != reg.first )
-                                      return false;
-
-                              // %reg1 == reg1
-                              //
-                              if ( reg1.second )
-                                  if ( match_bases
-                                       ? !register_base_equal( instruction->operand( 1 ).reg, reg1.first )
-                                       : instruction->operand( 1 ).reg != reg1.first )
-                                      return false;
-
-                              reg.first = instruction->operand( 0 ).reg;
-                              reg1.first = instruction->operand( 1 ).reg;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_REG } );
+            return match<X86_OP_REG, X86_OP_REG>( [&]( const instruction* instruction )
+                                                  {
+                                                      if ( instruction->id != id )
+                                                          return false;
+
+                                                      // %reg == reg
+                                                      //
+                                                      if ( !reg.accepts( instruction->operand( 0 ).reg, registers_equal<match_bases> ) )
+                                                          return false;
+
+                                                      // %reg1 == reg1
+                                                      //
+                                                      if ( !reg1.accepts( instruction->operand( 1 ).reg, registers_equal<match_bases> ) )
+                                                          return false;
+
+                                                      reg.assign( instruction->operand( 0 ).reg );
+                                                      reg1.assign( instruction->operand( 1 ).reg );
+
+                                                      return true;
+                                                  } );
         }
 
         // Templates for double register-operand instructions.
         //
-        analysis_context* mov_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_MOV, dst, src, match_bases ); }
-        analysis_context* xor_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_XOR, dst, src, match_bases ); }
-        analysis_context* add_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_ADD, dst, src, match_bases ); }
-        analysis_context* shl_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_SHL, dst, src, match_bases ); }
-        analysis_context* shr_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_SHR, dst, src, match_bases ); }
-        analysis_context* or_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true)   { return generic_reg_reg( X86_INS_OR, dst, src, match_bases ); }
-        analysis_context* and_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_AND, dst, src, match_bases ); }
-        analysis_context* rcl_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_RCL, dst, src, match_bases ); }
-        analysis_context* rcr_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, bool match_bases = true ) { return generic_reg_reg( X86_INS_RCR, dst, src, match_bases ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> mov_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_MOV, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> xor_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_XOR, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> add_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_ADD, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> shl_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_SHL, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> shr_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_SHR, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> or_reg_reg( Dst dst, Src src )  { return generic_reg_reg<match_bases>( X86_INS_OR, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> and_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_AND, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> rcl_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_RCL, dst, src ); }
+        template <bool match_bases = true, binding Dst, binding Src> analysis_chain<analysis_context> rcr_reg_reg( Dst dst, Src src ) { return generic_reg_reg<match_bases>( X86_INS_RCR, dst, src ); }
 
         // Matches for a generic instruciton with 3 register operands.
-        // If argument match_bases is true, reigster comparison is done via bases. Otherwise, it is done via
+        // If match_bases is true, reigster comparison is done via bases. Otherwise, it is done via
         // a strict == comparison.
         // Constraints: id:     the instruction's id.
         //              reg:    the first operand's register. Comparison via base.
         //              reg1:   the second operand's register. Comparison via base.
         //              reg2:   the third operand's register. Comparison via base.
         //
-        analysis_context* generic_reg_reg_reg( x86_insn id, inout<x86_reg> reg, inout<x86_reg> reg1, inout<x86_reg> reg2, bool match_bases )
+        template <bool match_bases, binding Reg, binding Reg1, binding Reg2>
+        analysis_chain<analysis_context> generic_reg_reg_reg( x86_insn id, Reg reg, Reg1 reg1, Reg2 reg2 )
         {
             // %id %reg, %reg1
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != id )
-                                  return false;
-
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( match_bases
-                                       ? !register_base_equal( instruction->operand( 0 ).reg, reg.first )
-                                       : instruction->operand( 0 ).reg != reg.first )
-                                      return false;
-
-                              // %reg1 == reg1
-                              //
-                              if ( reg1.second )
-                                  if ( match_bases
-                                       ? !register_base_equal( instruction->operand( 1 ).reg, reg1.first )
-                                       : instruction->operand( 1 ).reg != reg1.first )
-                                      return false;
-
-                              // %reg2 == reg2
-                              //
-                              if ( reg2.second )
-                                  if ( match_bases
-                                       ? !register_base_equal( instruction->operand( 2 ).reg, reg2.first )
-                                       : instruction->operand( 2 ).reg != reg2.first )
-                                      return false;
-
-                              reg.first = instruction->operand( 0 ).reg;
-                              reg1.first = instruction->operand( 1 ).reg;
-                              reg2.first = instruction->operand( 2 ).reg;
-
-                              return true;
-                          }, 3, { X86_OP_REG, X86_OP_REG, X86_OP_REG } );
+            return match<X86_OP_REG, X86_OP_REG, X86_OP_REG>( [&]( const instruction* instruction )
+                                                              {
+                                                                  if ( instruction->id != id )
+                                                                      return false;
+
+                                                                  // %reg == reg
+                                                                  //
+                                                                  if ( !reg.accepts( instruction->operand( 0 ).reg, registers_equal<match_bases> ) )
+                                                                      return false;
+
+                                                                  // %reg1 == reg1
+                                                                  //
+                                                                  if ( !reg1.accepts( instruction->operand( 1 ).reg, registers_equal<match_bases> ) )
+                                                                      return false;
+
+                                                                  // %reg2 == reg2
+                                                                  //
+                                                                  if ( !reg2.accepts( instruction->operand( 2 ).reg, registers_equal<match_bases> ) )
+                                                                      return false;
+
+                                                                  reg.assign( instruction->operand( 0 ).reg );
+                                                                  reg1.assign( instruction->operand( 1 ).reg );
+                                                                  reg2.assign( instruction->operand( 2 ).reg );
+
+                                                                  return true;
+                                                              } );
         }
 
         // Templates for triple register-operand instructions.
         //
-        analysis_context* shld_reg_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, inout<x86_reg> shift, bool match_bases = true ) { return generic_reg_reg_reg( X86_INS_SHLD, dst, src, shift, match_bases ); }
-        analysis_context* shrd_reg_reg_reg( inout<x86_reg> dst, inout<x86_reg> src, inout<x86_reg> shift, bool match_bases = true ) { return generic_reg_reg_reg( X86_INS_SHRD, dst, src, shift, match_bases ); }
+        template <bool match_bases = true, binding Dst, binding Src, binding Shift> analysis_chain<analysis_context> shld_reg_reg_reg( Dst dst, Src src, Shift shift ) { return generic_reg_reg_reg<match_bases>( X86_INS_SHLD, dst, src, shift ); }
+        template <bool match_bases = true, binding Dst, binding Src, binding Shift> analysis_chain<analysis_context> shrd_reg_reg_reg( Dst dst, Src src, Shift shift ) { return generic_reg_reg_reg<match_bases>( X86_INS_SHRD, dst, src, shift ); }
 
         // Matches for a generic instruciton with 1 register and 1 immediate operand.
         // Constraints: id:     the instruction's id.
         //              reg:    the first operand's register.
         //              imm:    the second operand's imm value.
         //
-        analysis_context* generic_reg_imm( x86_insn id, inout<x86_reg> reg, inout<uint64_t> imm, bool match_bases )
+        template <bool match_bases, binding Reg, binding Imm>
+        analysis_chain<analysis_context> generic_reg_imm( x86_insn id, Reg reg, Imm imm )
         {
             // %id %reg, %reg1
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != id )
-                                  return false;
-
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( match_bases
-                                       ? !register_base_equal( instruction->operand( 0 ).reg, reg.first )
-                                       : instruction->operand( 0 ).reg != reg.first )
-                                      return false;
-
-                              // %imm == imm
-                              //
-                              if ( imm.second )
-                                  if ( instruction->operand( 1 ).imm != imm.first )
-                                      return false;
-
-                              reg.first = instruction->operand( 0 ).reg;
-                              imm.first = instruction->operand( 1 ).imm;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_IMM } );
+            return match<X86_OP_REG, X86_OP_IMM>( [&]( const instruction* instruction )
+                                                  {
+                                                      if ( instruction->id != id )
+                                                          return false;
+
+                                                      // %reg == reg
+                                                      //
+                                                      if ( !reg.accepts( instruction->operand( 0 ).reg, registers_equal<match_bases> ) )
+                                                          return false;
+
+                                                      // %imm == imm
+                                                      //
+                                                      if ( !imm.accepts( ( uint64_t )instruction->operand( 1 ).imm ) )
+                                                          return false;
+
+                                                      reg.assign( instruction->operand( 0 ).reg );
+                                                      imm.assign( instruction->operand( 1 ).imm );
+
+                                                      return true;
+                                                  } );
         }
 
         // Matches for a mov / movzx of memory at a register into another register.
@@ -449,44 +574,42 @@ namespace vmpattack
         //              src:    the memory source register.
         //              size:   the size of the destination.
         //
-        analysis_context* fetch_memory( inout<x86_reg> dst, inout<x86_reg> src, inout<size_t> size )
+        template <binding Dst, binding Src, binding Size>
+        analysis_chain<analysis_context> fetch_memory( Dst dst, Src src, Size size )
         {
             // mov(zx) %size:%dst, [%src]
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != X86_INS_MOV
-                                && instruction->ins.id != X86_INS_MOVZX )
-                                  return false;
-
-                              // %dst == dst
-                              //
-                              if ( dst.second )
-                                  if ( instruction->operand( 0 ).reg != dst.first )
-                                      return false;
-
-                              // %size:%dst == size
-                              //
-                              if ( size.second )
-                                  if ( instruction->operand( 0 ).size != size.first )
-                                      return false;
-
-                              // %src == src
-                              //
-                              if ( src.second )
-                                  if ( instruction->operand( 1 ).mem.base != src.first )
-                                      return false;
-
-                              if ( instruction->operand( 1 ).mem.disp != 0
-                                || instruction->operand( 1 ).mem.index != X86_REG_INVALID )
-                                  return false;
-
-                              dst.first = instruction->operand( 0 ).reg;
-                              size.first = instruction->operand( 0 ).size;
-                              src.first = instruction->operand( 1 ).mem.base;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_MEM } );
+            return match<X86_OP_REG, X86_OP_MEM>( [&]( const instruction* instruction )
+                                                  {
+                                                      if ( instruction->id != X86_INS_MOV
+                                                        && instruction->id != X86_INS_MOVZX )
+                                                          return false;
+
+                                                      // %dst == dst
+                                                      //
+                                                      if ( !dst.accepts( instruction->operand( 0 ).reg ) )
+                                                          return false;
+
+                                                      // %size:%dst == size
+                                                      //
+                                                      if ( !size.accepts( ( size_t )instruction->operand( 0 ).size ) )
+                                                          return false;
+
+                                                      // %src == src
+                                                      //
+                                                      if ( !src.accepts( instruction->operand( 1 ).mem.base ) )
+                                                          return false;
+
+                                                      if ( instruction->operand( 1 ).mem.disp != 0
+                                                        || instruction->operand( 1 ).mem.index != X86_REG_INVALID )
+                                                          return false;
+
+                                                      dst.assign( instruction->operand( 0 ).reg );
+                                                      size.assign( instruction->operand( 0 ).size );
+                                                      src.assign( instruction->operand( 1 ).mem.base );
+
+                                                      return true;
+                                                  } );
         }
 
         // Matches for a mov / movzx of a register into memory at another register.
@@ -494,121 +617,117 @@ namespace vmpattack
         //              src:    the memory source register.
         //              size:   the size of the source.
         //
-        analysis_context* store_memory( inout<x86_reg> dst, inout<x86_reg> src, inout<size_t> size )
+        template <binding Dst, binding Src, binding Size>
+        analysis_chain<analysis_context> store_memory( Dst dst, Src src, Size size )
         {
             // mov(zx) [%dst], %size:%src
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != X86_INS_MOV
-                                && instruction->ins.id != X86_INS_MOVZX )
-                                  return false;
-
-                              // %dst == dst
-                              //
-                              if ( dst.second )
-                                  if ( instruction->operand( 0 ).mem.base != dst.first )
-                                      return false;
-
-                              // %size: == size
-                              //
-                              if ( size.second )
-                                  if ( instruction->operand( 1 ).size != size.first )
-                                      return false;
-
-                              // %src == src
-                              //
-                              if ( src.second )
-                                  if ( instruction->operand( 1 ).reg != src.first )
-                                      return false;
-
-                              dst.first = instruction->operand( 0 ).mem.base;
-                              size.first = instruction->operand( 1 ).size;
-                              src.first = instruction->operand( 1 ).reg;
-
-                              return true;
-                          }, 2, { X86_OP_MEM, X86_OP_REG } );
+            return match<X86_OP_MEM, X86_OP_REG>( [&]( const instruction* instruction )
+                                                  {
+                                                      if ( instruction->id != X86_INS_MOV
+                                                        && instruction->id != X86_INS_MOVZX )
+                                                          return false;
+
+                                                      // %dst == dst
+                                                      //
+                                                      if ( !dst.accepts( instruction->operand( 0 ).mem.base ) )
+                                                          return false;
+
+                                                      // %size: == size
+                                                      //
+                                                      if ( !size.accepts( ( size_t )instruction->operand( 1 ).size ) )
+                                                          return false;
+
+                                                      // %src == src
+                                                      //
+                                                      if ( !src.accepts( instruction->operand( 1 ).reg ) )
+                                                          return false;
+
+                                                      dst.assign( instruction->operand( 0 ).mem.base );
+                                                      size.assign( instruction->operand( 1 ).size );
+                                                      src.assign( instruction->operand( 1 ).reg );
+
+                                                      return true;
+                                                  } );
         }
 
         // Matches for a push of memory at a register
         // Constraints: src:    the memory source register.
         //              size:   the size of the source.
         //
-        analysis_context* push_memory( inout<x86_reg> src, inout<size_t> size )
+        template <binding Src, binding Size>
+        analysis_chain<analysis_context> push_memory( Src src, Size size )
         {
             // push %size:[%src]
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              if ( instruction->ins.id != X86_INS_PUSH )
-                                  return false;
-
-                              if ( instruction->operand( 0 ).mem.disp != 0
-                                || instruction->operand( 0 ).mem.scale != 1 )
-                                  return false;
-
-                              // %size: == size
-                              //
-                              if ( size.second )
-                                  if ( instruction->operand( 0 ).size != size.first )
-                                      return false;
-
-                              // %src == src
-                              //
-                              if ( src.second )
-                                  if ( instruction->operand( 0 ).mem.base != src.first )
-                                      return false;
-
-                              size.first = instruction->operand( 0 ).size;
-                              src.first = instruction->operand( 0 ).mem.base;
-
-                              return true;
-                          }, 1, { X86_OP_MEM } );
+            return match<X86_OP_MEM>( [&]( const instruction* instruction )
+                                      {
+                                          if ( instruction->id != X86_INS_PUSH )
+                                              return false;
+
+                                          if ( instruction->operand( 0 ).mem.disp != 0
+                                            || instruction->operand( 0 ).mem.scale != 1 )
+                                              return false;
+
+                                          // %size: == size
+                                          //
+                                          if ( !size.accepts( ( size_t )instruction->operand( 0 ).size ) )
+                                              return false;
+
+                                          // %src == src
+                                          //
+                                          if ( !src.accepts( instruction->operand( 0 ).mem.base ) )
+                                              return false;
+
+                                          size.assign( instruction->operand( 0 ).size );
+                                          src.assign( instruction->operand( 0 ).mem.base );
+
+                                          return true;
+                                      } );
         }
+
         // Matches for instructions that either increment or decrement the a given register.
         // via ADD or SUB instructions, using a immedaite value.
         // Constraints: id:             the id of the matched instruction (either ADD or SUB)
         //              reg:            the register that is incremented / decremented.
         //              offset:         the amount the vip is offseted by.
         //
-        analysis_context* update_reg( inout<x86_insn> id, inout<x86_reg> reg, inout<uint64_t> offset )
+        template <binding Id, binding Reg, binding Offset>
+        analysis_chain<analysis_context> update_reg( Id id, Reg reg, Offset offset )
         {
             // ADD %reg, %offset
             //      or
             // SUB %reg, %offset
             //  ^ %id
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              // ins_id == ADD / SUB
-                              //
-                              if ( instruction->ins.id != X86_INS_ADD
-                                   && instruction->ins.id != X86_INS_SUB )
-                                  return false;
-
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( instruction->operand( 0 ).reg != reg.first )
-                                      return false;
-
-                              // ins_id == constraint ADD / SUB
-                              //
-                              if ( id.second )
-                                  if ( instruction->ins.id != ( x86_insn )instruction->ins.id )
-                                      return false;
-
-                              // %offset == offset
-                              //
-                              if ( offset.second )
-                                  if ( instruction->operand( 1 ).imm != offset.first )
-                                      return false;
-
-                              id.first = ( x86_insn )instruction->ins.id;
-                              offset.first = instruction->operand( 1 ).imm;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_IMM } );
+            return match<X86_OP_REG, X86_OP_IMM>( [&]( const instruction* instruction )
+                                                  {
+                                                      // ins_id == ADD / SUB
+                                                      //
+                                                      if ( instruction->id != X86_INS_ADD
+                                                           && instruction->id != X86_INS_SUB )
+                                                          return false;
+
+                                                      // %reg == reg
+                                                      //
+                                                      if ( !reg.accepts( instruction->operand( 0 ).reg ) )
+                                                          return false;
+
+                                                      // ins_id == constraint ADD / SUB
+                                                      //
+                                                      if ( !id.accepts( ( x86_insn )instruction->id ) )
+                                                          return false;
+
+                                                      // %offset == offset
+                                                      //
+                                                      if ( !offset.accepts( ( uint64_t )instruction->operand( 1 ).imm ) )
+                                                          return false;
+
+                                                      id.assign( ( x86_insn )instruction->id );
+                                                      offset.assign( instruction->operand( 1 ).imm );
+
+                                                      return true;
+                                                  } );
         }
 
         // Matches for instructions that offset the given register via either a lea or add instruction.
@@ -616,7 +735,8 @@ namespace vmpattack
         //              reg:            the register that is incremented / decremented.
         //              offset_reg:     the register the register is offseted by.
         //
-        analysis_context* offset_reg( inout<x86_insn> id, inout<x86_reg> reg, inout<x86_reg> offset_reg )
+        template <binding Id, binding Reg, binding OffsetReg>
+        analysis_chain<analysis_context> offset_reg( Id id, Reg reg, OffsetReg offset_reg )
         {
             // lea %reg, 8:[%reg + %offset_reg]
             //      or
@@ -627,7 +747,7 @@ namespace vmpattack
                           {
                               // lea %reg, 8:[%reg + %offset]
                               //
-                              if ( ( !id.second || id.first == X86_INS_LEA ) && instruction->ins.id == X86_INS_LEA )
+                              if ( id.accepts( X86_INS_LEA ) && instruction->id == X86_INS_LEA )
                               {
                                   // operand( 0 ) == reg && operand( 1 ) == mem
                                   //
@@ -637,9 +757,8 @@ namespace vmpattack
 
                                   // %reg == reg
                                   //
-                                  if ( reg.second )
-                                      if ( instruction->operand( 0 ).reg != reg.first )
-                                          return false;
+                                  if ( !reg.accepts( instruction->operand( 0 ).reg ) )
+                                      return false;
 
                                   // operand( 1 ).base == %reg && .index != invalid && .disp == 0 && .scale = 1
                                   //
@@ -651,20 +770,19 @@ namespace vmpattack
 
                                   // operand( 1 ).index == offset_reg
                                   //
-                                  if ( offset_reg.second )
-                                      if ( instruction->operand( 1 ).mem.index != offset_reg.first )
-                                          return false;
+                                  if ( !offset_reg.accepts( instruction->operand( 1 ).mem.index ) )
+                                      return false;
 
-                                  id.first = ( x86_insn )instruction->ins.id;
-                                  reg.first = instruction->operand( 0 ).reg;
-                                  offset_reg.first = instruction->operand( 1 ).mem.index;
+                                  id.assign( ( x86_insn )instruction->id );
+                                  reg.assign( instruction->operand( 0 ).reg );
+                                  offset_reg.assign( instruction->operand( 1 ).mem.index );
 
                                   return true;
                               }
 
                               // add %reg, %offset_reg
                               //
-                              if ( ( !id.second || id.first == X86_INS_ADD ) && instruction->ins.id == X86_INS_ADD )
+                              if ( id.accepts( X86_INS_ADD ) && instruction->id == X86_INS_ADD )
                               {
                                   // operand( 0 ) == reg && operand( 1 ) == reg
                                   //
@@ -674,19 +792,17 @@ namespace vmpattack
 
                                   // %reg == reg
                                   //
-                                  if ( reg.second )
-                                      if ( instruction->operand( 0 ).reg != reg.first )
-                                          return false;
+                                  if ( !reg.accepts( instruction->operand( 0 ).reg ) )
+                                      return false;
 
                                   // operand( 1 ).reg == offset_reg
                                   //
-                                  if ( offset_reg.second )
-                                      if ( instruction->operand( 1 ).reg != offset_reg.first )
-                                          return false;
+                                  if ( !offset_reg.accepts( instruction->operand( 1 ).reg ) )
+                                      return false;
 
-                                  id.first = ( x86_insn )instruction->ins.id;
-                                  reg.first = instruction->operand( 0 ).reg;
-                                  offset_reg.first = instruction->operand( 1 ).reg;
+                                  id.assign( ( x86_insn )instruction->id );
+                                  reg.assign( instruction->operand( 0 ).reg );
+                                  offset_reg.assign( instruction->operand( 1 ).reg );
 
                                   return true;
                               }
@@ -694,7 +810,7 @@ namespace vmpattack
                               // No matches.
                               //
                               return false;
-                          }, {}, {} );
+                          } );
         }
 
         // Matches for an instruction which begins an encryption/obfuscation sequence, by XORing the given register by the rolling key.
@@ -702,12 +818,13 @@ namespace vmpattack
         //              rkey:   the register currently holding the rolling key.
         //                      NOTE: the rkey register returned is expanded into the largest architecture size.
         //
-        analysis_context* begin_encryption( inout<x86_reg> reg, inout<x86_reg> rkey )
+        template <binding Reg, binding RKey>
+        analysis_chain<analysis_context> begin_encryption( Reg reg, RKey rkey )
         {
-            analysis_context* result = generic_reg_reg( X86_INS_XOR, reg, rkey, true );
+            analysis_chain<analysis_context> result = generic_reg_reg<true>( X86_INS_XOR, reg, rkey );
 
             if ( result )
-                rkey.first = get_largest_for_arch( rkey.first );
+                rkey.assign( get_largest_for_arch( rkey.value ) );
 
             return result;
         }
@@ -719,7 +836,8 @@ namespace vmpattack
         //              rkey:   the register currently holding the rolling key. Comparison via base.
         //                      NOTE: the rkey register returned is expanded into the largest architecture size.
         //
-        analysis_context* end_encryption( inout<x86_reg> reg, inout<x86_reg> rkey )
+        template <binding Reg, binding RKey>
+        analysis_chain<analysis_context> end_encryption( Reg reg, RKey rkey )
         {
             // push %rkey
             //      or
@@ -729,7 +847,7 @@ namespace vmpattack
                           {
                               // push %rkey
                               //
-                              if ( instruction->ins.id == X86_INS_PUSH )
+                              if ( instruction->id == X86_INS_PUSH )
                               {
                                   // operand( 0 ) == reg
                                   //
@@ -738,18 +856,17 @@ namespace vmpattack
 
                                   // %rkey == rkey
                                   //
-                                  if ( rkey.second )
-                                      if ( !register_base_equal( instruction->operand( 0 ).reg, rkey.first ) )
-                                          return false;
+                                  if ( !rkey.accepts( instruction->operand( 0 ).reg, register_base_equal ) )
+                                      return false;
 
-                                  rkey.first = get_largest_for_arch( instruction->operand( 0 ).reg );
+                                  rkey.assign( get_largest_for_arch( instruction->operand( 0 ).reg ) );
 
                                   return true;
                               }
 
                               // xor %rkey, %reg
                               //
-                              else if ( instruction->ins.id == X86_INS_XOR )
+                              else if ( instruction->id == X86_INS_XOR )
                               {
                                   // operand( 0 ) == reg && operand( 1 ) == reg
                                   //
@@ -759,18 +876,16 @@ namespace vmpattack
 
                                   // %rkey == rkey
                                   //
-                                  if ( rkey.second )
-                                      if ( !register_base_equal( instruction->operand( 0 ).reg, rkey.first ) )
-                                          return false;
+                                  if ( !rkey.accepts( instruction->operand( 0 ).reg, register_base_equal ) )
+                                      return false;
 
                                   // %reg == reg
                                   //
-                                  if ( reg.second )
-                                      if ( !register_base_equal( instruction->operand( 1 ).reg, reg.first ) )
-                                          return false;
+                                  if ( !reg.accepts( instruction->operand( 1 ).reg, register_base_equal ) )
+                                      return false;
 
-                                  rkey.first = get_largest_for_arch( instruction->operand( 0 ).reg );
-                                  reg.first = instruction->operand( 1 ).reg;
+                                  rkey.assign( get_largest_for_arch( instruction->operand( 0 ).reg ) );
+                                  reg.assign( instruction->operand( 1 ).reg );
 
                                   return true;
                               }
@@ -778,120 +893,120 @@ namespace vmpattack
                               // No matches.
                               //
                               return false;
-                          }, {}, {} );
+                          } );
         }
 
         // Matches an instruction that fetches the encrypted vip ("stub") from the stack.
         // Constraints: reg:    the register the stub is written into.
         //              offset: the stack offset of the stub.
         //
-        analysis_context* fetch_encrypted_vip( inout<x86_reg> reg, inout<uint64_t> offset )
+        template <binding Reg, binding Offset>
+        analysis_chain<analysis_context> fetch_encrypted_vip( Reg reg, Offset offset )
         {
             // MOV %reg, 8: [RSP + %offset]
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              // ins_id == MOV
-                              //
-                              if ( instruction->ins.id != X86_INS_MOV )
-                                  return false;
-
-                              // .base == rsp && .index = INVALID
-                              //
-                              if ( instruction->operand( 1 ).mem.base != X86_REG_RSP
-                                   || instruction->operand( 1 ).mem.index != X86_REG_INVALID )
-                                  return false;
-
-                              // operand( 0 ).reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( instruction->operand( 0 ).reg != reg.first )
-                                      return false;
-
-                              // operand( 1 ).disp == offset
-                              //
-                              if ( offset.second )
-                                  if ( instruction->operand( 1 ).mem.disp != offset.first )
-                                      return false;
-
-                              reg.first = instruction->operand( 0 ).reg;
-                              offset.first = instruction->operand( 1 ).mem.disp;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_MEM } );
+            return match<X86_OP_REG, X86_OP_MEM>( [&]( const instruction* instruction )
+                                                  {
+                                                      // ins_id == MOV
+                                                      //
+                                                      if ( instruction->id != X86_INS_MOV )
+                                                          return false;
+
+                                                      // .base == rsp && .index = INVALID
+                                                      //
+                                                      if ( instruction->operand( 1 ).mem.base != X86_REG_RSP
+                                                           || instruction->operand( 1 ).mem.index != X86_REG_INVALID )
+                                                          return false;
+
+                                                      // operand( 0 ).reg == reg
+                                                      //
+                                                      if ( !reg.accepts( instruction->operand( 0 ).reg ) )
+                                                          return false;
+
+                                                      // operand( 1 ).disp == offset
+                                                      //
+                                                      if ( !offset.accepts( ( uint64_t )instruction->operand( 1 ).mem.disp ) )
+                                                          return false;
+
+                                                      reg.assign( instruction->operand( 0 ).reg );
+                                                      offset.assign( instruction->operand( 1 ).mem.disp );
+
+                                                      return true;
+                                                  } );
         }
 
         // Matches an instruction that loads the "flow" (ie. the rip of the current instruction) into a register.
         // Constraints: reg:    the register the flow is written into.
         //              flow:   the rva of the flow.
         //
-        analysis_context* set_flow( inout<x86_reg> reg, inout<uint64_t> flow )
+        template <binding Reg, binding Flow>
+        analysis_chain<analysis_context> set_flow( Reg reg, Flow flow )
         {
             // lea %reg, [%rip - {ins_len}]
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              // ins_id == lea
-                              //
-                              if ( instruction->ins.id != X86_INS_LEA )
-                                  return false;
-
-                              // %reg == reg
-                              //
-                              if ( reg.second )
-                                  if ( instruction->operand( 0 ).reg != reg.first )
-                                      return false;
-
-                              // operand( 1 ) is rip offsetted, without any other index.
-                              // Disp is -( instruction length ).
-                              //
-                              if ( instruction->operand( 1 ).mem.base != X86_REG_RIP
-                                   || instruction->operand( 1 ).mem.index != X86_REG_INVALID
-                                   || instruction->operand( 1 ).mem.disp != -instruction->ins.size )
-                                  return false;
-
-                              // %rip - {ins_len} == flow
-                              //
-                              if ( flow.second )
-                                  if ( instruction->ins.address + instruction->operand( 1 ).mem.disp != reg.first )
-                                      return false;
-
-                              reg.first = instruction->operand( 0 ).reg;
-                              flow.first = instruction->ins.address + instruction->ins.size + instruction->operand( 1 ).mem.disp;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_MEM } );
+            return match<X86_OP_REG, X86_OP_MEM>( [&]( const instruction* instruction )
+                                                  {
+                                                      // ins_id == lea
+                                                      //
+                                                      if ( instruction->id != X86_INS_LEA )
+                                                          return false;
+
+                                                      // %reg == reg
+                                                      //
+                                                      if ( !reg.accepts( instruction->operand( 0 ).reg ) )
+                                                          return false;
+
+                                                      // operand( 1 ) is rip offsetted, without any other index.
+                                                      // Disp is -( instruction length ).
+                                                      //
+                                                      if ( instruction->operand( 1 ).mem.base != X86_REG_RIP
+                                                           || instruction->operand( 1 ).mem.index != X86_REG_INVALID
+                                                           || instruction->operand( 1 ).mem.disp != -instruction->size )
+                                                          return false;
+
+                                                      uint64_t matched_flow = instruction->address + instruction->size + instruction->operand( 1 ).mem.disp;
+
+                                                      // %rip - {ins_len} == flow
+                                                      //
+                                                      if ( !flow.accepts( matched_flow ) )
+                                                          return false;
+
+                                                      reg.assign( instruction->operand( 0 ).reg );
+                                                      flow.assign( matched_flow );
+
+                                                      return true;
+                                                  } );
         }
 
         // Matches an instruction that allocates the VM's stack by subtracting and immediate value from rsp.
         // Constraints: imm:    the immediate valued subtracted from rsp.
         //
-        analysis_context* allocate_stack( inout<uint64_t> imm )
+        template <binding Imm>
+        analysis_chain<analysis_context> allocate_stack( Imm imm )
         {
             // sub rsp, %imm
             //
-            return match( [&]( const instruction* instruction )
-                          {
-                              // ins_id == sub
-                              //
-                              if ( instruction->ins.id != X86_INS_SUB )
-                                  return false;
-
-                              // operand( 0 ).reg == rsp
-                              //
-                              if ( instruction->operand( 0 ).reg != X86_REG_RSP )
-                                  return false;
-
-                              // %im == imm
-                              //
-                              if ( imm.second )
-                                  if ( instruction->operand( 1 ).imm == imm.first )
-                                      return false;
-
-                              imm.first = instruction->operand( 1 ).imm;
-
-                              return true;
-                          }, 2, { X86_OP_REG, X86_OP_IMM } );
+            return match<X86_OP_REG, X86_OP_IMM>( [&]( const instruction* instruction )
+                                                  {
+                                                      // ins_id == sub
+                                                      //
+                                                      if ( instruction->id != X86_INS_SUB )
+                                                          return false;
+
+                                                      // operand( 0 ).reg == rsp
+                                                      //
+                                                      if ( instruction->operand( 0 ).reg != X86_REG_RSP )
+                                                          return false;
+
+                                                      // %im == imm
+                                                      //
+                                                      if ( !imm.accepts( ( uint64_t )instruction->operand( 1 ).imm ) )
+                                                          return false;
+
+                                                      imm.assign( instruction->operand( 1 ).imm );
+
+                                                      return true;
+                                                  } );
         }
     };
-}
\ No newline at end of file
+}
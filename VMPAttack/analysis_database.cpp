@@ -0,0 +1,682 @@
+#include "analysis_database.hpp"
+#include "vm_instruction_index.hpp"
+#include "arithmetic_operations.hpp"
+#include <algorithm>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace vmpattack
+{
+    // The database file header magic ('VMPADB\0\0'), and the current format version.
+    // The version must be bumped whenever the record layout changes.
+    //
+    const uint64_t database_magic = 0x0000424441504D56;
+    const uint32_t database_version = 1;
+
+    // The marker preceding every record ('VREC').
+    //
+    const uint32_t database_record_marker = 0x43455256;
+
+    // The types of records.
+    //
+    enum database_record_type : uint32_t
+    {
+        database_record_instance = 1,
+        database_record_handler = 2,
+    };
+
+    // The header at the beginning of the database file.
+    //
+    struct database_header
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t header_size;
+
+        // A hash of the virtual instruction set and arithmetic operations, as records
+        // refer to them by index.
+        //
+        uint64_t schema;
+    };
+
+    // The header preceding every record's payload. Payloads are padded to 8 bytes, so that
+    // all headers are aligned within the mapped file.
+    //
+    struct database_record_header
+    {
+        uint32_t marker;
+        uint32_t type;
+        uint32_t size;
+        uint32_t reserved;
+        uint64_t image_hash;
+        uint64_t rva;
+        uint64_t checksum;
+    };
+
+    // Hashes the bytes, 8 at a time.
+    //
+    static uint64_t hash_bytes( const uint8_t* data, size_t size, uint64_t seed = 0xCBF29CE484222325 )
+    {
+        uint64_t hash = seed ^ ( size * 0x9E3779B97F4A7C15ull );
+
+        auto mix = [&]( uint64_t word )
+        {
+            hash ^= word * 0x87C37B91114253D5ull;
+            hash = ( hash << 31 ) | ( hash >> 33 );
+            hash *= 0x4CF5AD432745937Full;
+        };
+
+        size_t i = 0;
+        for ( ; i + 8 <= size; i += 8 )
+        {
+            uint64_t word;
+            memcpy( &word, data + i, 8 );
+            mix( word );
+        }
+
+        uint64_t tail = 0;
+        memcpy( &tail, data + i, size - i );
+        mix( tail );
+
+        return hash ^ ( hash >> 29 );
+    }
+
+    // Computes the schema hash of the current virtual instruction set and arithmetic operations.
+    //
+    static uint64_t compute_schema()
+    {
+        std::vector<uint8_t> schema;
+
+        const vm_instruction_index& index = vm_instruction_index::get();
+        for ( size_t i = 0; i < index.size(); i++ )
+        {
+            const std::string& name = index.get_descriptor( i )->name;
+            schema.insert( schema.end(), name.begin(), name.end() );
+            schema.push_back( 0 );
+        }
+
+        for ( auto descriptor : arithmetic_descriptors::all )
+        {
+            schema.push_back( ( uint8_t )descriptor->insn );
+            schema.push_back( ( uint8_t )( descriptor->insn >> 8 ) );
+            schema.push_back( descriptor->num_additional_operands );
+            schema.push_back( ( uint8_t )descriptor->input_size.value_or( 0 ) );
+        }
+
+        return hash_bytes( schema.data(), schema.size(), database_version );
+    }
+
+    // This class serializes a record payload.
+    //
+    class record_writer
+    {
+    public:
+        std::vector<uint8_t> buffer;
+
+        template <typename T>
+        void write( T value )
+        {
+            const uint8_t* bytes = ( const uint8_t* )&value;
+            buffer.insert( buffer.end(), bytes, bytes + sizeof( T ) );
+        }
+
+        void write_state( const vm_state& state )
+        {
+            for ( x86_reg reg : { state.stack_reg, state.vip_reg, state.context_reg, state.rolling_key_reg, state.flow_reg } )
+                write<uint16_t>( reg );
+
+            write<uint8_t>( state.direction );
+            write<uint64_t>( state.flow );
+        }
+
+        void write_expression( const arithmetic_expression* expression )
+        {
+            write<uint32_t>( ( uint32_t )expression->operations.size() );
+
+            for ( const arithmetic_operation& operation : expression->operations )
+            {
+                uint8_t descriptor_index = 0;
+                while ( arithmetic_descriptors::all[ descriptor_index ] != operation.descriptor )
+                    descriptor_index++;
+
+                write<uint8_t>( descriptor_index );
+
+                for ( size_t i = 0; i < operation.descriptor->num_additional_operands; i++ )
+                    write<uint64_t>( operation.additional_operands[ i ] );
+            }
+        }
+
+        void write_bridge( const vm_bridge* bridge )
+        {
+            write<uint8_t>( bridge != nullptr );
+
+            if ( bridge )
+            {
+                write<uint64_t>( bridge->rva );
+                write_expression( bridge->handler_expression.get() );
+            }
+        }
+    };
+
+    // This class deserializes a record payload, bounds-checking every read.
+    // Once a read fails, all further reads fail too.
+    //
+    class record_reader
+    {
+    private:
+        const uint8_t* position;
+        const uint8_t* end;
+
+    public:
+        bool failed = false;
+
+        record_reader( const uint8_t* data, size_t size )
+            : position( data ), end( data + size )
+        {}
+
+        template <typename T>
+        T read()
+        {
+            T value = {};
+
+            if ( failed || end - position < ( ptrdiff_t )sizeof( T ) )
+            {
+                failed = true;
+                return value;
+            }
+
+            memcpy( &value, position, sizeof( T ) );
+            position += sizeof( T );
+
+            return value;
+        }
+
+        x86_reg read_reg()
+        {
+            uint16_t reg = read<uint16_t>();
+
+            if ( reg >= X86_REG_ENDING )
+                failed = true;
+
+            return ( x86_reg )reg;
+        }
+
+        vm_state read_state()
+        {
+            x86_reg stack_reg = read_reg();
+            x86_reg vip_reg = read_reg();
+            x86_reg context_reg = read_reg();
+            x86_reg rolling_key_reg = read_reg();
+            x86_reg flow_reg = read_reg();
+            vm_direction direction = ( vm_direction )read<uint8_t>();
+            uint64_t flow = read<uint64_t>();
+
+            return vm_state( stack_reg, vip_reg, context_reg, rolling_key_reg, flow_reg, direction, flow );
+        }
+
+        std::shared_ptr<const arithmetic_expression> read_expression()
+        {
+            arithmetic_expression expression;
+
+            uint32_t count = read<uint32_t>();
+
+            for ( uint32_t i = 0; i < count && !failed; i++ )
+            {
+                uint8_t descriptor_index = read<uint8_t>();
+
+                if ( descriptor_index >= std::size( arithmetic_descriptors::all ) )
+                {
+                    failed = true;
+                    break;
+                }
+
+                const arithmetic_operation_desc* descriptor = arithmetic_descriptors::all[ descriptor_index ];
+
+                std::array<uint64_t, arithmetic_operation::max_additional_operands> additional_operands = {};
+                for ( size_t j = 0; j < descriptor->num_additional_operands; j++ )
+                    additional_operands[ j ] = read<uint64_t>();
+
+                expression.operations.push_back( arithmetic_operation( descriptor, additional_operands ) );
+            }
+
+            return arithmetic_expression::intern( expression );
+        }
+
+        std::shared_ptr<const vm_bridge> read_bridge()
+        {
+            if ( !read<uint8_t>() )
+                return nullptr;
+
+            uint64_t rva = read<uint64_t>();
+
+            return std::make_shared<const vm_bridge>( rva, read_expression() );
+        }
+    };
+
+    // Platform file helpers. Handles are intptr_t's, as in mapped_image.
+    //
+#ifdef _WIN32
+    static void lock_file( intptr_t file )
+    {
+        OVERLAPPED overlapped = {};
+        LockFileEx( ( HANDLE )file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped );
+    }
+
+    static void unlock_file( intptr_t file )
+    {
+        OVERLAPPED overlapped = {};
+        UnlockFileEx( ( HANDLE )file, 0, MAXDWORD, MAXDWORD, &overlapped );
+    }
+
+    static uint64_t get_file_size( intptr_t file )
+    {
+        LARGE_INTEGER size;
+        return GetFileSizeEx( ( HANDLE )file, &size ) ? size.QuadPart : 0;
+    }
+
+    static bool read_file( intptr_t file, uint64_t offset, void* data, size_t size )
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = ( DWORD )offset;
+        overlapped.OffsetHigh = ( DWORD )( offset >> 32 );
+
+        DWORD read = 0;
+        return ReadFile( ( HANDLE )file, data, ( DWORD )size, &read, &overlapped ) && read == size;
+    }
+
+    static bool append_file( intptr_t file, const void* data, size_t size )
+    {
+        DWORD written = 0;
+        return WriteFile( ( HANDLE )file, data, ( DWORD )size, &written, nullptr ) && written == size;
+    }
+
+    static void close_file( intptr_t file )
+    {
+        CloseHandle( ( HANDLE )file );
+    }
+#else
+    static void lock_file( intptr_t file )
+    {
+        flock( ( int )file, LOCK_EX );
+    }
+
+    static void unlock_file( intptr_t file )
+    {
+        flock( ( int )file, LOCK_UN );
+    }
+
+    static uint64_t get_file_size( intptr_t file )
+    {
+        struct stat file_stat;
+        return fstat( ( int )file, &file_stat ) == 0 ? file_stat.st_size : 0;
+    }
+
+    static bool read_file( intptr_t file, uint64_t offset, void* data, size_t size )
+    {
+        return pread( ( int )file, data, size, offset ) == ( ssize_t )size;
+    }
+
+    static bool append_file( intptr_t file, const void* data, size_t size )
+    {
+        return write( ( int )file, data, size ) == ( ssize_t )size;
+    }
+
+    static void close_file( intptr_t file )
+    {
+        close( ( int )file );
+    }
+#endif
+
+    // Closes the database file.
+    //
+    analysis_database::~analysis_database()
+    {
+        close_file( file_handle );
+    }
+
+    // Appends a single record, with the given type, key rva and payload.
+    // Returns whether or not the operation succeeded.
+    //
+    bool analysis_database::append( uint32_t type, uint64_t rva, const std::vector<uint8_t>& payload )
+    {
+        database_record_header header = { database_record_marker, type, ( uint32_t )payload.size(), 0, image_hash, rva, hash_bytes( payload.data(), payload.size() ) };
+
+        // Build the whole record, so that it is appended with a single write.
+        //
+        std::vector<uint8_t> record( sizeof( header ) + ( ( payload.size() + 7 ) & ~7ull ) );
+        memcpy( record.data(), &header, sizeof( header ) );
+        memcpy( record.data() + sizeof( header ), payload.data(), payload.size() );
+
+        const std::lock_guard<std::mutex> lock( append_mutex );
+
+        // Lock the file against other processes' appends.
+        //
+        lock_file( file_handle );
+        bool success = append_file( file_handle, record.data(), record.size() );
+        unlock_file( file_handle );
+
+        return success;
+    }
+
+    // Finds the offset of the first record marker at or after the offset, byte by byte, as torn
+    // records may leave later ones unaligned.
+    // If there is none, returns the file size.
+    //
+    static uint64_t find_record_marker( const uint8_t* view, uint64_t offset, uint64_t file_size )
+    {
+        for ( ; offset + sizeof( database_record_marker ) <= file_size; offset++ )
+        {
+            uint32_t marker;
+            memcpy( &marker, view + offset, sizeof( marker ) );
+
+            if ( marker == database_record_marker )
+                return offset;
+        }
+
+        return file_size;
+    }
+
+    // Loads every instance recorded for the image, along with all of their handlers, inserting
+    // them into the given table. Instances whose rva is already present are extended with any
+    // handlers they are missing.
+    // Returns the number of records loaded.
+    //
+    size_t analysis_database::load( rva_table<vm_instance>* instances ) const
+    {
+        uint64_t file_size = get_file_size( file_handle );
+
+        if ( file_size <= sizeof( database_header ) )
+            return 0;
+
+        // Map a read-only view of the file as it is now; anything appended afterwards is not seen.
+        //
+#ifdef _WIN32
+        HANDLE mapping = CreateFileMappingA( ( HANDLE )file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        if ( !mapping )
+            return 0;
+
+        const uint8_t* view = ( const uint8_t* )MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, ( SIZE_T )file_size );
+        if ( !view )
+        {
+            CloseHandle( mapping );
+            return 0;
+        }
+#else
+        void* mapped_view = mmap( nullptr, file_size, PROT_READ, MAP_SHARED, ( int )file_handle, 0 );
+        if ( mapped_view == MAP_FAILED )
+            return 0;
+
+        const uint8_t* view = ( const uint8_t* )mapped_view;
+#endif
+
+        // Handler records are applied after all instances are loaded, as records from different
+        // processes may interleave.
+        //
+        std::vector<std::pair<const uint8_t*, uint32_t>> handler_records;
+
+        size_t loaded = 0;
+
+        const vm_instruction_index& index = vm_instruction_index::get();
+
+        uint64_t offset = ( ( const database_header* )view )->header_size;
+
+        while ( file_size - offset >= sizeof( database_record_header ) )
+        {
+            database_record_header header;
+            memcpy( &header, view + offset, sizeof( header ) );
+
+            uint64_t record_size = sizeof( header ) + ( ( ( uint64_t )header.size + 7 ) & ~7ull );
+
+            // A malformed record is either one still being appended, or one torn by a process that
+            // crashed mid-write, after which other processes may have kept appending. Resume at the next
+            // marker rather than stopping, so that a torn record does not hide every later one.
+            //
+            if ( header.marker != database_record_marker || file_size - offset < record_size
+                 || hash_bytes( view + offset + sizeof( header ), header.size ) != header.checksum )
+            {
+                offset = find_record_marker( view, offset + 1, file_size );
+                continue;
+            }
+
+            const uint8_t* payload = view + offset + sizeof( header );
+
+            offset += record_size;
+
+            if ( header.image_hash != image_hash )
+                continue;
+
+            if ( header.type == database_record_handler )
+            {
+                handler_records.push_back( { payload, header.size } );
+                continue;
+            }
+
+            if ( header.type != database_record_instance || instances->find( header.rva ) )
+                continue;
+
+            record_reader reader( payload, header.size );
+
+            auto initial_state = std::make_unique<vm_state>( reader.read_state() );
+
+            std::vector<vtil::register_desc> entry_frame;
+            uint32_t frame_size = reader.read<uint32_t>();
+            for ( uint32_t i = 0; i < frame_size && !reader.failed; i++ )
+            {
+                x86_reg reg = reader.read_reg();
+                entry_frame.push_back( reg == X86_REG_EFLAGS ? vtil::REG_FLAGS : vtil::register_desc( vtil::register_physical, ( uint64_t )reg, 64 ) );
+            }
+
+            auto vip_expression = reader.read_expression();
+            auto bridge = reader.read_bridge();
+
+            if ( reader.failed )
+                continue;
+
+            // The instance may have been created by a concurrent lift meanwhile, in which case it is dropped.
+            //
+            if ( instances->insert( header.rva, std::make_unique<vm_instance>( header.rva, std::move( initial_state ), entry_frame, std::move( vip_expression ), std::move( bridge ) ) ) )
+                loaded++;
+        }
+
+        for ( auto const& [payload, size] : handler_records )
+        {
+            record_reader reader( payload, size );
+
+            uint64_t instance_rva = reader.read<uint64_t>();
+            uint64_t handler_rva = reader.read<uint64_t>();
+            uint8_t descriptor_index = reader.read<uint8_t>();
+
+            vm_instance* instance = instances->find( instance_rva );
+            if ( reader.failed || descriptor_index >= index.size() || !instance )
+                continue;
+
+            // Skip handlers that are already known.
+            //
+            if ( instance->find_handler( handler_rva ) )
+                continue;
+
+            auto instruction_info = std::make_unique<vm_instruction_info>();
+
+            uint32_t operand_count = reader.read<uint32_t>();
+            for ( uint32_t i = 0; i < operand_count && !reader.failed; i++ )
+            {
+                vm_operand_type type = ( vm_operand_type )reader.read<uint8_t>();
+                size_t operand_size = reader.read<uint8_t>();
+                size_t byte_length = reader.read<uint8_t>();
+
+                instruction_info->operands.push_back( { vm_operand( type, operand_size, byte_length ), reader.read_expression() } );
+            }
+
+            uint32_t size_count = reader.read<uint32_t>();
+            for ( uint32_t i = 0; i < size_count && !reader.failed; i++ )
+                instruction_info->sizes.push_back( reader.read<uint64_t>() );
+
+            if ( reader.read<uint8_t>() )
+                instruction_info->updated_state = reader.read_state();
+
+            auto bridge = reader.read_bridge();
+
+            if ( reader.failed )
+                continue;
+
+            if ( instance->add_handler( std::make_unique<vm_handler>( index.get_descriptor( descriptor_index ), std::move( instruction_info ), handler_rva, std::move( bridge ) ) ) )
+                loaded++;
+        }
+
+#ifdef _WIN32
+        UnmapViewOfFile( view );
+        CloseHandle( mapping );
+#else
+        munmap( mapped_view, file_size );
+#endif
+
+        return loaded;
+    }
+
+    // Appends the vm_instance's entry information.
+    // Returns whether or not the operation succeeded.
+    //
+    bool analysis_database::append_instance( const vm_instance* instance )
+    {
+        record_writer writer;
+
+        writer.write_state( *instance->get_initial_state() );
+
+        writer.write<uint32_t>( ( uint32_t )instance->entry_frame.size() );
+        for ( const vtil::register_desc& reg : instance->entry_frame )
+            writer.write<uint16_t>( reg == vtil::REG_FLAGS ? X86_REG_EFLAGS : ( x86_reg )reg.local_id );
+
+        writer.write_expression( instance->get_vip_expression() );
+        writer.write_bridge( instance->bridge.get() );
+
+        return append( database_record_instance, instance->rva, writer.buffer );
+    }
+
+    // Appends a vm_handler discovered for the vm_instance at the given rva.
+    // Handlers holding custom data are not recorded.
+    // Returns whether or not the operation succeeded.
+    //
+    bool analysis_database::append_handler( uint64_t instance_rva, const vm_handler* handler )
+    {
+        const vm_instruction_info* instruction_info = handler->instruction_info.get();
+
+        if ( instruction_info->custom_data.has_value() )
+            return false;
+
+        const vm_instruction_index& index = vm_instruction_index::get();
+
+        uint8_t descriptor_index = 0;
+        while ( index.get_descriptor( descriptor_index ) != handler->descriptor )
+            descriptor_index++;
+
+        record_writer writer;
+
+        writer.write<uint64_t>( instance_rva );
+        writer.write<uint64_t>( handler->rva );
+        writer.write<uint8_t>( descriptor_index );
+
+        writer.write<uint32_t>( ( uint32_t )instruction_info->operands.size() );
+        for ( auto const& [operand, expression] : instruction_info->operands )
+        {
+            writer.write<uint8_t>( operand.type );
+            writer.write<uint8_t>( ( uint8_t )operand.size );
+            writer.write<uint8_t>( ( uint8_t )operand.byte_length );
+            writer.write_expression( expression.get() );
+        }
+
+        writer.write<uint32_t>( ( uint32_t )instruction_info->sizes.size() );
+        for ( size_t size : instruction_info->sizes )
+            writer.write<uint64_t>( size );
+
+        writer.write<uint8_t>( instruction_info->updated_state.has_value() );
+        if ( instruction_info->updated_state )
+            writer.write_state( *instruction_info->updated_state );
+
+        writer.write_bridge( handler->bridge.get() );
+
+        return append( database_record_handler, handler->rva, writer.buffer );
+    }
+
+    // Computes the content hash of the mapped image, identifying it across runs.
+    // Only the headers and the raw data of each section are hashed, so that pages which are
+    // merely zero-filled are never touched.
+    //
+    uint64_t analysis_database::compute_image_hash( const mapped_image* image )
+    {
+        uint64_t hash = hash_bytes( image->data(), image->get_header_size() );
+
+        for ( const image_section& section : image->get_sections() )
+        {
+            if ( section.virtual_address >= image->size() )
+                continue;
+
+            uint64_t raw_size = std::min<uint64_t>( { section.physical_size, section.virtual_size, image->size() - section.virtual_address } );
+
+            hash = hash_bytes( image->data() + section.virtual_address, raw_size, hash );
+        }
+
+        return hash;
+    }
+
+    // Opens the database at the specified path for the image with the given content hash, creating
+    // it if it does not exist.
+    // If the file cannot be opened, or was written by an incompatible version, returns empty {}.
+    //
+    std::optional<std::unique_ptr<analysis_database>> analysis_database::open( const std::string& path, uint64_t image_hash )
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA( path.c_str(), GENERIC_READ | FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+        if ( file == INVALID_HANDLE_VALUE )
+            return {};
+
+        intptr_t file_handle = ( intptr_t )file;
+#else
+        int file = ::open( path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644 );
+        if ( file == -1 )
+            return {};
+
+        intptr_t file_handle = file;
+#endif
+
+        database_header expected_header = { database_magic, database_version, sizeof( database_header ), compute_schema() };
+
+        // Hold the lock while checking the header, so that only one process writes it.
+        //
+        lock_file( file_handle );
+
+        bool valid;
+        if ( get_file_size( file_handle ) == 0 )
+        {
+            valid = append_file( file_handle, &expected_header, sizeof( expected_header ) );
+        }
+        else
+        {
+            database_header header;
+            valid = read_file( file_handle, 0, &header, sizeof( header ) )
+                 && header.magic == expected_header.magic
+                 && header.version == expected_header.version
+                 && header.header_size == expected_header.header_size
+                 && header.schema == expected_header.schema;
+        }
+
+        unlock_file( file_handle );
+
+        if ( !valid )
+        {
+            close_file( file_handle );
+            return {};
+        }
+
+        // Cannot use make_unique as the constructor is private.
+        //
+        return std::unique_ptr<analysis_database>( new analysis_database( file_handle, image_hash ) );
+    }
+}
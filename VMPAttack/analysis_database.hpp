@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "vm_instance.hpp"
+#include "mapped_image.hpp"
+#include "rva_table.hpp"
+
+namespace vmpattack
+{
+    // This class provides a persistent, append-only database of analysis results, so that
+    // instances and handlers do not have to be matched again when re-lifting the same image.
+    //
+    // The file consists of a versioned header followed by self-describing records, each keyed
+    // by (image content hash, rva) and protected by a checksum. Records are only ever appended,
+    // one write at a time under an exclusive file lock, so any number of processes may read
+    // the file concurrently by mapping it; a record still being written is simply ignored.
+    //
+    class analysis_database
+    {
+    private:
+        // The handle of the opened database file, opened for appending.
+        //
+        intptr_t file_handle;
+
+        // The content hash of the image whose records are read and written.
+        //
+        const uint64_t image_hash;
+
+        // A mutex serializing appends from this process.
+        //
+        std::mutex append_mutex;
+
+        // Private constructor; use the static factory.
+        //
+        analysis_database( intptr_t file_handle, uint64_t image_hash )
+            : file_handle( file_handle ), image_hash( image_hash )
+        {}
+
+        // Appends a single record, with the given type, key rva and payload.
+        // Returns whether or not the operation succeeded.
+        //
+        bool append( uint32_t type, uint64_t rva, const std::vector<uint8_t>& payload );
+
+    public:
+        // Cannot be copied or moved, as the file handle is owned.
+        //
+        analysis_database( const analysis_database& ) = delete;
+        analysis_database( analysis_database&& ) = delete;
+        analysis_database& operator=( const analysis_database& ) = delete;
+        analysis_database& operator=( analysis_database&& ) = delete;
+
+        // Closes the database file.
+        //
+        ~analysis_database();
+
+        // Loads every instance recorded for the image, along with all of their handlers, inserting
+        // them into the given table. Instances whose rva is already present are extended with any
+        // handlers they are missing.
+        // Returns the number of records loaded.
+        //
+        size_t load( rva_table<vm_instance>* instances ) const;
+
+        // Appends the vm_instance's entry information.
+        // Returns whether or not the operation succeeded.
+        //
+        bool append_instance( const vm_instance* instance );
+
+        // Appends a vm_handler discovered for the vm_instance at the given rva.
+        // Handlers holding custom data are not recorded.
+        // Returns whether or not the operation succeeded.
+        //
+        bool append_handler( uint64_t instance_rva, const vm_handler* handler );
+
+        // Getters.
+        //
+        inline uint64_t get_image_hash() const { return image_hash; }
+
+        // Computes the content hash of the mapped image, identifying it across runs.
+        // Only the headers and the raw data of each section are hashed, so that pages which are
+        // merely zero-filled are never touched.
+        //
+        static uint64_t compute_image_hash( const mapped_image* image );
+
+        // Opens the database at the specified path for the image with the given content hash, creating
+        // it if it does not exist.
+        // If the file cannot be opened, or was written by an incompatible version, returns empty {}.
+        //
+        static std::optional<std::unique_ptr<analysis_database>> open( const std::string& path, uint64_t image_hash );
+    };
+}
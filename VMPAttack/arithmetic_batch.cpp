@@ -0,0 +1,345 @@
+#include "arithmetic_batch.hpp"
+#include "arithmetic_operations.hpp"
+#include "arithmetic_utilities.hpp"
+#include <immintrin.h>
+#include <algorithm>
+#include <iterator>
+
+// Compiles a single function for an instruction set extension, so that the rest of the binary
+// does not require it. MSVC allows intrinsics of any extension without it.
+//
+#if defined( _MSC_VER ) && !defined( __clang__ )
+#define VMPATTACK_TARGET( isa )
+#else
+#define VMPATTACK_TARGET( isa ) __attribute__( ( target( isa ) ) )
+#endif
+
+namespace vmpattack
+{
+    // The kind of an operation, as computed by the vector kernels.
+    //
+    enum batch_operation_kind : uint8_t
+    {
+        batch_add,
+        batch_xor,
+        batch_neg,
+        batch_rotate_left,
+        batch_rotate_right,
+        batch_byte_swap,
+
+        // No vector kernel; computed via the operation's transform.
+        //
+        batch_unsupported,
+    };
+
+    // Describes an operation in the terms of the vector kernels.
+    //
+    struct batch_operation
+    {
+        // The operation kind.
+        //
+        batch_operation_kind kind;
+
+        // The addend, XOR value, or rotation count.
+        //
+        uint64_t operand;
+
+        // The width of rotations and byte swaps, in bytes.
+        //
+        size_t width;
+    };
+
+    // The byte shuffles that swap the bytes of each 64-bit lane of a 128-bit vector, zero-extending
+    // from the width, for widths of 8, 4 and 2 bytes.
+    //
+    alignas( 16 ) static const int8_t byte_swap_shuffles[ 3 ][ 16 ] =
+    {
+        { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+        { 3, 2, 1, 0, -1, -1, -1, -1, 11, 10, 9, 8, -1, -1, -1, -1 },
+        { 1, 0, -1, -1, -1, -1, -1, -1, 9, 8, -1, -1, -1, -1, -1, -1 },
+    };
+
+    // Describes the operation in the terms of the vector kernels.
+    // Subtractions, increments and decrements are described as additions, and NOTs as XORs.
+    //
+    static batch_operation classify( const arithmetic_operation& operation )
+    {
+        namespace descriptors = arithmetic_descriptors;
+
+        const arithmetic_operation_desc* descriptor = operation.descriptor;
+        uint64_t operand = operation.additional_operands[ 0 ];
+
+        if ( descriptor == &descriptors::add )
+            return { batch_add, operand, 8 };
+        if ( descriptor == &descriptors::sub )
+            return { batch_add, ( uint64_t )-( int64_t )operand, 8 };
+        if ( descriptor == &descriptors::inc )
+            return { batch_add, 1, 8 };
+        if ( descriptor == &descriptors::dec )
+            return { batch_add, ~0ull, 8 };
+        if ( descriptor == &descriptors::bxor )
+            return { batch_xor, operand, 8 };
+        if ( descriptor == &descriptors::bnot )
+            return { batch_xor, ~0ull, 8 };
+        if ( descriptor == &descriptors::bneg )
+            return { batch_neg, 0, 8 };
+
+        if ( descriptor->input_size )
+        {
+            size_t width = *descriptor->input_size;
+
+            // Rotation counts are taken modulo the width, as by the rotate intrinsics.
+            //
+            switch ( descriptor->insn )
+            {
+                case X86_INS_ROL: return { batch_rotate_left, operand & ( width * 8 - 1 ), width };
+                case X86_INS_ROR: return { batch_rotate_right, operand & ( width * 8 - 1 ), width };
+                case X86_INS_BSWAP: return { width >= 2 ? batch_byte_swap : batch_unsupported, 0, width };
+                default: break;
+            }
+        }
+
+        return { batch_unsupported, 0, 0 };
+    }
+
+    // Computes the values 4 at a time with AVX2.
+    // Returns the number of values computed.
+    //
+    VMPATTACK_TARGET( "avx2" )
+    static size_t apply_avx2( const batch_operation& operation, uint64_t* values, size_t count, uint64_t output_mask )
+    {
+        if ( operation.kind == batch_unsupported )
+            return 0;
+
+        size_t vector_count = count & ~( size_t )3;
+
+        // Rotations are computed as a pair of shifts of the value zero-extended from its width. A zero
+        // count shifts the complementary half out entirely.
+        //
+        uint64_t lane_mask = operation.width >= 8 ? ~0ull : ( 1ull << ( operation.width * 8 ) ) - 1;
+        size_t shuffle_index = operation.width >= 8 ? 0 : operation.width == 4 ? 1 : 2;
+
+        const __m256i output_masks = _mm256_set1_epi64x( ( int64_t )output_mask );
+        const __m256i lane_masks = _mm256_set1_epi64x( ( int64_t )lane_mask );
+        const __m256i operands = _mm256_set1_epi64x( ( int64_t )operation.operand );
+        const __m128i shift_count = _mm_cvtsi64_si128( ( int64_t )operation.operand );
+        const __m128i complement_count = _mm_cvtsi64_si128( ( int64_t )( operation.width * 8 - operation.operand ) );
+        const __m256i shuffle = _mm256_broadcastsi128_si256( _mm_load_si128( ( const __m128i* )byte_swap_shuffles[ shuffle_index ] ) );
+
+        for ( size_t i = 0; i < vector_count; i += 4 )
+        {
+            __m256i value = _mm256_loadu_si256( ( const __m256i* )( values + i ) );
+
+            switch ( operation.kind )
+            {
+                case batch_add: value = _mm256_add_epi64( value, operands ); break;
+                case batch_xor: value = _mm256_xor_si256( value, operands ); break;
+                case batch_neg: value = _mm256_sub_epi64( _mm256_setzero_si256(), value ); break;
+                case batch_rotate_left:
+                    value = _mm256_and_si256( value, lane_masks );
+                    value = _mm256_and_si256( _mm256_or_si256( _mm256_sll_epi64( value, shift_count ), _mm256_srl_epi64( value, complement_count ) ), lane_masks );
+                    break;
+                case batch_rotate_right:
+                    value = _mm256_and_si256( value, lane_masks );
+                    value = _mm256_and_si256( _mm256_or_si256( _mm256_srl_epi64( value, shift_count ), _mm256_sll_epi64( value, complement_count ) ), lane_masks );
+                    break;
+                case batch_byte_swap: value = _mm256_shuffle_epi8( value, shuffle ); break;
+                default: break;
+            }
+
+            _mm256_storeu_si256( ( __m256i* )( values + i ), _mm256_and_si256( value, output_masks ) );
+        }
+
+        return vector_count;
+    }
+
+    // Computes the values 8 at a time with AVX-512.
+    // Returns the number of values computed.
+    //
+    VMPATTACK_TARGET( "avx512f,avx512bw" )
+    static size_t apply_avx512( const batch_operation& operation, uint64_t* values, size_t count, uint64_t output_mask )
+    {
+        if ( operation.kind == batch_unsupported )
+            return 0;
+
+        size_t vector_count = count & ~( size_t )7;
+
+        uint64_t lane_mask = operation.width >= 8 ? ~0ull : ( 1ull << ( operation.width * 8 ) ) - 1;
+        size_t shuffle_index = operation.width >= 8 ? 0 : operation.width == 4 ? 1 : 2;
+
+        const __m512i output_masks = _mm512_set1_epi64( ( int64_t )output_mask );
+        const __m512i lane_masks = _mm512_set1_epi64( ( int64_t )lane_mask );
+        const __m512i operands = _mm512_set1_epi64( ( int64_t )operation.operand );
+        const __m128i shift_count = _mm_cvtsi64_si128( ( int64_t )operation.operand );
+        const __m128i complement_count = _mm_cvtsi64_si128( ( int64_t )( operation.width * 8 - operation.operand ) );
+        const __m512i shuffle = _mm512_broadcast_i32x4( _mm_load_si128( ( const __m128i* )byte_swap_shuffles[ shuffle_index ] ) );
+
+        for ( size_t i = 0; i < vector_count; i += 8 )
+        {
+            __m512i value = _mm512_loadu_si512( values + i );
+
+            switch ( operation.kind )
+            {
+                case batch_add: value = _mm512_add_epi64( value, operands ); break;
+                case batch_xor: value = _mm512_xor_si512( value, operands ); break;
+                case batch_neg: value = _mm512_sub_epi64( _mm512_setzero_si512(), value ); break;
+                case batch_rotate_left:
+                    value = _mm512_and_si512( value, lane_masks );
+                    value = _mm512_and_si512( _mm512_or_si512( _mm512_sll_epi64( value, shift_count ), _mm512_srl_epi64( value, complement_count ) ), lane_masks );
+                    break;
+                case batch_rotate_right:
+                    value = _mm512_and_si512( value, lane_masks );
+                    value = _mm512_and_si512( _mm512_or_si512( _mm512_srl_epi64( value, shift_count ), _mm512_sll_epi64( value, complement_count ) ), lane_masks );
+                    break;
+                case batch_byte_swap: value = _mm512_shuffle_epi8( value, shuffle ); break;
+                default: break;
+            }
+
+            _mm512_storeu_si512( values + i, _mm512_and_si512( value, output_masks ) );
+        }
+
+        return vector_count;
+    }
+
+    // Determines the best instruction set extension supported by both the CPU and the OS.
+    //
+    static arithmetic_batch_isa get_supported_isa()
+    {
+#if defined( _MSC_VER ) && !defined( __clang__ )
+        int registers[ 4 ];
+
+        __cpuid( registers, 0 );
+        if ( registers[ 0 ] < 7 )
+            return arithmetic_batch_scalar;
+
+        // The OS must save the extended registers across context switches.
+        //
+        __cpuid( registers, 1 );
+        if ( !( registers[ 2 ] & ( 1 << 27 ) ) )
+            return arithmetic_batch_scalar;
+
+        uint64_t enabled_state = _xgetbv( 0 );
+
+        __cpuidex( registers, 7, 0 );
+
+        if ( ( registers[ 1 ] & ( 1 << 16 ) ) && ( registers[ 1 ] & ( 1 << 30 ) ) && ( enabled_state & 0xE6 ) == 0xE6 )
+            return arithmetic_batch_avx512;
+
+        if ( ( registers[ 1 ] & ( 1 << 5 ) ) && ( enabled_state & 0x6 ) == 0x6 )
+            return arithmetic_batch_avx2;
+
+        return arithmetic_batch_scalar;
+#else
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" ) )
+            return arithmetic_batch_avx512;
+
+        if ( __builtin_cpu_supports( "avx2" ) )
+            return arithmetic_batch_avx2;
+
+        return arithmetic_batch_scalar;
+#endif
+    }
+
+    // Determines the best instruction set extension supported by both the CPU and the OS, whose
+    // kernels also match the scalar transforms.
+    // Detected once.
+    //
+    arithmetic_batch_isa get_arithmetic_batch_isa()
+    {
+        static const arithmetic_batch_isa isa = []()
+        {
+            arithmetic_batch_isa supported_isa = get_supported_isa();
+
+            // Fall back to the next extension down on any mismatch.
+            //
+            while ( supported_isa != arithmetic_batch_scalar && !verify_arithmetic_batch( supported_isa ) )
+                supported_isa = ( arithmetic_batch_isa )( supported_isa - 1 );
+
+            return supported_isa;
+        }();
+
+        return isa;
+    }
+
+    // Applies the operation to each of the values in place, size-casting each output to the byte count.
+    // Operations with a vector kernel are computed with the specified instruction set extension, and
+    // any other operation, or remaining values, with the operation's transform.
+    //
+    void apply_operation_batch( const arithmetic_operation& operation, uint64_t* values, size_t count, size_t byte_count, arithmetic_batch_isa isa )
+    {
+        uint64_t output_mask = byte_count >= 8 ? ~0ull : ( 1ull << ( byte_count * 8 ) ) - 1;
+
+        size_t computed = 0;
+
+        switch ( isa )
+        {
+            case arithmetic_batch_avx512: computed = apply_avx512( classify( operation ), values, count, output_mask ); break;
+            case arithmetic_batch_avx2: computed = apply_avx2( classify( operation ), values, count, output_mask ); break;
+            default: break;
+        }
+
+        for ( size_t i = computed; i < count; i++ )
+            values[ i ] = dynamic_size_cast( operation.descriptor->transform( values[ i ], operation.additional_operands.data() ), byte_count );
+    }
+
+    // Checks the kernels of the instruction set extension against the descriptors' transforms, for
+    // every descriptor and output byte count, over a spread of values and operands.
+    // Returns whether or not every computed value matched.
+    //
+    bool verify_arithmetic_batch( arithmetic_batch_isa isa )
+    {
+        // Not a multiple of any vector width, so that the scalar tail is covered as well.
+        //
+        constexpr size_t value_count = 67;
+
+        // Edge cases of every width, and rotation counts within, at and beyond every width.
+        //
+        constexpr uint64_t sample_operands[] =
+        {
+            0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 0x7F, 0x80, 0xFF, 0x8000, 0xFFFF,
+            0x80000000, 0xFFFFFFFF, 0x8000000000000000, 0x0123456789ABCDEF, ~0ull,
+        };
+
+        uint64_t values[ value_count ];
+        uint64_t expected_values[ value_count ];
+
+        for ( const arithmetic_operation_desc* descriptor : arithmetic_descriptors::all )
+        {
+            for ( uint64_t operand : sample_operands )
+            {
+                arithmetic_operation operation = { descriptor, { operand, 0, 0 } };
+
+                for ( size_t byte_count : { 1, 2, 4, 8 } )
+                {
+                    // Fill the values with the operands themselves, followed by a xorshift sequence.
+                    //
+                    uint64_t state = 0x9E3779B97F4A7C15 ^ operand;
+
+                    for ( size_t i = 0; i < value_count; i++ )
+                    {
+                        if ( i < std::size( sample_operands ) )
+                            values[ i ] = sample_operands[ i ];
+                        else
+                        {
+                            state ^= state << 13;
+                            state ^= state >> 7;
+                            state ^= state << 17;
+                            values[ i ] = state;
+                        }
+
+                        expected_values[ i ] = dynamic_size_cast( descriptor->transform( values[ i ], operation.additional_operands.data() ), byte_count );
+                    }
+
+                    apply_operation_batch( operation, values, value_count, byte_count, isa );
+
+                    if ( !std::equal( values, values + value_count, expected_values ) )
+                        return false;
+                }
+            }
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include "arithmetic_operation.hpp"
+
+namespace vmpattack
+{
+    // The vector instruction set extensions batched operations can use.
+    //
+    enum arithmetic_batch_isa : uint8_t
+    {
+        // Scalar code only.
+        //
+        arithmetic_batch_scalar,
+
+        // AVX2, 4 values at a time.
+        //
+        arithmetic_batch_avx2,
+
+        // AVX-512 F and BW, 8 values at a time.
+        //
+        arithmetic_batch_avx512,
+    };
+
+    // Determines the best instruction set extension supported by both the CPU and the OS, whose
+    // kernels also match the scalar transforms.
+    // Detected once.
+    //
+    arithmetic_batch_isa get_arithmetic_batch_isa();
+
+    // Applies the operation to each of the values in place, size-casting each output to the byte count.
+    // Operations with a vector kernel are computed with the specified instruction set extension, and
+    // any other operation, or remaining values, with the operation's transform.
+    //
+    void apply_operation_batch( const arithmetic_operation& operation, uint64_t* values, size_t count, size_t byte_count, arithmetic_batch_isa isa = get_arithmetic_batch_isa() );
+
+    // Checks the kernels of the instruction set extension against the descriptors' transforms, for
+    // every descriptor and output byte count, over a spread of values and operands.
+    // Returns whether or not every computed value matched.
+    //
+    bool verify_arithmetic_batch( arithmetic_batch_isa isa );
+}
@@ -1,5 +1,10 @@
 #include "arithmetic_expression.hpp"
 #include "arithmetic_utilities.hpp"
+#include "arithmetic_batch.hpp"
+#include <algorithm>
+#include <shared_mutex>
+#include <mutex>
+#include <unordered_map>
 
 namespace vmpattack
 {
@@ -24,4 +29,110 @@ namespace vmpattack
 
         return output;
     }
+
+    // Computes the outputs for a batch of inputs, each equal to that of compute for the byte count.
+    // The operations are applied to a block of inputs at a time, with vector instructions where supported.
+    // The outputs must be at least as many as the inputs, and may be the inputs themselves.
+    //
+    void arithmetic_expression::compute_batch( std::span<const uint64_t> inputs, std::span<uint64_t> outputs, size_t byte_count ) const
+    {
+        fassert( outputs.size() >= inputs.size() && "Not enough outputs for the inputs." );
+
+        // The number of values per block, small enough for a block to stay in the L1 cache across
+        // all operations.
+        //
+        constexpr size_t block_size = 512;
+
+        arithmetic_batch_isa isa = get_arithmetic_batch_isa();
+
+        for ( size_t begin = 0; begin < inputs.size(); begin += block_size )
+        {
+            size_t count = std::min( block_size, inputs.size() - begin );
+            uint64_t* block = outputs.data() + begin;
+
+            if ( block != inputs.data() + begin )
+                std::copy_n( inputs.data() + begin, count, block );
+
+            for ( auto& operation : operations )
+                apply_operation_batch( operation, block, count, byte_count, isa );
+        }
+    }
+
+    // Determines whether both expressions consist of the same operations.
+    //
+    bool arithmetic_expression::operator==( const arithmetic_expression& other ) const
+    {
+        return std::equal( operations.begin(), operations.end(), other.operations.begin(), other.operations.end(), []( const arithmetic_operation& a, const arithmetic_operation& b )
+                           {
+                               return a.descriptor == b.descriptor && a.additional_operands == b.additional_operands;
+                           } );
+    }
+
+    // Computes a hash over the expression's operations.
+    //
+    uint64_t arithmetic_expression::hash() const
+    {
+        uint64_t hash = operations.size();
+
+        for ( auto& operation : operations )
+        {
+            hash = ( hash ^ ( uint64_t )operation.descriptor ) * 0x9E3779B97F4A7C15ull;
+
+            for ( uint64_t operand : operation.additional_operands )
+                hash = ( hash ^ operand ) * 0x9E3779B97F4A7C15ull;
+        }
+
+        return hash ^ ( hash >> 32 );
+    }
+
+    // The table of interned expressions, by hash.
+    //
+    struct expression_intern_table
+    {
+        // Shared for lookups, exclusive for inserts.
+        //
+        std::shared_mutex mutex;
+
+        // The interned expressions. Never released, as they are shared freely.
+        //
+        std::unordered_map<uint64_t, std::vector<std::shared_ptr<const arithmetic_expression>>> expressions;
+    };
+
+    // Returns the process-wide, immutable instance of the expression's contents, creating it if
+    // no identical expression was interned before.
+    //
+    std::shared_ptr<const arithmetic_expression> arithmetic_expression::intern( const arithmetic_expression& expression )
+    {
+        static expression_intern_table table;
+
+        uint64_t hash = expression.hash();
+
+        {
+            std::shared_lock lock( table.mutex );
+
+            if ( auto it = table.expressions.find( hash ); it != table.expressions.end() )
+            {
+                for ( auto& interned : it->second )
+                {
+                    if ( *interned == expression )
+                        return interned;
+                }
+            }
+        }
+
+        std::unique_lock lock( table.mutex );
+
+        // Another thread may have interned it in the meantime.
+        //
+        auto& candidates = table.expressions[ hash ];
+        for ( auto& interned : candidates )
+        {
+            if ( *interned == expression )
+                return interned;
+        }
+
+        // Copying allocates from the default resource, so the expression may come from a job_arena.
+        //
+        return candidates.emplace_back( std::make_shared<const arithmetic_expression>( expression ) );
+    }
 }
\ No newline at end of file
@@ -1,4 +1,7 @@
 #pragma once
+#include <memory>
+#include <memory_resource>
+#include <span>
 #include <vector>
 #include "arithmetic_operation.hpp"
 
@@ -6,15 +9,49 @@ namespace vmpattack
 {
     // This struct describes an expression instance containing numerous arithmetic_operation's
     // in a specific order. It allows for computation of an output given an input value.
+    // Completed expressions are interned, so that identical chains are shared by pointer.
     //
     struct arithmetic_expression
     {
         // An ordered vector of operations.
+        // May be backed by a job_arena while being recorded.
         //
-        std::vector<arithmetic_operation> operations;
+        std::pmr::vector<arithmetic_operation> operations;
+
+        // Construct an empty expression, allocating from the given memory resource.
+        //
+        arithmetic_expression( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+            : operations( resource )
+        {}
+
+        // Copying always allocates from the default resource, so that an expression
+        // recorded in a job_arena can be copied out to outlive it.
+        //
+        arithmetic_expression( const arithmetic_expression& other )
+            : operations( other.operations, std::pmr::get_default_resource() )
+        {}
 
         // Compute the output for a given input, by applying each operation on said input.
         //
         uint64_t compute( uint64_t input, size_t byte_count = 8 ) const;
+
+        // Computes the outputs for a batch of inputs, each equal to that of compute for the byte count.
+        // The operations are applied to a block of inputs at a time, with vector instructions where supported.
+        // The outputs must be at least as many as the inputs, and may be the inputs themselves.
+        //
+        void compute_batch( std::span<const uint64_t> inputs, std::span<uint64_t> outputs, size_t byte_count = 8 ) const;
+
+        // Determines whether both expressions consist of the same operations.
+        //
+        bool operator==( const arithmetic_expression& other ) const;
+
+        // Computes a hash over the expression's operations.
+        //
+        uint64_t hash() const;
+
+        // Returns the process-wide, immutable instance of the expression's contents, creating it if
+        // no identical expression was interned before.
+        //
+        static std::shared_ptr<const arithmetic_expression> intern( const arithmetic_expression& expression );
     };
 }
\ No newline at end of file
@@ -8,7 +8,12 @@ namespace vmpattack
     //
     std::optional<arithmetic_operation> arithmetic_operation::from_instruction( const arithmetic_operation_desc* descriptor, const instruction* instruction )
     {
-        std::vector<uint64_t> imm_operands;
+        std::array<uint64_t, max_additional_operands> imm_operands = {};
+
+        // Make sure the operands fit.
+        //
+        if ( instruction->operand_count() > max_additional_operands + 1 )
+            return {};
 
         // The first operand is always the target operand. We need
         // to generate the additional operand vector, so we only loop
@@ -24,9 +29,9 @@ namespace vmpattack
             if ( operand.type != X86_OP_IMM )
                 return {};
 
-            // Append to vector.
+            // Append to array.
             //
-            imm_operands.push_back( operand.imm );
+            imm_operands[ i - 1 ] = operand.imm;
         }
 
         return arithmetic_operation( descriptor, imm_operands );
@@ -1,5 +1,6 @@
 #pragma once
 #include <optional>
+#include <array>
 #include "arithmetic_operation_desc.hpp"
 #include "instruction.hpp"
 
@@ -14,13 +15,17 @@ namespace vmpattack
         //
         const arithmetic_operation_desc* descriptor;
 
-        // Any additional argument operands in order.
+        // The maximum number of additional operands an operation can hold.
         //
-        const std::vector<uint64_t> additional_operands;
+        static constexpr size_t max_additional_operands = 3;
 
-        // Construct via backing descriptor and additional operand vector.
+        // Any additional argument operands in order, stored inline.
         //
-        arithmetic_operation( const arithmetic_operation_desc* descriptor, const std::vector<uint64_t>& additional_operands )
+        std::array<uint64_t, max_additional_operands> additional_operands;
+
+        // Construct via backing descriptor and additional operand array.
+        //
+        arithmetic_operation( const arithmetic_operation_desc* descriptor, const std::array<uint64_t, max_additional_operands>& additional_operands )
             : descriptor( descriptor ), additional_operands( additional_operands )
         {}
 
@@ -36,7 +36,7 @@ namespace vmpattack
 
         // Constructor.
         //
-        arithmetic_operation_desc( x86_insn insn, uint8_t num_additional_operands, fn_transform transform, std::optional<bitcnt_t> input_size = {} )
+        constexpr arithmetic_operation_desc( x86_insn insn, uint8_t num_additional_operands, fn_transform transform, std::optional<bitcnt_t> input_size = {} )
             : insn( insn ), num_additional_operands( num_additional_operands ), transform( transform ), input_size( input_size )
         {}
     };
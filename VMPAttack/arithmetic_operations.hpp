@@ -4,6 +4,8 @@
 #else
 #include <x86intrin.h>
 #endif
+#include <array>
+#include <iterator>
 #include "arithmetic_operation_desc.hpp"
 #include "instruction.hpp"
 
@@ -18,29 +20,29 @@ namespace vmpattack
     {
         // Addition / Subtraction.
         //
-        inline const arithmetic_operation_desc add = { X86_INS_ADD,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return d + a[ 0 ]; } };
-        inline const arithmetic_operation_desc sub = { X86_INS_SUB,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return d - a[ 0 ]; } };
+        inline constexpr arithmetic_operation_desc add = { X86_INS_ADD,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return d + a[ 0 ]; } };
+        inline constexpr arithmetic_operation_desc sub = { X86_INS_SUB,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return d - a[ 0 ]; } };
 
         // Bitwise Byte-Swaps.
         //
         //         inline const arithmetic_operation_desc bswap_64 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return __bswap_64( d ); }, 8 };
         // inline const arithmetic_operation_desc bswap_32 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return __bswap_32( ( uint32_t )d ); }, 4 };
         // inline const arithmetic_operation_desc bswap_16 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return __bswap_16( ( uint16_t )d ); }, 2 };
-        inline const arithmetic_operation_desc bswap_64 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bswap_64 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _byteswap_uint64( d );
 #else
             return __bswap_64( d );
 #endif
         }, 8 };
-        inline const arithmetic_operation_desc bswap_32 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bswap_32 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _byteswap_ulong( ( uint32_t )d );
 #else
             return __bswap_32( ( uint32_t )d );
 #endif
         }, 4 };
-        inline const arithmetic_operation_desc bswap_16 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bswap_16 = { X86_INS_BSWAP,  0, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _byteswap_ushort( ( uint16_t )d );
 #else
@@ -50,39 +52,39 @@ namespace vmpattack
 
         // Incement / Decrement.
         //
-        inline const arithmetic_operation_desc inc = { X86_INS_INC,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return ++d; } };
-        inline const arithmetic_operation_desc dec = { X86_INS_DEC,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return --d; } };
+        inline constexpr arithmetic_operation_desc inc = { X86_INS_INC,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return ++d; } };
+        inline constexpr arithmetic_operation_desc dec = { X86_INS_DEC,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return --d; } };
 
         // Bitwise NOT / NEG / XOR.
         //
-        inline const arithmetic_operation_desc bnot = { X86_INS_NOT,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return ~d; } };
-        inline const arithmetic_operation_desc bneg = { X86_INS_NEG,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return ( uint64_t )-( int64_t )d; } };
-        inline const arithmetic_operation_desc bxor = { X86_INS_XOR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return d ^ a[ 0 ]; } };
+        inline constexpr arithmetic_operation_desc bnot = { X86_INS_NOT,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return ~d; } };
+        inline constexpr arithmetic_operation_desc bneg = { X86_INS_NEG,    0, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return ( uint64_t )-( int64_t )d; } };
+        inline constexpr arithmetic_operation_desc bxor = { X86_INS_XOR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t { return d ^ a[ 0 ]; } };
 
         // Left Bitwise Rotations.
         //
-        inline const arithmetic_operation_desc brol_64 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc brol_64 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotl64( d, ( int )a[ 0 ] );
 #else
             return __rolq( d, ( int )a[ 0 ] );
 #endif
         }, 8 };
-        inline const arithmetic_operation_desc brol_32 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc brol_32 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotl( ( uint32_t )d, ( int )a[ 0 ] );
 #else
             return __rold( ( uint32_t )d, ( int )a[ 0 ] );
 #endif
         }, 4 };
-        inline const arithmetic_operation_desc brol_16 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc brol_16 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotl16( ( uint16_t )d, ( uint8_t )a[ 0 ] );
 #else
             return __rolw( ( uint16_t )d, ( uint8_t )a[ 0 ] );
 #endif
         }, 2 };
-        inline const arithmetic_operation_desc brol_8 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc brol_8 = { X86_INS_ROL,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotl8( ( uint8_t )d, ( uint8_t )a[ 0 ] );
 #else
@@ -92,28 +94,28 @@ namespace vmpattack
 
         // Right Bitwise Rotations.
         //
-        inline const arithmetic_operation_desc bror_64 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bror_64 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotr64( d, ( int )a[ 0 ] );
 #else
             return __rorq( d, ( int )a[ 0 ] );
 #endif
         }, 8 };
-        inline const arithmetic_operation_desc bror_32 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bror_32 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotr( ( uint32_t )d, ( int )a[ 0 ] );
 #else
             return __rord( ( uint32_t )d, ( int )a[ 0 ] );
 #endif
         }, 4 };
-        inline const arithmetic_operation_desc bror_16 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bror_16 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotr16( ( uint16_t )d, ( uint8_t )a[ 0 ] );
 #else
             return __rorw( ( uint16_t )d, ( uint8_t )a[ 0 ] );
 #endif
         }, 2 };
-        inline const arithmetic_operation_desc bror_8 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
+        inline constexpr arithmetic_operation_desc bror_8 = { X86_INS_ROR,    1, []( uint64_t d, const uint64_t a[] ) -> uint64_t {
 #ifdef _WIN32
             return _rotr8( ( uint8_t )d, ( uint8_t )a[ 0 ] );
 #else
@@ -123,7 +125,7 @@ namespace vmpattack
 
         // List of all operation descriptors.
         //
-        inline const arithmetic_operation_desc* all[] =
+        inline constexpr const arithmetic_operation_desc* all[] =
         {
             &add, &sub,
             &bswap_64, &bswap_32, &bswap_16,
@@ -134,34 +136,58 @@ namespace vmpattack
         };
     }
 
-    // Fetches the appropriate arithmetic operation descriptor for the given instruction, or nullptr otherwise.
-    //
-    inline const arithmetic_operation_desc* operation_desc_from_instruction( const instruction* instruction )
+    namespace arithmetic_descriptors
     {
-        // Loop through full operation descriptor list.
+        // The operand width classes descriptors are looked up by: 1, 2, 4 and 8 bytes, and any other.
+        //
+        inline constexpr size_t width_class_count = 5;
+
+        // Gets the width class of an operand size, in bytes.
         //
-        for ( auto descriptor : arithmetic_descriptors::all )
+        constexpr size_t get_width_class( size_t size )
         {
-            // Check if the descriptor target instruction is equal to the instruction given.
-            //
-            if ( descriptor->insn == instruction->ins.id )
+            switch ( size )
             {
-                // If the descriptor has a specified input size, ensure it is equal to the input operand, which
-                // is always the first operand.
-                //
-                if ( descriptor->input_size.has_value() 
-                     && descriptor->input_size.value() != instruction->ins.detail->x86.operands[ 0 ].size )
+                case 1: return 0;
+                case 2: return 1;
+                case 4: return 2;
+                case 8: return 3;
+                default: return 4;
+            }
+        }
+
+        // Maps every instruction and input operand width class to the first descriptor in `all` matching
+        // them, as its index plus one, or 0 if none does. Generated from `all` at compile time.
+        // Descriptors with an input size only match operands of that size.
+        //
+        inline constexpr auto lookup_table = []()
+        {
+            std::array<std::array<uint8_t, width_class_count>, X86_INS_ENDING> table = {};
+
+            for ( size_t i = 0; i < std::size( all ); i++ )
+            {
+                for ( size_t width_class = 0; width_class < width_class_count; width_class++ )
                 {
-                    // If not equal, continue search.
-                    continue;
-                }
+                    bool matches = !all[ i ]->input_size
+                        || ( get_width_class( *all[ i ]->input_size ) == width_class && width_class != width_class_count - 1 );
 
-                return descriptor;
+                    if ( matches && !table[ all[ i ]->insn ][ width_class ] )
+                        table[ all[ i ]->insn ][ width_class ] = ( uint8_t )( i + 1 );
+                }
             }
-        }
 
-        // Nothing found; return nullptr.
+            return table;
+        }();
+    }
+
+    // Fetches the appropriate arithmetic operation descriptor for the given instruction, or nullptr otherwise.
+    //
+    inline const arithmetic_operation_desc* operation_desc_from_instruction( const instruction* instruction )
+    {
+        // The input operand is always the first operand.
         //
-        return nullptr;
+        uint8_t entry = arithmetic_descriptors::lookup_table[ instruction->id ][ arithmetic_descriptors::get_width_class( instruction->operand( 0 ).size ) ];
+
+        return entry ? arithmetic_descriptors::all[ entry - 1 ] : nullptr;
     }
 }
\ No newline at end of file
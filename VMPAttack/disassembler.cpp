@@ -1,26 +1,74 @@
 #include "disassembler.hpp"
+#include <algorithm>
 
 namespace vmpattack
 {
-    // Disassembles at the effective address, negotating jumps according to the flags.
+    // The maximum length of an x86 instruction.
+    //
+    const size_t max_instruction_size = 15;
+
+    // Fetches the instruction at the offset from the base, consulting the process-wide
+    // instruction cache before decoding at most max_size bytes, which must not reach past the
+    // end of the image.
+    // The instruction is owned by the cache. If decoding fails, returns nullptr.
     //
-    instruction_stream disassembler::disassemble( uint64_t base, uint64_t offset, disassembler_flags flags )
+    const instruction* disassembler::decode( uint64_t base, uint64_t offset, size_t max_size )
     {
         // ea = base + offset
         //
         uint64_t ea = base + offset;
 
-        std::vector<std::shared_ptr<instruction>> instructions;
+        instruction_cache& cache = instruction_cache::get();
+
+        if ( auto cached = cache.lookup( ea ) )
+            return cached.get();
+
+        // A successful decode is the same regardless of max_size, so it is always safe to cache.
+        //
+        const uint8_t* code = ( const uint8_t* )ea;
+        size_t size = std::min( max_size, max_instruction_size );
+
+        if ( !cs_disasm_iter( handle, &code, &size, &offset, insn ) )
+            return nullptr;
+
+        return cache.insert( ea, std::make_shared<instruction>( handle, insn ) ).get();
+    }
+
+    // Decodes the instruction at the offset from the base, decoding at most max_size bytes, without
+    // consulting or filling the instruction cache. Used for sweeps over large amounts of code, whose
+    // instructions are only looked at once.
+    // If decoding fails, returns empty {}.
+    //
+    std::optional<instruction> disassembler::decode_uncached( uint64_t base, uint64_t offset, size_t max_size )
+    {
+        const uint8_t* code = ( const uint8_t* )( base + offset );
+        size_t size = std::min( max_size, max_instruction_size );
+
+        if ( !cs_disasm_iter( handle, &code, &size, &offset, insn ) )
+            return {};
+
+        return instruction( handle, insn );
+    }
 
-        size_t size = 0xFFFFFFFFFFFFFFFFull;
+    // Disassembles at the effective address, negotating jumps according to the flags.
+    // No byte at or past end_rva is read, and disassembly ends once it is reached.
+    //
+    instruction_buffer disassembler::disassemble( uint64_t base, uint64_t offset, uint64_t end_rva, disassembler_flags flags, job_arena* arena )
+    {
+        instruction_buffer instructions( arena ? arena->get_resource() : std::pmr::get_default_resource() );
 
-        // While iterative disassembly is successful.
+        // While within bounds and disassembly is successful. Jumps out of bounds end disassembly too.
         //
-        while ( cs_disasm_iter( handle, ( const uint8_t** )&ea, &size, &offset, insn ) )
+        while ( offset < end_rva )
         {
-            // Construct a self-containing instruction.
+            auto ins = decode( base, offset, end_rva - offset );
+
+            if ( !ins )
+                break;
+
+            // Advance past the instruction.
             //
-            auto ins = std::make_shared<instruction>( insn );
+            offset += ins->size;
 
             // Is the instruction a branch?
             //
@@ -36,10 +84,6 @@ namespace vmpattack
                     //
                     offset = ins->operand( 0 ).imm;
 
-                    // Update actual disassembly pointer.
-                    //
-                    ea = offset + base;
-
                     // Don't append the jump to the stream.
                     //
                     continue;
@@ -52,7 +96,7 @@ namespace vmpattack
 
             // Is the instruction a call?
             //
-            if ( ins->ins.id == X86_INS_CALL )
+            if ( ins->id == X86_INS_CALL )
             {
                 // If the pass calls flag is not set, add it and end disassembly.
                 //
@@ -65,7 +109,7 @@ namespace vmpattack
 
             // Is the instruction a return?
             //
-            if ( ins->ins.id == X86_INS_RET )
+            if ( ins->id == X86_INS_RET )
             {
                 // Add the instruction and end disassembly.
                 //
@@ -78,46 +122,6 @@ namespace vmpattack
             instructions.push_back( ins );
         }
 
-        // Return an instruction stream of said instructions.
-        //
-        return { instructions };
-    }
-
-
-    // Disassembles at the offset from the base, simply disassembling every instruction in order.
-    //
-    std::vector<std::unique_ptr<instruction>> disassembler::disassembly_simple( uint64_t base, uint64_t offset, uint64_t end_rva )
-    {
-        // ea = base + offset
-        //
-        uint64_t ea = base + offset;
-
-        std::vector<std::unique_ptr<instruction>> instructions;
-
-        size_t size = end_rva - offset;
-
-        // While iterative disassembly is successful.
-        //
-        while ( true )
-        {
-            // Check if we're within bounds.
-            //
-            if ( offset >= size )
-                break;
-
-            // In case disassembly failed (due to invalid instructions), try to continue by incrementing offset.
-            //
-            if ( !cs_disasm_iter( handle, ( const uint8_t** )&ea, &size, &offset, insn ) )
-            {
-                offset++;
-                ea++;
-
-                continue;
-            }
-
-            instructions.push_back( std::make_unique<instruction>( insn ) );
-        }
-
-        return std::move( instructions );
+        return instructions;
     }
 }
\ No newline at end of file
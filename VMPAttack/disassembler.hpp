@@ -1,7 +1,10 @@
 #pragma once
 #include <capstone/capstone.h>
+#include <optional>
 #include <vtil/utility>
 #include "instruction_stream.hpp"
+#include "instruction_cache.hpp"
+#include "job_arena.hpp"
 
 namespace vmpattack
 {
@@ -49,20 +52,24 @@ namespace vmpattack
         //
         cs_insn* insn;
 
+        // Whether or not instruction detail is enabled.
+        //
+        bool detail;
 
     public:
         // Cannot be copied or moved.
-        // Only one disassembler can exist per thread.
+        // Only one disassembler of each kind can exist per thread.
         //
         disassembler( const disassembler& ) = delete;
         disassembler( disassembler&& ) = delete;
         disassembler& operator=( const disassembler&& ) = delete;
         disassembler& operator=( disassembler&& ) = delete;
 
-        disassembler( cs_arch arch, cs_mode mode )
+        disassembler( cs_arch arch, cs_mode mode, bool detail = true )
+            : detail( detail )
         {
             fassert( cs_open( arch, mode, &handle ) == CS_ERR_OK );
-            cs_option( handle, CS_OPT_DETAIL, CS_OPT_ON );
+            cs_option( handle, CS_OPT_DETAIL, detail ? CS_OPT_ON : CS_OPT_OFF );
             insn = cs_malloc( handle );
         }
 
@@ -84,13 +91,65 @@ namespace vmpattack
             return instance;
         }
 
-        // Disassembles at the offset from the base, negotating jumps according to the flags.
-        // NOTE: The offset is used for the disassembled instructions' addresses.
+        // Singleton to provide a unique detail-less disassembler instance for each thread.
+        // Used for linear sweeps, where only instruction ids and lengths are needed.
+        //
+        inline static disassembler& get_sweep( cs_arch arch = cs_default_arch, cs_mode mode = cs_default_mode )
+        {
+            thread_local static disassembler instance( arch, mode, false );
+
+            return instance;
+        }
+
+        // Fetches the instruction at the offset from the base, consulting the process-wide
+        // instruction cache before decoding at most max_size bytes, which must not reach past the
+        // end of the image.
+        // Must be used on a disassembler with detail.
+        // The instruction is owned by the cache. If decoding fails, returns nullptr.
+        //
+        const instruction* decode( uint64_t base, uint64_t offset, size_t max_size );
+
+        // Decodes the instruction at the offset from the base, decoding at most max_size bytes, without
+        // consulting or filling the instruction cache. Used for sweeps over large amounts of code, whose
+        // instructions are only looked at once.
+        // Must be used on a disassembler with detail.
+        // If decoding fails, returns empty {}.
         //
-        instruction_stream disassemble( uint64_t base, uint64_t offset, disassembler_flags flags = disassembler_take_unconditional_imm );
+        std::optional<instruction> decode_uncached( uint64_t base, uint64_t offset, size_t max_size );
 
-        // Disassembles at the offset from the base, simply disassembling every instruction in order.
+        // Linearly sweeps [offset, end_rva) from the base, invoking the callback with the rva
+        // and id of every instruction decoded. Nothing is stored or cached, and no detail is
+        // decoded, so this must be used on a detail-less disassembler.
+        // In case disassembly fails (due to invalid instructions), the sweep continues at the next byte.
+        //
+        template <typename T>
+        void sweep( uint64_t base, uint64_t offset, uint64_t end_rva, T callback )
+        {
+            fassert( !detail && "Sweeps must be done on a detail-less disassembler." );
+
+            const uint8_t* code = ( const uint8_t* )( base + offset );
+            size_t size = end_rva - offset;
+
+            while ( offset < end_rva )
+            {
+                if ( !cs_disasm_iter( handle, &code, &size, &offset, insn ) )
+                {
+                    code++;
+                    size--;
+                    offset++;
+
+                    continue;
+                }
+
+                callback( insn->address, ( x86_insn )insn->id );
+            }
+        }
+
+        // Disassembles at the offset from the base, negotating jumps according to the flags.
+        // No byte at or past end_rva is read, and disassembly ends once it is reached.
+        // If an arena is specified, the returned buffer is allocated from it.
+        // NOTE: The offset is used for the disassembled instructions' addresses.
         //
-        std::vector<std::unique_ptr<instruction>> disassembly_simple( uint64_t base, uint64_t offset, uint64_t end_rva );
+        instruction_buffer disassemble( uint64_t base, uint64_t offset, uint64_t end_rva, disassembler_flags flags = disassembler_take_unconditional_imm, job_arena* arena = nullptr );
     };
 }
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include "entry_signature.hpp"
+#include <cstring>
+
+#if defined( _M_X64 ) || defined( __x86_64__ )
+#define VMPATTACK_SIMD_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Functions using AVX2 intrinsics must be explicitly compiled for it on GCC/Clang, as the
+// rest of the binary is not. MSVC allows the intrinsics regardless.
+//
+#if defined( VMPATTACK_SIMD_X64 ) && !defined( _MSC_VER )
+#define VMPATTACK_TARGET_AVX2 __attribute__( ( target( "avx2" ) ) )
+#else
+#define VMPATTACK_TARGET_AVX2
+#endif
+
+namespace vmpattack
+{
+    // Determines whether the E9 byte at the rva is the start of a VMEntry site, by validating
+    // its destination against the target ranges and the stub signature.
+    //
+    inline bool is_vmentry_candidate( const uint8_t* image, uint64_t image_size, uint64_t rva, const std::vector<rva_range>& target_ranges )
+    {
+        int32_t displacement;
+        memcpy( &displacement, image + rva + 1, sizeof( displacement ) );
+
+        uint64_t destination = rva + vmentry_jmp_size + ( int64_t )displacement;
+
+        // Make sure the whole stub is mapped.
+        //
+        if ( destination > image_size || image_size - destination < vmentry_stub_size )
+            return false;
+
+        // Is the destination within any of the target ranges?
+        //
+        bool within_target = false;
+        for ( const rva_range& range : target_ranges )
+        {
+            if ( destination >= range.begin && destination < range.end )
+            {
+                within_target = true;
+                break;
+            }
+        }
+
+        if ( !within_target )
+            return false;
+
+        // PUSH imm32 / CALL rel32
+        //
+        return image[ destination ] == vmentry_push_opcode
+            && image[ destination + 5 ] == vmentry_call_opcode;
+    }
+
+    // Scalar kernel, scanning [rva, end_rva) one byte at a time.
+    //
+    void find_vmentry_candidates_scalar( const uint8_t* image, uint64_t image_size, uint64_t rva, uint64_t end_rva, const std::vector<rva_range>& target_ranges, std::vector<uint64_t>& candidates )
+    {
+        for ( ; rva < end_rva; rva++ )
+        {
+            if ( image[ rva ] == vmentry_jmp_opcode && is_vmentry_candidate( image, image_size, rva, target_ranges ) )
+                candidates.push_back( rva );
+        }
+    }
+
+#ifdef VMPATTACK_SIMD_X64
+    // Returns the index of the lowest set bit of a non-zero mask.
+    //
+    inline uint32_t lowest_set_bit( uint32_t mask )
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward( &index, mask );
+        return index;
+#else
+        return __builtin_ctz( mask );
+#endif
+    }
+
+    // SSE2 kernel, comparing 16 bytes at a time for the JMP opcode.
+    // Returns the rva at which it stopped, for the remainder to be scanned by the scalar kernel.
+    //
+    uint64_t find_vmentry_candidates_sse2( const uint8_t* image, uint64_t image_size, uint64_t rva, uint64_t end_rva, const std::vector<rva_range>& target_ranges, std::vector<uint64_t>& candidates )
+    {
+        const __m128i opcode = _mm_set1_epi8( ( char )vmentry_jmp_opcode );
+
+        for ( ; end_rva - rva >= 16; rva += 16 )
+        {
+            __m128i block = _mm_loadu_si128( ( const __m128i* )( image + rva ) );
+            uint32_t mask = ( uint32_t )_mm_movemask_epi8( _mm_cmpeq_epi8( block, opcode ) );
+
+            for ( ; mask; mask &= mask - 1 )
+            {
+                uint64_t candidate = rva + lowest_set_bit( mask );
+
+                if ( is_vmentry_candidate( image, image_size, candidate, target_ranges ) )
+                    candidates.push_back( candidate );
+            }
+        }
+
+        return rva;
+    }
+
+    // AVX2 kernel, comparing 32 bytes at a time for the JMP opcode.
+    // Returns the rva at which it stopped, for the remainder to be scanned by the scalar kernel.
+    //
+    VMPATTACK_TARGET_AVX2
+    uint64_t find_vmentry_candidates_avx2( const uint8_t* image, uint64_t image_size, uint64_t rva, uint64_t end_rva, const std::vector<rva_range>& target_ranges, std::vector<uint64_t>& candidates )
+    {
+        const __m256i opcode = _mm256_set1_epi8( ( char )vmentry_jmp_opcode );
+
+        for ( ; end_rva - rva >= 32; rva += 32 )
+        {
+            __m256i block = _mm256_loadu_si256( ( const __m256i* )( image + rva ) );
+            uint32_t mask = ( uint32_t )_mm256_movemask_epi8( _mm256_cmpeq_epi8( block, opcode ) );
+
+            for ( ; mask; mask &= mask - 1 )
+            {
+                uint64_t candidate = rva + lowest_set_bit( mask );
+
+                if ( is_vmentry_candidate( image, image_size, candidate, target_ranges ) )
+                    candidates.push_back( candidate );
+            }
+        }
+
+        return rva;
+    }
+
+    // Determines whether the CPU and OS support AVX2.
+    //
+    bool cpu_supports_avx2()
+    {
+#ifdef _MSC_VER
+        int info[ 4 ];
+
+        // AVX and OSXSAVE.
+        //
+        __cpuid( info, 1 );
+        if ( ( info[ 2 ] & ( 1 << 27 ) ) == 0 || ( info[ 2 ] & ( 1 << 28 ) ) == 0 )
+            return false;
+
+        // The OS must save the YMM state.
+        //
+        if ( ( _xgetbv( 0 ) & 6 ) != 6 )
+            return false;
+
+        // AVX2.
+        //
+        __cpuidex( info, 7, 0 );
+        return ( info[ 1 ] & ( 1 << 5 ) ) != 0;
+#else
+        return __builtin_cpu_supports( "avx2" );
+#endif
+    }
+#endif
+
+    // Scans the mapped bytes of the rva range [begin_rva, end_rva) of the image for VMEntry sites,
+    // by their byte signature.
+    // Returns the rvas of all candidate jumps, in ascending order.
+    //
+    std::vector<uint64_t> find_vmentry_candidates( const uint8_t* image, uint64_t image_size, uint64_t begin_rva, uint64_t end_rva, const std::vector<rva_range>& target_ranges )
+    {
+        std::vector<uint64_t> candidates;
+
+        // The whole jump must lie within the range, and within the image.
+        //
+        end_rva = end_rva < image_size ? end_rva : image_size;
+
+        if ( end_rva < begin_rva + vmentry_jmp_size )
+            return candidates;
+
+        uint64_t last_rva = end_rva - vmentry_jmp_size + 1;
+        uint64_t rva = begin_rva;
+
+#ifdef VMPATTACK_SIMD_X64
+        static const bool has_avx2 = cpu_supports_avx2();
+
+        if ( has_avx2 )
+            rva = find_vmentry_candidates_avx2( image, image_size, rva, last_rva, target_ranges, candidates );
+        else
+            rva = find_vmentry_candidates_sse2( image, image_size, rva, last_rva, target_ranges, candidates );
+#endif
+
+        find_vmentry_candidates_scalar( image, image_size, rva, last_rva, target_ranges, candidates );
+
+        return candidates;
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "mapped_image.hpp"
+
+namespace vmpattack
+{
+    // The byte signature of a VMEntry site and its stub:
+    //
+    //      site:   E9 %rel32           JMP stub
+    //      stub:   68 %imm32           PUSH %entry_stub
+    //              E8 %rel32           CALL %vmentry
+    //
+    const uint8_t vmentry_jmp_opcode = 0xE9;
+    const uint8_t vmentry_push_opcode = 0x68;
+    const uint8_t vmentry_call_opcode = 0xE8;
+
+    const size_t vmentry_jmp_size = 5;
+    const size_t vmentry_stub_size = 10;
+
+    // Scans the mapped bytes of the rva range [begin_rva, end_rva) of the image for VMEntry sites,
+    // by their byte signature: E9 rel32 jumps whose destination lies in one of the target ranges,
+    // and begins with a PUSH imm32 / CALL rel32 stub.
+    // The fastest kernel supported by the CPU is used (AVX2, SSE2 or scalar).
+    // Returns the rvas of all candidate jumps, in ascending order. Candidates are not aligned
+    // to instruction boundaries, and must still be validated.
+    //
+    std::vector<uint64_t> find_vmentry_candidates( const uint8_t* image, uint64_t image_size, uint64_t begin_rva, uint64_t end_rva, const std::vector<rva_range>& target_ranges );
+}
@@ -0,0 +1,206 @@
+#include "folded_expression.hpp"
+#include "arithmetic_operations.hpp"
+#include <vector>
+
+namespace vmpattack
+{
+    // Returns the canonical left rotation descriptor of the specified width, in bytes.
+    //
+    static const arithmetic_operation_desc* get_rotation_descriptor( size_t width )
+    {
+        switch ( width )
+        {
+            case 8: return &arithmetic_descriptors::brol_64;
+            case 4: return &arithmetic_descriptors::brol_32;
+            case 2: return &arithmetic_descriptors::brol_16;
+            case 1: return &arithmetic_descriptors::brol_8;
+            default: return nullptr;
+        }
+    }
+
+    // This class folds operations one at a time, merging each into the tail of the folded chain.
+    //
+    class expression_folder
+    {
+    private:
+        // The byte count the output is size-cast to after each operation.
+        //
+        const size_t byte_count;
+
+        // The folded operations so far, along with the descriptor of each transform.
+        //
+        std::vector<std::pair<folded_operation, const arithmetic_operation_desc*>> folded;
+
+        // Determines whether the last folded operation is of the kind.
+        //
+        inline bool tail_is( folded_operation_kind kind ) const
+        {
+            return !folded.empty() && folded.back().first.kind == kind;
+        }
+
+    public:
+        expression_folder( size_t byte_count )
+            : byte_count( byte_count )
+        {}
+
+        // Folds output += value.
+        //
+        void add( uint64_t value )
+        {
+            if ( tail_is( folded_add ) )
+            {
+                if ( ( folded.back().first.operand += value ) == 0 )
+                    folded.pop_back();
+            }
+            else if ( value != 0 )
+                folded.push_back( { { folded_add, nullptr, value }, nullptr } );
+        }
+
+        // Folds output ^= value.
+        //
+        void bxor( uint64_t value )
+        {
+            if ( tail_is( folded_xor ) )
+            {
+                if ( ( folded.back().first.operand ^= value ) == 0 )
+                    folded.pop_back();
+            }
+            else if ( value != 0 )
+                folded.push_back( { { folded_xor, nullptr, value }, nullptr } );
+        }
+
+        // Folds output = -output.
+        // As -( -x + c ) = x - c, a trailing addition is moved past the negation.
+        //
+        void neg()
+        {
+            uint64_t addend = 0;
+
+            if ( tail_is( folded_add ) )
+            {
+                addend = folded.back().first.operand;
+                folded.pop_back();
+            }
+
+            if ( tail_is( folded_neg ) )
+                folded.pop_back();
+            else
+                folded.push_back( { { folded_neg, nullptr, 0 }, nullptr } );
+
+            add( ( uint64_t )-( int64_t )addend );
+        }
+
+        // Folds output = ~output.
+        // Merged into a trailing XOR if any, otherwise folded as ~x = -x - 1.
+        //
+        void bnot()
+        {
+            if ( tail_is( folded_add ) || tail_is( folded_neg ) )
+            {
+                neg();
+                add( ~0ull );
+            }
+            else
+                bxor( ~0ull );
+        }
+
+        // Folds a rotation of the specified width, in bytes, by the amount of bits to the left.
+        // Rotations only merge if the size-cast between them has no effect, ie. the byte count is
+        // at least as wide, and only cancel out if it is exactly as wide.
+        //
+        void rotate_left( size_t width, uint64_t amount )
+        {
+            const arithmetic_operation_desc* descriptor = get_rotation_descriptor( width );
+            amount %= width * 8;
+
+            if ( byte_count >= width && tail_is( folded_transform ) && folded.back().second == descriptor )
+            {
+                amount = ( folded.back().first.operand + amount ) % ( width * 8 );
+                folded.pop_back();
+            }
+
+            if ( amount != 0 || byte_count != width )
+                folded.push_back( { { folded_transform, descriptor->transform, amount }, descriptor } );
+        }
+
+        // Folds any other transform, cancelling out pairs of byte swaps of exactly the byte count's width.
+        //
+        void transform( const arithmetic_operation_desc* descriptor, uint64_t operand )
+        {
+            if ( descriptor->insn == X86_INS_BSWAP && descriptor->input_size == byte_count
+                 && tail_is( folded_transform ) && folded.back().second == descriptor )
+            {
+                folded.pop_back();
+                return;
+            }
+
+            folded.push_back( { { folded_transform, descriptor->transform, operand }, descriptor } );
+        }
+
+        // Getter to the folded operations.
+        //
+        inline const std::vector<std::pair<folded_operation, const arithmetic_operation_desc*>>& get_folded() const { return folded; }
+    };
+
+    // Folds the expression, as computed for the specified byte count.
+    //
+    folded_expression folded_expression::fold( const std::shared_ptr<const arithmetic_expression>& expression, size_t byte_count )
+    {
+        namespace descriptors = arithmetic_descriptors;
+
+        folded_expression result = {};
+        result.byte_count = ( uint8_t )byte_count;
+
+        expression_folder folder( byte_count );
+
+        for ( const arithmetic_operation& operation : expression->operations )
+        {
+            const arithmetic_operation_desc* descriptor = operation.descriptor;
+            uint64_t operand = operation.additional_operands[ 0 ];
+
+            // Only single-operand operations can be stored inline.
+            //
+            if ( descriptor->num_additional_operands > 1 )
+            {
+                result.unfolded = expression;
+                return result;
+            }
+
+            if ( descriptor == &descriptors::add )
+                folder.add( operand );
+            else if ( descriptor == &descriptors::sub )
+                folder.add( ( uint64_t )-( int64_t )operand );
+            else if ( descriptor == &descriptors::inc )
+                folder.add( 1 );
+            else if ( descriptor == &descriptors::dec )
+                folder.add( ~0ull );
+            else if ( descriptor == &descriptors::bxor )
+                folder.bxor( operand );
+            else if ( descriptor == &descriptors::bnot )
+                folder.bnot();
+            else if ( descriptor == &descriptors::bneg )
+                folder.neg();
+            else if ( descriptor->insn == X86_INS_ROL && descriptor->input_size )
+                folder.rotate_left( *descriptor->input_size, operand );
+            else if ( descriptor->insn == X86_INS_ROR && descriptor->input_size )
+                folder.rotate_left( *descriptor->input_size, *descriptor->input_size * 8 - operand % ( *descriptor->input_size * 8 ) );
+            else
+                folder.transform( descriptor, operand );
+        }
+
+        auto& folded = folder.get_folded();
+
+        if ( folded.size() > max_operations )
+        {
+            result.unfolded = expression;
+            return result;
+        }
+
+        for ( size_t i = 0; i < folded.size(); i++ )
+            result.operations[ i ] = folded[ i ].first;
+
+        result.operation_count = ( uint8_t )folded.size();
+
+        return result;
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include "arithmetic_expression.hpp"
+#include "arithmetic_utilities.hpp"
+
+namespace vmpattack
+{
+    // The kind of a single folded operation.
+    //
+    enum folded_operation_kind : uint8_t
+    {
+        // output += operand.
+        //
+        folded_add,
+
+        // output ^= operand.
+        //
+        folded_xor,
+
+        // output = -output.
+        //
+        folded_neg,
+
+        // output = transform( output, operand ), for rotations and byte swaps.
+        //
+        folded_transform,
+    };
+
+    // This struct describes a single operation of a folded_expression.
+    //
+    struct folded_operation
+    {
+        // The operation kind.
+        //
+        folded_operation_kind kind;
+
+        // The transformation function, only used by folded_transform.
+        //
+        arithmetic_operation_desc::fn_transform transform;
+
+        // The single additional operand, if any.
+        //
+        uint64_t operand;
+    };
+
+    // This struct describes an arithmetic_expression folded, for a fixed byte count, into a minimal
+    // canonical chain of operations, stored inline.
+    // Runs of additions, subtractions, increments, decrements, negations and NOTs are folded into
+    // at most a negation followed by an addition, runs of XORs into a single XOR, and runs of
+    // rotations and byte swaps of the byte count's width are merged, or cancelled out.
+    //
+    struct folded_expression
+    {
+        // The maximum number of operations stored inline.
+        //
+        static constexpr size_t max_operations = 16;
+
+        // The folded operations, in order.
+        //
+        std::array<folded_operation, max_operations> operations;
+
+        // The number of folded operations.
+        //
+        uint8_t operation_count;
+
+        // The byte count the expression was folded for.
+        //
+        uint8_t byte_count;
+
+        // The original expression, only set if it could not be folded, in which case it is computed instead.
+        //
+        std::shared_ptr<const arithmetic_expression> unfolded;
+
+        // Compute the output for a given input, equal to that of the original expression for the byte count.
+        //
+        inline uint64_t compute( uint64_t input ) const
+        {
+            if ( unfolded )
+                return unfolded->compute( input, byte_count );
+
+            uint64_t output = input;
+
+            for ( size_t i = 0; i < operation_count; i++ )
+            {
+                const folded_operation& operation = operations[ i ];
+
+                switch ( operation.kind )
+                {
+                    case folded_add: output += operation.operand; break;
+                    case folded_xor: output ^= operation.operand; break;
+                    case folded_neg: output = ( uint64_t )-( int64_t )output; break;
+
+                    // Additions, XORs and negations do not depend on the bits above the byte count, so
+                    // the output only has to be size-cast before the transforms that may.
+                    //
+                    case folded_transform: output = operation.transform( dynamic_size_cast( output, byte_count ), &operation.operand ); break;
+                }
+            }
+
+            return dynamic_size_cast( output, byte_count );
+        }
+
+        // Folds the expression, as computed for the specified byte count.
+        //
+        static folded_expression fold( const std::shared_ptr<const arithmetic_expression>& expression, size_t byte_count = 8 );
+    };
+}
@@ -0,0 +1,246 @@
+#include "handler_shape.hpp"
+#include "instruction_stream.hpp"
+#include "instruction_utilities.hpp"
+#include <algorithm>
+#include <array>
+
+namespace vmpattack
+{
+    // The general purpose registers the virtual instruction set never refers to by name,
+    // which may thus be renamed freely.
+    //
+    static constexpr x86_reg renamable_registers[] =
+    {
+        X86_REG_RSI, X86_REG_RDI, X86_REG_RBP,
+        X86_REG_R8, X86_REG_R9, X86_REG_R10, X86_REG_R11,
+        X86_REG_R12, X86_REG_R13, X86_REG_R14, X86_REG_R15,
+    };
+
+    // Canonical register names are tagged with this bit, so that they never collide with
+    // the registers that are kept as-is.
+    //
+    static constexpr uint64_t renamed_register_tag = 0x1000;
+
+    // Mixes the value into the hash.
+    //
+    static inline uint64_t combine_hash( uint64_t seed, uint64_t value )
+    {
+        return seed ^ ( value + 0x9E3779B97F4A7C15ull + ( seed << 6 ) + ( seed >> 2 ) );
+    }
+
+    // This class renames registers in order of first use.
+    //
+    class register_renamer
+    {
+    private:
+        // Describes a register of a renamable family.
+        //
+        struct renamable_register
+        {
+            // The index of the family in renamable_registers, plus one. Zero if not renamable.
+            //
+            uint8_t family;
+
+            // The register's size within the family.
+            //
+            uint8_t size;
+        };
+
+        // Maps every register to its renamable family, if any. Built on first use.
+        //
+        static const std::array<renamable_register, X86_REG_ENDING>& get_families()
+        {
+            static const std::array<renamable_register, X86_REG_ENDING> families = []()
+            {
+                std::array<renamable_register, X86_REG_ENDING> result = {};
+
+                for ( size_t i = 0; i < std::size( renamable_registers ); i++ )
+                {
+                    for ( uint8_t size : { 1, 2, 4, 8 } )
+                        result[ vtil::amd64::registers.remap( renamable_registers[ i ], 0, size ) ] = { ( uint8_t )( i + 1 ), size };
+                }
+
+                return result;
+            }();
+
+            return families;
+        }
+
+        // The name assigned to each family, or zero if not yet used.
+        //
+        std::array<uint8_t, std::size( renamable_registers ) + 1> names = {};
+
+        // The last assigned name.
+        //
+        uint8_t last_name = 0;
+
+    public:
+        // Returns the canonical name of the register, assigning its family a name if it is
+        // seen for the first time.
+        //
+        uint64_t rename( x86_reg reg )
+        {
+            renamable_register entry = get_families()[ reg ];
+
+            // Registers outside the renamable families are kept as-is.
+            //
+            if ( !entry.family )
+                return reg;
+
+            uint8_t& name = names[ entry.family ];
+            if ( !name )
+                name = ++last_name;
+
+            return renamed_register_tag | ( name << 4 ) | entry.size;
+        }
+
+        // Returns whether or not the register belongs to a renamable family.
+        //
+        static bool is_renamable( x86_reg reg )
+        {
+            return get_families()[ reg ].family != 0;
+        }
+    };
+
+    // Determines whether the instruction is known to have no effect, ie. is a nop, or moves a
+    // register into itself without zero-extending it.
+    //
+    bool is_identity_instruction( const instruction* instruction )
+    {
+        if ( instruction->id == X86_INS_NOP )
+            return true;
+
+        if ( instruction->operand_count() != 2 || instruction->operand_type( 0 ) != X86_OP_REG )
+            return false;
+
+        const instruction_operand& destination = instruction->operand( 0 );
+        const instruction_operand& source = instruction->operand( 1 );
+
+        // 32-bit writes zero the upper half of the register, so they are never identities.
+        //
+        if ( destination.size == 4 )
+            return false;
+
+        switch ( instruction->id )
+        {
+            // MOV %reg, %reg
+            // XCHG %reg, %reg
+            //
+            case X86_INS_MOV:
+            case X86_INS_XCHG:
+                return source.type == X86_OP_REG && source.reg == destination.reg;
+
+            // LEA %reg, [%reg]
+            //
+            case X86_INS_LEA:
+                return destination.size == 8
+                    && source.type == X86_OP_MEM
+                    && source.mem.base == destination.reg
+                    && source.mem.index == X86_REG_INVALID
+                    && source.mem.disp == 0;
+
+            default:
+                return false;
+        }
+    }
+
+    // Returns the number of kept instructions before the given stream position.
+    //
+    size_t handler_shape::kept_before( uint32_t position ) const
+    {
+        return std::lower_bound( positions.begin(), positions.end(), position ) - positions.begin();
+    }
+
+    // Computes the shape of the remainder of the instruction stream, for the given vm_state.
+    // The stream's position is left untouched.
+    //
+    handler_shape handler_shape::from_instruction_stream( const vm_state* state, const instruction_stream* stream )
+    {
+        handler_shape shape = {};
+
+        register_renamer renamer;
+
+        // Name the vm_state's registers first, in a fixed order, so that their roles are part of the shape.
+        //
+        uint64_t hash = state->direction;
+        for ( x86_reg reg : { state->stack_reg, state->vip_reg, state->context_reg, state->rolling_key_reg, state->flow_reg } )
+            hash = combine_hash( hash, renamer.rename( reg ) );
+
+        shape.prefix_hashes.push_back( hash );
+        shape.prefix_immediate_counts.push_back( 0 );
+
+        instruction_stream shape_stream = *stream;
+
+        uint32_t position = shape_stream.mark();
+        while ( const instruction* instruction = shape_stream.next() )
+        {
+            uint32_t instruction_position = position;
+            position = shape_stream.mark();
+
+            if ( is_identity_instruction( instruction ) )
+                continue;
+
+            uint64_t token = combine_hash( instruction->id, instruction->operand_count() );
+
+            for ( int i = 0; i < instruction::max_prefixes; i++ )
+                token = combine_hash( token, instruction->prefix( i ) );
+
+            for ( int i = 0; i < instruction->operand_count(); i++ )
+            {
+                const instruction_operand& operand = instruction->operand( i );
+
+                token = combine_hash( token, operand.type );
+                token = combine_hash( token, operand.size );
+
+                switch ( operand.type )
+                {
+                    case X86_OP_REG:
+                        token = combine_hash( token, renamer.rename( operand.reg ) );
+                        break;
+
+                    // Immediates are only referred to by their slot, which follows from their order.
+                    //
+                    case X86_OP_IMM:
+                        shape.immediates.push_back( operand.imm );
+                        break;
+
+                    case X86_OP_MEM:
+                        token = combine_hash( token, renamer.rename( operand.mem.base ) );
+                        token = combine_hash( token, renamer.rename( operand.mem.index ) );
+                        token = combine_hash( token, operand.mem.scale );
+                        token = combine_hash( token, operand.mem.disp );
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+
+            // Registers accessed implicitly are determined by the instruction id, except for those of
+            // renamable families, which must be renamed consistently too.
+            //
+            for ( auto* accessed : { &instruction->get_regs_read(), &instruction->get_regs_written() } )
+            {
+                for ( size_t reg = 0; reg < accessed->size(); reg++ )
+                {
+                    if ( accessed->test( reg ) && register_renamer::is_renamable( ( x86_reg )reg ) )
+                        token = combine_hash( token, renamer.rename( ( x86_reg )reg ) );
+                }
+
+                token = combine_hash( token, X86_REG_ENDING );
+            }
+
+            shape.tokens.push_back( token );
+            shape.positions.push_back( instruction_position );
+
+            hash = combine_hash( hash, token );
+
+            shape.prefix_hashes.push_back( hash );
+            shape.prefix_immediate_counts.push_back( ( uint32_t )shape.immediates.size() );
+        }
+
+        shape.end = position;
+
+        return shape;
+    }
+}
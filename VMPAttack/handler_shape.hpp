@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "instruction.hpp"
+#include "vm_state.hpp"
+
+namespace vmpattack
+{
+    class instruction_stream;
+
+    // This struct describes the canonical shape of a handler's instruction stream, invariant
+    // to register allocation, immediate values and known junk.
+    // General purpose registers not referred to by the virtual instruction set are renamed in
+    // order of first use, after the vm_state's registers. Immediates are replaced by their slot
+    // in order of appearance, and identity instructions are dropped.
+    //
+    struct handler_shape
+    {
+        // The canonical token of each kept instruction, in order.
+        //
+        std::vector<uint64_t> tokens;
+
+        // The stream position of each kept instruction, in order.
+        //
+        std::vector<uint32_t> positions;
+
+        // The stream position after the last instruction.
+        //
+        uint32_t end;
+
+        // The immediate values, by slot.
+        //
+        std::vector<uint64_t> immediates;
+
+        // The hash over the first n tokens, by n.
+        //
+        std::vector<uint64_t> prefix_hashes;
+
+        // The number of immediates within the first n tokens, by n.
+        //
+        std::vector<uint32_t> prefix_immediate_counts;
+
+        // Returns the stream position after the given number of kept instructions.
+        //
+        inline uint32_t position_after( size_t kept_count ) const
+        {
+            return kept_count < positions.size() ? positions[ kept_count ] : end;
+        }
+
+        // Returns the number of kept instructions before the given stream position.
+        //
+        size_t kept_before( uint32_t position ) const;
+
+        // Computes the shape of the remainder of the instruction stream, for the given vm_state.
+        // The stream's position is left untouched.
+        //
+        static handler_shape from_instruction_stream( const vm_state* state, const instruction_stream* stream );
+    };
+
+    // Determines whether the instruction is known to have no effect, ie. is a nop, or moves a
+    // register into itself without zero-extending it.
+    //
+    bool is_identity_instruction( const instruction* instruction );
+}
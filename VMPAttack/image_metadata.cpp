@@ -0,0 +1,173 @@
+#include "image_metadata.hpp"
+#include <algorithm>
+
+namespace vmpattack
+{
+    // Sorts the ranges and merges any overlapping or adjacent ones, dropping empty ranges.
+    //
+    void normalize_ranges( std::vector<rva_range>& ranges )
+    {
+        ranges.erase( std::remove_if( ranges.begin(), ranges.end(), []( const rva_range& range ) { return range.begin >= range.end; } ), ranges.end() );
+        std::sort( ranges.begin(), ranges.end(), []( const rva_range& a, const rva_range& b ) { return a.begin < b.begin; } );
+
+        size_t merged_count = 0;
+
+        for ( const rva_range& range : ranges )
+        {
+            if ( merged_count != 0 && range.begin <= ranges[ merged_count - 1 ].end )
+                ranges[ merged_count - 1 ].end = std::max( ranges[ merged_count - 1 ].end, range.end );
+            else
+                ranges[ merged_count++ ] = range;
+        }
+
+        ranges.resize( merged_count );
+    }
+
+    // Removes all the excluded ranges from the ranges. Both must be normalized.
+    // Returns the remaining ranges, normalized.
+    //
+    std::vector<rva_range> subtract_ranges( const std::vector<rva_range>& ranges, const std::vector<rva_range>& excluded )
+    {
+        std::vector<rva_range> result = {};
+
+        auto excluded_it = excluded.begin();
+
+        for ( rva_range range : ranges )
+        {
+            // Skip all excluded ranges that end before this range.
+            //
+            while ( excluded_it != excluded.end() && excluded_it->end <= range.begin )
+                ++excluded_it;
+
+            // Cut out every excluded range overlapping this one.
+            //
+            for ( auto it = excluded_it; it != excluded.end() && it->begin < range.end; ++it )
+            {
+                if ( it->begin > range.begin )
+                    result.push_back( { range.begin, it->begin } );
+
+                range.begin = std::max( range.begin, it->end );
+            }
+
+            if ( range.begin < range.end )
+                result.push_back( range );
+        }
+
+        return result;
+    }
+
+    // Determines whether the rva lies in any of the normalized ranges.
+    //
+    bool ranges_contain( const std::vector<rva_range>& ranges, uint64_t rva )
+    {
+        // Find the first range beginning after the rva; the one before it is the only candidate.
+        //
+        auto it = std::upper_bound( ranges.begin(), ranges.end(), rva, []( uint64_t rva, const rva_range& range ) { return rva < range.begin; } );
+
+        return it != ranges.begin() && rva < std::prev( it )->end;
+    }
+
+    // Parses the metadata from the image's data directories.
+    // Malformed or missing directories are ignored.
+    //
+    image_metadata image_metadata::from_image( const mapped_image* image )
+    {
+        image_metadata metadata = {};
+
+        // The entry point, if any. DLLs may have none.
+        //
+        if ( image->get_entry_point() != 0 )
+            metadata.entry_points.push_back( image->get_entry_point() );
+
+        // Exception directory: an array of RUNTIME_FUNCTION { BeginAddress, EndAddress, UnwindData }.
+        // This layout is specific to AMD64 PE32+ images; any other is left without function ranges.
+        //
+        const rva_range& exception_directory = image->get_data_directory( image_directory_exception );
+        bool x64_runtime_functions = image->get_machine() == image_machine_amd64 && image->is_pe32_plus();
+
+        for ( uint64_t entry = exception_directory.begin; x64_runtime_functions && entry + 12 <= exception_directory.end; entry += 12 )
+        {
+            std::optional<uint32_t> begin_address = image->read<uint32_t>( entry );
+            std::optional<uint32_t> end_address = image->read<uint32_t>( entry + 4 );
+
+            if ( !begin_address || !end_address )
+                break;
+
+            metadata.functions.push_back( { *begin_address, *end_address } );
+        }
+
+        // Export directory: AddressOfFunctions holds NumberOfFunctions rvas. Those pointing back
+        // into the export directory are forwarder strings, not code.
+        //
+        const rva_range& export_directory = image->get_data_directory( image_directory_export );
+
+        if ( export_directory.begin != 0 )
+        {
+            std::optional<uint32_t> number_of_functions = image->read<uint32_t>( export_directory.begin + 20 );
+            std::optional<uint32_t> address_of_functions = image->read<uint32_t>( export_directory.begin + 28 );
+
+            if ( number_of_functions && address_of_functions )
+            {
+                for ( uint32_t i = 0; i < *number_of_functions; i++ )
+                {
+                    std::optional<uint32_t> function_rva = image->read<uint32_t>( ( uint64_t )*address_of_functions + i * 4ull );
+
+                    if ( !function_rva )
+                        break;
+
+                    if ( *function_rva != 0 && ( *function_rva < export_directory.begin || *function_rva >= export_directory.end ) )
+                        metadata.entry_points.push_back( *function_rva );
+                }
+            }
+        }
+
+        // TLS directory: AddressOfCallBacks is the va of a null-terminated array of callback vas.
+        // The image is not relocated, so these are relative to the preferred base.
+        //
+        const rva_range& tls_directory = image->get_data_directory( image_directory_tls );
+
+        if ( tls_directory.begin != 0 )
+        {
+            const size_t pointer_size = image->is_pe32_plus() ? 8 : 4;
+
+            // Reads a pointer-sized va at the rva, converting it to an rva.
+            //
+            auto read_va = [&]( uint64_t rva ) -> std::optional<uint64_t>
+            {
+                std::optional<uint64_t> va = {};
+
+                if ( pointer_size == 8 )
+                    va = image->read<uint64_t>( rva );
+                else if ( std::optional<uint32_t> va32 = image->read<uint32_t>( rva ) )
+                    va = *va32;
+
+                if ( !va || *va < image->preferred_base() || *va - image->preferred_base() >= image->size() )
+                    return {};
+
+                return *va - image->preferred_base();
+            };
+
+            // AddressOfCallBacks follows StartAddressOfRawData, EndAddressOfRawData and AddressOfIndex.
+            //
+            if ( std::optional<uint64_t> callbacks = read_va( tls_directory.begin + 3 * pointer_size ) )
+            {
+                for ( uint64_t callback_entry = *callbacks; std::optional<uint64_t> callback = read_va( callback_entry ); callback_entry += pointer_size )
+                    metadata.entry_points.push_back( *callback );
+            }
+        }
+
+        // Relocations, imports and the IAT are data even when placed within executable sections,
+        // as are the directories parsed above.
+        //
+        for ( image_directory index : { image_directory_basereloc, image_directory_import, image_directory_iat, image_directory_exception, image_directory_export, image_directory_tls } )
+            metadata.data_ranges.push_back( image->get_data_directory( index ) );
+
+        normalize_ranges( metadata.functions );
+        normalize_ranges( metadata.data_ranges );
+
+        std::sort( metadata.entry_points.begin(), metadata.entry_points.end() );
+        metadata.entry_points.erase( std::unique( metadata.entry_points.begin(), metadata.entry_points.end() ), metadata.entry_points.end() );
+
+        return metadata;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "mapped_image.hpp"
+
+namespace vmpattack
+{
+    // Sorts the ranges and merges any overlapping or adjacent ones, dropping empty ranges.
+    //
+    void normalize_ranges( std::vector<rva_range>& ranges );
+
+    // Removes all the excluded ranges from the ranges. Both must be normalized.
+    // Returns the remaining ranges, normalized.
+    //
+    std::vector<rva_range> subtract_ranges( const std::vector<rva_range>& ranges, const std::vector<rva_range>& excluded );
+
+    // Determines whether the rva lies in any of the normalized ranges.
+    //
+    bool ranges_contain( const std::vector<rva_range>& ranges, uint64_t rva );
+
+    // This struct describes what the image's own metadata says about its code: which ranges are
+    // known function bodies, which rvas are known code entry points, and which ranges are data.
+    //
+    struct image_metadata
+    {
+        // The function extents from the exception directory (.pdata RUNTIME_FUNCTION entries).
+        // Normalized.
+        //
+        std::vector<rva_range> functions;
+
+        // Code entry points of unknown extent: the image entry point, exported functions and
+        // TLS callbacks.
+        // Sorted and unique.
+        //
+        std::vector<uint64_t> entry_points;
+
+        // Ranges known to hold data: relocations, imports and the IAT, along with the parsed
+        // directories themselves.
+        // Normalized.
+        //
+        std::vector<rva_range> data_ranges;
+
+        // Parses the metadata from the image's data directories.
+        // Malformed or missing directories are ignored.
+        //
+        static image_metadata from_image( const mapped_image* image );
+    };
+}
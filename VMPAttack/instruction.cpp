@@ -1,45 +1,145 @@
 #include "instruction.hpp"
 #include "disassembler.hpp"
+#include "instruction_utilities.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace vmpattack
 {
-    // Determines whether this instruction is any type of jump.
+    // Maps capstone's eflags effects onto the flags they test, or modify.
     //
-    bool instruction::is_jmp() const
+    static constexpr std::pair<uint64_t, uint8_t> eflags_tested[] =
+    {
+        { X86_EFLAGS_TEST_CF, eflags_cf }, { X86_EFLAGS_PRIOR_CF, eflags_cf },
+        { X86_EFLAGS_TEST_PF, eflags_pf }, { X86_EFLAGS_PRIOR_PF, eflags_pf },
+        { X86_EFLAGS_TEST_AF, eflags_af }, { X86_EFLAGS_PRIOR_AF, eflags_af },
+        { X86_EFLAGS_TEST_ZF, eflags_zf }, { X86_EFLAGS_PRIOR_ZF, eflags_zf },
+        { X86_EFLAGS_TEST_SF, eflags_sf }, { X86_EFLAGS_PRIOR_SF, eflags_sf },
+        { X86_EFLAGS_TEST_OF, eflags_of }, { X86_EFLAGS_PRIOR_OF, eflags_of },
+        { X86_EFLAGS_TEST_DF, eflags_df }, { X86_EFLAGS_PRIOR_DF, eflags_df },
+    };
+
+    static constexpr std::pair<uint64_t, uint8_t> eflags_modified[] =
     {
-        // Enumerate instruction groups.
+        { X86_EFLAGS_MODIFY_CF, eflags_cf }, { X86_EFLAGS_RESET_CF, eflags_cf }, { X86_EFLAGS_SET_CF, eflags_cf }, { X86_EFLAGS_UNDEFINED_CF, eflags_cf },
+        { X86_EFLAGS_MODIFY_PF, eflags_pf }, { X86_EFLAGS_RESET_PF, eflags_pf }, { X86_EFLAGS_UNDEFINED_PF, eflags_pf },
+        { X86_EFLAGS_MODIFY_AF, eflags_af }, { X86_EFLAGS_RESET_AF, eflags_af }, { X86_EFLAGS_UNDEFINED_AF, eflags_af },
+        { X86_EFLAGS_MODIFY_ZF, eflags_zf }, { X86_EFLAGS_UNDEFINED_ZF, eflags_zf },
+        { X86_EFLAGS_MODIFY_SF, eflags_sf }, { X86_EFLAGS_RESET_SF, eflags_sf }, { X86_EFLAGS_UNDEFINED_SF, eflags_sf },
+        { X86_EFLAGS_MODIFY_OF, eflags_of }, { X86_EFLAGS_RESET_OF, eflags_of }, { X86_EFLAGS_UNDEFINED_OF, eflags_of },
+        { X86_EFLAGS_MODIFY_DF, eflags_df }, { X86_EFLAGS_RESET_DF, eflags_df }, { X86_EFLAGS_SET_DF, eflags_df },
+    };
+
+    // Construct by packing a detailed capstone instruction. The handle is used to
+    // resolve the registers accessed.
+    //
+    instruction::instruction( csh handle, const cs_insn* ins )
+        : address( ins->address ), id( ( x86_insn )ins->id ), size( ( uint8_t )ins->size ), bytes{},
+          op_count( 0 ), operands{}, prefixes{}, groups_count( 0 ), groups{}, regs_read{}, regs_write{}, bases_write{}, flags_read( 0 ), flags_write( 0 )
+    {
+        const cs_detail* detail = ins->detail;
+
+        memcpy( bytes, ins->bytes, std::min<size_t>( size, max_size ) );
+        memcpy( prefixes, detail->x86.prefix, max_prefixes );
+
+        // Pack the operands.
         //
-        for ( int i = 0; i < ins.detail->groups_count; i++ )
+        op_count = std::min<uint8_t>( detail->x86.op_count, max_operands );
+
+        for ( int i = 0; i < op_count; i++ )
         {
-            auto grp = ins.detail->groups[ i ];
+            const cs_x86_op& source = detail->x86.operands[ i ];
+            instruction_operand& target = operands[ i ];
+
+            target.type = source.type;
+            target.size = source.size;
+            target.access = source.access;
+
+            switch ( source.type )
+            {
+                case X86_OP_REG:
+                    target.reg = source.reg;
+                    break;
+                case X86_OP_IMM:
+                    target.imm = source.imm;
+                    break;
+                case X86_OP_MEM:
+                    target.mem.base = source.mem.base;
+                    target.mem.index = source.mem.index;
+                    target.mem.scale = ( int8_t )source.mem.scale;
+                    target.mem.disp = source.mem.disp;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // Copy the groups.
+        //
+        groups_count = std::min<uint8_t>( detail->groups_count, max_groups );
+        memcpy( groups, detail->groups, groups_count );
 
-            // If group is JMP, return true.
-            //
-            if ( grp == X86_GRP_JUMP )
+        // Resolve all registers accessed once, rather than every time they're queried.
+        //
+        cs_regs read, write;
+        uint8_t readc, writec;
+
+        if ( cs_regs_access( handle, ins, read, &readc, write, &writec ) == CS_ERR_OK )
+        {
+            for ( int i = 0; i < readc; i++ )
+                regs_read.set( read[ i ] );
+            for ( int i = 0; i < writec; i++ )
+            {
+                regs_write.set( write[ i ] );
+                bases_write.set( get_register_base( ( x86_reg )write[ i ] ) );
+            }
+        }
+
+        // Resolve the individual flags accessed.
+        //
+        for ( auto const& [effect, flag] : eflags_tested )
+        {
+            if ( detail->x86.eflags & effect )
+                flags_read |= flag;
+        }
+
+        for ( auto const& [effect, flag] : eflags_modified )
+        {
+            if ( detail->x86.eflags & effect )
+                flags_write |= flag;
+        }
+    }
+
+    // Determines whether the instruction belongs to the specified group.
+    //
+    bool instruction::in_group( x86_insn_group group ) const
+    {
+        for ( int i = 0; i < groups_count; i++ )
+        {
+            if ( groups[ i ] == group )
                 return true;
         }
 
         return false;
     }
 
+    // Determines whether this instruction is any type of jump.
+    //
+    bool instruction::is_jmp() const
+    {
+        return in_group( X86_GRP_JUMP );
+    }
+
     // Is the instruction a conditional jump?
     //
     bool instruction::is_cond_jump() const
     {
         // Return false if unconditional.
         //
-        if ( ins.id == X86_INS_JMP )
+        if ( id == X86_INS_JMP )
             return false;
 
-        // Loop through groups.
-        //
-        for ( int i = 0; i < ins.detail->groups_count; i++ )
-        {
-            if ( ins.detail->groups[ i ] == X86_GRP_JUMP )
-                return true;
-        }
-
-        return false;
+        return in_group( X86_GRP_JUMP );
     }
 
     // Returns a vector of registers this instruction writes to and reads from.
@@ -47,25 +147,34 @@ namespace vmpattack
     //
     std::pair<std::vector<x86_reg>, std::vector<x86_reg>> instruction::get_regs_accessed() const
     {
-        // Declare C-arrays of the data.
-        //
-        cs_regs read, write;
-        uint8_t readc, writec;
-
-        // Use capstone to get lists of registers read from / written to.
-        //
-        if ( cs_regs_access( disassembler::get().get_handle(), &ins, read, &readc, write, &writec ) != CS_ERR_OK )
-            return {};
-
         std::vector<x86_reg> read_vec, write_vec;
 
-        // Convert raw C style arrays to pretty C++ vectors.
+        // Convert the bitsets to pretty C++ vectors.
         //
-        for ( int i = 0; i < readc; i++ )
-            read_vec.push_back( ( x86_reg )read[ i ] );
-        for ( int i = 0; i < writec; i++ )
-            write_vec.push_back( ( x86_reg )write[ i ] );
+        for ( size_t i = 0; i < X86_REG_ENDING; i++ )
+        {
+            if ( regs_read.test( i ) )
+                read_vec.push_back( ( x86_reg )i );
+            if ( regs_write.test( i ) )
+                write_vec.push_back( ( x86_reg )i );
+        }
 
         return { read_vec, write_vec };
     }
-}
\ No newline at end of file
+
+    // Disassembles the instruction bytes again to produce its textual representation.
+    //
+    std::string instruction::to_string() const
+    {
+        cs_insn* insn;
+
+        if ( cs_disasm( disassembler::get().get_handle(), bytes, size, address, 1, &insn ) != 1 )
+            return "???";
+
+        std::string text = std::string( insn->mnemonic ) + " " + insn->op_str;
+
+        cs_free( insn, 1 );
+
+        return text;
+    }
+}
@@ -1,51 +1,156 @@
 #pragma once
 #include <capstone/capstone.h>
+#include <bitset>
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace vmpattack
 {
-    // This class provides a simple wrapper over the cs_insn and cs_detail
-    // structs to make it self-containing, and to provide some simple utilities.
+    // This struct describes a packed x86 memory operand.
+    // Field names mirror capstone's x86_op_mem.
+    //
+    struct instruction_memory
+    {
+        x86_reg base : 16;
+        x86_reg index : 16;
+        int8_t scale;
+        int64_t disp;
+    };
+
+    // This struct describes a packed x86 operand.
+    // Field names mirror capstone's cs_x86_op, so that it may be consumed the same way.
+    //
+    struct instruction_operand
+    {
+        x86_op_type type : 8;
+
+        // Size of the operand, in bytes.
+        //
+        uint8_t size;
+
+        // How the operand is accessed, as a combination of CS_AC_READ and CS_AC_WRITE.
+        //
+        uint8_t access;
+
+        union
+        {
+            x86_reg reg;
+            int64_t imm;
+            instruction_memory mem;
+        };
+    };
+
+    // The status and direction flags, as tracked across instructions.
+    //
+    enum eflags_mask : uint8_t
+    {
+        eflags_cf = 1 << 0,
+        eflags_pf = 1 << 1,
+        eflags_af = 1 << 2,
+        eflags_zf = 1 << 3,
+        eflags_sf = 1 << 4,
+        eflags_of = 1 << 5,
+        eflags_df = 1 << 6,
+
+        eflags_all = eflags_cf | eflags_pf | eflags_af | eflags_zf | eflags_sf | eflags_of | eflags_df,
+    };
+
+    // This class provides a compact, self-containing decoded form of a capstone instruction,
+    // holding only what analysis needs, and providing some simple utilities.
+    // The textual representation is not kept, and is instead produced on demand.
     //
     class instruction
     {
+    public:
+        // Capstone never reports more operands, prefixes or groups than these.
+        //
+        static constexpr size_t max_operands = 8;
+        static constexpr size_t max_prefixes = 4;
+        static constexpr size_t max_groups = 8;
+        static constexpr size_t max_size = 15;
+
+        // The instruction address (the rva it was disassembled at).
+        //
+        uint64_t address;
+
+        // The instruction id.
+        //
+        x86_insn id;
+
+        // The instruction length, and its raw bytes.
+        //
+        uint8_t size;
+        uint8_t bytes[ max_size ];
+
     private:
-        // This is an internal backing structure that the cs_insn->detail
-        // points to.
+        // The number of operands, and the packed operands.
         //
-        cs_detail detail;
+        uint8_t op_count;
+        instruction_operand operands[ max_operands ];
 
-    public:
-        // The wrapped instruction.
+        // The raw prefix bytes, as laid out by capstone.
         //
-        cs_insn ins;
+        uint8_t prefixes[ max_prefixes ];
 
-        // Copy constructor.
+        // The groups this instruction belongs to.
         //
-        instruction( const cs_insn* ins )
-            : ins( *ins ), detail( *ins->detail )
-        {
-            // Point ins->detail to copy.
-            //
-            this->ins.detail = &detail;
-        }
+        uint8_t groups_count;
+        uint8_t groups[ max_groups ];
+
+        // The registers read from / written to by this instruction, implicitly or explicitly.
+        //
+        std::bitset<X86_REG_ENDING> regs_read;
+        std::bitset<X86_REG_ENDING> regs_write;
+
+        // The bases of the registers written to by this instruction, as per get_register_base.
+        //
+        std::bitset<X86_REG_ENDING> bases_write;
+
+        // The flags tested by / modified by this instruction, as eflags_mask.
+        // Flags set, reset or left undefined count as modified.
+        //
+        uint8_t flags_read;
+        uint8_t flags_write;
+
+    public:
+        // Construct by packing a detailed capstone instruction. The handle is used to
+        // resolve the registers accessed.
+        //
+        instruction( csh handle, const cs_insn* ins );
 
         // Determines whether this instruction is any type of jump.
         //
         bool is_jmp() const;
 
+        // Determines whether the instruction belongs to the specified group.
+        //
+        bool in_group( x86_insn_group group ) const;
+
         // Useful utilities.
         //
-        inline int                 operand_count()         const { return detail.x86.op_count; }
-        inline const cs_x86_op&    operand( int i )        const { return detail.x86.operands[ i ]; }
-        inline x86_op_type         operand_type( int i )   const { return detail.x86.operands[ i ].type; }
+        inline int                          operand_count()         const { return op_count; }
+        inline const instruction_operand&   operand( int i )        const { return operands[ i ]; }
+        inline x86_op_type                  operand_type( int i )   const { return operands[ i ].type; }
+
+        inline bool                         is_uncond_jmp()         const { return id == X86_INS_JMP; };
 
-        inline bool                is_uncond_jmp()         const { return ins.id == X86_INS_JMP; };
+        inline bool                         is_branch()             const { return is_jmp(); }
 
-        inline bool                is_branch()             const { return is_jmp(); }
+        inline x86_prefix                   prefix( int i )         const { return ( x86_prefix )prefixes[ i ]; }
 
-        inline x86_prefix          prefix( int i )         const { return ( x86_prefix )detail.x86.prefix[ i ]; }
+        inline bool                         reads( x86_reg reg )    const { return regs_read.test( reg ); }
+        inline bool                         writes( x86_reg reg )   const { return regs_write.test( reg ); }
+
+        // Determines whether the instruction writes to any register of the base, as per get_register_base.
+        //
+        inline bool                         writes_base( x86_reg base ) const { return bases_write.test( base ); }
+
+        inline const std::bitset<X86_REG_ENDING>& get_regs_read()    const { return regs_read; }
+        inline const std::bitset<X86_REG_ENDING>& get_regs_written() const { return regs_write; }
+
+        inline uint8_t                      get_flags_read()        const { return flags_read; }
+        inline uint8_t                      get_flags_written()     const { return flags_write; }
 
         // Returns a vector of registers this instruction writes to and reads from.
         // Read is returned in the first part of the pair, Written in the second.
@@ -55,5 +160,10 @@ namespace vmpattack
         // Is the instruction a conditional jump?
         //
         bool is_cond_jump() const;
+
+        // Disassembles the instruction bytes again to produce its textual representation.
+        // Only intended for debug output.
+        //
+        std::string to_string() const;
     };
-}
\ No newline at end of file
+}
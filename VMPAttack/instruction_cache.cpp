@@ -0,0 +1,28 @@
+#include "instruction_cache.hpp"
+
+namespace vmpattack
+{
+    // Looks up the instruction at the effective address, updating statistics.
+    // If not cached, returns nullptr.
+    //
+    std::shared_ptr<instruction> instruction_cache::lookup( uint64_t ea )
+    {
+        return entries.lookup( ea );
+    }
+
+    // Inserts the decoded instruction at the effective address. If another thread
+    // inserted it first, the existing instruction is kept.
+    // Returns the cached instruction.
+    //
+    std::shared_ptr<instruction> instruction_cache::insert( uint64_t ea, std::shared_ptr<instruction> ins )
+    {
+        return entries.insert( ea, std::move( ins ) );
+    }
+
+    // Drops all cached instructions in the effective address range [begin, end).
+    //
+    void instruction_cache::flush( uint64_t begin, uint64_t end )
+    {
+        entries.flush( begin, end );
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <memory>
+#include "instruction.hpp"
+#include "sharded_cache.hpp"
+
+namespace vmpattack
+{
+    // This class provides a process-wide, thread-safe cache of decoded instructions.
+    // Mapped images are immutable, so an instruction decoded once at an address never
+    // has to be decoded again. Entries are keyed by effective address (image base + rva),
+    // so that multiple images can share the cache without colliding.
+    //
+    class instruction_cache
+    {
+    private:
+        // The decoded instructions, by effective address.
+        //
+        sharded_cache<uint64_t, std::shared_ptr<instruction>, 64> entries;
+
+        instruction_cache() = default;
+
+    public:
+        // Cannot be copied or moved.
+        //
+        instruction_cache( const instruction_cache& ) = delete;
+        instruction_cache( instruction_cache&& ) = delete;
+        instruction_cache& operator=( const instruction_cache& ) = delete;
+        instruction_cache& operator=( instruction_cache&& ) = delete;
+
+        // Singleton to provide the process-wide cache instance.
+        //
+        inline static instruction_cache& get()
+        {
+            static instruction_cache instance;
+
+            return instance;
+        }
+
+        // Looks up the instruction at the effective address, updating statistics.
+        // If not cached, returns nullptr.
+        //
+        std::shared_ptr<instruction> lookup( uint64_t ea );
+
+        // Inserts the decoded instruction at the effective address. If another thread
+        // inserted it first, the existing instruction is kept.
+        // Returns the cached instruction.
+        //
+        std::shared_ptr<instruction> insert( uint64_t ea, std::shared_ptr<instruction> ins );
+
+        // Drops all cached instructions in the effective address range [begin, end).
+        // Must be called before the memory backing the range is released.
+        //
+        void flush( uint64_t begin, uint64_t end );
+
+        // Statistics getters.
+        //
+        inline uint64_t hit_count() const { return entries.hit_count(); }
+        inline uint64_t miss_count() const { return entries.miss_count(); }
+    };
+}
@@ -9,19 +9,11 @@ namespace vmpattack
     {
         // Check if within bounds.
         //
-        if ( begin + index > end )
+        if ( index >= count )
             return nullptr;
 
-        // Fetch instruction.
+        // Fetch instruction, and increment index.
         //
-        auto& ins = instructions[ begin + index ];
-
-        // Increment index.
-        //
-        index++;
-
-        // Return a non-owning pointer to the instruction.
-        //
-        return ins.get();
+        return instructions[ index++ ];
     }
-}
\ No newline at end of file
+}
@@ -1,30 +1,33 @@
 #pragma once
 #include <memory>
+#include <memory_resource>
+#include <vector>
 #include "instruction.hpp"
 
 namespace vmpattack
 {
-    // This class spans over an ordered vector of instructions.
+    // An ordered buffer of decoded instructions, optionally backed by a job_arena.
+    // Non-owning; the instructions are owned by the instruction_cache, and stay valid
+    // for as long as the image they were decoded from is loaded.
+    //
+    using instruction_buffer = std::pmr::vector<const instruction*>;
+
+    // This class spans over an ordered buffer of instructions.
     // It contains an index to determine the current position in the
-    // stream.
+    // stream. It does not own the buffer, so copying it, or saving and
+    // restoring its position, is trivial.
     //
     class instruction_stream
     {
-    public:
-        // The backing instruction vector.
-        // This is a shared_ptr vector as instruction_streams are copyable
-        // and thus instruction objects can have multiple owners.
-        //
-        std::vector<std::shared_ptr<instruction>> instructions;
-
     private:
-        // Begin index of span.
+        // The backing instruction buffer.
+        // Non-owning.
         //
-        uint32_t begin;
+        const instruction* const* instructions;
 
-        // End index of span.
+        // Number of instructions in the span.
         //
-        uint32_t end;
+        uint32_t count;
 
         // Current Index.
         //
@@ -38,17 +41,22 @@ namespace vmpattack
         instruction_stream& operator= ( instruction_stream&& ) = default;
         instruction_stream& operator= ( const instruction_stream& ) = default;
 
-        // Construct via copying existing instruction vector
+        // Construct a span over an existing instruction buffer.
+        // The buffer must stay valid for the lifetime of the stream.
         //
-        instruction_stream( const std::vector<std::shared_ptr<instruction>>& instructions )
-            : instructions( instructions ), begin( 0 ), end( instructions.size() - 1 ), index( 0 )
+        instruction_stream( const instruction_buffer& instructions )
+            : instructions( instructions.data() ), count( ( uint32_t )instructions.size() ), index( 0 )
         {}
 
+        // Cannot span over a temporary buffer.
+        //
+        instruction_stream( instruction_buffer&& ) = delete;
+
         // Get the stream base
         //
         inline uint64_t base() const
         {
-            return instructions[ begin ]->ins.address;
+            return instructions[ 0 ]->address;
         }
 
         // Disassembler bases instructions via RVA, thus base == rva.
@@ -65,10 +73,24 @@ namespace vmpattack
             index = 0;
         }
 
+        // Returns the current position, which can later be restored via rewind.
+        //
+        inline uint32_t mark() const
+        {
+            return index;
+        }
+
+        // Restores a position previously returned by mark.
+        //
+        inline void rewind( uint32_t position )
+        {
+            index = position;
+        }
+
         // Advances the stream, incrementing index and returning the
         // instruction ptr.
         // Non-owning.
         //
         const instruction* next();
     };
-}
\ No newline at end of file
+}
@@ -4,12 +4,20 @@
 
 namespace vmpattack
 {
+    // Gets the register's base, ie. its lowest byte equivalent.
+    // e.g. base( RAX ) == AL, and base( AH ) == AL.
+    //
+    inline x86_reg get_register_base( x86_reg reg )
+    {
+        return vtil::amd64::registers.remap( reg, 0, 1 );
+    }
+
     // Determines whether or not the register's bases are equal.
     // e.g. RAX == AH, as base( RAX ) == AL, and base( AH ) == AL.
     //
     inline bool register_base_equal( x86_reg first, x86_reg second )
     {
-        return vtil::amd64::registers.remap( first, 0, 1 ) == vtil::amd64::registers.remap( second, 0, 1 );
+        return get_register_base( first ) == get_register_base( second );
     }
     
     // Gets the register's largest architecture equivalent.
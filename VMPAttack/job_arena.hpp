@@ -0,0 +1,91 @@
+#pragma once
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+
+namespace vmpattack
+{
+    // This class provides a bump allocator scoped to a single job, such as a lifting job or
+    // a section scan. It owns the temporaries created while analyzing, which are all freed
+    // at once when the arena is reset or destroyed.
+    // Anything that must outlive the job must be copied out of the arena.
+    //
+    class job_arena
+    {
+    private:
+        // The backing bump allocator.
+        //
+        std::pmr::monotonic_buffer_resource resource;
+
+        // A destructor registered for an object created in the arena.
+        //
+        struct destructor_entry
+        {
+            void( *destroy )( void* object );
+            void* object;
+            destructor_entry* next;
+        };
+
+        // Singly-linked list of destructors to run on reset, most recent first.
+        // The entries themselves live in the arena.
+        //
+        destructor_entry* destructors;
+
+    public:
+        // The default size of the first arena block.
+        //
+        static constexpr size_t default_initial_size = 64 * 1024;
+
+        // Cannot be copied or moved, as objects hold pointers into the arena.
+        //
+        job_arena( const job_arena& ) = delete;
+        job_arena( job_arena&& ) = delete;
+        job_arena& operator=( const job_arena& ) = delete;
+        job_arena& operator=( job_arena&& ) = delete;
+
+        job_arena( size_t initial_size = default_initial_size )
+            : resource( initial_size ), destructors( nullptr )
+        {}
+
+        ~job_arena()
+        {
+            reset();
+        }
+
+        // Getter to the memory resource, for use with std::pmr containers.
+        //
+        inline std::pmr::memory_resource* get_resource() { return &resource; }
+
+        // Constructs an object of type T in the arena, forwarding the arguments.
+        // Non-trivially destructible objects are destroyed when the arena is reset.
+        //
+        template <typename T, typename... Args>
+        T* create( Args&&... args )
+        {
+            T* object = new ( resource.allocate( sizeof( T ), alignof( T ) ) ) T( std::forward<Args>( args )... );
+
+            if constexpr ( !std::is_trivially_destructible_v<T> )
+            {
+                destructors = new ( resource.allocate( sizeof( destructor_entry ), alignof( destructor_entry ) ) ) destructor_entry
+                {
+                    []( void* object ) { static_cast< T* >( object )->~T(); },
+                    object,
+                    destructors
+                };
+            }
+
+            return object;
+        }
+
+        // Destroys all objects created in the arena, and frees all of its memory in one shot.
+        //
+        void reset()
+        {
+            for ( destructor_entry* entry = destructors; entry; entry = entry->next )
+                entry->destroy( entry->object );
+
+            destructors = nullptr;
+            resource.release();
+        }
+    };
+}
@@ -0,0 +1,268 @@
+#include "junk_filter.hpp"
+#include "disassembler.hpp"
+#include "instruction_utilities.hpp"
+#include <vector>
+
+namespace vmpattack
+{
+    // The general purpose registers, by which liveness is tracked.
+    //
+    static constexpr x86_reg general_purpose_registers[] =
+    {
+        X86_REG_RAX, X86_REG_RBX, X86_REG_RCX, X86_REG_RDX,
+        X86_REG_RSI, X86_REG_RDI, X86_REG_RBP, X86_REG_RSP,
+        X86_REG_R8, X86_REG_R9, X86_REG_R10, X86_REG_R11,
+        X86_REG_R12, X86_REG_R13, X86_REG_R14, X86_REG_R15,
+    };
+
+    // Describes the general purpose register a register is part of.
+    //
+    struct register_family
+    {
+        // The full 64-bit register, or X86_REG_INVALID if not a general purpose register.
+        //
+        x86_reg parent;
+
+        // Whether or not writing to the register overwrites all of the parent, ie. it is the parent
+        // itself, or its zero-extended lower half.
+        //
+        bool overwrites_parent;
+    };
+
+    // Maps every register to its general purpose register family, if any. Built on first use.
+    //
+    static const std::array<register_family, X86_REG_ENDING>& get_register_families()
+    {
+        static const std::array<register_family, X86_REG_ENDING> families = []()
+        {
+            std::array<register_family, X86_REG_ENDING> result = {};
+
+            for ( x86_reg reg : general_purpose_registers )
+            {
+                for ( uint8_t size : { 1, 2, 4, 8 } )
+                    result[ vtil::amd64::registers.remap( reg, 0, size ) ] = { reg, size >= 4 };
+            }
+
+            for ( auto [high_byte, parent] : { std::pair{ X86_REG_AH, X86_REG_RAX }, std::pair{ X86_REG_BH, X86_REG_RBX },
+                                               std::pair{ X86_REG_CH, X86_REG_RCX }, std::pair{ X86_REG_DH, X86_REG_RDX } } )
+                result[ high_byte ] = { parent, false };
+
+            return result;
+        }();
+
+        return families;
+    }
+
+    // Determines whether the instruction only writes its destination if some condition holds, so
+    // that it never ends the liveness of the destination's previous value.
+    //
+    static bool writes_conditionally( const instruction* instruction )
+    {
+        if ( instruction->in_group( X86_GRP_CMOV ) )
+            return true;
+
+        switch ( instruction->id )
+        {
+            case X86_INS_BSF:
+            case X86_INS_BSR:
+            case X86_INS_CMPXCHG:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Determines whether the instruction leaves the flags untouched if its shift count is zero, so
+    // that it never ends the liveness of the flags.
+    //
+    static bool modifies_flags_conditionally( const instruction* instruction )
+    {
+        switch ( instruction->id )
+        {
+            case X86_INS_SHL:
+            case X86_INS_SAL:
+            case X86_INS_SHR:
+            case X86_INS_SAR:
+            case X86_INS_ROL:
+            case X86_INS_ROR:
+            case X86_INS_RCL:
+            case X86_INS_RCR:
+            case X86_INS_SHLD:
+            case X86_INS_SHRD:
+            {
+                // Only an immediate, non-zero count is known to modify the flags. The CPU masks the count
+                // to 6 bits for 64-bit destinations, and to 5 bits otherwise, eg. shl eax, 0x20 leaves
+                // the flags untouched.
+                //
+                if ( instruction->operand_count() < 2 )
+                    return false;
+
+                const instruction_operand& count = instruction->operand( instruction->operand_count() - 1 );
+                uint64_t count_mask = instruction->operand( 0 ).size == 8 ? 0x3F : 0x1F;
+
+                return count.type != X86_OP_IMM || ( count.imm & count_mask ) == 0;
+            }
+            default:
+                return false;
+        }
+    }
+
+    // Determines whether the instruction has an effect beyond the registers and flags it writes, ie.
+    // it changes the control flow, writes memory or the stack pointer, or writes any register
+    // that is not tracked.
+    //
+    static bool has_side_effects( const instruction* instruction )
+    {
+        for ( x86_insn_group group : { X86_GRP_JUMP, X86_GRP_CALL, X86_GRP_RET, X86_GRP_INT, X86_GRP_IRET, X86_GRP_PRIVILEGE } )
+        {
+            if ( instruction->in_group( group ) )
+                return true;
+        }
+
+        for ( int i = 0; i < instruction->operand_count(); i++ )
+        {
+            if ( instruction->operand_type( i ) == X86_OP_MEM && instruction->operand( i ).access & CS_AC_WRITE )
+                return true;
+        }
+
+        const std::array<register_family, X86_REG_ENDING>& families = get_register_families();
+        const std::bitset<X86_REG_ENDING>& written = instruction->get_regs_written();
+
+        for ( size_t reg = 0; reg < written.size(); reg++ )
+        {
+            if ( !written.test( reg ) || reg == X86_REG_EFLAGS )
+                continue;
+
+            // Stack operations write memory implicitly.
+            //
+            if ( families[ reg ].parent == X86_REG_INVALID || families[ reg ].parent == X86_REG_RSP )
+                return true;
+        }
+
+        return instruction->id == X86_INS_INVALID;
+    }
+
+    // Removes the junk instructions of a handler's instruction buffer, ie. those without side effects
+    // whose results are overwritten before ever being used, via a backwards liveness pass over the
+    // registers and flags. All registers and flags are assumed to be live at the end of the buffer.
+    // The first instruction is always kept, as it determines the stream's rva.
+    // If a memory resource is specified, the returned buffer is allocated from it.
+    //
+    instruction_buffer filter_junk( const instruction_buffer& instructions, std::pmr::memory_resource* resource )
+    {
+        const std::array<register_family, X86_REG_ENDING>& families = get_register_families();
+
+        // The registers and flags whose current values may still be used. Registers are tracked
+        // by their family's parent, and registers of no family by themselves.
+        //
+        std::bitset<X86_REG_ENDING> live_registers;
+        live_registers.set();
+
+        uint8_t live_flags = eflags_all;
+
+        std::vector<bool> kept( instructions.size() );
+
+        for ( size_t i = instructions.size(); i-- > 0; )
+        {
+            const instruction* instruction = instructions[ i ];
+
+            const std::bitset<X86_REG_ENDING>& read = instruction->get_regs_read();
+            const std::bitset<X86_REG_ENDING>& written = instruction->get_regs_written();
+
+            // Instructions accessing the flags without saying which are assumed to read and possibly
+            // write all of them, but never to overwrite any.
+            //
+            uint8_t flags_read = instruction->get_flags_read();
+            if ( !flags_read && read.test( X86_REG_EFLAGS ) )
+                flags_read = eflags_all;
+
+            uint8_t flags_overwritten = instruction->get_flags_written();
+
+            uint8_t flags_written = flags_overwritten;
+            if ( !flags_written && written.test( X86_REG_EFLAGS ) )
+                flags_written = eflags_all;
+
+            std::bitset<X86_REG_ENDING> written_families;
+            std::bitset<X86_REG_ENDING> overwritten_families;
+
+            for ( size_t reg = 0; reg < written.size(); reg++ )
+            {
+                if ( !written.test( reg ) || reg == X86_REG_EFLAGS )
+                    continue;
+
+                x86_reg family = families[ reg ].parent != X86_REG_INVALID ? families[ reg ].parent : ( x86_reg )reg;
+
+                written_families.set( family );
+
+                if ( families[ reg ].overwrites_parent )
+                    overwritten_families.set( family );
+            }
+
+            kept[ i ] = i == 0
+                || has_side_effects( instruction )
+                || ( written_families & live_registers ).any()
+                || ( flags_written & live_flags );
+
+            if ( !kept[ i ] )
+                continue;
+
+            // The instruction's writes end the liveness of the previous values, unless they may not happen.
+            //
+            if ( !writes_conditionally( instruction ) )
+                live_registers &= ~overwritten_families;
+
+            if ( !modifies_flags_conditionally( instruction ) )
+                live_flags &= ~flags_overwritten;
+
+            // Its reads, including those of memory operand bases and indices, begin them again.
+            //
+            for ( size_t reg = 0; reg < read.size(); reg++ )
+            {
+                if ( read.test( reg ) && reg != X86_REG_EFLAGS )
+                    live_registers.set( families[ reg ].parent != X86_REG_INVALID ? families[ reg ].parent : reg );
+            }
+
+            live_flags |= flags_read;
+        }
+
+        instruction_buffer result( resource );
+
+        for ( size_t i = 0; i < instructions.size(); i++ )
+        {
+            if ( kept[ i ] )
+                result.push_back( instructions[ i ] );
+        }
+
+        return result;
+    }
+
+    // Fetches the junk-free instructions of the handler at the offset from the base, disassembling
+    // and filtering them on first use, taking all unconditional immediate jumps.
+    // No byte at or past end_rva is disassembled.
+    // The instructions are owned by the instruction_cache.
+    //
+    std::shared_ptr<const instruction_buffer> junk_filter_cache::fetch( uint64_t base, uint64_t offset, uint64_t end_rva )
+    {
+        uint64_t ea = base + offset;
+
+        if ( auto cached = entries.lookup( ea ) )
+            return cached;
+
+        // Filtering is deterministic, so if another thread races us, either result may be kept.
+        //
+        instruction_buffer instructions = disassembler::get().disassemble( base, offset, end_rva, disassembler_take_unconditional_imm );
+        auto filtered = std::make_shared<const instruction_buffer>( filter_junk( instructions ) );
+
+        instructions_seen.fetch_add( instructions.size(), std::memory_order_relaxed );
+        instructions_kept.fetch_add( filtered->size(), std::memory_order_relaxed );
+
+        return entries.insert( ea, std::move( filtered ) );
+    }
+
+    // Drops all cached buffers disassembled in the effective address range [begin, end).
+    //
+    void junk_filter_cache::flush( uint64_t begin, uint64_t end )
+    {
+        entries.flush( begin, end );
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include "instruction_stream.hpp"
+#include "sharded_cache.hpp"
+
+namespace vmpattack
+{
+    // Removes the junk instructions of a handler's instruction buffer, ie. those without side effects
+    // whose results are overwritten before ever being used, via a backwards liveness pass over the
+    // registers and flags. All registers and flags are assumed to be live at the end of the buffer.
+    // The first instruction is always kept, as it determines the stream's rva.
+    // If a memory resource is specified, the returned buffer is allocated from it.
+    //
+    instruction_buffer filter_junk( const instruction_buffer& instructions, std::pmr::memory_resource* resource = std::pmr::get_default_resource() );
+
+    // This class provides a process-wide, thread-safe cache of junk-free handler instruction buffers,
+    // so that each handler is only disassembled and filtered once.
+    // Entries are keyed by the effective address (image base + rva) the handler was disassembled at.
+    //
+    class junk_filter_cache
+    {
+    private:
+        // The filtered instruction buffers, by effective address.
+        //
+        sharded_cache<uint64_t, std::shared_ptr<const instruction_buffer>> entries;
+
+        // Statistics.
+        //
+        std::atomic<uint64_t> instructions_seen;
+        std::atomic<uint64_t> instructions_kept;
+
+        junk_filter_cache()
+            : instructions_seen( 0 ), instructions_kept( 0 )
+        {}
+
+    public:
+        // Cannot be copied or moved.
+        //
+        junk_filter_cache( const junk_filter_cache& ) = delete;
+        junk_filter_cache( junk_filter_cache&& ) = delete;
+        junk_filter_cache& operator=( const junk_filter_cache& ) = delete;
+        junk_filter_cache& operator=( junk_filter_cache&& ) = delete;
+
+        // Singleton to provide the process-wide cache instance.
+        //
+        inline static junk_filter_cache& get()
+        {
+            static junk_filter_cache instance;
+
+            return instance;
+        }
+
+        // Fetches the junk-free instructions of the handler at the offset from the base, disassembling
+        // and filtering them on first use, taking all unconditional immediate jumps.
+        // No byte at or past end_rva is disassembled.
+        // The instructions are owned by the instruction_cache.
+        //
+        std::shared_ptr<const instruction_buffer> fetch( uint64_t base, uint64_t offset, uint64_t end_rva );
+
+        // Drops all cached buffers disassembled in the effective address range [begin, end).
+        // Must be called before the instructions they refer to are flushed from the instruction_cache.
+        //
+        void flush( uint64_t begin, uint64_t end );
+
+        // Statistics getters.
+        //
+        inline uint64_t hit_count() const { return entries.hit_count(); }
+        inline uint64_t miss_count() const { return entries.miss_count(); }
+        inline uint64_t seen_count() const { return instructions_seen.load( std::memory_order_relaxed ); }
+        inline uint64_t kept_count() const { return instructions_kept.load( std::memory_order_relaxed ); }
+    };
+}
@@ -4,9 +4,12 @@
 #include <cstdint>
 
 #include "vmpattack.hpp"
+#include "instruction_cache.hpp"
+#include "vm_shape_cache.hpp"
+#include "junk_filter.hpp"
+#include "vm_jit.hpp"
 
 #include <vtil/compiler>
-#include <fstream>
 #include <filesystem>
 
 #ifdef _MSC_VER
@@ -19,16 +22,6 @@ using namespace vtil::logger;
 
 namespace vmpattack
 {
-    using std::uint8_t;
-
-    template <typename T = uint8_t> 
-    auto read_file(const char* filepath) -> std::vector<T>
-    {
-        std::ifstream file(filepath, std::ios::binary);
-        std::vector<T> file_buf(std::istreambuf_iterator<char>(file), {});
-        return file_buf;
-    }
-
     extern "C" int main( int argc, const char* args[])
     {
         std::filesystem::path input_file_path = { args[1] };
@@ -43,13 +36,70 @@ namespace vmpattack
         //
         std::filesystem::create_directory( output_path );
 
-        std::vector<uint8_t> buffer = read_file( input_file_path.string().c_str() );
+        std::optional<std::unique_ptr<mapped_image>> image = mapped_image::from_file( input_file_path.string() );
 
-        log<CON_GRN>( "** Loaded raw image buffer @ 0x%p of size 0x%llx\r\n", buffer.data(), buffer.size() );
+        if ( !image )
+        {
+            log<CON_RED>( "** Failed to map image %s\r\n", input_file_path.string() );
+            return 1;
+        }
 
-        vmpattack instance( buffer );
+        log<CON_GRN>( "** Mapped image @ 0x%llx of size 0x%llx\r\n", ( *image )->base(), ( *image )->size() );
+
+        vmpattack instance( std::move( *image ) );
         
-        std::vector<scan_result> scan_results = instance.scan_for_vmentry();
+        // Parse the optional arguments:
+        //      --guided:           only scan the code described by the image's metadata rather than
+        //                          all executable sections.
+        //      --profile <path>:   start off with the descriptor order saved in the profile, and
+        //                          update it with this run's matching statistics.
+        //      --database <path>:  load previously analyzed instances and handlers from the database,
+        //                          and record any newly discovered ones into it.
+        //      --harvest:          pre-discover the handlers of each VM instance from the VMP sections
+        //                          in parallel, before lifting through it.
+        //      --jit:              decode handlers via natively compiled functions.
+        //      --jit-check:        as --jit, but also check every compiled decode against the interpreter.
+        //
+        bool guided_scan = false;
+        bool harvest = false;
+        std::optional<std::string> profile_path;
+        std::optional<std::string> database_path;
+
+        for ( int i = 2; i < argc; i++ )
+        {
+            std::string argument = args[ i ];
+
+            if ( argument == "--guided" )
+                guided_scan = true;
+            else if ( argument == "--harvest" )
+                harvest = true;
+            else if ( argument == "--jit" )
+                vm_jit::get().set_enabled( true );
+            else if ( argument == "--jit-check" )
+            {
+                vm_jit::get().set_enabled( true );
+                vm_jit::get().set_self_checking( true );
+            }
+            else if ( argument == "--profile" && i + 1 < argc )
+                profile_path = args[ ++i ];
+            else if ( argument == "--database" && i + 1 < argc )
+                database_path = args[ ++i ];
+        }
+
+        instance.set_harvesting( harvest );
+
+        if ( profile_path && instance.load_match_profile( *profile_path ) )
+            log<CON_GRN>( "** Loaded matching profile %s\r\n", *profile_path );
+
+        if ( database_path )
+        {
+            if ( std::optional<size_t> loaded = instance.attach_database( *database_path ) )
+                log<CON_GRN>( "** Attached database %s, loaded %llu records\r\n", *database_path, *loaded );
+            else
+                log<CON_RED>( "** Failed to attach database %s\r\n", *database_path );
+        }
+
+        std::vector<scan_result> scan_results = guided_scan ? instance.scan_for_vmentry_guided() : instance.scan_for_vmentry();
 
         log<CON_GRN>( "** Found %u virtualized routines:\r\n", scan_results.size() );
 
@@ -58,6 +108,10 @@ namespace vmpattack
 
         log( "\r\n" );
 
+        // Create every VM instance and decrypt all entry stubs up front, rather than one job at a time.
+        //
+        instance.prepare_jobs( scan_results );
+
         std::vector<vtil::routine*> lifted_routines;
 
         int i = 0;
@@ -97,6 +151,23 @@ namespace vmpattack
             i++;
         }
 
+        log<CON_CYN>( "** Instruction cache: %llu hits, %llu misses\r\n", instruction_cache::get().hit_count(), instruction_cache::get().miss_count() );
+        log<CON_CYN>( "** Handler shape cache: %llu hits, %llu misses\r\n", vm_shape_cache::get().hit_count(), vm_shape_cache::get().miss_count() );
+        log<CON_CYN>( "** Junk filter: %llu hits, %llu misses, %llu/%llu instructions kept\r\n", junk_filter_cache::get().hit_count(), junk_filter_cache::get().miss_count(), junk_filter_cache::get().kept_count(), junk_filter_cache::get().seen_count() );
+
+        if ( vm_jit::get().is_enabled() )
+            log<CON_CYN>( "** JIT: %llu handlers compiled, %llu rejected, %llu checked decodes\r\n", vm_jit::get().compiled_count(), vm_jit::get().rejected_count(), vm_jit::get().checked_count() );
+
+        log<CON_CYN>( "** Descriptor matching statistics:\r\n%s", instance.dump_match_statistics() );
+
+        if ( profile_path )
+        {
+            if ( instance.save_match_profile( *profile_path ) )
+                log<CON_GRN>( "** Saved matching profile %s\r\n", *profile_path );
+            else
+                log<CON_RED>( "** Failed to save matching profile %s\r\n", *profile_path );
+        }
+
         system( "pause" );
     }
 }
@@ -0,0 +1,340 @@
+#include "mapped_image.hpp"
+#include <cstring>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace vmpattack
+{
+    // PE header constants.
+    //
+    const uint16_t pe_dos_signature = 0x5A4D;
+    const uint32_t pe_nt_signature = 0x00004550;
+    const uint16_t pe_optional_magic_32 = 0x10B;
+    const uint16_t pe_optional_magic_64 = 0x20B;
+    const uint32_t pe_section_header_size = 40;
+    const uint32_t pe_scn_mem_execute = 0x20000000;
+    const uint32_t pe_scn_mem_read = 0x40000000;
+    const uint32_t pe_scn_mem_write = 0x80000000;
+
+    // Section mappings are done in units of pages.
+    //
+    const uint64_t image_page_size = 0x1000;
+
+    // Reads a little-endian header field from the raw image bytes, ensuring it is in bounds.
+    // If out of bounds, returns empty {}.
+    //
+    template <typename T>
+    std::optional<T> read_raw( const uint8_t* raw_bytes, size_t raw_size, uint64_t offset )
+    {
+        if ( offset > raw_size || raw_size - offset < sizeof( T ) )
+            return {};
+
+        T value;
+        memcpy( &value, raw_bytes + offset, sizeof( T ) );
+
+        return value;
+    }
+
+    // Parses the headers of the raw image bytes, reserves the image and maps all of
+    // its sections. If file_handle is valid, sections are mapped directly from the file
+    // wherever their alignment allows, otherwise they are copied from the raw bytes.
+    // Returns whether or not the operation succeeded.
+    //
+    bool mapped_image::map( const uint8_t* raw_bytes, size_t raw_size, intptr_t file_handle )
+    {
+        // Validate the DOS header, and locate the NT headers.
+        //
+        auto dos_signature = read_raw<uint16_t>( raw_bytes, raw_size, 0 );
+        auto nt_offset = read_raw<uint32_t>( raw_bytes, raw_size, 0x3C );
+
+        if ( !dos_signature || *dos_signature != pe_dos_signature || !nt_offset )
+            return false;
+
+        auto nt_signature = read_raw<uint32_t>( raw_bytes, raw_size, *nt_offset );
+        if ( !nt_signature || *nt_signature != pe_nt_signature )
+            return false;
+
+        // Parse the file header.
+        //
+        uint64_t file_header_offset = *nt_offset + 4ull;
+
+        auto file_machine = read_raw<uint16_t>( raw_bytes, raw_size, file_header_offset );
+        auto number_of_sections = read_raw<uint16_t>( raw_bytes, raw_size, file_header_offset + 2 );
+        auto size_of_optional_header = read_raw<uint16_t>( raw_bytes, raw_size, file_header_offset + 16 );
+
+        if ( !file_machine || !number_of_sections || !size_of_optional_header )
+            return false;
+
+        machine = *file_machine;
+
+        // Parse the optional header. Only the image base differs in layout between PE32 and PE32+.
+        //
+        uint64_t optional_header_offset = file_header_offset + 20;
+
+        auto optional_magic = read_raw<uint16_t>( raw_bytes, raw_size, optional_header_offset );
+        auto address_of_entry_point = read_raw<uint32_t>( raw_bytes, raw_size, optional_header_offset + 16 );
+        auto size_of_image = read_raw<uint32_t>( raw_bytes, raw_size, optional_header_offset + 56 );
+        auto size_of_headers = read_raw<uint32_t>( raw_bytes, raw_size, optional_header_offset + 60 );
+
+        if ( !optional_magic || !address_of_entry_point || !size_of_image || !size_of_headers || *size_of_image == 0 )
+            return false;
+
+        entry_point = *address_of_entry_point;
+
+        // The data directories directly follow the NumberOfRvaAndSizes field.
+        //
+        uint64_t number_of_rva_and_sizes_offset = optional_header_offset + ( *optional_magic == pe_optional_magic_64 ? 108 : 92 );
+
+        if ( *optional_magic == pe_optional_magic_64 )
+        {
+            auto image_base = read_raw<uint64_t>( raw_bytes, raw_size, optional_header_offset + 24 );
+            if ( !image_base )
+                return false;
+
+            preferred_image_base = *image_base;
+            pe32_plus = true;
+        }
+        else if ( *optional_magic == pe_optional_magic_32 )
+        {
+            auto image_base = read_raw<uint32_t>( raw_bytes, raw_size, optional_header_offset + 28 );
+            if ( !image_base )
+                return false;
+
+            preferred_image_base = *image_base;
+        }
+        else
+            return false;
+
+        // Parse the data directories, ignoring any not present.
+        //
+        if ( auto number_of_rva_and_sizes = read_raw<uint32_t>( raw_bytes, raw_size, number_of_rva_and_sizes_offset ) )
+        {
+            for ( uint32_t i = 0; i < std::min<uint32_t>( *number_of_rva_and_sizes, image_directory_count ); i++ )
+            {
+                auto directory_rva = read_raw<uint32_t>( raw_bytes, raw_size, number_of_rva_and_sizes_offset + 4 + i * 8 );
+                auto directory_size = read_raw<uint32_t>( raw_bytes, raw_size, number_of_rva_and_sizes_offset + 8 + i * 8 );
+
+                if ( directory_rva && directory_size && *directory_rva != 0 && *directory_size != 0 )
+                    data_directories[ i ] = { *directory_rva, ( uint64_t )*directory_rva + *directory_size };
+            }
+        }
+
+        // Reserve exactly SizeOfImage bytes. The reservation is zero-filled and only
+        // backed by physical memory once a page is touched.
+        //
+        image_size = *size_of_image;
+
+#ifdef _WIN32
+        image = ( uint8_t* )VirtualAlloc( nullptr, image_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+
+        if ( !image )
+            return false;
+#else
+        void* reservation = mmap( nullptr, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+
+        if ( reservation == MAP_FAILED )
+            return false;
+
+        image = ( uint8_t* )reservation;
+#endif
+
+        // Copy the PE headers.
+        //
+        header_size = std::min<uint64_t>( { *size_of_headers, raw_size, image_size } );
+        memcpy( image, raw_bytes, header_size );
+
+        // Parse and map each section.
+        //
+        uint64_t section_table_offset = optional_header_offset + *size_of_optional_header;
+
+        for ( uint16_t i = 0; i < *number_of_sections; i++ )
+        {
+            uint64_t section_header_offset = section_table_offset + i * pe_section_header_size;
+
+            auto virtual_size = read_raw<uint32_t>( raw_bytes, raw_size, section_header_offset + 8 );
+            auto virtual_address = read_raw<uint32_t>( raw_bytes, raw_size, section_header_offset + 12 );
+            auto physical_size = read_raw<uint32_t>( raw_bytes, raw_size, section_header_offset + 16 );
+            auto physical_address = read_raw<uint32_t>( raw_bytes, raw_size, section_header_offset + 20 );
+            auto characteristics = read_raw<uint32_t>( raw_bytes, raw_size, section_header_offset + 36 );
+
+            if ( !virtual_size || !virtual_address || !physical_size || !physical_address || !characteristics )
+                return false;
+
+            // Section names are padded with nulls, and are not null terminated if 8 characters long.
+            //
+            const char* raw_name = ( const char* )raw_bytes + section_header_offset;
+
+            image_section section =
+            {
+                std::string( raw_name, strnlen( raw_name, 8 ) ),
+                *virtual_address, *virtual_size ? *virtual_size : *physical_size,
+                *physical_address, *physical_size,
+                ( *characteristics & pe_scn_mem_read ) != 0,
+                ( *characteristics & pe_scn_mem_write ) != 0,
+                ( *characteristics & pe_scn_mem_execute ) != 0
+            };
+
+            // Never let a section describe memory past the end of the image.
+            //
+            if ( section.virtual_address < image_size )
+                section.virtual_size = std::min<uint64_t>( section.virtual_size, image_size - section.virtual_address );
+
+            sections.push_back( section );
+
+            // Sanity check for potentially broken PEs.
+            //
+            if ( section.physical_address + section.physical_size > raw_size
+                 || section.virtual_address >= image_size )
+                continue;
+
+            uint64_t copy_size = std::min<uint64_t>( section.physical_size, image_size - section.virtual_address );
+            uint64_t mapped_size = 0;
+
+#ifndef _WIN32
+            // If both the file offset and the rva are page aligned, map the file pages straight into
+            // the reservation. These are only read from the disk (or page cache) once touched.
+            //
+            if ( file_handle != -1
+                 && section.physical_address % image_page_size == 0
+                 && section.virtual_address % image_page_size == 0 )
+            {
+                mapped_size = copy_size & ~( image_page_size - 1 );
+
+                if ( mapped_size != 0
+                     && mmap( image + section.virtual_address, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, ( int )file_handle, section.physical_address ) == MAP_FAILED )
+                    mapped_size = 0;
+            }
+#endif
+
+            // Copy whatever could not be mapped directly.
+            //
+            memcpy( image + section.virtual_address + mapped_size, raw_bytes + section.physical_address + mapped_size, copy_size - mapped_size );
+        }
+
+        // The view handed out is read-only.
+        //
+#ifdef _WIN32
+        DWORD old_protect;
+        VirtualProtect( image, image_size, PAGE_READONLY, &old_protect );
+#else
+        mprotect( image, image_size, PROT_READ );
+#endif
+
+        return true;
+    }
+
+    // Unmaps the image.
+    //
+    mapped_image::~mapped_image()
+    {
+        if ( !image )
+            return;
+
+#ifdef _WIN32
+        VirtualFree( image, 0, MEM_RELEASE );
+#else
+        munmap( image, image_size );
+#endif
+    }
+
+    // Fetches the section the rva resides in, or nullptr if none.
+    //
+    const image_section* mapped_image::rva_to_section( uint64_t rva ) const
+    {
+        for ( const image_section& section : sections )
+        {
+            if ( rva >= section.virtual_address && rva < section.virtual_address + section.virtual_size )
+                return &section;
+        }
+
+        return nullptr;
+    }
+
+    // Memory-maps the PE image at the specified path.
+    // If the operation fails, returns empty {}.
+    //
+    std::optional<std::unique_ptr<mapped_image>> mapped_image::from_file( const std::string& path )
+    {
+        // Cannot use make_unique as the constructor is private.
+        //
+        std::unique_ptr<mapped_image> mapped = std::unique_ptr<mapped_image>( new mapped_image() );
+
+        bool success = false;
+
+#ifdef _WIN32
+        HANDLE file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        if ( file == INVALID_HANDLE_VALUE )
+            return {};
+
+        LARGE_INTEGER file_size;
+        HANDLE mapping = nullptr;
+        const uint8_t* view = nullptr;
+
+        if ( GetFileSizeEx( file, &file_size ) && file_size.QuadPart != 0 )
+            mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+
+        if ( mapping )
+            view = ( const uint8_t* )MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+
+        // Sections are copied from the file view on Windows, as mapping them into an existing
+        // reservation requires placeholder support.
+        //
+        if ( view )
+        {
+            success = mapped->map( view, ( size_t )file_size.QuadPart, -1 );
+            UnmapViewOfFile( view );
+        }
+
+        if ( mapping )
+            CloseHandle( mapping );
+
+        CloseHandle( file );
+#else
+        int file = open( path.c_str(), O_RDONLY );
+        if ( file == -1 )
+            return {};
+
+        struct stat file_stat;
+        if ( fstat( file, &file_stat ) == 0 && file_stat.st_size != 0 )
+        {
+            void* view = mmap( nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+
+            if ( view != MAP_FAILED )
+            {
+                success = mapped->map( ( const uint8_t* )view, file_stat.st_size, file );
+                munmap( view, file_stat.st_size );
+            }
+        }
+
+        // Any section mappings outlive the file descriptor.
+        //
+        close( file );
+#endif
+
+        if ( !success )
+            return {};
+
+        return std::move( mapped );
+    }
+
+    // Maps the PE image from a raw image bytes buffer. The buffer is not referenced after
+    // the call returns.
+    // If the operation fails, returns empty {}.
+    //
+    std::optional<std::unique_ptr<mapped_image>> mapped_image::from_buffer( const std::vector<uint8_t>& raw_bytes )
+    {
+        std::unique_ptr<mapped_image> mapped = std::unique_ptr<mapped_image>( new mapped_image() );
+
+        if ( !mapped->map( raw_bytes.data(), raw_bytes.size(), -1 ) )
+            return {};
+
+        return std::move( mapped );
+    }
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <cstring>
+
+namespace vmpattack
+{
+    // Describes a range of rvas, [begin, end).
+    //
+    struct rva_range
+    {
+        uint64_t begin;
+        uint64_t end;
+    };
+
+    // Indices of the PE data directories used.
+    //
+    enum image_directory : size_t
+    {
+        image_directory_export = 0,
+        image_directory_import = 1,
+        image_directory_exception = 3,
+        image_directory_basereloc = 5,
+        image_directory_tls = 9,
+        image_directory_iat = 12,
+        image_directory_count = 16,
+    };
+
+    // The PE machine types used.
+    //
+    enum image_machine : uint16_t
+    {
+        image_machine_i386 = 0x14C,
+        image_machine_amd64 = 0x8664,
+    };
+
+    // This struct describes a single section of a mapped image.
+    //
+    struct image_section
+    {
+        // The section name, stripped of any null padding.
+        //
+        std::string name;
+
+        // The section's RVA and size once mapped.
+        //
+        uint64_t virtual_address;
+        uint64_t virtual_size;
+
+        // The section's offset and size in the raw file.
+        //
+        uint64_t physical_address;
+        uint64_t physical_size;
+
+        // The section's memory protection.
+        //
+        bool read;
+        bool write;
+        bool execute;
+    };
+
+    // This class provides a read-only view of a PE image, laid out in memory as it
+    // would be by the loader.
+    // The raw file is memory-mapped rather than read, exactly SizeOfImage bytes are reserved
+    // for the image, and section pages are only backed once they are actually touched.
+    //
+    class mapped_image
+    {
+    private:
+        // The base of the mapped image, and its size (SizeOfImage).
+        //
+        uint8_t* image;
+        size_t image_size;
+
+        // The size of the PE headers copied to the start of the image (SizeOfHeaders).
+        //
+        size_t header_size;
+
+        // The image's preferred image base, as specified by its optional header.
+        //
+        uint64_t preferred_image_base;
+
+        // The image's sections, in header order.
+        //
+        std::vector<image_section> sections;
+
+        // The machine type the image targets, as specified by its file header.
+        //
+        uint16_t machine;
+
+        // Whether the image is PE32+, i.e. uses 64-bit pointers.
+        //
+        bool pe32_plus;
+
+        // The rva of the image's entry point, or 0 if none.
+        //
+        uint64_t entry_point;
+
+        // The image's data directories, as rva ranges. Empty if not present.
+        //
+        rva_range data_directories[ image_directory_count ];
+
+        // Private constructor; use the static factories.
+        //
+        mapped_image()
+            : image( nullptr ), image_size( 0 ), header_size( 0 ), preferred_image_base( 0 ), sections{}, machine( 0 ), pe32_plus( false ), entry_point( 0 ), data_directories{}
+        {}
+
+        // Parses the headers of the raw image bytes, reserves the image and maps all of
+        // its sections. If file_handle is valid, sections are mapped directly from the file
+        // wherever their alignment allows, otherwise they are copied from the raw bytes.
+        // Returns whether or not the operation succeeded.
+        //
+        bool map( const uint8_t* raw_bytes, size_t raw_size, intptr_t file_handle );
+
+    public:
+        // Cannot be copied or moved, as views into the image are handed out freely.
+        //
+        mapped_image( const mapped_image& ) = delete;
+        mapped_image( mapped_image&& ) = delete;
+        mapped_image& operator=( const mapped_image& ) = delete;
+        mapped_image& operator=( mapped_image&& ) = delete;
+
+        // Unmaps the image.
+        //
+        ~mapped_image();
+
+        // Getters.
+        //
+        inline uint64_t                             base()                  const { return ( uint64_t )image; }
+        inline const uint8_t*                       data()                  const { return image; }
+        inline size_t                               size()                  const { return image_size; }
+        inline size_t                               get_header_size()       const { return header_size; }
+        inline uint64_t                             preferred_base()        const { return preferred_image_base; }
+        inline const std::vector<image_section>&    get_sections()          const { return sections; }
+        inline uint16_t                             get_machine()           const { return machine; }
+        inline bool                                 is_pe32_plus()          const { return pe32_plus; }
+        inline uint64_t                             get_entry_point()       const { return entry_point; }
+        inline const rva_range&                     get_data_directory( image_directory index ) const { return data_directories[ index ]; }
+
+        // Reads a value at the rva, ensuring it is within the image.
+        // If out of bounds, returns empty {}.
+        //
+        template <typename T>
+        std::optional<T> read( uint64_t rva ) const
+        {
+            if ( rva > image_size || image_size - rva < sizeof( T ) )
+                return {};
+
+            T value;
+            memcpy( &value, image + rva, sizeof( T ) );
+
+            return value;
+        }
+
+        // Fetches the section the rva resides in, or nullptr if none.
+        //
+        const image_section* rva_to_section( uint64_t rva ) const;
+
+        // Memory-maps the PE image at the specified path.
+        // If the operation fails, returns empty {}.
+        //
+        static std::optional<std::unique_ptr<mapped_image>> from_file( const std::string& path );
+
+        // Maps the PE image from a raw image bytes buffer. The buffer is not referenced after
+        // the call returns.
+        // If the operation fails, returns empty {}.
+        //
+        static std::optional<std::unique_ptr<mapped_image>> from_buffer( const std::vector<uint8_t>& raw_bytes );
+    };
+}
@@ -0,0 +1,282 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace vmpattack
+{
+    // This class provides a thread-safe, read-mostly hash table of objects keyed by rva.
+    // Lookups are lock-free, and the objects are owned by the table, so pointers to them stay
+    // valid for its whole lifetime.
+    // Each object is constructed at most once: threads racing to construct the same rva all wait
+    // for the first one, and then share its result. A failed construction is not cached, so a later
+    // request, or insertion, for the rva may still fill it.
+    //
+    template <typename T>
+    class rva_table
+    {
+    private:
+        // The initial number of slots. Must be a power of two.
+        //
+        static constexpr size_t initial_capacity = 64;
+
+        // The construction states of an entry.
+        //
+        enum entry_state : uint32_t
+        {
+            // Never constructed, or the last construction failed.
+            //
+            entry_empty,
+
+            // Being constructed by a thread, which all others wait for.
+            //
+            entry_constructing,
+
+            // Constructed, never to change again.
+            //
+            entry_constructed,
+        };
+
+        // A single entry of the table, created once its rva is first requested.
+        //
+        struct entry
+        {
+            // The entry's key.
+            //
+            const uint64_t rva;
+
+            // The construction state, claimed via CAS by the constructing thread.
+            //
+            std::atomic<uint32_t> state;
+
+            // The owned object, written once by the thread that claimed the construction.
+            //
+            std::unique_ptr<T> object;
+
+            // The object, published for lock-free readers once constructed.
+            // Null if not yet constructed, or if construction failed.
+            //
+            std::atomic<T*> value;
+
+            entry( uint64_t rva )
+                : rva( rva ), state( entry_empty ), value( nullptr )
+            {}
+        };
+
+        // An open-addressing slot array, probed linearly.
+        //
+        struct slot_array
+        {
+            // The number of slots, minus one.
+            //
+            const size_t mask;
+
+            // The slots. Once set, a slot never changes.
+            //
+            const std::unique_ptr<std::atomic<entry*>[]> slots;
+
+            slot_array( size_t capacity )
+                : mask( capacity - 1 ), slots( new std::atomic<entry*>[ capacity ] )
+            {
+                for ( size_t i = 0; i < capacity; i++ )
+                    slots[ i ].store( nullptr, std::memory_order_relaxed );
+            }
+        };
+
+        // The slot array lookups are done in.
+        //
+        std::atomic<slot_array*> current;
+
+        // All slot arrays ever allocated. Outgrown arrays are kept alive, as lock-free readers
+        // may still be probing them.
+        //
+        std::vector<std::unique_ptr<slot_array>> slot_arrays;
+
+        // All entries, in order of creation.
+        //
+        std::vector<std::unique_ptr<entry>> entries;
+
+        // Serializes the creation of entries, and enumeration.
+        //
+        mutable std::mutex entries_mutex;
+
+        // Computes the first slot to probe for the rva.
+        //
+        static inline size_t home_slot( uint64_t rva, size_t mask )
+        {
+            // Fibonacci hashing, as handler and instance rvas share their low bits.
+            //
+            return ( size_t )( ( rva * 0x9E3779B97F4A7C15ull ) >> 32 ) & mask;
+        }
+
+        // Finds the entry for the rva in the slot array.
+        // If none, returns nullptr.
+        //
+        static entry* find_entry( const slot_array* array, uint64_t rva )
+        {
+            for ( size_t i = home_slot( rva, array->mask );; i = ( i + 1 ) & array->mask )
+            {
+                entry* candidate = array->slots[ i ].load( std::memory_order_acquire );
+
+                if ( !candidate || candidate->rva == rva )
+                    return candidate;
+            }
+        }
+
+        // Places the entry into the first free slot of its probe sequence.
+        // Must be called with the entries mutex held.
+        //
+        static void place_entry( slot_array* array, entry* new_entry )
+        {
+            size_t i = home_slot( new_entry->rva, array->mask );
+
+            while ( array->slots[ i ].load( std::memory_order_relaxed ) )
+                i = ( i + 1 ) & array->mask;
+
+            array->slots[ i ].store( new_entry, std::memory_order_release );
+        }
+
+        // Finds the entry for the rva, creating it if it does not exist.
+        //
+        entry* acquire_entry( uint64_t rva )
+        {
+            if ( entry* existing = find_entry( current.load( std::memory_order_acquire ), rva ) )
+                return existing;
+
+            const std::lock_guard<std::mutex> lock( entries_mutex );
+
+            // Another thread may have created it since.
+            //
+            slot_array* array = current.load( std::memory_order_relaxed );
+
+            if ( entry* existing = find_entry( array, rva ) )
+                return existing;
+
+            entry* new_entry = entries.emplace_back( std::make_unique<entry>( rva ) ).get();
+
+            // Keep the load factor at most one half, so that probe sequences stay short and always end.
+            // The grown array is fully populated before it is published.
+            //
+            if ( entries.size() * 2 > array->mask + 1 )
+            {
+                slot_array* grown_array = slot_arrays.emplace_back( std::make_unique<slot_array>( ( array->mask + 1 ) * 2 ) ).get();
+
+                for ( auto& existing : entries )
+                    place_entry( grown_array, existing.get() );
+
+                current.store( grown_array, std::memory_order_release );
+            }
+            else
+                place_entry( array, new_entry );
+
+            return new_entry;
+        }
+
+    public:
+        // Cannot be copied or moved, as pointers to the objects are handed out.
+        //
+        rva_table( const rva_table& ) = delete;
+        rva_table( rva_table&& ) = delete;
+        rva_table& operator=( const rva_table& ) = delete;
+        rva_table& operator=( rva_table&& ) = delete;
+
+        // Constructs an empty table.
+        //
+        rva_table()
+        {
+            current.store( slot_arrays.emplace_back( std::make_unique<slot_array>( initial_capacity ) ).get(), std::memory_order_relaxed );
+        }
+
+        // Finds the object constructed for the rva, without taking any lock.
+        // If none, or its construction is still in progress, returns nullptr.
+        //
+        T* find( uint64_t rva ) const
+        {
+            if ( entry* existing = find_entry( current.load( std::memory_order_acquire ), rva ) )
+                return existing->value.load( std::memory_order_acquire );
+
+            return nullptr;
+        }
+
+        // Finds the object for the rva, constructing it via the factory if it was not yet constructed.
+        // The factory returns the object, or nullptr if it cannot be constructed; it is invoked by one
+        // thread at a time per rva, and any other thread requesting the rva meanwhile waits for it and
+        // shares its result. A failed construction leaves the rva to be constructed again later.
+        // Returns the object, or nullptr if construction failed, and whether or not this call constructed it.
+        //
+        template <typename F>
+        std::pair<T*, bool> find_or_construct( uint64_t rva, F&& factory )
+        {
+            entry* target = acquire_entry( rva );
+
+            if ( T* existing = target->value.load( std::memory_order_acquire ) )
+                return { existing, false };
+
+            uint32_t state = entry_empty;
+
+            if ( !target->state.compare_exchange_strong( state, entry_constructing, std::memory_order_acquire ) )
+            {
+                // Another thread is constructing the object; wait for it, and share its result.
+                //
+                if ( state == entry_constructing )
+                    target->state.wait( entry_constructing, std::memory_order_acquire );
+
+                return { target->value.load( std::memory_order_acquire ), false };
+            }
+
+            std::unique_ptr<T> object = factory();
+
+            // On failure, release the claim without publishing anything, so that the rva stays retryable.
+            //
+            if ( !object )
+            {
+                target->state.store( entry_empty, std::memory_order_release );
+                target->state.notify_all();
+
+                return { nullptr, false };
+            }
+
+            target->object = std::move( object );
+            target->value.store( target->object.get(), std::memory_order_release );
+
+            target->state.store( entry_constructed, std::memory_order_release );
+            target->state.notify_all();
+
+            return { target->value.load( std::memory_order_relaxed ), true };
+        }
+
+        // Inserts the already constructed object for the rva.
+        // If the object for the rva was already constructed, or is being constructed, the given object is dropped.
+        // Returns whether or not the object was inserted.
+        //
+        bool insert( uint64_t rva, std::unique_ptr<T> object )
+        {
+            return find_or_construct( rva, [&]() { return std::move( object ); } ).second;
+        }
+
+        // Invokes the callback with every constructed object, in order of construction request.
+        // Objects requested during the enumeration may be skipped.
+        //
+        template <typename F>
+        void for_each( F&& callback ) const
+        {
+            std::vector<T*> objects;
+
+            {
+                const std::lock_guard<std::mutex> lock( entries_mutex );
+
+                for ( auto& existing : entries )
+                {
+                    if ( T* object = existing->value.load( std::memory_order_acquire ) )
+                        objects.push_back( object );
+                }
+            }
+
+            for ( T* object : objects )
+                callback( object );
+        }
+    };
+}
@@ -0,0 +1,60 @@
+#include "section_index.hpp"
+#include <algorithm>
+
+namespace vmpattack
+{
+    // Builds the index from the image's section table.
+    //
+    section_index::section_index( const mapped_image* image )
+        : section_index()
+    {
+        for ( const image_section& section : image->get_sections() )
+        {
+            if ( section.virtual_size == 0 )
+                continue;
+
+            uint8_t flags = section_flag_mapped;
+
+            if ( section.execute )
+                flags |= section_flag_execute;
+
+            // VMP names its sections with a trailing digit, ie. .vmp0 / .vmp1.
+            //
+            if ( section.name.ends_with( "0" ) || section.name.ends_with( "1" ) )
+                flags |= section_flag_vmp_candidate;
+
+            ranges.push_back( { section.virtual_address, section.virtual_address + section.virtual_size, flags } );
+        }
+
+        std::sort( ranges.begin(), ranges.end(), []( const section_range& a, const section_range& b ) { return a.begin < b.begin; } );
+
+        // Malformed images may have overlapping sections. Clip each to the start of the next
+        // one, so that every rva belongs to at most one range.
+        //
+        for ( size_t i = 0; i + 1 < ranges.size(); i++ )
+            ranges[ i ].end = std::min( ranges[ i ].end, ranges[ i + 1 ].begin );
+
+        ranges.erase( std::remove_if( ranges.begin(), ranges.end(), []( const section_range& range ) { return range.begin >= range.end; } ), ranges.end() );
+
+        for ( const section_range& range : ranges )
+            if ( range.flags & section_flag_vmp_candidate )
+                vmp_candidate_ranges.push_back( { range.begin, range.end } );
+    }
+
+    // Finds the range containing the rva.
+    // If none, returns nullptr.
+    //
+    const section_range* section_index::lookup( uint64_t rva ) const
+    {
+        // Find the first range beginning after the rva; the one before it is the only candidate.
+        //
+        auto it = std::upper_bound( ranges.begin(), ranges.end(), rva, []( uint64_t rva, const section_range& range ) { return rva < range.begin; } );
+
+        if ( it == ranges.begin() )
+            return nullptr;
+
+        const section_range* range = &*std::prev( it );
+
+        return rva < range->end ? range : nullptr;
+    }
+}
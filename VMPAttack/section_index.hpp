@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "mapped_image.hpp"
+
+namespace vmpattack
+{
+    // Flags classifying an rva range of the image.
+    //
+    enum section_flags : uint8_t
+    {
+        // The range is backed by the mapped image.
+        //
+        section_flag_mapped = 1 << 0,
+
+        // The range is executable.
+        //
+        section_flag_execute = 1 << 1,
+
+        // The range potentially belongs to a VMP section.
+        //
+        section_flag_vmp_candidate = 1 << 2,
+    };
+
+    // This struct describes a single classified rva range, [begin, end).
+    //
+    struct section_range
+    {
+        uint64_t begin;
+        uint64_t end;
+        uint8_t flags;
+    };
+
+    // This class provides an immutable, sorted interval index over the image's sections, so that
+    // rvas can be classified in O(log n) without any allocation.
+    //
+    class section_index
+    {
+    private:
+        // The classified ranges, sorted by rva and non-overlapping.
+        //
+        std::vector<section_range> ranges;
+
+        // The rva ranges of all VMP candidate sections, as consumed by the signature scanner.
+        //
+        std::vector<rva_range> vmp_candidate_ranges;
+
+    public:
+        // Constructs an empty index, in which no rva is mapped.
+        //
+        section_index()
+            : ranges{}, vmp_candidate_ranges{}
+        {}
+
+        // Builds the index from the image's section table.
+        //
+        section_index( const mapped_image* image );
+
+        // Finds the range containing the rva.
+        // If none, returns nullptr.
+        //
+        const section_range* lookup( uint64_t rva ) const;
+
+        // Returns the flags of the range containing the rva, or 0 if none.
+        //
+        inline uint8_t get_flags( uint64_t rva ) const
+        {
+            const section_range* range = lookup( rva );
+            return range ? range->flags : 0;
+        }
+
+        // Determines whether [rva, rva + size) lies entirely within a single range that has all of the flags.
+        //
+        inline bool contains( uint64_t rva, uint64_t size, uint8_t flags ) const
+        {
+            const section_range* range = lookup( rva );
+            return range && ( range->flags & flags ) == flags && range->end - rva >= size;
+        }
+
+        // Useful utilities.
+        //
+        inline bool is_mapped( uint64_t rva, uint64_t size = 1 )    const { return contains( rva, size, section_flag_mapped ); }
+        inline bool is_executable( uint64_t rva )                   const { return contains( rva, 1, section_flag_mapped | section_flag_execute ); }
+        inline bool is_vmp_candidate( uint64_t rva )                const { return contains( rva, 1, section_flag_mapped | section_flag_vmp_candidate ); }
+
+        inline const std::vector<section_range>&    get_ranges()                    const { return ranges; }
+        inline const std::vector<rva_range>&        get_vmp_candidate_ranges()      const { return vmp_candidate_ranges; }
+    };
+}
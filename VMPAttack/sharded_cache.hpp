@@ -0,0 +1,148 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <unordered_map>
+
+namespace vmpattack
+{
+    // This class provides a thread-safe cache of values keyed by an integer, such as an effective
+    // address or a hash, split into independently locked shards so that concurrent lookups and
+    // inserts of unrelated keys rarely contend.
+    // Lookups and inserts are counted, for statistics.
+    //
+    template <typename K, typename V, size_t ShardCount = 16>
+    class sharded_cache
+    {
+        static_assert( std::is_integral_v<K>, "Keys must be integers." );
+        static_assert( std::has_single_bit( ShardCount ) && ShardCount > 1, "The shard count must be a power of two." );
+
+    private:
+        // A single shard of the cache, owning a subset of the keyspace.
+        //
+        struct shard
+        {
+            // Shared for lookups, exclusive for inserts and flushes.
+            //
+            std::shared_mutex mutex;
+
+            // The cached values, by key.
+            //
+            std::unordered_map<K, V> entries;
+        };
+
+        // The shards.
+        //
+        std::array<shard, ShardCount> shards;
+
+        // Statistics.
+        //
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+
+        // Selects the shard responsible for the key.
+        //
+        inline shard& shard_for( K key )
+        {
+            // Fibonacci hashing, so that neighbouring keys spread across shards.
+            //
+            return shards[ ( ( uint64_t )key * 0x9E3779B97F4A7C15ull ) >> ( 64 - std::countr_zero( ShardCount ) ) ];
+        }
+
+    public:
+        // Constructs an empty cache.
+        //
+        sharded_cache()
+            : hits( 0 ), misses( 0 )
+        {}
+
+        // Cannot be copied or moved.
+        //
+        sharded_cache( const sharded_cache& ) = delete;
+        sharded_cache( sharded_cache&& ) = delete;
+        sharded_cache& operator=( const sharded_cache& ) = delete;
+        sharded_cache& operator=( sharded_cache&& ) = delete;
+
+        // Invokes the callback with the value cached for the key, if any, under the shard's shared lock.
+        // The callback returns whether or not the value satisfies the lookup, counting it as a hit.
+        // Returns whether or not the lookup was a hit.
+        //
+        template <typename F>
+        bool lookup( K key, F&& callback )
+        {
+            shard& target = shard_for( key );
+
+            std::shared_lock lock( target.mutex );
+
+            if ( auto it = target.entries.find( key ); it != target.entries.end() && callback( it->second ) )
+            {
+                hits.fetch_add( 1, std::memory_order_relaxed );
+                return true;
+            }
+
+            misses.fetch_add( 1, std::memory_order_relaxed );
+            return false;
+        }
+
+        // Looks up the value cached for the key.
+        // If not cached, returns an empty value.
+        //
+        V lookup( K key )
+        {
+            V result = {};
+
+            lookup( key, [&]( const V& value ) { result = value; return true; } );
+
+            return result;
+        }
+
+        // Inserts the value for the key. If another thread inserted one first, the existing value is kept.
+        // Returns the cached value.
+        //
+        V insert( K key, V value )
+        {
+            shard& target = shard_for( key );
+
+            std::unique_lock lock( target.mutex );
+
+            return target.entries.try_emplace( key, std::move( value ) ).first->second;
+        }
+
+        // Invokes the callback with the value cached for the key, empty if not yet cached, under the
+        // shard's exclusive lock, so that it may be updated in place.
+        //
+        template <typename F>
+        void update( K key, F&& callback )
+        {
+            shard& target = shard_for( key );
+
+            std::unique_lock lock( target.mutex );
+
+            callback( target.entries[ key ] );
+        }
+
+        // Drops all cached values whose key is in the range [begin, end).
+        //
+        void flush( K begin, K end )
+        {
+            for ( shard& target : shards )
+            {
+                std::unique_lock lock( target.mutex );
+
+                std::erase_if( target.entries, [&]( const auto& entry )
+                               {
+                                   return entry.first >= begin && entry.first < end;
+                               } );
+            }
+        }
+
+        // Statistics getters.
+        //
+        inline uint64_t hit_count() const { return hits.load( std::memory_order_relaxed ); }
+        inline uint64_t miss_count() const { return misses.load( std::memory_order_relaxed ); }
+    };
+}
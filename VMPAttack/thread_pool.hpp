@@ -0,0 +1,135 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace vmpattack
+{
+    // This class provides a simple fixed-size pool of worker threads, executing
+    // enqueued tasks in FIFO order.
+    // Tasks must not block waiting on other tasks of the same pool.
+    //
+    class thread_pool
+    {
+    private:
+        // The worker threads.
+        //
+        std::vector<std::thread> workers;
+
+        // The pending tasks.
+        //
+        std::queue<std::function<void()>> tasks;
+
+        // Guards the task queue and the stopping flag.
+        //
+        std::mutex mutex;
+
+        // Signalled whenever a task is enqueued, or the pool is stopping.
+        //
+        std::condition_variable condition;
+
+        // Set once the pool is being destroyed.
+        //
+        bool stopping;
+
+        // The worker thread loop, executing tasks until the pool is stopped.
+        //
+        void worker_loop()
+        {
+            while ( true )
+            {
+                std::function<void()> task;
+
+                {
+                    std::unique_lock lock( mutex );
+                    condition.wait( lock, [&]() { return stopping || !tasks.empty(); } );
+
+                    // Drain all remaining tasks before exiting.
+                    //
+                    if ( tasks.empty() )
+                        return;
+
+                    task = std::move( tasks.front() );
+                    tasks.pop();
+                }
+
+                task();
+            }
+        }
+
+    public:
+        // Cannot be copied or moved.
+        //
+        thread_pool( const thread_pool& ) = delete;
+        thread_pool( thread_pool&& ) = delete;
+        thread_pool& operator=( const thread_pool& ) = delete;
+        thread_pool& operator=( thread_pool&& ) = delete;
+
+        // Constructs the pool with the specified number of workers, or one per hardware thread.
+        //
+        thread_pool( size_t thread_count = std::thread::hardware_concurrency() )
+            : stopping( false )
+        {
+            if ( thread_count == 0 )
+                thread_count = 1;
+
+            for ( size_t i = 0; i < thread_count; i++ )
+                workers.emplace_back( &thread_pool::worker_loop, this );
+        }
+
+        // Finishes all pending tasks, and joins the workers.
+        //
+        ~thread_pool()
+        {
+            {
+                std::lock_guard lock( mutex );
+                stopping = true;
+            }
+
+            condition.notify_all();
+
+            for ( std::thread& worker : workers )
+                worker.join();
+        }
+
+        // Getter to the number of workers.
+        //
+        inline size_t size() const { return workers.size(); }
+
+        // Singleton to provide the process-wide pool instance.
+        //
+        inline static thread_pool& get()
+        {
+            static thread_pool instance;
+
+            return instance;
+        }
+
+        // Enqueues the task, returning a future for its result.
+        //
+        template <typename T>
+        auto enqueue( T task ) -> std::future<decltype( task() )>
+        {
+            using result_type = decltype( task() );
+
+            // std::function requires a copyable target, so the packaged_task is shared.
+            //
+            auto packaged = std::make_shared<std::packaged_task<result_type()>>( std::move( task ) );
+            std::future<result_type> future = packaged->get_future();
+
+            {
+                std::lock_guard lock( mutex );
+                tasks.emplace( [packaged]() { ( *packaged )(); } );
+            }
+
+            condition.notify_one();
+
+            return future;
+        }
+    };
+}
@@ -14,7 +14,7 @@ namespace vmpattack
 
         // Decrypt the next handler via the arith expression.
         //
-        next_handler = ( uint32_t )handler_expression->compute( next_handler );
+        next_handler = ( uint32_t )folded_handler_expression.compute( next_handler );
 
         // Update rolling key.
         //
@@ -35,17 +35,35 @@ namespace vmpattack
     }
 
     // Construct a vm_bridge from an initial state and its instruction stream.
+    // If a cache is specified, bridges already analyzed at the same position are reused as-is,
+    // whichever stream reached them.
     // If the operation fails, returns empty {}.
     //
-    std::optional<std::unique_ptr<vm_bridge>> vm_bridge::from_instruction_stream( const vm_state* state, const instruction_stream* stream )
+    std::optional<std::shared_ptr<const vm_bridge>> vm_bridge::from_instruction_stream( const vm_state* state, const instruction_stream* stream, vm_bridge_cache* cache )
     {
-        // Copy stream to drop the const.
+        // Copy the stream view to drop the const.
         //
         instruction_stream copied_stream = *stream;
 
-        // Initialize empty expression.h
+        // Peek at the first instruction of the bridge to determine its position.
         //
-        std::unique_ptr<arithmetic_expression> bridge_expression = std::make_unique<arithmetic_expression>();
+        instruction_stream peek_stream = *stream;
+        const instruction* first_instruction = peek_stream.next();
+
+        if ( !first_instruction )
+            return {};
+
+        // If the bridge was analyzed before, skip its analysis entirely.
+        //
+        if ( cache )
+        {
+            if ( auto cached_bridge = cache->lookup( first_instruction->address, state ) )
+                return cached_bridge;
+        }
+
+        // Initialize empty expression.
+        //
+        arithmetic_expression bridge_expression;
 
         vm_analysis_context bridge_analysis_context = vm_analysis_context( &copied_stream, state );
 
@@ -55,9 +73,9 @@ namespace vmpattack
         x86_reg rolling_key_reg = state->rolling_key_reg;
 
         auto result = ( &bridge_analysis_context )
-            ->fetch_vip( { fetch_reg, false }, { fetch_reg_size, true } )
-            ->xor_reg_reg( { fetch_reg, true }, { rolling_key_reg, true } )
-            ->record_expression( fetch_reg, bridge_expression.get(), [&]()
+            ->fetch_vip( out( fetch_reg ), in( fetch_reg_size ) )
+            ->xor_reg_reg( in( fetch_reg ), in( rolling_key_reg ) )
+            ->record_expression( fetch_reg, &bridge_expression, [&]()
                                  {
                                      return ( &bridge_analysis_context )
                                          ->id( X86_INS_PUSH );
@@ -68,8 +86,35 @@ namespace vmpattack
         if ( !result )
             return {};
 
-        // Construct actual vm_bridge from the information.
+        // Construct actual vm_bridge from the information, sharing the expression with identical ones.
         //
-        return std::make_unique<vm_bridge>( copied_stream.base(), std::move( bridge_expression ) );
+        auto bridge = std::make_shared<const vm_bridge>( first_instruction->address, arithmetic_expression::intern( bridge_expression ) );
+
+        if ( cache )
+            return cache->insert( first_instruction->address, state, std::move( bridge ) );
+
+        return bridge;
+    }
+
+    // Looks up the bridge analyzed at the given position, for the given vm_state.
+    // If none, returns nullptr.
+    //
+    std::shared_ptr<const vm_bridge> vm_bridge_cache::lookup( uint64_t bridge_rva, const vm_state* state )
+    {
+        const std::lock_guard<std::mutex> lock( mutex );
+
+        auto it = bridges.find( { bridge_rva, state->vip_reg, state->rolling_key_reg } );
+
+        return it != bridges.end() ? it->second : nullptr;
+    }
+
+    // Caches the bridge analyzed at the given position, for the given vm_state.
+    // If another thread cached one first, the existing bridge is kept and returned.
+    //
+    std::shared_ptr<const vm_bridge> vm_bridge_cache::insert( uint64_t bridge_rva, const vm_state* state, std::shared_ptr<const vm_bridge> bridge )
+    {
+        const std::lock_guard<std::mutex> lock( mutex );
+
+        return bridges.try_emplace( { bridge_rva, state->vip_reg, state->rolling_key_reg }, std::move( bridge ) ).first->second;
     }
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #pragma once
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "arithmetic_expression.hpp"
+#include "folded_expression.hpp"
 #include "instruction_stream.hpp"
 #include "vm_state.hpp"
 #include "vm_context.hpp"
@@ -9,25 +12,33 @@
 namespace vmpattack
 {
     struct vm_handler;
+    class vm_bridge_cache;
 
     // This struct represents the virtual machine handler and entry "bridge", which
     // is responsible for advancing the context by computing the next handler and
     // branching to it.
+    // Bridges are immutable once constructed, and shared by pointer.
     //
     struct vm_bridge
     {
-        // The RVA of the bridge in image space
+        // The RVA of the bridge's first instruction in image space. Handlers sharing the bridge
+        // each hold their own RVA.
         //
         const uint64_t rva;
 
-        // The arithmetic chain used to decrypt the next handler's offset
+        // The arithmetic chain used to decrypt the next handler's offset.
+        // Interned.
         //
-        const std::unique_ptr<arithmetic_expression> handler_expression;
+        const std::shared_ptr<const arithmetic_expression> handler_expression;
+
+        // The handler expression, folded for computation.
+        //
+        const folded_expression folded_handler_expression;
 
         // Constructor.
         //
-        vm_bridge( uint64_t rva, std::unique_ptr<arithmetic_expression> handler_expression )
-            : rva( rva ), handler_expression( std::move( handler_expression ) )
+        vm_bridge( uint64_t rva, std::shared_ptr<const arithmetic_expression> handler_expression )
+            : rva( rva ), handler_expression( std::move( handler_expression ) ), folded_handler_expression( folded_expression::fold( this->handler_expression ) )
         {}
 
         // Computes the next handler from the bridge, updating the context in respect.
@@ -36,8 +47,62 @@ namespace vmpattack
         uint64_t advance( vm_context* context ) const;
 
         // Construct a vm_bridge from an initial state and its instruction stream.
+        // If a cache is specified, bridges already analyzed at the same position are reused as-is,
+        // whichever stream reached them.
         // If the operation fails, returns empty {}.
         //
-        static std::optional<std::unique_ptr<vm_bridge>> from_instruction_stream( const vm_state* state, const instruction_stream* stream );
+        static std::optional<std::shared_ptr<const vm_bridge>> from_instruction_stream( const vm_state* state, const instruction_stream* stream, vm_bridge_cache* cache = nullptr );
+    };
+
+    // This class provides a thread-safe cache of analyzed bridges, keyed by their position and
+    // the vm_state registers their analysis depends on.
+    //
+    class vm_bridge_cache
+    {
+    private:
+        // Describes what a bridge's analysis depends on.
+        //
+        struct key
+        {
+            // The RVA of the first instruction of the bridge.
+            //
+            uint64_t bridge_rva;
+
+            // The vm_state registers the bridge is matched against.
+            //
+            x86_reg vip_reg;
+            x86_reg rolling_key_reg;
+
+            bool operator==( const key& other ) const = default;
+        };
+
+        // Hashes a key.
+        //
+        struct key_hash
+        {
+            size_t operator()( const key& k ) const
+            {
+                return k.bridge_rva * 0x9E3779B97F4A7C15ull ^ ( ( uint64_t )k.vip_reg << 16 | k.rolling_key_reg );
+            }
+        };
+
+        // A mutex guarding the bridges.
+        //
+        std::mutex mutex;
+
+        // The analyzed bridges.
+        //
+        std::unordered_map<key, std::shared_ptr<const vm_bridge>, key_hash> bridges;
+
+    public:
+        // Looks up the bridge analyzed at the given position, for the given vm_state.
+        // If none, returns nullptr.
+        //
+        std::shared_ptr<const vm_bridge> lookup( uint64_t bridge_rva, const vm_state* state );
+
+        // Caches the bridge analyzed at the given position, for the given vm_state.
+        // If another thread cached one first, the existing bridge is kept and returned.
+        //
+        std::shared_ptr<const vm_bridge> insert( uint64_t bridge_rva, const vm_state* state, std::shared_ptr<const vm_bridge> bridge );
     };
 }
\ No newline at end of file
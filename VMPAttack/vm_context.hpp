@@ -3,6 +3,7 @@
 #include <memory>
 #include <vtil/utility>
 #include "vm_state.hpp"
+#include "section_index.hpp"
 
 namespace vmpattack
 {
@@ -23,10 +24,16 @@ namespace vmpattack
         //
         uint64_t vip;
 
+        // The section index fetches are bounds-checked against, and the base it is relative to.
+        // If null, fetches are unchecked.
+        //
+        const section_index* sections;
+        uint64_t image_base;
+
         // Constructor. Takes ownership of state.
         //
-        vm_context( std::unique_ptr<vm_state> state, uint64_t rolling_key, uint64_t vip )
-            : state( std::move( state ) ), rolling_key( rolling_key ), vip( vip )
+        vm_context( std::unique_ptr<vm_state> state, uint64_t rolling_key, uint64_t vip, const section_index* sections = nullptr, uint64_t image_base = 0 )
+            : state( std::move( state ) ), rolling_key( rolling_key ), vip( vip ), sections( sections ), image_base( image_base )
         {}
 
         // Fetches an arbitrarily-sized value from the current virtual instruction
@@ -46,6 +53,10 @@ namespace vmpattack
             if ( state->direction == vm_direction_up )
                 vip -= size;
 
+            // Make sure the whole read lies within the mapped image.
+            //
+            fassert( ( !sections || sections->is_mapped( vip - image_base, size ) ) && "Virtual instruction pointer is outside of the mapped image." );
+
             // Zero-initialize the read value, then populate it via a copy from the vip stream.
             //
             T read_value = {};
@@ -59,5 +70,37 @@ namespace vmpattack
 
             return read_value;
         }
+
+        // Determines whether the specified number of bytes can be fetched from the current virtual
+        // instruction pointer, in the current direction, without leaving the mapped image.
+        //
+        inline bool can_fetch( size_t size ) const
+        {
+            uint64_t begin = state->direction == vm_direction_up ? vip - size : vip;
+
+            return !sections || sections->is_mapped( begin - image_base, size );
+        }
+
+        // Fetches an N-byte value from the current virtual instruction pointer, and moves it
+        // by that size in direction D.
+        // Specialized at compile time, so that the read is a single load. Not bounds-checked; the
+        // caller must make sure the read is within the mapped image, ie. via can_fetch.
+        //
+        template <vm_direction D, size_t N>
+        inline uint64_t fetch_unchecked()
+        {
+            static_assert( N == 1 || N == 2 || N == 4 || N == 8, "Fetches must be of 1, 2, 4 or 8 bytes." );
+
+            if constexpr ( D == vm_direction_up )
+                vip -= N;
+
+            uint64_t read_value = 0;
+            memcpy( &read_value, ( void* )vip, N );
+
+            if constexpr ( D == vm_direction_down )
+                vip += N;
+
+            return read_value;
+        }
     };
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "vm_decode_plan.hpp"
+#include "vm_bridge.hpp"
+
+namespace vmpattack
+{
+    // Decodes a single N-byte operand, fetched in direction D, updating the rolling key.
+    //
+    template <vm_direction D, size_t N>
+    static inline uint64_t decode_operand( vm_context* context, const folded_expression& expression )
+    {
+        constexpr uint64_t mask = N == 8 ? ~0ull : ( 1ull << ( N * 8 ) ) - 1;
+
+        uint64_t operand_value = context->fetch_unchecked<D, N>() ^ ( context->rolling_key & mask );
+
+        operand_value = expression.compute( operand_value );
+        context->rolling_key ^= operand_value;
+
+        return operand_value;
+    }
+
+    // The kernel, specialized for the vip direction.
+    //
+    template <vm_direction D>
+    uint64_t vm_decode_plan::execute_kernel( vm_context* context, uint64_t* operands, bool advance ) const
+    {
+        for ( size_t i = 0; i < operand_count; i++ )
+        {
+            switch ( byte_lengths[ i ] )
+            {
+                case 1: operands[ i ] = decode_operand<D, 1>( context, expressions[ i ] ); break;
+                case 2: operands[ i ] = decode_operand<D, 2>( context, expressions[ i ] ); break;
+                case 4: operands[ i ] = decode_operand<D, 4>( context, expressions[ i ] ); break;
+                case 8: operands[ i ] = decode_operand<D, 8>( context, expressions[ i ] ); break;
+            }
+        }
+
+        if ( !advance )
+            return 0;
+
+        // Mirrors vm_bridge::advance.
+        //
+        uint32_t next_handler = ( uint32_t )context->fetch_unchecked<D, 4>() ^ ( uint32_t )context->rolling_key;
+
+        next_handler = ( uint32_t )expressions[ operand_count ].compute( next_handler );
+        context->rolling_key ^= next_handler;
+
+        // Emulate movsxd.
+        //
+        context->state->flow += ( int64_t )( int32_t )next_handler;
+
+        return context->state->flow;
+    }
+
+    // Decodes the operands into the buffer, updating the context, then if requested, advances
+    // the context over the bridge, writing the next handler's rva.
+    // Returns false without touching the context if any fetch would leave the mapped image.
+    //
+    bool vm_decode_plan::execute( vm_context* context, uint64_t* operands, uint64_t* next_handler_rva ) const
+    {
+        bool advance = next_handler_rva != nullptr;
+
+        fassert( ( !advance || has_bridge ) && "Cannot advance over a handler without a bridge." );
+
+        // Bounds-check all fetches at once, so that the kernel does not have to.
+        //
+        if ( !context->can_fetch( operand_fetch_size + ( advance ? 4 : 0 ) ) )
+            return false;
+
+        uint64_t next_rva = context->state->direction == vm_direction_up
+            ? execute_kernel<vm_direction_up>( context, operands, advance )
+            : execute_kernel<vm_direction_down>( context, operands, advance );
+
+        if ( advance )
+            *next_handler_rva = next_rva;
+
+        return true;
+    }
+
+    // Construct a vm_decode_plan from a handler's instruction information, its folded operand
+    // expressions, and its bridge, if any.
+    // If the handler has too many operands, or any operand of an unsupported byte length, returns empty {}.
+    //
+    std::optional<vm_decode_plan> vm_decode_plan::from_handler( const vm_instruction_info* instruction_info, const std::vector<folded_expression>& folded_operand_expressions, const vm_bridge* bridge )
+    {
+        if ( instruction_info->operands.size() > max_operands )
+            return {};
+
+        vm_decode_plan plan;
+
+        for ( size_t i = 0; i < instruction_info->operands.size(); i++ )
+        {
+            size_t byte_length = instruction_info->operands[ i ].first.byte_length;
+
+            if ( byte_length != 1 && byte_length != 2 && byte_length != 4 && byte_length != 8 )
+                return {};
+
+            plan.byte_lengths[ i ] = ( uint8_t )byte_length;
+            plan.expressions[ i ] = folded_operand_expressions[ i ];
+            plan.operand_fetch_size += byte_length;
+        }
+
+        plan.operand_count = ( uint8_t )instruction_info->operands.size();
+
+        if ( bridge )
+        {
+            plan.expressions[ plan.operand_count ] = bridge->folded_handler_expression;
+            plan.has_bridge = true;
+        }
+
+        return plan;
+    }
+}
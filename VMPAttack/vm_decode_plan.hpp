@@ -0,0 +1,72 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "folded_expression.hpp"
+#include "vm_context.hpp"
+#include "vm_instruction_info.hpp"
+
+namespace vmpattack
+{
+    struct vm_bridge;
+
+    // This class describes everything needed to decode a handler's operands and advance over its
+    // bridge, laid out contiguously so that it can be executed by a kernel specialized at compile
+    // time for the vip direction and each operand's byte length, without any indirection.
+    //
+    class vm_decode_plan
+    {
+    public:
+        // The maximum number of operands a plan holds.
+        //
+        static constexpr size_t max_operands = 4;
+
+    private:
+        // The number of operands.
+        //
+        uint8_t operand_count;
+
+        // The byte length of each operand.
+        //
+        std::array<uint8_t, max_operands> byte_lengths;
+
+        // The folded expression of each operand, followed by the bridge's, if any.
+        //
+        std::array<folded_expression, max_operands + 1> expressions;
+
+        // Whether or not the handler has a bridge.
+        //
+        bool has_bridge;
+
+        // The number of bytes fetched by the operands.
+        //
+        size_t operand_fetch_size;
+
+        vm_decode_plan()
+            : operand_count( 0 ), byte_lengths{}, expressions{}, has_bridge( false ), operand_fetch_size( 0 )
+        {}
+
+        // The kernel, specialized for the vip direction.
+        //
+        template <vm_direction D>
+        uint64_t execute_kernel( vm_context* context, uint64_t* operands, bool advance ) const;
+
+    public:
+        // Getter to the number of operands.
+        //
+        inline size_t get_operand_count() const { return operand_count; }
+
+        // Decodes the operands into the buffer, updating the context, then if requested, advances
+        // the context over the bridge, writing the next handler's rva.
+        // Returns false without touching the context if any fetch would leave the mapped image.
+        //
+        bool execute( vm_context* context, uint64_t* operands, uint64_t* next_handler_rva = nullptr ) const;
+
+        // Construct a vm_decode_plan from a handler's instruction information, its folded operand
+        // expressions, and its bridge, if any.
+        // If the handler has too many operands, or any operand of an unsupported byte length, returns empty {}.
+        //
+        static std::optional<vm_decode_plan> from_handler( const vm_instruction_info* instruction_info, const std::vector<folded_expression>& folded_operand_expressions, const vm_bridge* bridge );
+    };
+}
@@ -1,24 +1,38 @@
 #include "vm_handler.hpp"
 #include "vm_instruction_set.hpp"
+#include "vm_instruction_index.hpp"
+#include "vm_shape_cache.hpp"
 #include "vm_bridge.hpp"
 #include "arithmetic_utilities.hpp"
+#include <chrono>
 
 namespace vmpattack
 {
     // Decodes and updates the context to construct a vm_instruction describing the instruction's details.
+    // Uses the decode plan's kernel where possible.
     //
     vm_instruction vm_handler::decode( vm_context* context ) const
     {
+        if ( decode_plan )
+        {
+            std::vector<uint64_t> operands( decode_plan->get_operand_count() );
+
+            if ( decode_plan->execute( context, operands.data() ) )
+                return vm_instruction( this, operands );
+        }
+
         std::vector<uint64_t> operands;
 
         // Loop through the handler's operand information.
         //
-        for ( auto const& [operand, expression] : instruction_info->operands )
+        for ( size_t i = 0; i < instruction_info->operands.size(); i++ )
         {
+            const vm_operand& operand = instruction_info->operands[ i ].first;
+
             uint64_t operand_value = context->fetch<uint64_t>( operand.byte_length );
 
             operand_value ^= dynamic_size_cast( context->rolling_key, operand.byte_length );
-            operand_value = expression->compute( operand_value, operand.byte_length );
+            operand_value = folded_operand_expressions[ i ].compute( operand_value );
             context->rolling_key ^= operand_value;
             
             // Add the decrypted operand.
@@ -29,51 +43,215 @@ namespace vmpattack
         return vm_instruction( this, operands );
     }
 
+    // Decodes the instruction as per decode, then advances the context over the bridge.
+    // Must not be used on branching, VMEXIT or block-creating handlers, as the vip at the end of
+    // the handler is needed by their lifting.
+    // If the JIT is enabled, the compiled function is used where possible, otherwise the decode plan's kernel.
+    // Returns the vm_instruction, writing the next handler's rva.
+    //
+    vm_instruction vm_handler::decode_and_advance( vm_context* context, uint64_t* next_handler_rva ) const
+    {
+        vm_jit& jit = vm_jit::get();
 
-    // Construct a vm_handler from its instruction stream.
-    // Updates vm_state if required by the descriptor.
-    // If the operation fails, returns empty {}.
+        if ( jit.is_enabled() )
+        {
+            if ( const jit_function* function = get_jit_function( context->state->direction ) )
+            {
+                // The compiled function does not bounds-check its fetches, so check them all at once
+                // beforehand. Out of bounds fetches are left to the interpreter, which asserts on them.
+                //
+                if ( context->can_fetch( function->get_fetch_size() ) )
+                {
+                    std::vector<uint64_t> operands( instruction_info->operands.size() );
+
+                    jit_frame frame = { context->vip, context->rolling_key, context->state->flow, operands.data() };
+                    uint64_t next_rva = ( *function )( &frame );
+
+                    // In self-check mode, run the interpreter on a copy of the context, and make sure
+                    // both agree on everything.
+                    //
+                    if ( jit.is_self_checking() )
+                    {
+                        vm_context reference_context( std::make_unique<vm_state>( *context->state ), context->rolling_key, context->vip, context->sections, context->image_base );
+
+                        vm_instruction reference_instruction = decode( &reference_context );
+                        uint64_t reference_rva = bridge->advance( &reference_context );
+
+                        jit.record_check();
+
+                        fassert( reference_instruction.operands == operands && reference_rva == next_rva
+                                 && reference_context.vip == frame.vip && reference_context.rolling_key == frame.rolling_key
+                                 && "Compiled handler diverged from the interpreter." );
+                    }
+
+                    context->vip = frame.vip;
+                    context->rolling_key = frame.rolling_key;
+                    context->state->flow = frame.flow;
+
+                    *next_handler_rva = next_rva;
+                    return vm_instruction( this, operands );
+                }
+            }
+        }
+
+        if ( decode_plan )
+        {
+            std::vector<uint64_t> operands( decode_plan->get_operand_count() );
+
+            if ( decode_plan->execute( context, operands.data(), next_handler_rva ) )
+                return vm_instruction( this, operands );
+        }
+
+        vm_instruction decoded_instruction = decode( context );
+        *next_handler_rva = bridge->advance( context );
+
+        return decoded_instruction;
+    }
+
+    // Gets the natively compiled decode and advance for the vip direction, compiling it on first use.
+    // If it cannot be compiled, returns nullptr.
     //
-    std::optional<std::unique_ptr<vm_handler>> vm_handler::from_instruction_stream( vm_state* initial_state, const instruction_stream* stream )
+    const jit_function* vm_handler::get_jit_function( vm_direction direction ) const
     {
-        const vm_instruction_desc* matched_instruction_desc = nullptr;
+        std::call_once( jit_compiled[ direction ], [&]()
+                        {
+                            jit_functions[ direction ] = vm_jit::get().compile( this, direction );
+                        } );
+
+        return jit_functions[ direction ].get();
+    }
+
+    // Folds the expressions of all of the instruction's operands.
+    //
+    std::vector<folded_expression> vm_handler::fold_operand_expressions( const vm_instruction_info* instruction_info )
+    {
+        std::vector<folded_expression> folded_expressions;
+
+        for ( auto const& [operand, expression] : instruction_info->operands )
+            folded_expressions.push_back( folded_expression::fold( expression, operand.byte_length ) );
+
+        return folded_expressions;
+    }
+
 
-        // Allocate the vm_instruction_info.
+    // Matches the handler against the virtual instruction set, filling in the instruction info.
+    // On success, returns the matched descriptor, leaving the stream after the matched instructions.
+    // Otherwise returns nullptr.
+    //
+    static const vm_instruction_desc* match_descriptor( vm_state* initial_state, instruction_stream* handler_stream, vm_instruction_info* matched_info, job_arena* arena, vm_match_statistics* statistics )
+    {
+        // Save the stream position to ensure we have a fresh query for each match.
         //
-        auto instruction_info = std::make_unique<vm_instruction_info>();
+        uint32_t handler_begin = handler_stream->mark();
 
-        // Copy the stream, to ensure we have a fresh query for each match.
+        // Only try the descriptors whose required features are all present in the handler.
         //
-        instruction_stream copied_stream = *stream;
+        const vm_instruction_index& index = vm_instruction_index::get();
+        uint64_t candidates = index.get_candidates( get_handler_features( initial_state, handler_stream ) );
 
-        // Enumerate instruction set.
+        // Enumerate candidates, in the order given by the statistics, or in instruction set order otherwise.
         //
-        for ( auto instruction_desc : all_virtual_instructions )
+        vm_descriptor_order order = statistics ? statistics->get_order() : get_default_descriptor_order();
+
+        for ( size_t i = 0; i < index.size() && candidates; i++ )
         {
+            size_t descriptor_index = order[ i ];
+
+            if ( !( candidates & ( 1ull << descriptor_index ) ) )
+                continue;
+
+            candidates &= ~( 1ull << descriptor_index );
+
+            const vm_instruction_desc* instruction_desc = index.get_descriptor( descriptor_index );
+
             //
             // TODO: Only update vm_state if updates_state in desc flags.
             //
 
-            // Attempt to match the instruction.
+            // Attempt to match the instruction, timing it if statistics are recorded.
             //
-            if ( instruction_desc->match( initial_state, &copied_stream, instruction_info.get() ) )
+            auto match_begin = statistics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+            bool matched = instruction_desc->match( initial_state, handler_stream, matched_info, arena );
+
+            if ( statistics )
             {
-                // If match successful, save the instruction descriptor and break out of
-                // the loop.
-                //
-                matched_instruction_desc = instruction_desc;
-                break;
+                auto match_time = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - match_begin );
+                statistics->record_attempt( descriptor_index, matched, handler_stream->mark() - handler_begin, match_time.count() );
+            }
+
+            if ( matched )
+            {
+                if ( statistics )
+                    statistics->record_handler();
+
+                return instruction_desc;
             }
 
             // Refresh stream.
             //
-            copied_stream = *stream;
+            handler_stream->rewind( handler_begin );
         }
 
-        // If no matching descriptor found, return empty.
+        return nullptr;
+    }
+
+    // Construct a vm_handler from its instruction stream.
+    // Updates vm_state if required by the descriptor.
+    // Handlers of a previously matched shape are not matched again, but re-bound from the vm_shape_cache.
+    // Matching temporaries are allocated from the arena if specified, otherwise from a local one.
+    // If statistics are specified, descriptors are tried in their order, and each match is recorded.
+    // If a bridge cache is specified, bridges already analyzed are reused.
+    // If the operation fails, returns empty {}.
+    //
+    std::optional<std::unique_ptr<vm_handler>> vm_handler::from_instruction_stream( vm_state* initial_state, const instruction_stream* stream, job_arena* arena, vm_match_statistics* statistics, vm_bridge_cache* bridges )
+    {
+        const vm_instruction_desc* matched_instruction_desc = nullptr;
+        std::unique_ptr<vm_instruction_info> instruction_info;
+
+        // Copy the stream view to drop the const.
         //
-        if ( !matched_instruction_desc )
-            return {};
+        instruction_stream handler_stream = *stream;
+
+        // If a handler of the same shape was matched before, only re-bind its constants, and skip
+        // the stream past the instructions its match consumed.
+        //
+        handler_shape shape = handler_shape::from_instruction_stream( initial_state, &handler_stream );
+
+        if ( auto shape_template = vm_shape_cache::get().lookup( shape ) )
+        {
+            matched_instruction_desc = shape_template->descriptor;
+            instruction_info = shape_template->instantiate( shape );
+
+            handler_stream.rewind( shape.position_after( shape_template->tokens.size() ) );
+        }
+        else
+        {
+            // If no arena was specified, use a local one for the duration of this call.
+            //
+            std::optional<job_arena> local_arena;
+            if ( !arena )
+                arena = &local_arena.emplace( 4096 );
+
+            // Allocate the vm_instruction_info in the arena; it is only moved out if a descriptor matches.
+            //
+            vm_instruction_info* matched_info = arena->create<vm_instruction_info>();
+
+            matched_instruction_desc = match_descriptor( initial_state, &handler_stream, matched_info, arena, statistics );
+
+            // If no matching descriptor found, return empty.
+            //
+            if ( !matched_instruction_desc )
+                return {};
+
+            // Move the instruction info out of the arena, as the handler outlives it.
+            //
+            instruction_info = std::make_unique<vm_instruction_info>( std::move( *matched_info ) );
+
+            // Cache the match for any other handler of the same shape.
+            //
+            vm_shape_cache::get().insert( shape, matched_instruction_desc, handler_stream.mark(), instruction_info.get() );
+        }
 
         // If the matched instruction updates state and its updated state is non-null, copy it into the current
         // VM state.
@@ -92,7 +270,7 @@ namespace vmpattack
         // follows the handler, so since we already advanced the stream while matching,
         // it should now be at the beginning of the bridge.
         //
-        auto bridge = vm_bridge::from_instruction_stream( initial_state, &copied_stream );
+        auto bridge = vm_bridge::from_instruction_stream( initial_state, &handler_stream, bridges );
 
         // If failed to construct bridge, return empty.
         //
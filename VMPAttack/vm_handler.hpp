@@ -1,10 +1,17 @@
 #pragma once
+#include <array>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include "vm_instruction_desc.hpp"
 #include "vm_state.hpp"
 #include "vm_instruction_info.hpp"
 #include "vm_bridge.hpp"
+#include "folded_expression.hpp"
+#include "vm_decode_plan.hpp"
+#include "job_arena.hpp"
+#include "vm_jit.hpp"
+#include "vm_match_statistics.hpp"
 
 namespace vmpattack
 {
@@ -25,24 +32,63 @@ namespace vmpattack
         //
         const std::unique_ptr<vm_instruction_info> instruction_info;
 
-        // The handler's bridge.
+        // The handler's bridge, shared with any other handler using the same one.
         //
-        const std::unique_ptr<vm_bridge> bridge;
+        const std::shared_ptr<const vm_bridge> bridge;
+
+        // The operand expressions, each folded for its operand's byte length, in operand order.
+        //
+        const std::vector<folded_expression> folded_operand_expressions;
+
+        // The operands and bridge laid out for the specialized decode kernels.
+        // Empty if the handler's operands are not supported by them.
+        //
+        const std::optional<vm_decode_plan> decode_plan;
+
+        // The natively compiled decode and advance, per vip direction, compiled on first use.
+        // Null if it could not be compiled.
+        //
+        mutable std::array<std::once_flag, 2> jit_compiled;
+        mutable std::array<std::unique_ptr<jit_function>, 2> jit_functions;
 
         // Constructor.
         //
-        vm_handler( const vm_instruction_desc* descriptor, std::unique_ptr<vm_instruction_info> instruction_info, uint64_t rva, std::unique_ptr<vm_bridge> bridge )
-            : descriptor( descriptor ), instruction_info( std::move( instruction_info ) ), rva( rva ), bridge( std::move( bridge ) )
+        vm_handler( const vm_instruction_desc* descriptor, std::unique_ptr<vm_instruction_info> instruction_info, uint64_t rva, std::shared_ptr<const vm_bridge> bridge )
+            : descriptor( descriptor ), instruction_info( std::move( instruction_info ) ), rva( rva ), bridge( std::move( bridge ) ),
+              folded_operand_expressions( fold_operand_expressions( this->instruction_info.get() ) ),
+              decode_plan( vm_decode_plan::from_handler( this->instruction_info.get(), folded_operand_expressions, this->bridge.get() ) )
         {}
 
+        // Folds the expressions of all of the instruction's operands.
+        //
+        static std::vector<folded_expression> fold_operand_expressions( const vm_instruction_info* instruction_info );
+
         // Decodes and updates the context to construct a vm_instruction describing the instruction's details.
+        // Uses the decode plan's kernel where possible.
         //
         vm_instruction decode( vm_context* context ) const;
 
+        // Decodes the instruction as per decode, then advances the context over the bridge.
+        // Must not be used on branching, VMEXIT or block-creating handlers, as the vip at the end of
+        // the handler is needed by their lifting.
+        // If the JIT is enabled, the compiled function is used where possible, otherwise the decode plan's kernel.
+        // Returns the vm_instruction, writing the next handler's rva.
+        //
+        vm_instruction decode_and_advance( vm_context* context, uint64_t* next_handler_rva ) const;
+
+        // Gets the natively compiled decode and advance for the vip direction, compiling it on first use.
+        // If it cannot be compiled, returns nullptr.
+        //
+        const jit_function* get_jit_function( vm_direction direction ) const;
+
         // Construct a vm_handler from its instruction stream.
         // Updates vm_state if required by the descriptor.
+        // Handlers of a previously matched shape are not matched again, but re-bound from the vm_shape_cache.
+        // Matching temporaries are allocated from the arena if specified, otherwise from a local one.
+        // If statistics are specified, descriptors are tried in their order, and each match is recorded.
+        // If a bridge cache is specified, bridges already analyzed are reused.
         // If the operation fails, returns empty {}.
         //
-        static std::optional<std::unique_ptr<vm_handler>> from_instruction_stream( vm_state* initial_state, const instruction_stream* stream );
+        static std::optional<std::unique_ptr<vm_handler>> from_instruction_stream( vm_state* initial_state, const instruction_stream* stream, job_arena* arena = nullptr, vm_match_statistics* statistics = nullptr, vm_bridge_cache* bridges = nullptr );
     };
 }
\ No newline at end of file
@@ -5,8 +5,9 @@ namespace vmpattack
 {
     // Creates an initial vm_context for this instance, given an entry stub and the image's load delta.
     // The created vm_context is initialized at the first handler in the vip stream.
+    // If specified, vip fetches are bounds-checked against the section index.
     //
-    std::unique_ptr<vm_context> vm_instance::initialize_context( uint64_t stub, int64_t load_delta ) const
+    std::unique_ptr<vm_context> vm_instance::initialize_context( uint64_t stub, int64_t load_delta, const section_index* sections, uint64_t image_base ) const
     {
         // Decrypt the stub to get the unbased (with orig imagebase) vip address.
         // Stub EA must always be cast to 32 bit.
@@ -14,6 +15,16 @@ namespace vmpattack
         //
         uint64_t vip = ( uint32_t )vip_expression->compute( stub ) + 0x100000000;
 
+        return initialize_context_at_vip( vip, load_delta, sections, image_base );
+    }
+
+    // Creates an initial vm_context for this instance, given the unbased vip an entry stub decrypts to,
+    // and the image's load delta.
+    // The created vm_context is initialized at the first handler in the vip stream.
+    // If specified, vip fetches are bounds-checked against the section index.
+    //
+    std::unique_ptr<vm_context> vm_instance::initialize_context_at_vip( uint64_t vip, int64_t load_delta, const section_index* sections, uint64_t image_base ) const
+    {
         // Get the absolute vip ea by adding the load delta.
         //
         uint64_t absolute_vip = vip + load_delta;
@@ -25,39 +36,38 @@ namespace vmpattack
         // Create a new vm_context and return it.
         // The rolling key is the pre-offsetted vip.
         //
-        return std::make_unique<vm_context>( std::move( copied_initial_state ), vip, absolute_vip );
+        return std::make_unique<vm_context>( std::move( copied_initial_state ), vip, absolute_vip, sections, image_base );
+    }
+
+    // Decrypts the entry stubs in bulk into their unbased vips, as done by initialize_context.
+    // The vips must be at least as many as the stubs, and may be the stubs themselves.
+    //
+    void vm_instance::decrypt_entry_stubs( std::span<const uint64_t> stubs, std::span<uint64_t> vips ) const
+    {
+        vip_expression->compute_batch( stubs, vips );
+
+        for ( size_t i = 0; i < stubs.size(); i++ )
+            vips[ i ] = ( uint32_t )vips[ i ] + 0x100000000;
     }
 
     // Adds a handler to the vm_instace.
+    // If a handler was already added at its rva, the new one is dropped.
+    // Returns whether or not the handler was added.
     //
-    void vm_instance::add_handler( std::unique_ptr<vm_handler> handler )
+    bool vm_instance::add_handler( std::unique_ptr<vm_handler> handler )
     {
-        // Lock the mutex.
-        //
-        const std::lock_guard<std::mutex> lock( handlers_mutex );
+        uint64_t handler_rva = handler->rva;
 
-        // Push back the handler.
-        //
-        handlers.push_back( std::move( handler ) );
+        return handlers.insert( handler_rva, std::move( handler ) );
     }
 
     // Attempts to find a handler, given an rva.
+    // Does not take any lock.
     //
-    std::optional<vm_handler*> vm_instance::find_handler( uint64_t rva )
+    std::optional<vm_handler*> vm_instance::find_handler( uint64_t rva ) const
     {
-        // Lock the mutex.
-        //
-        const std::lock_guard<std::mutex> lock( handlers_mutex );
-
-        // Loop through owned handlers.
-        //
-        for ( auto& handler : handlers )
-        {
-            // If the rva matches, return a non-owning pointer to said handler.
-            //
-            if ( handler->rva == rva )
-                return handler.get();
-        }
+        if ( vm_handler* handler = handlers.find( rva ) )
+            return handler;
 
         // If not found return empty {}.
         //
@@ -69,7 +79,7 @@ namespace vmpattack
     //
     std::optional<std::unique_ptr<vm_instance>> vm_instance::from_instruction_stream( const instruction_stream* stream )
     {
-        // Copy the stream to drop the const.
+        // Copy the stream view to drop the const.
         //
         instruction_stream copied_stream = *stream;
 
@@ -77,7 +87,7 @@ namespace vmpattack
         //
         analysis_context entry_analysis_context = analysis_context( &copied_stream );
 
-        std::unique_ptr<arithmetic_expression> vip_expression = std::make_unique<arithmetic_expression>();
+        arithmetic_expression vip_expression;
 
         x86_insn vip_offset_ins;
         x86_reg vip_reg;
@@ -99,17 +109,17 @@ namespace vmpattack
             ->track_register_pushes( &pushed_regs, [&]()
                                      {
                                          return ( &entry_analysis_context )
-                                             ->fetch_encrypted_vip( { vip_reg, false }, { vip_stack_offset, false } );
+                                             ->fetch_encrypted_vip( out( vip_reg ), out( vip_stack_offset ) );
                                      } )
-            ->record_expression( vip_reg, vip_expression.get(), [&]() 
+            ->record_expression( vip_reg, &vip_expression, [&]() 
                                  {
                                      return ( &entry_analysis_context )
-                                         ->offset_reg( { vip_offset_ins, false }, { vip_reg, true }, { vip_offset_reg, false } );
+                                         ->offset_reg( out( vip_offset_ins ), in( vip_reg ), out( vip_offset_reg ) );
                                  } )
-            ->mov_reg_reg( { stack_reg, false }, { rsp, true }, false )
-            ->allocate_stack( { stack_alloc_size, false } )
-            ->mov_reg_reg( { rolling_key_reg, false }, { vip_reg, true } )
-            ->set_flow( { flow_reg, false }, { flow_rva, false } );
+            ->mov_reg_reg<false>( out( stack_reg ), in( rsp ) )
+            ->allocate_stack( out( stack_alloc_size ) )
+            ->mov_reg_reg( out( rolling_key_reg ), in( vip_reg ) )
+            ->set_flow( out( flow_reg ), out( flow_rva ) );
 
         // If information fetch failed, return empty {}.
         //
@@ -117,21 +127,19 @@ namespace vmpattack
             return {};
 
         // We're gonna peek into the bridge instructions to see if the vip goes forwards or backwards.
-        // So we have to copy the stream to not modify the previous one.
+        // So we have to save the stream position to rewind to once done.
         //
-        instruction_stream peek_stream = copied_stream;
-
-        // Create a new analysis context from the newly copied stream.
-        //
-        analysis_context peek_analysis_context = analysis_context( &peek_stream );
+        uint32_t bridge_begin = entry_analysis_context.mark();
 
         // The VIP is offseted by 4 at each handler; search for this so.
         //
         uint64_t vip_offset_size = 4;
         x86_insn update_vip_ins;
 
-        auto bridge_result = peek_analysis_context
-            .update_reg( { update_vip_ins, false }, { vip_reg, true }, { vip_offset_size, true } );
+        auto bridge_result = entry_analysis_context
+            .update_reg( out( update_vip_ins ), in( vip_reg ), in( vip_offset_size ) );
+
+        entry_analysis_context.rewind( bridge_begin );
 
         // If nothing found, something went wrong; return empty {}.
         //
@@ -175,6 +183,6 @@ namespace vmpattack
         
         // Otherwise, construct & return vm_instance.
         //
-        return std::make_unique<vm_instance>( copied_stream.base(), std::move( initial_state ), stack, std::move( vip_expression ), std::move( *bridge ) );
+        return std::make_unique<vm_instance>( copied_stream.base(), std::move( initial_state ), stack, arithmetic_expression::intern( vip_expression ), std::move( *bridge ) );
     }
 }
\ No newline at end of file
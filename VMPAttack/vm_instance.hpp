@@ -2,11 +2,12 @@
 #include <cstdint>
 #include <memory>
 #include <vector>
-#include <mutex>
 #include "vm_state.hpp"
 #include "arithmetic_expression.hpp"
 #include "vm_bridge.hpp"
 #include "vm_handler.hpp"
+#include "vm_match_statistics.hpp"
+#include "rva_table.hpp"
 
 namespace vmpattack
 {
@@ -21,48 +22,88 @@ namespace vmpattack
 
         // The bridge of the VMEntry.
         //
-        const std::unique_ptr<vm_bridge> bridge;
+        const std::shared_ptr<const vm_bridge> bridge;
 
         // Specifies the registers that were pushed at VMEntry in what order.
         //
         const std::vector<vtil::register_desc> entry_frame;
 
     private:
-        // A mutex used to access the handlers vector.
+        // All vm_handlers owned by the vm_instance, by rva.
         //
-        std::mutex handlers_mutex;
-        
-        // An vector of all vm_handlers owned by the vm_instance.
-        //
-        std::vector<std::unique_ptr<vm_handler>> handlers;
+        rva_table<vm_handler> handlers;
 
         // The initial vm_state as initialized by the vm_instance.
         //
         const std::unique_ptr<vm_state> initial_state;
 
         // The arithmetic expression used to decrypt the VMEntry stub to the initial vip.
+        // Interned.
+        //
+        const std::shared_ptr<const arithmetic_expression> vip_expression;
+
+        // The descriptor matching statistics of this instance's handlers, which also decide
+        // the order in which descriptors are tried for it.
         //
-        const std::unique_ptr<arithmetic_expression> vip_expression;
+        vm_match_statistics match_statistics;
+
+        // The bridges analyzed for this instance's handlers.
+        //
+        vm_bridge_cache bridge_cache;
 
     public:
         // Constructor.
         //
-        vm_instance( uint64_t rva, std::unique_ptr<vm_state> initial_state, const std::vector<vtil::register_desc>& entry_frame, std::unique_ptr<arithmetic_expression> vip_expression, std::unique_ptr<vm_bridge> bridge )
+        vm_instance( uint64_t rva, std::unique_ptr<vm_state> initial_state, const std::vector<vtil::register_desc>& entry_frame, std::shared_ptr<const arithmetic_expression> vip_expression, std::shared_ptr<const vm_bridge> bridge )
             : rva( rva ), initial_state( std::move( initial_state ) ), entry_frame( entry_frame ), vip_expression( std::move( vip_expression ) ), bridge( std::move( bridge ) )
         {}
 
         // Creates an initial vm_context for this instance, given an entry stub and the image's load delta.
         // The vm_context is initialized at just before this vm_instance's VMEntry bridge.
+        // If specified, vip fetches are bounds-checked against the section index.
+        //
+        std::unique_ptr<vm_context> initialize_context( uint64_t stub, int64_t load_delta, const section_index* sections = nullptr, uint64_t image_base = 0 ) const;
+
+        // Creates an initial vm_context for this instance, given the unbased vip an entry stub decrypts to,
+        // and the image's load delta.
+        // The vm_context is initialized at just before this vm_instance's VMEntry bridge.
+        // If specified, vip fetches are bounds-checked against the section index.
+        //
+        std::unique_ptr<vm_context> initialize_context_at_vip( uint64_t vip, int64_t load_delta, const section_index* sections = nullptr, uint64_t image_base = 0 ) const;
+
+        // Decrypts the entry stubs in bulk into their unbased vips, as done by initialize_context.
+        // The vips must be at least as many as the stubs, and may be the stubs themselves.
         //
-        std::unique_ptr<vm_context> initialize_context( uint64_t stub, int64_t load_delta ) const;
+        void decrypt_entry_stubs( std::span<const uint64_t> stubs, std::span<uint64_t> vips ) const;
 
         // Adds a handler to the vm_instace.
+        // If a handler was already added at its rva, the new one is dropped.
+        // Returns whether or not the handler was added.
         //
-        void add_handler( std::unique_ptr<vm_handler> handler );
+        bool add_handler( std::unique_ptr<vm_handler> handler );
 
         // Attempts to find a handler, given an rva.
+        // Does not take any lock.
+        //
+        std::optional<vm_handler*> find_handler( uint64_t rva ) const;
+
+        // Finds the handler at the rva, constructing it via the factory if it is not yet known.
+        // The factory is invoked at most once per rva, even if multiple threads reach the handler at once.
+        // Returns the handler, or nullptr if the factory failed, and whether or not this call constructed it.
+        //
+        template <typename F>
+        inline std::pair<vm_handler*, bool> find_or_add_handler( uint64_t rva, F&& factory )
+        {
+            return handlers.find_or_construct( rva, std::forward<F>( factory ) );
+        }
+
+        // Getters.
         //
-        std::optional<vm_handler*> find_handler( uint64_t rva );
+        inline vm_match_statistics*         get_match_statistics()          { return &match_statistics; }
+        inline const vm_match_statistics*   get_match_statistics()  const   { return &match_statistics; }
+        inline const vm_state*              get_initial_state()     const   { return initial_state.get(); }
+        inline const arithmetic_expression* get_vip_expression()    const   { return vip_expression.get(); }
+        inline vm_bridge_cache*             get_bridge_cache()              { return &bridge_cache; }
 
         // Attempts to construct a vm_instance from the VMEntry instruction stream.
         // If fails, returns empty {}.
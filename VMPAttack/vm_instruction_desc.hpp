@@ -5,6 +5,7 @@
 namespace vmpattack
 {
     class instruction_stream;
+    class job_arena;
     struct vm_state;
     struct vm_instruction_info;
 
@@ -33,6 +34,100 @@ namespace vmpattack
         vm_instruction_creates_basic_block = 1 << 4,
     };
 
+    // Describes cheap, register-agnostic instruction shapes that may be present in a handler.
+    // Each descriptor declares the shapes its match strictly requires, so that descriptors
+    // can be ruled out before running their match.
+    //
+    enum vm_handler_features : uint64_t
+    {
+        // None.
+        //
+        vm_feature_none = 0,
+
+        // MOV(ZX) %reg, [VSP + %disp]
+        //
+        vm_feature_vsp_load = 1ull << 0,
+
+        // MOV [VSP], %reg
+        //
+        vm_feature_vsp_store = 1ull << 1,
+
+        // ADD VSP, %imm
+        //
+        vm_feature_vsp_add = 1ull << 2,
+
+        // MOV(ZX) %reg, [VIP]
+        //
+        vm_feature_vip_load = 1ull << 3,
+
+        // MOV(ZX) %reg, [VCTX + %reg]
+        //
+        vm_feature_ctx_load = 1ull << 4,
+
+        // MOV [VCTX + %reg], %reg
+        //
+        vm_feature_ctx_store = 1ull << 5,
+
+        // MOV(ZX) %reg, [%reg]
+        //
+        vm_feature_memory_load = 1ull << 6,
+
+        // MOV(ZX) [%reg], %reg
+        //
+        vm_feature_memory_store = 1ull << 7,
+
+        // PUSH [%reg]
+        //
+        vm_feature_memory_push = 1ull << 8,
+
+        // LEA %reg, [RIP - {ins_len}]
+        //
+        vm_feature_flow_load = 1ull << 9,
+
+        // ADD/SUB %reg, %imm
+        //
+        vm_feature_update_reg = 1ull << 10,
+
+        // MOVABS %reg, %imm
+        //
+        vm_feature_movabs = 1ull << 11,
+
+        // %id %reg, %reg
+        //
+        vm_feature_mov_reg_reg = 1ull << 12,
+        vm_feature_xor_reg_reg = 1ull << 13,
+        vm_feature_sub_reg_reg = 1ull << 14,
+        vm_feature_add_reg_reg = 1ull << 15,
+        vm_feature_or_reg_reg = 1ull << 16,
+        vm_feature_and_reg_reg = 1ull << 17,
+        vm_feature_shl_reg_reg = 1ull << 18,
+        vm_feature_shr_reg_reg = 1ull << 19,
+        vm_feature_rcl_reg_reg = 1ull << 20,
+        vm_feature_rcr_reg_reg = 1ull << 21,
+
+        // %id %reg, %reg, %reg
+        //
+        vm_feature_shld_reg_reg_reg = 1ull << 22,
+        vm_feature_shrd_reg_reg_reg = 1ull << 23,
+
+        // %id %reg
+        //
+        vm_feature_not_reg = 1ull << 24,
+        vm_feature_div_reg = 1ull << 25,
+        vm_feature_idiv_reg = 1ull << 26,
+        vm_feature_mul_reg = 1ull << 27,
+        vm_feature_imul_reg = 1ull << 28,
+
+        // Instruction ids, regardless of operands.
+        //
+        vm_feature_or = 1ull << 29,
+        vm_feature_pushfq = 1ull << 30,
+        vm_feature_popfq = 1ull << 31,
+        vm_feature_rdtsc = 1ull << 32,
+        vm_feature_cpuid = 1ull << 33,
+        vm_feature_ret = 1ull << 34,
+    };
+
     // This struct describes a virtual machine instruction and its
     // semantics.
     //
@@ -42,8 +137,10 @@ namespace vmpattack
         // Returns whether or not the match succeeded, and if so, updates the vm_state to
         // the state after instruction execution, and sets vm_instruction_info based on the
         // instruction instance information.
+        // Any temporaries are allocated from the arena; anything stored in the info must
+        // be copied out of it.
         //
-        using fn_match = bool( * )( const vm_state* state, instruction_stream* stream, vm_instruction_info* info );
+        using fn_match = bool( * )( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena );
 
         // Function prototype used to generate VTIL given a virtual instruction.
         //
@@ -61,6 +158,10 @@ namespace vmpattack
         //
         const uint32_t flags;
 
+        // The handler features the match delegate strictly requires.
+        //
+        const uint64_t signature;
+
         // The match delegate.
         //
         const fn_match match;
@@ -71,8 +172,8 @@ namespace vmpattack
 
         // Constructor.
         //
-        vm_instruction_desc( const std::string& name, uint32_t operand_count, uint32_t flags, fn_match match, fn_generate generate )
-            : name( name ), operand_count( operand_count ), flags( flags ), match( match ), generate( generate )
+        vm_instruction_desc( const std::string& name, uint32_t operand_count, uint32_t flags, uint64_t signature, fn_match match, fn_generate generate )
+            : name( name ), operand_count( operand_count ), flags( flags ), signature( signature ), match( match ), generate( generate )
         {}
     };
 }
\ No newline at end of file
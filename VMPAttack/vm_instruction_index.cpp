@@ -0,0 +1,289 @@
+#include "vm_instruction_index.hpp"
+#include "vm_handler.hpp"
+#include "vm_instruction_set.hpp"
+#include "instruction_stream.hpp"
+#include <algorithm>
+#include <iterator>
+#include <bit>
+
+namespace vmpattack
+{
+    // Computes the features of a single instruction, for the given vm_state.
+    // Each feature mirrors the filters of the corresponding analysis_context template, without
+    // any register bindings.
+    //
+    uint64_t get_instruction_features( const vm_state* state, const instruction* instruction )
+    {
+        uint64_t features = vm_feature_none;
+
+        int operand_count = instruction->operand_count();
+
+        // Features by instruction id alone.
+        //
+        switch ( instruction->id )
+        {
+            case X86_INS_OR:        features |= vm_feature_or; break;
+            case X86_INS_PUSHFQ:    features |= vm_feature_pushfq; break;
+            case X86_INS_POPFQ:     features |= vm_feature_popfq; break;
+            case X86_INS_RDTSC:     features |= vm_feature_rdtsc; break;
+            case X86_INS_CPUID:     features |= vm_feature_cpuid; break;
+            case X86_INS_RET:       features |= vm_feature_ret; break;
+            default:                break;
+        }
+
+        // %id %reg
+        //
+        if ( operand_count == 1 && instruction->operand_type( 0 ) == X86_OP_REG )
+        {
+            switch ( instruction->id )
+            {
+                case X86_INS_NOT:   features |= vm_feature_not_reg; break;
+                case X86_INS_DIV:   features |= vm_feature_div_reg; break;
+                case X86_INS_IDIV:  features |= vm_feature_idiv_reg; break;
+                case X86_INS_MUL:   features |= vm_feature_mul_reg; break;
+                case X86_INS_IMUL:  features |= vm_feature_imul_reg; break;
+                default:            break;
+            }
+        }
+
+        // PUSH [%reg]
+        //
+        if ( operand_count == 1 && instruction->operand_type( 0 ) == X86_OP_MEM && instruction->id == X86_INS_PUSH )
+        {
+            if ( instruction->operand( 0 ).mem.disp == 0 && instruction->operand( 0 ).mem.scale == 1 )
+                features |= vm_feature_memory_push;
+        }
+
+        if ( operand_count == 2 )
+        {
+            x86_op_type type0 = instruction->operand_type( 0 );
+            x86_op_type type1 = instruction->operand_type( 1 );
+
+            bool is_mov = instruction->id == X86_INS_MOV;
+            bool is_movzx = instruction->id == X86_INS_MOVZX;
+
+            // %id %reg, %reg
+            //
+            if ( type0 == X86_OP_REG && type1 == X86_OP_REG )
+            {
+                switch ( instruction->id )
+                {
+                    case X86_INS_MOV:   features |= vm_feature_mov_reg_reg; break;
+                    case X86_INS_XOR:   features |= vm_feature_xor_reg_reg; break;
+                    case X86_INS_SUB:   features |= vm_feature_sub_reg_reg; break;
+                    case X86_INS_ADD:   features |= vm_feature_add_reg_reg; break;
+                    case X86_INS_OR:    features |= vm_feature_or_reg_reg; break;
+                    case X86_INS_AND:   features |= vm_feature_and_reg_reg; break;
+                    case X86_INS_SHL:   features |= vm_feature_shl_reg_reg; break;
+                    case X86_INS_SHR:   features |= vm_feature_shr_reg_reg; break;
+                    case X86_INS_RCL:   features |= vm_feature_rcl_reg_reg; break;
+                    case X86_INS_RCR:   features |= vm_feature_rcr_reg_reg; break;
+                    default:            break;
+                }
+            }
+
+            // %id %reg, %imm
+            //
+            else if ( type0 == X86_OP_REG && type1 == X86_OP_IMM )
+            {
+                if ( instruction->id == X86_INS_ADD || instruction->id == X86_INS_SUB )
+                    features |= vm_feature_update_reg;
+
+                if ( instruction->id == X86_INS_ADD && instruction->operand( 0 ).reg == state->stack_reg )
+                    features |= vm_feature_vsp_add;
+
+                if ( instruction->id == X86_INS_MOVABS )
+                    features |= vm_feature_movabs;
+            }
+
+            // %id %reg, [%mem]
+            //
+            else if ( type0 == X86_OP_REG && type1 == X86_OP_MEM )
+            {
+                const instruction_memory& mem = instruction->operand( 1 ).mem;
+
+                if ( is_mov || is_movzx )
+                {
+                    if ( mem.index == X86_REG_INVALID )
+                    {
+                        if ( mem.base == state->stack_reg )
+                            features |= vm_feature_vsp_load;
+
+                        if ( mem.base == state->vip_reg )
+                            features |= vm_feature_vip_load;
+
+                        if ( mem.disp == 0 )
+                            features |= vm_feature_memory_load;
+                    }
+
+                    if ( mem.base == state->context_reg && mem.disp == 0 && mem.scale == 1 )
+                        features |= vm_feature_ctx_load;
+                }
+
+                if ( instruction->id == X86_INS_LEA
+                     && mem.base == X86_REG_RIP
+                     && mem.index == X86_REG_INVALID
+                     && mem.disp == -instruction->size )
+                    features |= vm_feature_flow_load;
+            }
+
+            // %id [%mem], %reg
+            //
+            else if ( type0 == X86_OP_MEM && type1 == X86_OP_REG )
+            {
+                const instruction_memory& mem = instruction->operand( 0 ).mem;
+
+                if ( is_mov || is_movzx )
+                    features |= vm_feature_memory_store;
+
+                if ( is_mov && mem.base == state->stack_reg && mem.index == X86_REG_INVALID && mem.disp == 0 )
+                    features |= vm_feature_vsp_store;
+
+                if ( is_mov && mem.base == state->context_reg && mem.scale == 1 && mem.disp == 0 )
+                    features |= vm_feature_ctx_store;
+            }
+        }
+
+        // %id %reg, %reg, %reg
+        //
+        if ( operand_count == 3
+             && instruction->operand_type( 0 ) == X86_OP_REG
+             && instruction->operand_type( 1 ) == X86_OP_REG
+             && instruction->operand_type( 2 ) == X86_OP_REG )
+        {
+            if ( instruction->id == X86_INS_SHLD )
+                features |= vm_feature_shld_reg_reg_reg;
+            else if ( instruction->id == X86_INS_SHRD )
+                features |= vm_feature_shrd_reg_reg_reg;
+        }
+
+        return features;
+    }
+
+    // Computes the features present in the remainder of the instruction stream, for the given vm_state.
+    // The stream's position is left untouched.
+    //
+    uint64_t get_handler_features( const vm_state* state, const instruction_stream* stream )
+    {
+        uint64_t features = vm_feature_none;
+
+        // Walk a copy of the view, so that the original position is kept.
+        //
+        instruction_stream walk_stream = *stream;
+
+        while ( const instruction* instruction = walk_stream.next() )
+            features |= get_instruction_features( state, instruction );
+
+        return features;
+    }
+
+    // The flags of descriptors altering control flow.
+    //
+    static constexpr uint32_t control_flow_flags = vm_instruction_branch | vm_instruction_vmexit | vm_instruction_updates_state | vm_instruction_creates_basic_block;
+
+    // Builds the index over the descriptors, keeping their order.
+    // At most 64 descriptors are supported.
+    //
+    vm_instruction_index::vm_instruction_index( const std::vector<const vm_instruction_desc*>& descriptors )
+        : descriptors( descriptors ), requiring_descriptors{}, shadowed_descriptors{}, used_features( vm_feature_none )
+    {
+        fassert( descriptors.size() <= 64 && "Too many descriptors to index." );
+
+        for ( size_t i = 0; i < descriptors.size(); i++ )
+        {
+            used_features |= descriptors[ i ]->signature;
+
+            for ( size_t feature = 0; feature < 64; feature++ )
+            {
+                if ( descriptors[ i ]->signature & ( 1ull << feature ) )
+                    requiring_descriptors[ feature ] |= 1ull << i;
+            }
+
+            // Descriptors overlap if either signature includes the other, eg. NOP's is part of RET's, so
+            // any RET handler is also a NOP candidate. Those altering control flow are never reordered.
+            //
+            uint64_t signature = descriptors[ i ]->signature;
+            bool alters_flow = descriptors[ i ]->flags & control_flow_flags;
+
+            for ( size_t j = 0; j < i; j++ )
+            {
+                uint64_t common_features = descriptors[ j ]->signature & signature;
+
+                if ( alters_flow || ( descriptors[ j ]->flags & control_flow_flags )
+                     || common_features == signature || common_features == descriptors[ j ]->signature )
+                    shadowed_descriptors[ i ] |= 1ull << j;
+            }
+        }
+    }
+
+    // Singleton to provide the index over all virtual instructions, built on first use.
+    //
+    const vm_instruction_index& vm_instruction_index::get()
+    {
+        static const vm_instruction_index instance = { { std::begin( all_virtual_instructions ), std::end( all_virtual_instructions ) } };
+
+        return instance;
+    }
+
+    // Returns a mask of the descriptors whose signature is satisfied by the features.
+    //
+    uint64_t vm_instruction_index::get_candidates( uint64_t features ) const
+    {
+        uint64_t all_descriptors = descriptors.size() == 64 ? ~0ull : ( 1ull << descriptors.size() ) - 1;
+        uint64_t excluded_descriptors = 0;
+
+        // Rule out every descriptor requiring a feature that is missing.
+        //
+        for ( uint64_t missing = used_features & ~features; missing; missing &= missing - 1 )
+            excluded_descriptors |= requiring_descriptors[ std::countr_zero( missing ) ];
+
+        return all_descriptors & ~excluded_descriptors;
+    }
+
+    // Determines whether the order keeps every descriptor after all of those it may shadow.
+    //
+    bool vm_instruction_index::is_order_safe( const uint8_t* order ) const
+    {
+        uint64_t placed = 0;
+
+        for ( size_t i = 0; i < descriptors.size(); i++ )
+        {
+            if ( ( shadowed_descriptors[ order[ i ] ] & placed ) != shadowed_descriptors[ order[ i ] ] )
+                return false;
+
+            placed |= 1ull << order[ i ];
+        }
+
+        return true;
+    }
+
+    // Reorders the order, keeping it as is as far as possible, so that every descriptor comes after
+    // all of those it may shadow.
+    //
+    void vm_instruction_index::make_order_safe( uint8_t* order ) const
+    {
+        uint8_t safe_order[ 64 ];
+        size_t count = 0;
+        uint64_t placed = 0;
+
+        // Places the descriptor, after first placing any it may shadow, in instruction set order.
+        // Those all precede it in instruction set order, so this always terminates.
+        //
+        auto place = [&]( auto&& self, size_t index ) -> void
+        {
+            if ( placed & ( 1ull << index ) )
+                return;
+
+            for ( uint64_t shadowed = shadowed_descriptors[ index ] & ~placed; shadowed; shadowed &= shadowed - 1 )
+                self( self, std::countr_zero( shadowed ) );
+
+            safe_order[ count++ ] = ( uint8_t )index;
+            placed |= 1ull << index;
+        };
+
+        for ( size_t i = 0; i < descriptors.size(); i++ )
+            place( place, order[ i ] );
+
+        std::copy( safe_order, safe_order + count, order );
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "vm_instruction_desc.hpp"
+#include "vm_state.hpp"
+
+namespace vmpattack
+{
+    class instruction_stream;
+
+    // Computes the features present in the remainder of the instruction stream, for the given vm_state.
+    // The stream's position is left untouched.
+    //
+    uint64_t get_handler_features( const vm_state* state, const instruction_stream* stream );
+
+    // This class provides an index over the virtual instruction set, mapping the features
+    // found in a handler to the descriptors that could possibly match it.
+    //
+    class vm_instruction_index
+    {
+    private:
+        // The indexed descriptors, in matching order.
+        //
+        std::vector<const vm_instruction_desc*> descriptors;
+
+        // For each feature bit, a mask of the descriptors requiring it.
+        //
+        uint64_t requiring_descriptors[ 64 ];
+
+        // For each descriptor, a mask of the descriptors before it that it overlaps with, and so may
+        // shadow if tried first: those whose signature includes or is included in its own, or all of
+        // them if either alters control flow.
+        //
+        uint64_t shadowed_descriptors[ 64 ];
+
+        // The union of all descriptor signatures.
+        //
+        uint64_t used_features;
+
+    public:
+        // Builds the index over the descriptors, keeping their order.
+        // At most 64 descriptors are supported.
+        //
+        vm_instruction_index( const std::vector<const vm_instruction_desc*>& descriptors );
+
+        // Singleton to provide the index over all virtual instructions, built on first use.
+        //
+        static const vm_instruction_index& get();
+
+        // Returns a mask of the descriptors whose signature is satisfied by the features, where
+        // bit i refers to get_descriptor( i ).
+        //
+        uint64_t get_candidates( uint64_t features ) const;
+
+        // Returns a mask of the descriptors before the descriptor that it may shadow if tried first.
+        //
+        inline uint64_t get_shadowed( size_t index ) const { return shadowed_descriptors[ index ]; }
+
+        // Determines whether the order keeps every descriptor after all of those it may shadow.
+        //
+        bool is_order_safe( const uint8_t* order ) const;
+
+        // Reorders the order, keeping it as is as far as possible, so that every descriptor comes after
+        // all of those it may shadow.
+        //
+        void make_order_safe( uint8_t* order ) const;
+
+        // Getters.
+        //
+        inline const vm_instruction_desc*   get_descriptor( size_t index )  const { return descriptors[ index ]; }
+        inline size_t                       size()                          const { return descriptors.size(); }
+    };
+}
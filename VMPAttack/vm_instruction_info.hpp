@@ -53,9 +53,9 @@ namespace vmpattack
     struct vm_instruction_info
     {
         // A map of operand information with their corresponding arithmetic expression used for
-        // obfuscation.
+        // obfuscation. The expressions are interned.
         //
-        std::vector<std::pair<vm_operand, std::unique_ptr<arithmetic_expression>>> operands;
+        std::vector<std::pair<vm_operand, std::shared_ptr<const arithmetic_expression>>> operands;
 
         // A vector of arbitrary sizes, determined during matching phase and
         // used during generation phase.
@@ -79,7 +79,7 @@ namespace vmpattack
 
         // Construct via initial operand list.
         //
-        vm_instruction_info( std::vector<std::pair<vm_operand, std::unique_ptr<arithmetic_expression>>> operands )
+        vm_instruction_info( std::vector<std::pair<vm_operand, std::shared_ptr<const arithmetic_expression>>> operands )
             : operands( std::move( operands ) ), sizes{}
         {}
     };
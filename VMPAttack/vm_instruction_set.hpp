@@ -2,6 +2,7 @@
 #include "vm_instruction_desc.hpp"
 #include "vm_analysis_context.hpp"
 #include "flags.hpp"
+#include "job_arena.hpp"
 #include <vtil/arch>
 
 namespace vmpattack
@@ -13,20 +14,22 @@ namespace vmpattack
 
     inline const vm_instruction_desc pop = 
     { 
-        "POP", 1, vm_instruction_none, 
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        "POP", 1, vm_instruction_none,
+        vm_feature_vsp_load | vm_feature_vsp_add | vm_feature_vip_load | vm_feature_xor_reg_reg | vm_feature_ctx_store,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
-            std::unique_ptr<arithmetic_expression> operand_chain = std::make_unique<arithmetic_expression>();
+            arithmetic_expression* operand_chain = arena->create<arithmetic_expression>( arena->get_resource() );
 
             x86_reg pop_reg, operand_reg;
             int64_t pop_disp = 0;
             size_t pop_size, operand_size;
             size_t store_size;
 
-            // Copy so we don't corrupt the state.
+            vm_analysis_context stream_context = vm_analysis_context( stream, state );
+
+            // Save the position so we don't corrupt the state.
             //
-            instruction_stream copied_stream = *stream;
-            vm_analysis_context stream_context = vm_analysis_context( &copied_stream, state );
+            uint32_t handler_begin = stream_context.mark();
 
             //
             // There are 2 types of POPs. We must match for both.
@@ -35,46 +38,50 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %pop_size:%pop_reg, [VSP]
-                ->fetch_vsp( { pop_reg, false }, { pop_size, false }, { pop_disp, true } )
+                ->fetch_vsp( out( pop_reg ), out( pop_size ), in( pop_disp ) )
 
                 // ADD VSP, %pop_size
-                ->add_vsp( { pop_size, true } )
+                ->add_vsp( in( pop_size ) )
 
                 // MOV(ZX) %operand_reg, %operand_size:[VIP]
-                ->fetch_vip( { operand_reg, false }, { operand_size, false } )
+                ->fetch_vip( out( operand_reg ), out( operand_size ) )
 
-                ->record_encryption( operand_reg, operand_chain.get() )
+                ->record_encryption( operand_reg, operand_chain )
 
                 // MOV %store_size:[CTX + %operand_reg], [%pop_reg]
-                ->store_ctx( { pop_reg, true }, { store_size, false }, { operand_reg, true } );
+                ->store_ctx( in( pop_reg ), out( store_size ), in( operand_reg ) );
 
             if ( !result )
             {
                 // Refresh all objects.
                 //
-                copied_stream = *stream;
-                operand_chain = std::make_unique<arithmetic_expression>();
+                stream_context.rewind( handler_begin );
+                operand_chain->operations.clear();
 
                 result = ( &stream_context )
                     // MOV(ZX) %operand_reg, %operand_size:[VIP]
-                    ->fetch_vip( { operand_reg, false }, { operand_size, false } )
-                    ->record_encryption( operand_reg, operand_chain.get() )
+                    ->fetch_vip( out( operand_reg ), out( operand_size ) )
+                    ->record_encryption( operand_reg, operand_chain )
 
                     // MOV(ZX) %pop_size:%pop_reg, [VSP]
-                    ->fetch_vsp( { pop_reg, false }, { pop_size, false }, { pop_disp, true } )
+                    ->fetch_vsp( out( pop_reg ), out( pop_size ), in( pop_disp ) )
 
                     // ADD VSP, %pop_size
-                    ->add_vsp( { pop_size, true } )
+                    ->add_vsp( in( pop_size ) )
 
                     // MOV %store_size:[CTX + %operand_reg], [%pop_reg]
-                    ->store_ctx( { pop_reg, true }, { store_size, false }, { operand_reg, true } );
+                    ->store_ctx( in( pop_reg ), out( store_size ), in( operand_reg ) );
 
                 if ( !result )
                     return false;
             }
 
+            // Leave the stream where it was.
+            //
+            stream_context.rewind( handler_begin );
+
             vm_operand op = { vm_operand_reg, pop_size, operand_size };
-            info->operands.push_back( { op, std::move( operand_chain ) } );
+            info->operands.push_back( { op, arithmetic_expression::intern( *operand_chain ) } );
 
             return true;
         },
@@ -94,7 +101,8 @@ namespace vmpattack
     inline const vm_instruction_desc popstk =
     {
         "POPSTK", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -104,7 +112,7 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV 8:VSP, [VSP]
-                ->fetch_vsp( { stack_reg, true }, { pop_size, true }, { disp, true } );
+                ->fetch_vsp( in( stack_reg ), in( pop_size ), in( disp ) );
 
             if ( !result )
                 return false;
@@ -122,41 +130,41 @@ namespace vmpattack
     inline const vm_instruction_desc push =
     {
         "PUSH", 1, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vip_load | vm_feature_xor_reg_reg | vm_feature_vsp_store,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
+            vm_analysis_context stream_context = vm_analysis_context( stream, state );
+
+            // Save the position, to retry from it if the first variant does not match.
+            //
+            uint32_t handler_begin = stream_context.mark();
+
             //
             // There are 2 types of this handler: push %reg, and push %imm.
             // First, attempt to match for push imm.
             //
             {
-                std::unique_ptr<arithmetic_expression> operand_chain = std::make_unique<arithmetic_expression>();
-
-                instruction_stream copied_stream = *stream;
-                vm_analysis_context stream_context = vm_analysis_context( &copied_stream, state );
+                arithmetic_expression* operand_chain = arena->create<arithmetic_expression>( arena->get_resource() );
 
                 x86_reg operand_reg;
                 size_t operand_size, stack_store_size;
 
                 auto result = ( &stream_context )
                     // MOV(ZX) %operand_size:%operand_reg, [VIP]
-                    ->fetch_vip( { operand_reg, false }, { operand_size, false } )
+                    ->fetch_vip( out( operand_reg ), out( operand_size ) )
 
-                    ->record_encryption( operand_reg, operand_chain.get() )
+                    ->record_encryption( operand_reg, operand_chain )
                     ->cast<vm_analysis_context*>()
 
                     // MOV %stack_store_size:[VSP], %operand_reg
-                    ->store_vsp( { operand_reg, true }, { stack_store_size, false } );
+                    ->store_vsp( in( operand_reg ), out( stack_store_size ) );
 
                 // If matching succeeded, that means that this is the push %imm variant.
                 //
                 if ( result )
                 {
-                    // Commit changes to the stream.
-                    //
-                    *stream = copied_stream;
-
                     vm_operand op = { vm_operand_imm, stack_store_size, operand_size };
-                    info->operands.push_back( { op, std::move( operand_chain ) }  );
+                    info->operands.push_back( { op, arithmetic_expression::intern( *operand_chain ) } );
 
                     return true;
                 }
@@ -167,48 +175,45 @@ namespace vmpattack
             //
 
             {
-                std::unique_ptr<arithmetic_expression> operand_chain = std::make_unique<arithmetic_expression>();
+                arithmetic_expression* operand_chain = arena->create<arithmetic_expression>( arena->get_resource() );
 
-                instruction_stream copied_stream = *stream;
-                vm_analysis_context stream_context = vm_analysis_context( &copied_stream, state );
+                stream_context.rewind( handler_begin );
 
                 x86_reg operand_reg, context_reg;
                 size_t operand_size, stack_store_size;
 
                 auto result = ( &stream_context )
                     // MOV(ZX) %operand_size:%operand_reg, [VIP]
-                    ->fetch_vip( { operand_reg, false }, { operand_size, false } )
+                    ->fetch_vip( out( operand_reg ), out( operand_size ) )
 
-                    ->record_encryption( operand_reg, operand_chain.get() )
+                    ->record_encryption( operand_reg, operand_chain )
                     ->cast<vm_analysis_context*>()
 
                     // MOV(ZX) %context_reg, %stack_store_size:[CTX + %operand_reg]
-                    ->fetch_ctx( { context_reg, false }, { stack_store_size, false }, { operand_reg, true } )
+                    ->fetch_ctx( out( context_reg ), out( stack_store_size ), in( operand_reg ) )
                     
                     // %stack_store_size = ALIGN(%stack_store_size)
                     ->align( stack_store_size )
                     ->cast<vm_analysis_context*>()
 
                     // MOV %stack_store_size:[VSP], %context_reg
-                    ->store_vsp( { context_reg, true }, { stack_store_size, true } );
+                    ->store_vsp( in( context_reg ), in( stack_store_size ) );
 
                 // If matching succeeded, that means that this is the push %imm variant.
                 //
                 if ( result )
                 {
-                    // Commit changes to the stream.
-                    //
-                    *stream = copied_stream;
-
                     vm_operand op = { vm_operand_reg, stack_store_size, operand_size };
-                    info->operands.push_back( { op, std::move( operand_chain ) } );
+                    info->operands.push_back( { op, arithmetic_expression::intern( *operand_chain ) } );
 
                     return true;
                 }
             }
 
-            // Neither variant matched.
+            // Neither variant matched; leave the stream where it was.
             //
+            stream_context.rewind( handler_begin );
+
             return false;
         },
 
@@ -252,7 +257,8 @@ namespace vmpattack
     inline const vm_instruction_desc pushstk =
     {
         "PUSHSTK", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_mov_reg_reg | vm_feature_vsp_store,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -261,11 +267,11 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV %stored_stack_reg, VSP
-                ->mov_reg_reg( { stored_stack_reg, false }, { stack_reg, true } )
+                ->mov_reg_reg( out( stored_stack_reg ), in( stack_reg ) )
                 ->cast<vm_analysis_context*>()
 
                 // MOV %store_size:[VSP], %stored_stack_reg
-                ->store_vsp( { stored_stack_reg, true }, { store_size, false } );
+                ->store_vsp( in( stored_stack_reg ), out( store_size ) );
 
             if ( !result )
                 return false;
@@ -290,7 +296,8 @@ namespace vmpattack
     inline const vm_instruction_desc add =
     {
         "ADD", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_add_reg_reg | vm_feature_pushfq,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -300,13 +307,13 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
 
                 // ADD %r0, %r1
-                ->add_reg_reg( { r0, true }, { r1, true } )
+                ->add_reg_reg( in( r0 ), in( r1 ) )
 
                 // PUSHFQ
                 ->id( X86_INS_PUSHFQ );
@@ -360,7 +367,8 @@ namespace vmpattack
     inline const vm_instruction_desc nand =
     {
         "NAND", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_not_reg | vm_feature_or_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -370,19 +378,19 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
 
                 // NOT %r0
-                ->not_reg( { r0, true } )
+                ->not_reg( in( r0 ) )
 
                 // NOT %r1
-                ->not_reg( { r1, true } )
+                ->not_reg( in( r1 ) )
 
                 // OR %r0, %r1
-                ->or_reg_reg( { r0, true }, { r1, true } );
+                ->or_reg_reg( in( r0 ), in( r1 ) );
 
             if ( !result )
                 return false;
@@ -429,7 +437,8 @@ namespace vmpattack
     inline  vm_instruction_desc nor =
     {
         "NOR", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_not_reg | vm_feature_and_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -439,19 +448,19 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
 
                 // NOT %r0
-                ->not_reg( { r0, true } )
+                ->not_reg( in( r0 ) )
 
                 // NOT %r1
-                ->not_reg( { r1, true } )
+                ->not_reg( in( r1 ) )
 
                 // AND %r0, %r1
-                ->and_reg_reg( { r0, true }, { r1, true } );
+                ->and_reg_reg( in( r0 ), in( r1 ) );
 
             if ( !result )
                 return false;
@@ -497,7 +506,8 @@ namespace vmpattack
     inline const vm_instruction_desc ldd =
     {
         "LDD", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_memory_load | vm_feature_vsp_store,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -507,14 +517,14 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %aligned_size:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { aligned_size, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( aligned_size ), in( initial_disp ) )
 
                 // MOV(ZX) %size:%r1, [%r0]
-                ->fetch_memory( { r1, false }, { r0, true }, { size, false } )
+                ->fetch_memory( out( r1 ), in( r0 ), out( size ) )
                 ->cast<vm_analysis_context*>()
 
                 // MOV %size:[VSP], %r1
-                ->store_vsp( { r1, true }, { size, true } );
+                ->store_vsp( in( r1 ), in( size ) );
 
             if ( !result )
                 return false;
@@ -543,7 +553,8 @@ namespace vmpattack
     inline const vm_instruction_desc str =
     {
         "STR", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_memory_store,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -554,13 +565,13 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
 
                 // MOV [%r0], %s1:%r1
-                ->store_memory( { r0, true }, { r1, true }, { s1, true } );
+                ->store_memory( in( r0 ), in( r1 ), in( s1 ) );
 
             if ( !result )
                 return false;
@@ -588,7 +599,8 @@ namespace vmpattack
     inline const vm_instruction_desc shld =
     {
         "SHLD", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_shld_reg_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -599,16 +611,16 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %size:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { size, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( size ), in( initial_disp ) )
 
                 // MOV(ZX) %size:%r1, [VSP + %size]
-                ->fetch_vsp( { r1, false }, { size, true }, { ( int64_t& )size, true } )
+                ->fetch_vsp( out( r1 ), in( size ), in( ( int64_t& )size ) )
 
                 // MOV(ZX) %shift_size:%r2, [VSP + %last_disp]
-                ->fetch_vsp( { r2, false }, { shift_size, false }, { ( int64_t& )last_disp, false } )
+                ->fetch_vsp( out( r2 ), out( shift_size ), out( ( int64_t& )last_disp ) )
 
                 // SHLD %r0, %r1, %r2
-                ->shld_reg_reg_reg( { r0, true }, { r1, true }, { r2, true } );
+                ->shld_reg_reg_reg( in( r0 ), in( r1 ), in( r2 ) );
 
             if ( !result )
                 return false;
@@ -668,7 +680,8 @@ namespace vmpattack
     inline const vm_instruction_desc shrd =
     {
         "SHRD", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_shrd_reg_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -679,16 +692,16 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %size:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { size, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( size ), in( initial_disp ) )
 
                 // MOV(ZX) %size:%r1, [VSP + %size]
-                ->fetch_vsp( { r1, false }, { size, true }, { ( int64_t& )size, true } )
+                ->fetch_vsp( out( r1 ), in( size ), in( ( int64_t& )size ) )
 
                 // MOV(ZX) %shift_size:%r2, [VSP + %last_disp]
-                ->fetch_vsp( { r2, false }, { shift_size, false }, { ( int64_t& )last_disp, false } )
+                ->fetch_vsp( out( r2 ), out( shift_size ), out( ( int64_t& )last_disp ) )
 
                 // SHRD %r0, %r1, %r2
-                ->shrd_reg_reg_reg( { r0, true }, { r1, true }, { r2, true } );
+                ->shrd_reg_reg_reg( in( r0 ), in( r1 ), in( r2 ) );
 
             if ( !result )
                 return false;
@@ -746,7 +759,8 @@ namespace vmpattack
     inline const vm_instruction_desc shl =
     {
         "SHL", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_shl_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -756,17 +770,17 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
                 ->align( s0 )
                 ->cast<vm_analysis_context*>()
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
                 ->align( s1 )
                 ->cast<vm_analysis_context*>()
 
                 // SHL %r0, %r1
-                ->shl_reg_reg( { r0, true }, { r1, true } );
+                ->shl_reg_reg( in( r0 ), in( r1 ) );
 
             if ( !result )
                 return false;
@@ -814,7 +828,8 @@ namespace vmpattack
     inline const vm_instruction_desc shr =
     {
         "SHR", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_shr_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -824,17 +839,17 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
                 ->align( s0 )
                 ->cast<vm_analysis_context*>()
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
                 ->align( s1 )
                 ->cast<vm_analysis_context*>()
 
                 // SHR %r0, %r1
-                ->shr_reg_reg( { r0, true }, { r1, true } );
+                ->shr_reg_reg( in( r0 ), in( r1 ) );
 
             if ( !result )
                 return false;
@@ -882,7 +897,8 @@ namespace vmpattack
     inline const vm_instruction_desc rdtsc =
     {
         "RDTSC", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_rdtsc,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -909,7 +925,8 @@ namespace vmpattack
     inline const vm_instruction_desc cpuid =
     {
         "CPUID", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_cpuid,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -919,7 +936,7 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV %s0:%r1, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // CPUID
                 ->id( X86_INS_CPUID );
@@ -954,7 +971,8 @@ namespace vmpattack
     inline const vm_instruction_desc pushreg =
     {
         "PUSHREG", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_mov_reg_reg | vm_feature_vsp_store,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -964,10 +982,10 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV %r0, %r1
-                ->mov_reg_reg( { r0, false }, { r1, false } )
+                ->mov_reg_reg( out( r0 ), out( r1 ) )
                 ->cast<vm_analysis_context*>()
                 
-                ->store_vsp( { r0, true }, { s0, true } );
+                ->store_vsp( in( r0 ), in( s0 ) );
 
             if ( !result )
                 return false;
@@ -993,7 +1011,8 @@ namespace vmpattack
     inline const vm_instruction_desc popreg =
     {
         "POPREG", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_mov_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1002,9 +1021,9 @@ namespace vmpattack
             int64_t initial_disp = 0;
 
             auto result = ( &stream_context )
-                ->fetch_vsp( { r0, false }, { s0, true }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), in( s0 ), in( initial_disp ) )
 
-                ->mov_reg_reg( { r1, false }, { r0, true } );
+                ->mov_reg_reg( out( r1 ), in( r0 ) );
 
             if ( !result )
                 return false;
@@ -1030,7 +1049,8 @@ namespace vmpattack
     inline const vm_instruction_desc lockor =
     {
         "LOCKOR", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_or,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1042,10 +1062,10 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV %r0, %s0:[VSP]
-                ->fetch_vsp( { r0, false }, { s0, true }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), in( s0 ), in( initial_disp ) )
 
                 // MOV %r1, %s1:[VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { d1, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( d1 ) )
 
                 // OR [%r0], %r1
                 ->id( X86_INS_OR, &lock_or_ins );
@@ -1084,7 +1104,8 @@ namespace vmpattack
     inline const vm_instruction_desc nop =
     {
         "NOP", 0, vm_instruction_creates_basic_block | vm_instruction_updates_state,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_flow_load,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             analysis_context stream_context = analysis_context( stream );
 
@@ -1093,7 +1114,7 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // LEA %flow_reg, [%rip - {ins_len}]
-                ->set_flow( { flow_reg, true }, { flow_rva, false } );
+                ->set_flow( in( flow_reg ), out( flow_rva ) );
 
             if ( result )
             {
@@ -1116,7 +1137,8 @@ namespace vmpattack
     inline const vm_instruction_desc popf =
     {
         "POPF", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_memory_push | vm_feature_popfq,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1126,7 +1148,7 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // PUSH 8:[VSP]
-                ->push_memory( { stack_reg, true }, { s0, true } )
+                ->push_memory( in( stack_reg ), in( s0 ) )
 
                 // POPFQ
                 ->id( X86_INS_POPFQ );
@@ -1144,7 +1166,8 @@ namespace vmpattack
     inline const vm_instruction_desc div =
     {
         "DIV", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_div_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1155,16 +1178,16 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP + %disp]
-                ->fetch_vsp( { r0, false }, { s0, false }, { disp, false } )
+                ->fetch_vsp( out( r0 ), out( s0 ), out( disp ) )
 
                 // MOV(ZX) %s0:%r1, [VSP]
-                ->fetch_vsp( { r1, false }, { s0, true }, { initial_disp, true } )
+                ->fetch_vsp( out( r1 ), in( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r2, [VSP + %divisor_disp]
-                ->fetch_vsp( { r2, false }, { s1, false }, { divisor_disp, false } )
+                ->fetch_vsp( out( r2 ), out( s1 ), out( divisor_disp ) )
 
                 // DIV %r0, %r1, %r2
-                ->div_reg( { r2, true } );
+                ->div_reg( in( r2 ) );
 
             if ( !result )
                 return false;
@@ -1217,7 +1240,8 @@ namespace vmpattack
     inline const vm_instruction_desc idiv =
     {
         "IDIV", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_idiv_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1228,16 +1252,16 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP + %disp]
-                ->fetch_vsp( { r0, false }, { s0, false }, { disp, false } )
+                ->fetch_vsp( out( r0 ), out( s0 ), out( disp ) )
 
                 // MOV(ZX) %s0:%r1, [VSP]
-                ->fetch_vsp( { r1, false }, { s0, true }, { initial_disp, true } )
+                ->fetch_vsp( out( r1 ), in( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r2, [VSP + %divisor_disp]
-                ->fetch_vsp( { r2, false }, { s1, false }, { divisor_disp, false } )
+                ->fetch_vsp( out( r2 ), out( s1 ), out( divisor_disp ) )
 
                 // IDIV %r0, %r1, %r2
-                ->idiv_reg( { r2, true } );
+                ->idiv_reg( in( r2 ) );
 
             if ( !result )
                 return false;
@@ -1290,7 +1314,8 @@ namespace vmpattack
     inline const vm_instruction_desc mul =
     {
         "MUL", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_mul_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1301,13 +1326,13 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP + %disp]
-                ->fetch_vsp( { r0, false }, { s0, false }, { disp, false } )
+                ->fetch_vsp( out( r0 ), out( s0 ), out( disp ) )
 
                 // MOV(ZX) %s0:%r1, [VSP]
-                ->fetch_vsp( { r1, false }, { s0, true }, { initial_disp, true } )
+                ->fetch_vsp( out( r1 ), in( s0 ), in( initial_disp ) )
 
                 // MUL %r0
-                ->mul_reg( { r1, true } );
+                ->mul_reg( in( r1 ) );
 
             if ( !result )
                 return false;
@@ -1357,7 +1382,8 @@ namespace vmpattack
     inline const vm_instruction_desc imul =
     {
         "IMUL", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_imul_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1368,13 +1394,13 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP + %disp]
-                ->fetch_vsp( { r0, false }, { s0, false }, { disp, false } )
+                ->fetch_vsp( out( r0 ), out( s0 ), out( disp ) )
 
                 // MOV(ZX) %s0:%r1, [VSP]
-                ->fetch_vsp( { r1, false }, { s0, true }, { initial_disp, true } )
+                ->fetch_vsp( out( r1 ), in( s0 ), in( initial_disp ) )
 
                 // IMUL %r0
-                ->imul_reg( { r1, true } );
+                ->imul_reg( in( r1 ) );
 
             if ( !result )
                 return false;
@@ -1428,7 +1454,8 @@ namespace vmpattack
     inline const vm_instruction_desc rcl =
     {
         "RCL", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_rcl_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1438,13 +1465,13 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
 
                 // RCL %r0, %r1
-                ->rcl_reg_reg( { r0, true }, { r1, true } );
+                ->rcl_reg_reg( in( r0 ), in( r1 ) );
 
             if ( !result )
                 return false;
@@ -1503,7 +1530,8 @@ namespace vmpattack
     inline const vm_instruction_desc rcr =
     {
         "RCR", 0, vm_instruction_none,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_rcr_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1513,13 +1541,13 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %s0:%r0, [VSP]
-                ->fetch_vsp( { r0, false }, { s0, false }, { initial_disp, true } )
+                ->fetch_vsp( out( r0 ), out( s0 ), in( initial_disp ) )
 
                 // MOV(ZX) %s1:%r1, [VSP + %s0]
-                ->fetch_vsp( { r1, false }, { s1, false }, { ( int64_t& )s0, true } )
+                ->fetch_vsp( out( r1 ), out( s1 ), in( ( int64_t& )s0 ) )
 
                 // RCR %r0, %r1
-                ->rcr_reg_reg( { r0, true }, { r1, true } );
+                ->rcr_reg_reg( in( r0 ), in( r1 ) );
 
             if ( !result )
                 return false;
@@ -1578,7 +1606,8 @@ namespace vmpattack
     inline const vm_instruction_desc vmexit =
     {
         "VMEXIT", 0, vm_instruction_vmexit,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_mov_reg_reg | vm_feature_ret,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
             vm_analysis_context stream_context = vm_analysis_context( stream, state );
 
@@ -1589,7 +1618,7 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV RSP, VSP
-                ->mov_reg_reg( { rsp, true }, { vsp, true } )
+                ->mov_reg_reg( in( rsp ), in( vsp ) )
 
                 // (n...) POP %reg
                 ->track_register_pops( &info->custom_data.get<std::vector<x86_reg>>(), [&]()
@@ -1627,10 +1656,14 @@ namespace vmpattack
     inline const vm_instruction_desc ret =
     {
         "RET", 0, vm_instruction_branch | vm_instruction_updates_state,
-        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info ) -> bool
+        vm_feature_vsp_load | vm_feature_flow_load | vm_feature_memory_load | vm_feature_movabs | vm_feature_sub_reg_reg | vm_feature_update_reg | vm_feature_xor_reg_reg,
+        []( const vm_state* state, instruction_stream* stream, vm_instruction_info* info, job_arena* arena ) -> bool
         {
-            instruction_stream initial_copied_stream = *stream;
-            vm_analysis_context stream_context = vm_analysis_context( &initial_copied_stream, state );
+            vm_analysis_context stream_context = vm_analysis_context( stream, state );
+
+            // Save the position, as we'll be running multiple queries over the handler.
+            //
+            uint32_t handler_begin = stream_context.mark();
 
             x86_reg reg, flow_reg;
             int64_t initial_disp = 0;
@@ -1641,14 +1674,14 @@ namespace vmpattack
 
             auto result = ( &stream_context )
                 // MOV(ZX) %reg_size:%reg, [VSP + %initial_disp]
-                ->fetch_vsp( { reg, false }, { reg_size, true }, { initial_disp, true } )
+                ->fetch_vsp( out( reg ), in( reg_size ), in( initial_disp ) )
 
                 // TRACK:
                 // MOV/XCHG %reg, %reg
                 ->simple_track_registers( { &stack_reg }, [&]()
                                           {
                                               return ( &stream_context )
-                                                  ->set_flow( { flow_reg, false }, { new_flow_rva, false } );
+                                                  ->set_flow( out( flow_reg ), out( new_flow_rva ) );
                                           } );
 
             if ( !result )
@@ -1656,30 +1689,29 @@ namespace vmpattack
 
             // Now we must determina the new vm_state, starting with the new
             // vip register. We will be looking for different information in
-            // the same span of instructions, so we will have to make a fresh
-            // copy of the instruction stream on each query.
+            // the same span of instructions, so we will have to rewind the
+            // instruction stream before each query. The first one continues
+            // from where the flow update was matched.
             //
             // We can not use vm_analysis_context any more, as the vm_state
             // is not valid until we update it. So we must only use the raw
             // analysis_context, and specify special registers manually.
             //
-            instruction_stream copied_stream = initial_copied_stream;
-            analysis_context post_exec_context = analysis_context( &copied_stream );
+            analysis_context post_exec_context = analysis_context( stream );
 
             x86_reg vip_reg, vip_fetch_reg;
             size_t vip_fetch_size = 4;
 
             result = ( &post_exec_context )
                 // MOV %vip_fetch_size:%vip_fetch-reg, [%vip_reg]
-                ->fetch_memory( { vip_fetch_reg, false }, { vip_reg, false }, { vip_fetch_size, true } );
+                ->fetch_memory( out( vip_fetch_reg ), out( vip_reg ), in( vip_fetch_size ) );
 
             if ( !result )
                 return false;
 
             // Determine new VIP fetch direction and new rolling key register.
             //
-            copied_stream = *stream;
-            post_exec_context = analysis_context( &copied_stream );
+            post_exec_context.rewind( handler_begin );
 
             x86_reg rolling_key_reg;
             x86_insn vip_offset_ins;
@@ -1689,26 +1721,25 @@ namespace vmpattack
 
             result = ( &post_exec_context )
                 // MOV %reloc_reg, 0
-                ->generic_reg_imm( X86_INS_MOVABS, { reloc_reg, false }, { imm, false/*true*/ }, false )
+                ->generic_reg_imm<false>( X86_INS_MOVABS, out( reloc_reg ), out( imm ) )
 
                 // SUB %rolling_key_reg, %reloc_reg
-                ->generic_reg_reg( X86_INS_SUB, { rolling_key_reg, false }, { reloc_reg, true }, false )
+                ->generic_reg_reg<false>( X86_INS_SUB, out( rolling_key_reg ), in( reloc_reg ) )
 
                 // ADD/SUB %vip_reg, %vip_fetch_size
                 //    ^ %vip_offset_ins
-                ->update_reg( { vip_offset_ins, false }, { vip_reg, true }, { vip_fetch_size, true } )
+                ->update_reg( out( vip_offset_ins ), in( vip_reg ), in( vip_fetch_size ) )
                 
                 // XOR %vip_fetch_reg, %rolling_key_reg
-                ->begin_encryption( { vip_fetch_reg, true }, { rolling_key_reg, true } );
+                ->begin_encryption( in( vip_fetch_reg ), in( rolling_key_reg ) );
 
             if ( !result )
                 return false;
 
+            // Leave the stream where it was; the bridge is searched for from the
+            // beginning of the handler.
             //
-            // stream needs to be updated to where the handler ends and bridge begins.
-            // Luckily enough, we just so happen to be exactly there in our original
-            // stream object, after the first template query. So no need to modify anything!
-            //
+            stream_context.rewind( handler_begin );
 
             // Store the updated state as instruction information, for future use.
             //
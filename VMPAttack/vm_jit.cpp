@@ -0,0 +1,398 @@
+#include "vm_jit.hpp"
+#include "vm_handler.hpp"
+#include "arithmetic_operations.hpp"
+#include <cstring>
+#include <initializer_list>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace vmpattack
+{
+    // This class emits the x86-64 machine code of compiled functions.
+    // The emitted code only uses registers that are volatile in both the System V and the
+    // Microsoft x64 calling conventions, so it needs no stack frame:
+    //      r11: the jit_frame.
+    //      r8:  the vip.
+    //      r9:  the rolling key.
+    //      r10: the operand buffer.
+    //      rax: the value being decrypted, whose bits above its size are undefined until size-cast.
+    //      rdx: scratch, for immediates that do not fit in 32 bits.
+    //
+    class code_emitter
+    {
+    private:
+        // The machine code emitted so far.
+        //
+        std::vector<uint8_t> code;
+
+        // Appends raw bytes.
+        //
+        inline void emit( std::initializer_list<uint8_t> bytes )
+        {
+            code.insert( code.end(), bytes );
+        }
+
+        // Appends a little-endian immediate.
+        //
+        template <typename T>
+        inline void emit_immediate( T value )
+        {
+            uint8_t bytes[ sizeof( T ) ];
+            memcpy( bytes, &value, sizeof( T ) );
+
+            code.insert( code.end(), bytes, bytes + sizeof( T ) );
+        }
+
+        // Determines whether the value can be encoded as a sign-extended 32-bit immediate.
+        //
+        static inline bool fits_imm32( uint64_t value )
+        {
+            return ( uint64_t )( int64_t )( int32_t )value == value;
+        }
+
+    public:
+        // Loads the frame, then the vip, rolling key and operand buffer from it.
+        //
+        void prologue()
+        {
+#ifdef _WIN32
+            emit( { 0x49, 0x89, 0xCB } );                   // mov r11, rcx
+#else
+            emit( { 0x49, 0x89, 0xFB } );                   // mov r11, rdi
+#endif
+            emit( { 0x4D, 0x8B, 0x43, 0x00 } );             // mov r8, [r11]
+            emit( { 0x4D, 0x8B, 0x4B, 0x08 } );             // mov r9, [r11 + 8]
+            emit( { 0x4D, 0x8B, 0x53, 0x18 } );             // mov r10, [r11 + 24]
+        }
+
+        // Fetches a value of the size from the vip into rax, zero-extended, and moves the vip past it.
+        // Only sizes of 1, 2, 4 and 8 bytes are supported.
+        //
+        void fetch( size_t size, vm_direction direction )
+        {
+            if ( direction == vm_direction_up )
+                emit( { 0x49, 0x83, 0xE8, ( uint8_t )size } ); // sub r8, size
+
+            switch ( size )
+            {
+                case 1: emit( { 0x41, 0x0F, 0xB6, 0x00 } ); break; // movzx eax, byte ptr [r8]
+                case 2: emit( { 0x41, 0x0F, 0xB7, 0x00 } ); break; // movzx eax, word ptr [r8]
+                case 4: emit( { 0x41, 0x8B, 0x00 } ); break;       // mov eax, [r8]
+                case 8: emit( { 0x49, 0x8B, 0x00 } ); break;       // mov rax, [r8]
+            }
+
+            if ( direction == vm_direction_down )
+                emit( { 0x49, 0x83, 0xC0, ( uint8_t )size } ); // add r8, size
+        }
+
+        // Size-casts rax, zero-extending it from the byte count.
+        //
+        void size_cast( size_t byte_count )
+        {
+            switch ( byte_count )
+            {
+                case 1: emit( { 0x0F, 0xB6, 0xC0 } ); break;       // movzx eax, al
+                case 2: emit( { 0x0F, 0xB7, 0xC0 } ); break;       // movzx eax, ax
+                case 4: emit( { 0x89, 0xC0 } ); break;             // mov eax, eax
+            }
+        }
+
+        // rax ^= rolling key.
+        //
+        void xor_rolling_key()
+        {
+            emit( { 0x4C, 0x31, 0xC8 } );                   // xor rax, r9
+        }
+
+        // rolling key ^= rax.
+        //
+        void update_rolling_key()
+        {
+            emit( { 0x49, 0x31, 0xC1 } );                   // xor r9, rax
+        }
+
+        // rax += value.
+        //
+        void add( uint64_t value )
+        {
+            if ( fits_imm32( value ) )
+            {
+                emit( { 0x48, 0x05 } );                     // add rax, imm32
+                emit_immediate( ( uint32_t )value );
+            }
+            else
+            {
+                emit( { 0x48, 0xBA } );                     // mov rdx, imm64
+                emit_immediate( value );
+                emit( { 0x48, 0x01, 0xD0 } );               // add rax, rdx
+            }
+        }
+
+        // rax ^= value.
+        //
+        void bxor( uint64_t value )
+        {
+            if ( fits_imm32( value ) )
+            {
+                emit( { 0x48, 0x35 } );                     // xor rax, imm32
+                emit_immediate( ( uint32_t )value );
+            }
+            else
+            {
+                emit( { 0x48, 0xBA } );                     // mov rdx, imm64
+                emit_immediate( value );
+                emit( { 0x48, 0x31, 0xD0 } );               // xor rax, rdx
+            }
+        }
+
+        // rax = -rax.
+        //
+        void neg()
+        {
+            emit( { 0x48, 0xF7, 0xD8 } );                   // neg rax
+        }
+
+        // Rotates the low width bytes of rax to the left, zero-extending the result.
+        //
+        void rotate_left( size_t width, uint8_t amount )
+        {
+            switch ( width )
+            {
+                case 8: emit( { 0x48, 0xC1, 0xC0, amount } ); break;  // rol rax, amount
+                case 4: emit( { 0xC1, 0xC0, amount } ); break;        // rol eax, amount
+                case 2: emit( { 0x66, 0xC1, 0xC0, amount } ); break;  // rol ax, amount
+                case 1: emit( { 0xC0, 0xC0, amount } ); break;        // rol al, amount
+            }
+
+            // Rotations of the low word or byte leave the rest of rax as-is.
+            //
+            if ( width < 4 )
+                size_cast( width );
+        }
+
+        // Swaps the bytes of the low width bytes of rax, zero-extending the result.
+        //
+        void byte_swap( size_t width )
+        {
+            switch ( width )
+            {
+                case 8: emit( { 0x48, 0x0F, 0xC8 } ); break;      // bswap rax
+                case 4: emit( { 0x0F, 0xC8 } ); break;            // bswap eax
+                case 2: rotate_left( 2, 8 ); break;
+            }
+        }
+
+        // Stores rax as the operand of the index.
+        //
+        void store_operand( size_t index )
+        {
+            emit( { 0x49, 0x89, 0x82 } );                   // mov [r10 + disp32], rax
+            emit_immediate( ( uint32_t )( index * sizeof( uint64_t ) ) );
+        }
+
+        // Adds the sign-extended low dword of rax to the flow, leaving the new flow in rax.
+        //
+        void advance_flow()
+        {
+            emit( { 0x48, 0x63, 0xC0 } );                   // movsxd rax, eax
+            emit( { 0x49, 0x03, 0x43, 0x10 } );             // add rax, [r11 + 16]
+            emit( { 0x49, 0x89, 0x43, 0x10 } );             // mov [r11 + 16], rax
+        }
+
+        // Stores the vip and rolling key back to the frame, and returns the flow.
+        //
+        void epilogue()
+        {
+            emit( { 0x4D, 0x89, 0x43, 0x00 } );             // mov [r11], r8
+            emit( { 0x4D, 0x89, 0x4B, 0x08 } );             // mov [r11 + 8], r9
+            emit( { 0xC3 } );                               // ret
+        }
+
+        // Getter to the emitted machine code.
+        //
+        inline const std::vector<uint8_t>& get_code() const { return code; }
+    };
+
+    // Emits the folded expression's operations on rax.
+    // Returns false if the expression uses an operation that cannot be compiled.
+    //
+    static bool emit_expression( code_emitter* emitter, const folded_expression& expression )
+    {
+        namespace descriptors = arithmetic_descriptors;
+
+        if ( expression.unfolded )
+            return false;
+
+        for ( size_t i = 0; i < expression.operation_count; i++ )
+        {
+            const folded_operation& operation = expression.operations[ i ];
+
+            switch ( operation.kind )
+            {
+                case folded_add: emitter->add( operation.operand ); break;
+                case folded_xor: emitter->bxor( operation.operand ); break;
+                case folded_neg: emitter->neg(); break;
+                case folded_transform:
+                {
+                    // As in the interpreter, the transform's input is size-cast first.
+                    //
+                    emitter->size_cast( expression.byte_count );
+
+                    bool emitted = false;
+
+                    for ( const arithmetic_operation_desc* rotation : { &descriptors::brol_64, &descriptors::brol_32, &descriptors::brol_16, &descriptors::brol_8 } )
+                    {
+                        if ( operation.transform == rotation->transform )
+                        {
+                            emitter->rotate_left( *rotation->input_size, ( uint8_t )( operation.operand % ( *rotation->input_size * 8 ) ) );
+                            emitted = true;
+                        }
+                    }
+
+                    for ( const arithmetic_operation_desc* byte_swap : { &descriptors::bswap_64, &descriptors::bswap_32, &descriptors::bswap_16 } )
+                    {
+                        if ( operation.transform == byte_swap->transform )
+                        {
+                            emitter->byte_swap( *byte_swap->input_size );
+                            emitted = true;
+                        }
+                    }
+
+                    if ( !emitted )
+                        return false;
+
+                    break;
+                }
+            }
+        }
+
+        emitter->size_cast( expression.byte_count );
+
+        return true;
+    }
+
+    // Destructor. Unmaps the code.
+    //
+    jit_function::~jit_function()
+    {
+#ifdef _WIN32
+        VirtualFree( code, 0, MEM_RELEASE );
+#else
+        munmap( code, size );
+#endif
+    }
+
+    // Construct a jit_function by mapping the machine code as executable, never both writable and executable.
+    // If the operation fails, returns empty {}.
+    //
+    std::optional<std::unique_ptr<jit_function>> jit_function::from_code( const std::vector<uint8_t>& machine_code, size_t fetch_size )
+    {
+        size_t size = machine_code.size();
+
+#ifdef _WIN32
+        void* code = VirtualAlloc( nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+
+        if ( !code )
+            return {};
+
+        memcpy( code, machine_code.data(), size );
+
+        DWORD old_protection;
+        if ( !VirtualProtect( code, size, PAGE_EXECUTE_READ, &old_protection ) )
+        {
+            VirtualFree( code, 0, MEM_RELEASE );
+            return {};
+        }
+
+        FlushInstructionCache( GetCurrentProcess(), code, size );
+#else
+        void* code = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+        if ( code == MAP_FAILED )
+            return {};
+
+        memcpy( code, machine_code.data(), size );
+
+        // Mapping executable pages may be forbidden outright, in which case the interpreter is used.
+        //
+        if ( mprotect( code, size, PROT_READ | PROT_EXEC ) != 0 )
+        {
+            munmap( code, size );
+            return {};
+        }
+#endif
+
+        return std::unique_ptr<jit_function>( new jit_function( code, size, fetch_size ) );
+    }
+
+    // Compiles the decode of the handler's operands followed by the advance over its bridge,
+    // for the specified vip direction.
+    // If the handler cannot be compiled, returns nullptr.
+    //
+    std::unique_ptr<jit_function> vm_jit::compile( const vm_handler* handler, vm_direction direction )
+    {
+        code_emitter emitter;
+        size_t fetch_size = 0;
+
+        // Emits the whole function, mirroring vm_handler::decode then vm_bridge::advance.
+        //
+        auto emit_function = [&]() -> bool
+        {
+            if ( !is_supported() || !handler->bridge )
+                return false;
+
+            emitter.prologue();
+
+            for ( size_t i = 0; i < handler->instruction_info->operands.size(); i++ )
+            {
+                size_t byte_length = handler->instruction_info->operands[ i ].first.byte_length;
+
+                if ( byte_length != 1 && byte_length != 2 && byte_length != 4 && byte_length != 8 )
+                    return false;
+
+                emitter.fetch( byte_length, direction );
+                emitter.xor_rolling_key();
+                emitter.size_cast( byte_length );
+
+                if ( !emit_expression( &emitter, handler->folded_operand_expressions[ i ] ) )
+                    return false;
+
+                emitter.update_rolling_key();
+                emitter.store_operand( i );
+
+                fetch_size += byte_length;
+            }
+
+            emitter.fetch( 4, direction );
+            emitter.xor_rolling_key();
+            emitter.size_cast( 4 );
+
+            if ( !emit_expression( &emitter, handler->bridge->folded_handler_expression ) )
+                return false;
+
+            emitter.size_cast( 4 );
+            emitter.update_rolling_key();
+            emitter.advance_flow();
+            emitter.epilogue();
+
+            fetch_size += 4;
+
+            return true;
+        };
+
+        if ( emit_function() )
+        {
+            if ( auto function = jit_function::from_code( emitter.get_code(), fetch_size ) )
+            {
+                compiled.fetch_add( 1, std::memory_order_relaxed );
+                return std::move( *function );
+            }
+        }
+
+        rejected.fetch_add( 1, std::memory_order_relaxed );
+        return nullptr;
+    }
+}
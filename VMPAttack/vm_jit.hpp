@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+#include "vm_state.hpp"
+
+namespace vmpattack
+{
+    struct vm_handler;
+
+    // This struct describes the context a JIT-compiled function runs on, updated in place.
+    // The layout is relied upon by the emitted code.
+    //
+    struct jit_frame
+    {
+        // The current absolute value of the virtual instruction pointer.
+        //
+        uint64_t vip;
+
+        // The current value of the rolling key.
+        //
+        uint64_t rolling_key;
+
+        // The vm_state's flow.
+        //
+        uint64_t flow;
+
+        // The buffer the decoded operands are written to, in operand order.
+        //
+        uint64_t* operands;
+    };
+
+    // This class owns a natively compiled function, mapped read-only and executable.
+    //
+    class jit_function
+    {
+    public:
+        // The function's signature. Returns the next handler's rva.
+        //
+        using fn_entry = uint64_t( * )( jit_frame* frame );
+
+    private:
+        // The mapped code.
+        //
+        void* code;
+
+        // The size of the mapping, in bytes.
+        //
+        size_t size;
+
+        // The number of bytes the function fetches from the vip stream.
+        //
+        size_t fetch_size;
+
+        jit_function( void* code, size_t size, size_t fetch_size )
+            : code( code ), size( size ), fetch_size( fetch_size )
+        {}
+
+    public:
+        // Cannot be copied or moved, as it owns the mapping.
+        //
+        jit_function( const jit_function& ) = delete;
+        jit_function( jit_function&& ) = delete;
+        jit_function& operator=( const jit_function& ) = delete;
+        jit_function& operator=( jit_function&& ) = delete;
+
+        // Destructor. Unmaps the code.
+        //
+        ~jit_function();
+
+        // Runs the function on the frame.
+        // Returns the next handler's rva.
+        //
+        inline uint64_t operator()( jit_frame* frame ) const
+        {
+            return ( ( fn_entry )code )( frame );
+        }
+
+        // Getter to the number of bytes fetched from the vip stream.
+        //
+        inline size_t get_fetch_size() const { return fetch_size; }
+
+        // Construct a jit_function by mapping the machine code as executable, never both writable and executable.
+        // If the operation fails, returns empty {}.
+        //
+        static std::optional<std::unique_ptr<jit_function>> from_code( const std::vector<uint8_t>& machine_code, size_t fetch_size );
+    };
+
+    // This class compiles the decode and advance of handlers into straight-line native functions,
+    // each fetching, decrypting and folding every operand, then the next handler's offset.
+    // Compilation is opt-in; handlers it does not support are decoded by the interpreter.
+    //
+    class vm_jit
+    {
+    private:
+        // Whether or not handlers are compiled and run natively.
+        //
+        std::atomic<bool> enabled;
+
+        // Whether or not every native run is checked against the interpreter.
+        //
+        std::atomic<bool> self_checking;
+
+        // Statistics.
+        //
+        std::atomic<uint64_t> compiled;
+        std::atomic<uint64_t> rejected;
+        std::atomic<uint64_t> checked;
+
+        vm_jit()
+            : enabled( false ), self_checking( false ), compiled( 0 ), rejected( 0 ), checked( 0 )
+        {}
+
+    public:
+        // Cannot be copied or moved.
+        //
+        vm_jit( const vm_jit& ) = delete;
+        vm_jit( vm_jit&& ) = delete;
+        vm_jit& operator=( const vm_jit& ) = delete;
+        vm_jit& operator=( vm_jit&& ) = delete;
+
+        // Singleton to provide the process-wide JIT instance.
+        //
+        inline static vm_jit& get()
+        {
+            static vm_jit instance;
+
+            return instance;
+        }
+
+        // Determines whether or not the host can run compiled functions.
+        //
+        static constexpr bool is_supported()
+        {
+#if defined( _M_X64 ) || defined( __x86_64__ )
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Enables or disables native decoding. Has no effect if the host is not supported.
+        //
+        inline void set_enabled( bool enable ) { enabled.store( enable && is_supported(), std::memory_order_relaxed ); }
+        inline bool is_enabled() const { return enabled.load( std::memory_order_relaxed ); }
+
+        // Enables or disables the differential self-check of native runs against the interpreter.
+        //
+        inline void set_self_checking( bool enable ) { self_checking.store( enable, std::memory_order_relaxed ); }
+        inline bool is_self_checking() const { return self_checking.load( std::memory_order_relaxed ); }
+
+        // Compiles the decode of the handler's operands followed by the advance over its bridge,
+        // for the specified vip direction.
+        // If the handler cannot be compiled, returns nullptr.
+        //
+        std::unique_ptr<jit_function> compile( const vm_handler* handler, vm_direction direction );
+
+        // Records a native run checked against the interpreter.
+        //
+        inline void record_check() { checked.fetch_add( 1, std::memory_order_relaxed ); }
+
+        // Statistics getters.
+        //
+        inline uint64_t compiled_count() const { return compiled.load( std::memory_order_relaxed ); }
+        inline uint64_t rejected_count() const { return rejected.load( std::memory_order_relaxed ); }
+        inline uint64_t checked_count() const { return checked.load( std::memory_order_relaxed ); }
+    };
+}
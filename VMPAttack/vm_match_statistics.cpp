@@ -0,0 +1,233 @@
+#include "vm_match_statistics.hpp"
+#include "vm_instruction_index.hpp"
+#include <vtil/utility>
+#include <algorithm>
+#include <fstream>
+
+namespace vmpattack
+{
+    // Constructs empty statistics, trying descriptors in instruction set order.
+    //
+    vm_match_statistics::vm_match_statistics()
+        : descriptor_counters{}, matched_handlers( 0 ), order( get_default_descriptor_order() )
+    {}
+
+    // Records a single run of the descriptor's match.
+    //
+    void vm_match_statistics::record_attempt( size_t descriptor_index, bool success, uint64_t instructions, uint64_t nanoseconds )
+    {
+        counters& target = descriptor_counters[ descriptor_index ];
+
+        target.attempts.fetch_add( 1, std::memory_order_relaxed );
+        target.instructions.fetch_add( instructions, std::memory_order_relaxed );
+        target.nanoseconds.fetch_add( nanoseconds, std::memory_order_relaxed );
+
+        if ( success )
+            target.successes.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    // Records that a handler was matched, recomputing the order every reorder_interval handlers.
+    //
+    void vm_match_statistics::record_handler()
+    {
+        if ( ( matched_handlers.fetch_add( 1, std::memory_order_relaxed ) + 1 ) % reorder_interval == 0 )
+            reorder();
+    }
+
+    // Recomputes the order from the counters, by descending hit rate, ie. the share of handlers each
+    // descriptor matched. Ties keep their current relative order, and no descriptor is moved ahead
+    // of any it may shadow.
+    //
+    void vm_match_statistics::reorder()
+    {
+        size_t descriptor_count = vm_instruction_index::get().size();
+
+        // Every descriptor's hit rate shares the same denominator, so the success counts order them.
+        // Snapshot them first, so that the comparison is consistent while sorting.
+        //
+        std::array<uint64_t, 64> successes = {};
+        for ( size_t i = 0; i < descriptor_count; i++ )
+            successes[ i ] = descriptor_counters[ i ].successes.load( std::memory_order_relaxed );
+
+        const std::lock_guard<std::mutex> lock( order_mutex );
+
+        std::stable_sort( order.begin(), order.begin() + descriptor_count, [&]( uint8_t a, uint8_t b ) { return successes[ a ] > successes[ b ]; } );
+
+        // Overlapping descriptors must stay in instruction set order, eg. RET ahead of NOP, as the
+        // first match wins.
+        //
+        vm_instruction_index::get().make_order_safe( order.data() );
+    }
+
+    // Replaces the current order, eg. with a previously saved profile.
+    // No descriptor is moved ahead of any it may shadow.
+    //
+    void vm_match_statistics::set_order( const vm_descriptor_order& new_order )
+    {
+        const std::lock_guard<std::mutex> lock( order_mutex );
+
+        order = new_order;
+
+        vm_instruction_index::get().make_order_safe( order.data() );
+    }
+
+    // Adds the counters of another set of statistics to this one's.
+    //
+    void vm_match_statistics::accumulate( const vm_match_statistics& other )
+    {
+        for ( size_t i = 0; i < descriptor_counters.size(); i++ )
+        {
+            vm_descriptor_counters snapshot = other.get_counters( i );
+
+            descriptor_counters[ i ].attempts.fetch_add( snapshot.attempts, std::memory_order_relaxed );
+            descriptor_counters[ i ].successes.fetch_add( snapshot.successes, std::memory_order_relaxed );
+            descriptor_counters[ i ].instructions.fetch_add( snapshot.instructions, std::memory_order_relaxed );
+            descriptor_counters[ i ].nanoseconds.fetch_add( snapshot.nanoseconds, std::memory_order_relaxed );
+        }
+
+        matched_handlers.fetch_add( other.get_matched_handlers(), std::memory_order_relaxed );
+    }
+
+    // Returns a snapshot of the descriptor's counters.
+    //
+    vm_descriptor_counters vm_match_statistics::get_counters( size_t descriptor_index ) const
+    {
+        const counters& source = descriptor_counters[ descriptor_index ];
+
+        return
+        {
+            source.attempts.load( std::memory_order_relaxed ),
+            source.successes.load( std::memory_order_relaxed ),
+            source.instructions.load( std::memory_order_relaxed ),
+            source.nanoseconds.load( std::memory_order_relaxed )
+        };
+    }
+
+    // Returns a copy of the current order.
+    //
+    vm_descriptor_order vm_match_statistics::get_order() const
+    {
+        const std::lock_guard<std::mutex> lock( order_mutex );
+
+        return order;
+    }
+
+    // Returns the number of handlers matched so far.
+    //
+    uint64_t vm_match_statistics::get_matched_handlers() const
+    {
+        return matched_handlers.load( std::memory_order_relaxed );
+    }
+
+    // Formats the counters of every descriptor into a human-readable table.
+    //
+    std::string vm_match_statistics::dump() const
+    {
+        const vm_instruction_index& index = vm_instruction_index::get();
+
+        uint64_t handlers = get_matched_handlers();
+
+        std::string result = vtil::format::str( "%-10s %10s %10s %8s %12s %12s\r\n", "DESCRIPTOR", "ATTEMPTS", "SUCCESSES", "HIT%", "INSTRUCTIONS", "MICROSECONDS" );
+
+        // List the descriptors in their current order.
+        //
+        vm_descriptor_order current_order = get_order();
+
+        for ( size_t i = 0; i < index.size(); i++ )
+        {
+            uint8_t descriptor_index = current_order[ i ];
+            vm_descriptor_counters snapshot = get_counters( descriptor_index );
+
+            double hit_rate = handlers ? 100.0 * snapshot.successes / handlers : 0.0;
+
+            result += vtil::format::str( "%-10s %10llu %10llu %8.2f %12llu %12llu\r\n",
+                                         index.get_descriptor( descriptor_index )->name.c_str(),
+                                         snapshot.attempts, snapshot.successes, hit_rate,
+                                         snapshot.instructions, snapshot.nanoseconds / 1000 );
+        }
+
+        return result;
+    }
+
+    // Returns the instruction set order.
+    //
+    vm_descriptor_order get_default_descriptor_order()
+    {
+        vm_descriptor_order order = {};
+
+        for ( size_t i = 0; i < order.size(); i++ )
+            order[ i ] = ( uint8_t )i;
+
+        return order;
+    }
+
+    // Loads an ordering profile, consisting of one descriptor name per line, most frequent first.
+    // Unknown names are ignored, and descriptors missing from the profile are appended in
+    // instruction set order.
+    // If the file cannot be read, or the profile lists any descriptor ahead of one it may shadow,
+    // returns empty {}.
+    //
+    std::optional<vm_descriptor_order> load_descriptor_order( const std::string& path )
+    {
+        std::ifstream file( path );
+
+        if ( !file )
+            return {};
+
+        const vm_instruction_index& index = vm_instruction_index::get();
+
+        vm_descriptor_order order = get_default_descriptor_order();
+        uint64_t placed = 0;
+        size_t count = 0;
+
+        std::string line;
+        while ( std::getline( file, line ) )
+        {
+            // Tolerate CRLF line endings.
+            //
+            if ( !line.empty() && line.back() == '\r' )
+                line.pop_back();
+
+            for ( size_t i = 0; i < index.size(); i++ )
+            {
+                if ( index.get_descriptor( i )->name != line || ( placed & ( 1ull << i ) ) )
+                    continue;
+
+                order[ count++ ] = ( uint8_t )i;
+                placed |= 1ull << i;
+                break;
+            }
+        }
+
+        // Append the descriptors the profile does not mention.
+        //
+        for ( size_t i = 0; i < index.size(); i++ )
+            if ( !( placed & ( 1ull << i ) ) )
+                order[ count++ ] = ( uint8_t )i;
+
+        // Reject profiles that would let a descriptor shadow another.
+        //
+        if ( !index.is_order_safe( order.data() ) )
+            return {};
+
+        return order;
+    }
+
+    // Saves an ordering profile in the format read by load_descriptor_order.
+    // Returns whether or not the file was written.
+    //
+    bool save_descriptor_order( const std::string& path, const vm_descriptor_order& order )
+    {
+        std::ofstream file( path, std::ios::trunc );
+
+        if ( !file )
+            return false;
+
+        const vm_instruction_index& index = vm_instruction_index::get();
+
+        for ( size_t i = 0; i < index.size(); i++ )
+            file << index.get_descriptor( order[ i ] )->name << '\n';
+
+        return ( bool )file;
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <optional>
+
+namespace vmpattack
+{
+    // A snapshot of the matching counters of a single descriptor.
+    //
+    struct vm_descriptor_counters
+    {
+        // The number of times the descriptor's match was run.
+        //
+        uint64_t attempts;
+
+        // The number of times the descriptor's match succeeded.
+        //
+        uint64_t successes;
+
+        // The number of instructions stepped over by the descriptor's match, including failed ones.
+        //
+        uint64_t instructions;
+
+        // The time spent in the descriptor's match, in nanoseconds.
+        //
+        uint64_t nanoseconds;
+    };
+
+    // The order in which descriptors are tried, as indices into vm_instruction_index.
+    // Only the first vm_instruction_index::size() entries are meaningful.
+    //
+    using vm_descriptor_order = std::array<uint8_t, 64>;
+
+    // This class records per-descriptor matching statistics, and derives from them the order
+    // in which descriptors should be tried, most frequently matched first.
+    // Descriptors are referred to by their index in vm_instruction_index.
+    // All members are thread-safe.
+    //
+    class vm_match_statistics
+    {
+    private:
+        // The live counters of a single descriptor.
+        //
+        struct counters
+        {
+            std::atomic<uint64_t> attempts;
+            std::atomic<uint64_t> successes;
+            std::atomic<uint64_t> instructions;
+            std::atomic<uint64_t> nanoseconds;
+        };
+
+        // The number of matched handlers after which the order is recomputed.
+        //
+        static constexpr uint64_t reorder_interval = 64;
+
+        // The counters of each descriptor.
+        //
+        std::array<counters, 64> descriptor_counters;
+
+        // The number of handlers matched so far.
+        //
+        std::atomic<uint64_t> matched_handlers;
+
+        // A mutex guarding the order.
+        //
+        mutable std::mutex order_mutex;
+
+        // The order in which descriptors are currently tried.
+        //
+        vm_descriptor_order order;
+
+    public:
+        // Constructs empty statistics, trying descriptors in instruction set order.
+        //
+        vm_match_statistics();
+
+        // Records a single run of the descriptor's match.
+        //
+        void record_attempt( size_t descriptor_index, bool success, uint64_t instructions, uint64_t nanoseconds );
+
+        // Records that a handler was matched, recomputing the order every reorder_interval handlers.
+        //
+        void record_handler();
+
+        // Recomputes the order from the counters, by descending hit rate, ie. the share of handlers each
+        // descriptor matched. Ties keep their current relative order, and no descriptor is moved ahead
+        // of any it may shadow.
+        //
+        void reorder();
+
+        // Replaces the current order, eg. with a previously saved profile.
+        // No descriptor is moved ahead of any it may shadow.
+        //
+        void set_order( const vm_descriptor_order& new_order );
+
+        // Adds the counters of another set of statistics to this one's.
+        //
+        void accumulate( const vm_match_statistics& other );
+
+        // Returns a snapshot of the descriptor's counters.
+        //
+        vm_descriptor_counters get_counters( size_t descriptor_index ) const;
+
+        // Returns a copy of the current order.
+        //
+        vm_descriptor_order get_order() const;
+
+        // Returns the number of handlers matched so far.
+        //
+        uint64_t get_matched_handlers() const;
+
+        // Formats the counters of every descriptor into a human-readable table.
+        //
+        std::string dump() const;
+    };
+
+    // Returns the instruction set order.
+    //
+    vm_descriptor_order get_default_descriptor_order();
+
+    // Loads an ordering profile, consisting of one descriptor name per line, most frequent first.
+    // Unknown names are ignored, and descriptors missing from the profile are appended in
+    // instruction set order.
+    // If the file cannot be read, or the profile lists any descriptor ahead of one it may shadow,
+    // returns empty {}.
+    //
+    std::optional<vm_descriptor_order> load_descriptor_order( const std::string& path );
+
+    // Saves an ordering profile in the format read by load_descriptor_order.
+    // Returns whether or not the file was written.
+    //
+    bool save_descriptor_order( const std::string& path, const vm_descriptor_order& order );
+}
@@ -0,0 +1,186 @@
+#include "vm_shape_cache.hpp"
+#include "vm_instruction_desc.hpp"
+#include <algorithm>
+
+namespace vmpattack
+{
+    // Determines whether the template applies to the handler of the given shape.
+    //
+    bool vm_shape_template::accepts( const handler_shape& shape ) const
+    {
+        if ( shape.tokens.size() < tokens.size() || !std::equal( tokens.begin(), tokens.end(), shape.tokens.begin() ) )
+            return false;
+
+        for ( auto const& [slot, value] : pinned_immediates )
+        {
+            if ( shape.immediates[ slot ] != value )
+                return false;
+        }
+
+        return true;
+    }
+
+    // Re-binds the template's expression constants to the handler of the given shape,
+    // constructing its vm_instruction_info.
+    //
+    std::unique_ptr<vm_instruction_info> vm_shape_template::instantiate( const handler_shape& shape ) const
+    {
+        auto info = std::make_unique<vm_instruction_info>();
+
+        auto slot_it = constant_slots.begin();
+
+        for ( auto const& [operand, expression] : operands )
+        {
+            arithmetic_expression bound_expression = expression;
+
+            for ( arithmetic_operation& operation : bound_expression.operations )
+            {
+                for ( size_t i = 0; i < operation.descriptor->num_additional_operands; i++ )
+                    operation.additional_operands[ i ] = shape.immediates[ *slot_it++ ];
+            }
+
+            info->operands.push_back( { operand, arithmetic_expression::intern( bound_expression ) } );
+        }
+
+        info->sizes = sizes;
+        info->custom_data = custom_data;
+
+        return info;
+    }
+
+    // Abstracts a match of the handler of the given shape, that ended at the given stream position.
+    // If the match cannot be re-bound, ie. the descriptor updates the vm_state, or an expression
+    // constant cannot be attributed to exactly one immediate slot, returns empty {}.
+    //
+    std::optional<vm_shape_template> vm_shape_template::from_match( const handler_shape& shape, const vm_instruction_desc* descriptor, uint32_t match_end, const vm_instruction_info* info )
+    {
+        // The updated state holds registers and addresses that are not part of the shape.
+        //
+        if ( descriptor->flags & vm_instruction_updates_state || info->updated_state )
+            return {};
+
+        // Only the instructions consumed by the match are part of the template. The bridge that follows
+        // holds per-handler constants, which would otherwise be pinned.
+        //
+        size_t consumed = shape.kept_before( match_end );
+        uint32_t consumed_immediates = shape.prefix_immediate_counts[ consumed ];
+
+        std::vector<bool> bound_slots( consumed_immediates );
+
+        vm_shape_template result = { descriptor, { shape.tokens.begin(), shape.tokens.begin() + consumed } };
+
+        for ( auto const& [operand, expression] : info->operands )
+        {
+            for ( const arithmetic_operation& operation : expression->operations )
+            {
+                for ( size_t i = 0; i < operation.descriptor->num_additional_operands; i++ )
+                {
+                    // Expression constants are always taken from an immediate, so a value found in exactly
+                    // one slot must have come from it.
+                    //
+                    std::optional<uint32_t> source_slot;
+
+                    for ( uint32_t slot = 0; slot < consumed_immediates; slot++ )
+                    {
+                        if ( shape.immediates[ slot ] != operation.additional_operands[ i ] )
+                            continue;
+
+                        if ( source_slot )
+                            return {};
+
+                        source_slot = slot;
+                    }
+
+                    if ( !source_slot )
+                        return {};
+
+                    result.constant_slots.push_back( *source_slot );
+                    bound_slots[ *source_slot ] = true;
+                }
+            }
+
+            result.operands.push_back( { operand, *expression } );
+        }
+
+        for ( uint32_t slot = 0; slot < consumed_immediates; slot++ )
+        {
+            if ( !bound_slots[ slot ] )
+                result.pinned_immediates.push_back( { slot, shape.immediates[ slot ] } );
+        }
+
+        result.sizes = info->sizes;
+        result.custom_data = info->custom_data;
+
+        return result;
+    }
+
+    // Looks up a template applying to the handler of the given shape, updating statistics.
+    // If none is cached, returns nullptr.
+    //
+    std::shared_ptr<const vm_shape_template> vm_shape_cache::lookup( const handler_shape& shape )
+    {
+        std::shared_ptr<const vm_shape_template> result = nullptr;
+
+        // Probe each prefix of the handler that a template was cached for, shortest first.
+        //
+        size_t max_length = std::min( shape.prefix_hashes.size(), max_consumed );
+
+        for ( size_t consumed = 0; consumed < max_length; consumed++ )
+        {
+            if ( !( ( consumed_lengths[ consumed / 64 ].load( std::memory_order_relaxed ) >> ( consumed % 64 ) ) & 1 ) )
+                continue;
+
+            bool found = entries.lookup( shape.prefix_hashes[ consumed ], [&]( const auto& templates )
+                                         {
+                                             for ( auto& shape_template : templates )
+                                             {
+                                                 if ( shape_template->accepts( shape ) )
+                                                 {
+                                                     result = shape_template;
+                                                     return true;
+                                                 }
+                                             }
+
+                                             return false;
+                                         } );
+
+            if ( found )
+            {
+                hits.fetch_add( 1, std::memory_order_relaxed );
+                return result;
+            }
+        }
+
+        misses.fetch_add( 1, std::memory_order_relaxed );
+        return nullptr;
+    }
+
+    // Abstracts and caches a match of the handler of the given shape, that ended at the given
+    // stream position. Matches that cannot be re-bound are not cached.
+    //
+    void vm_shape_cache::insert( const handler_shape& shape, const vm_instruction_desc* descriptor, uint32_t match_end, const vm_instruction_info* info )
+    {
+        auto shape_template = vm_shape_template::from_match( shape, descriptor, match_end, info );
+
+        if ( !shape_template || shape_template->tokens.size() >= max_consumed )
+            return;
+
+        size_t consumed = shape_template->tokens.size();
+
+        entries.update( shape.prefix_hashes[ consumed ], [&]( auto& templates )
+                        {
+                            // If another thread cached an applicable template first, keep it.
+                            //
+                            for ( auto& existing : templates )
+                            {
+                                if ( existing->accepts( shape ) )
+                                    return;
+                            }
+
+                            if ( templates.size() < max_templates_per_shape )
+                                templates.push_back( std::make_shared<const vm_shape_template>( std::move( *shape_template ) ) );
+                        } );
+
+        consumed_lengths[ consumed / 64 ].fetch_or( 1ull << ( consumed % 64 ), std::memory_order_relaxed );
+    }
+}
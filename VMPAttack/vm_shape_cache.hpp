@@ -0,0 +1,128 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <vector>
+#include "handler_shape.hpp"
+#include "sharded_cache.hpp"
+#include "vm_instruction_info.hpp"
+
+namespace vmpattack
+{
+    struct vm_instruction_desc;
+
+    // This struct describes the outcome of matching a handler, abstracted over its shape, so
+    // that it can be re-bound to any other handler of the same shape without matching it.
+    //
+    struct vm_shape_template
+    {
+        // The matched descriptor.
+        //
+        const vm_instruction_desc* descriptor;
+
+        // The canonical tokens of the instructions consumed by the match, ie. the bridge that
+        // follows is not part of the template.
+        //
+        std::vector<uint64_t> tokens;
+
+        // The operand layout, with the expression chains recorded for the matched handler.
+        //
+        std::vector<std::pair<vm_operand, arithmetic_expression>> operands;
+
+        // The immediate slot each expression constant is bound to, in order of operand,
+        // operation, and additional operand.
+        //
+        std::vector<uint32_t> constant_slots;
+
+        // The sizes and custom data, copied as-is.
+        //
+        std::vector<size_t> sizes;
+        vtil::variant custom_data;
+
+        // The immediate slots consumed by the match not bound to any expression constant, and their values.
+        // These may have driven the match itself, so they must be equal for the template to apply.
+        //
+        std::vector<std::pair<uint32_t, uint64_t>> pinned_immediates;
+
+        // Determines whether the template applies to the handler of the given shape.
+        //
+        bool accepts( const handler_shape& shape ) const;
+
+        // Re-binds the template's expression constants to the handler of the given shape,
+        // constructing its vm_instruction_info.
+        //
+        std::unique_ptr<vm_instruction_info> instantiate( const handler_shape& shape ) const;
+
+        // Abstracts a match of the handler of the given shape, that ended at the given stream position.
+        // If the match cannot be re-bound, ie. the descriptor updates the vm_state, or an expression
+        // constant cannot be attributed to exactly one immediate slot, returns empty {}.
+        //
+        static std::optional<vm_shape_template> from_match( const handler_shape& shape, const vm_instruction_desc* descriptor, uint32_t match_end, const vm_instruction_info* info );
+    };
+
+    // This class provides a process-wide, thread-safe cache of handler matches, keyed by
+    // the shape of the instructions they consumed.
+    //
+    class vm_shape_cache
+    {
+    private:
+        // The maximum number of templates kept per prefix hash, as the pinned immediates
+        // may differ between handlers of the same shape.
+        //
+        static constexpr size_t max_templates_per_shape = 8;
+
+        // Matches consuming this many kept instructions or more are not cached.
+        //
+        static constexpr size_t max_consumed = 256;
+
+        // The templates, by the hash of the prefix they consumed.
+        //
+        sharded_cache<uint64_t, std::vector<std::shared_ptr<const vm_shape_template>>> entries;
+
+        // The set of consumed lengths any template was cached for, so that lookups only probe those.
+        //
+        std::array<std::atomic<uint64_t>, max_consumed / 64> consumed_lengths;
+
+        // Statistics.
+        //
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+
+        vm_shape_cache()
+            : consumed_lengths{}, hits( 0 ), misses( 0 )
+        {}
+
+    public:
+        // Cannot be copied or moved.
+        //
+        vm_shape_cache( const vm_shape_cache& ) = delete;
+        vm_shape_cache( vm_shape_cache&& ) = delete;
+        vm_shape_cache& operator=( const vm_shape_cache& ) = delete;
+        vm_shape_cache& operator=( vm_shape_cache&& ) = delete;
+
+        // Singleton to provide the process-wide cache instance.
+        //
+        inline static vm_shape_cache& get()
+        {
+            static vm_shape_cache instance;
+
+            return instance;
+        }
+
+        // Looks up a template applying to the handler of the given shape, updating statistics.
+        // If none is cached, returns nullptr.
+        //
+        std::shared_ptr<const vm_shape_template> lookup( const handler_shape& shape );
+
+        // Abstracts and caches a match of the handler of the given shape, that ended at the given
+        // stream position. Matches that cannot be re-bound are not cached.
+        //
+        void insert( const handler_shape& shape, const vm_instruction_desc* descriptor, uint32_t match_end, const vm_instruction_info* info );
+
+        // Statistics getters.
+        //
+        inline uint64_t hit_count() const { return hits.load( std::memory_order_relaxed ); }
+        inline uint64_t miss_count() const { return misses.load( std::memory_order_relaxed ); }
+    };
+}
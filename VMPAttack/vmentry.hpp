@@ -16,6 +16,10 @@ namespace vmpattack
         //
         uint64_t vmentry_rva;
 
+        // The unbased vip the entry stub decrypts to, if already decrypted.
+        //
+        std::optional<uint64_t> vip;
+
         // Constructor.
         //
         lifting_job( uint64_t entry_stub, uint64_t vmentry_rva )
@@ -47,14 +51,15 @@ namespace vmpattack
     struct vmentry_analysis_result
     {
         // Optional instruction that caused the vm-exit.
+        // Non-owning.
         //
-        std::optional<std::shared_ptr<instruction>> exit_instruction;
+        std::optional<const instruction*> exit_instruction;
 
         // The lifting job described by the vmentry stub.
         //
         lifting_job job;
 
-        vmentry_analysis_result( std::shared_ptr<instruction> exit_instruction, lifting_job job )
+        vmentry_analysis_result( const instruction* exit_instruction, lifting_job job )
             : exit_instruction( exit_instruction ), job( job )
         {}
 
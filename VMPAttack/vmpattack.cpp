@@ -1,86 +1,96 @@
 #include "vmpattack.hpp"
 #include "disassembler.hpp"
+#include "thread_pool.hpp"
+#include "image_metadata.hpp"
+#include "junk_filter.hpp"
 #include <vtil/compiler>
 #include <vtil/arch>
 #include <functional> 
 #include <locale>
 #include <algorithm> 
 #include <cctype>
+#include <unordered_set>
 
 //#define VMPATTACK_VERBOSE_1
 
 namespace vmpattack
 {
-    // Attempts to find a vm_instance for the specified rva. If succeeded, returns
-    // said instance. Otherwise returns nullptr.
+    // Looks up the vm_instance at the rva, creating it if not yet cached.
+    // If another thread is creating the same vm_instance, waits for it instead.
+    // Newly created vm_instances are recorded into the database, and harvested if enabled.
+    // If creation fails, returns nullptr.
     //
-    vm_instance* vmpattack::lookup_instance( uint64_t rva )
+    vm_instance* vmpattack::find_or_create_instance( uint64_t rva, job_arena* arena )
     {
-        // Lock the mutex.
-        //
-        const std::lock_guard<std::mutex> lock( instances_mutex );
+        auto [instance, created] = instances.find_or_construct( rva, [&]() -> std::unique_ptr<vm_instance>
+                                                                {
+                                                                    // The VMEntry only needs to be disassembled if the instance is not cached.
+                                                                    //
+                                                                    instruction_buffer instructions = disassembler::get().disassemble( image_base, rva, get_image_end(), disassembler_take_unconditional_imm, arena );
+                                                                    instruction_stream stream = { instructions };
 
-        // Enumerate instances without acquiring them.
-        //
-        for ( auto& instance : instances )
+                                                                    // Try to construct from instruction_stream.
+                                                                    //
+                                                                    auto new_instance = vm_instance::from_instruction_stream( &stream );
+
+                                                                    if ( !new_instance )
+                                                                        return nullptr;
+
+                                                                    // Start off with the profiled descriptor order, if any.
+                                                                    //
+                                                                    if ( profile_order )
+                                                                        ( *new_instance )->get_match_statistics()->set_order( *profile_order );
+
+                                                                    return std::move( *new_instance );
+                                                                } );
+
+        if ( !instance )
+            return nullptr;
+
+        if ( created )
         {
-            // If rva is equal, return a non-owning ptr.
+            // Record the instance, so that the next run does not have to analyze it again.
             //
-            if ( instance->rva == rva )
-                return instance.get();
-        }
+            if ( database )
+                database->append_instance( instance );
 
-        // None found - return nullptr.
-        //
-        return nullptr;
-    }
+            // Pre-discover the instance's handlers, so that lifting does not have to match them one by one.
+            //
+            if ( harvest_on_discovery )
+            {
+                [[maybe_unused]] size_t harvested_count = harvest_handlers( instance );
 
-    // Adds the specified vm_instance to the cached list, exersizing thread-safe behaviour
-    // in doing so.
-    //
-    void vmpattack::add_instance( std::unique_ptr<vm_instance> instance )
-    {
-        // Lock the mutex.
-        //
-        const std::lock_guard<std::mutex> lock( instances_mutex );
+#ifdef VMPATTACK_VERBOSE_0
+                vtil::logger::log<vtil::logger::CON_CYN>( "==> Harvested %llu handlers for VM instance @ RVA 0x%llx\r\n", harvested_count, instance->rva );
+#endif
+            }
+        }
 
-        // Add the instance.
-        //
-        instances.push_back( std::move( instance ) );
+        return instance;
     }
 
     // Performs the specified lifting job, returning a raw, unoptimized vtil routine.
     // Optionally takes in a previous block to fork. If null, creates a new block via a new routine.
     // If the passed previous block is not completed, it is completed with a jmp to the newly created block.
     //
-    std::optional<vtil::routine*> vmpattack::lift_internal( uint64_t rva, uint64_t stub, vtil::basic_block* prev_block )
+    std::optional<vtil::routine*> vmpattack::lift_internal( const lifting_job& job, vtil::basic_block* prev_block, job_arena* arena )
     {
         // First we must either lookup or create the vm_instance.
         //
-        vm_instance* instance = lookup_instance( rva );
-
-        instruction_stream stream = disassembler::get().disassemble( image_base, rva );
+        vm_instance* instance = find_or_create_instance( job.vmentry_rva, arena );
 
+        // If creation failed, return empty {}.
+        //
         if ( !instance )
-        {
-            // Try to construct from instruction_stream.
-            //
-            auto new_instance = vm_instance::from_instruction_stream( &stream );
-
-            // If creation failed, return empty {}.
-            //
-            if ( !new_instance )
-                return {};
-
-            // Otherwise, append vm_instance to cached list and fetch a non-owning ptr.
-            //
-            instance = new_instance->get();
-            add_instance( std::move( *new_instance ) );
-        }
+            return {};
 
-        // Construct the initial vm_context from the vip stub.
+        // Construct the initial vm_context from the vip stub, unless it was already decrypted.
         //
-        std::unique_ptr<vm_context> initial_context = instance->initialize_context( stub, image_base - preferred_image_base );
+        int64_t load_delta = image_base - preferred_image_base;
+
+        std::unique_ptr<vm_context> initial_context = job.vip
+            ? instance->initialize_context_at_vip( *job.vip, load_delta, get_fetch_bounds(), image_base )
+            : instance->initialize_context( job.entry_stub, load_delta, get_fetch_bounds(), image_base );
 
         vtil::basic_block* block = nullptr;
         if ( prev_block )
@@ -120,53 +130,49 @@ namespace vmpattack
             //  ->sub( t0, preferred_image_base )
             ->push( t0 );
 
-        if ( !lift_block( instance, block, initial_context.get(), instance->bridge->advance( initial_context.get() ), {} ) )
+        if ( !lift_block( instance, block, initial_context.get(), instance->bridge->advance( initial_context.get() ), {}, arena ) )
             return {};
 
         return block->owner;
     }
 
-    std::vector<uint8_t> map_image( const vtil::pe_image& image )
+    // Maps the raw image bytes, asserting that they describe a valid PE image.
+    //
+    std::unique_ptr<mapped_image> map_image( const std::vector<uint8_t>& raw_bytes )
     {
-        // Kinda amazing that there's no SizeOfImage in a PE wrapper.......
-        //
-        uint8_t* mapped_buffer = new uint8_t[ 0x10000000 ]();
-
-        // Copy PE headers.
-        // TODO: Fix this hardcoded trash.
-        //
-        memcpy( mapped_buffer, image.cdata(), 0x1000 );
+        auto image = mapped_image::from_buffer( raw_bytes );
 
-        // Copy each section.
-        //
-        for ( const vtil::section_descriptor& section : image )
-        {
-            // Sanity check for potentially broken PEs.
-            //
-            if ( image.raw_bytes.size() >= section.physical_address + section.physical_size )
-                memcpy( &mapped_buffer[ section.virtual_address ], &image.raw_bytes[ section.physical_address ], section.physical_size );
-        }
-
-        // Copy into a vector.
-        //
-        std::vector<uint8_t> mapped_image = { mapped_buffer, mapped_buffer + 0x10000000 };
+        fassert( image && "Failed to map the image. Is it a valid PE?" );
 
-        // Delete the raw buffer.
-        //
-        delete[] mapped_buffer;
-
-        return mapped_image;
+        return std::move( *image );
     }
 
+    // Construct from a mapped image, taking ownership of it.
+    //
+    vmpattack::vmpattack( std::unique_ptr<mapped_image> image ) :
+        image( std::move( image ) ), preferred_image_base( this->image->preferred_base() ), image_base( this->image->base() ), sections( this->image.get() )
+    {}
+
     // Construct from raw image bytes vector.
     //
     vmpattack::vmpattack( const std::vector<uint8_t>& raw_bytes ) :
-        image( raw_bytes ), mapped_image( map_image( image ) ), image_base( ( uint64_t )mapped_image.data() ), preferred_image_base( 0x0000000140000000 )
+        vmpattack( map_image( raw_bytes ) )
     {}
 
+    // Drops any cached instructions decoded from the image, as the mapping is about to be released.
+    //
+    vmpattack::~vmpattack()
+    {
+        if ( image )
+        {
+            junk_filter_cache::get().flush( image->base(), image->base() + image->size() );
+            instruction_cache::get().flush( image->base(), image->base() + image->size() );
+        }
+    }
+
     // Lifts a single basic block, given the appropriate information.
     //
-    bool vmpattack::lift_block( vm_instance* instance, vtil::basic_block* block, vm_context* context, uint64_t first_handler_rva, std::vector<vtil::vip_t> explored_blocks )
+    bool vmpattack::lift_block( vm_instance* instance, vtil::basic_block* block, vm_context* context, uint64_t first_handler_rva, std::vector<vtil::vip_t> explored_blocks, job_arena* arena )
     {
 #ifdef VMPATTACK_VERBOSE_0
         vtil::logger::log<vtil::logger::CON_CYN>( "==> Lifting Basic Block @ VIP RVA 0x%llx and Handler RVA 0x%llx\r\n", context->vip - image_base, first_handler_rva );
@@ -183,36 +189,42 @@ namespace vmpattack
         //
         while ( true )
         {
-            // Try to lookup a cached handler.
+            // Try to lookup a cached handler, constructing it ourselves if there is none.
+            // If another thread is constructing the same handler, wait for it instead.
             //
-            auto handler_lookup = instance->find_handler( current_handler_rva );
-            if ( !handler_lookup )
-            {
-                // No cached handler found; construct it ourselves.
-                //
-                instruction_stream stream = disassembler::get().disassemble( image_base, current_handler_rva );
-                auto handler = vm_handler::from_instruction_stream( context->state.get(), &stream );
+            auto [handler, constructed] = instance->find_or_add_handler( current_handler_rva, [&]() -> std::unique_ptr<vm_handler>
+                                                                         {
+                                                                             // Match against the handler with its junk instructions removed.
+                                                                             //
+                                                                             std::shared_ptr<const instruction_buffer> instructions = junk_filter_cache::get().fetch( image_base, current_handler_rva, get_image_end() );
+                                                                             instruction_stream stream = { *instructions };
+                                                                             auto matched_handler = vm_handler::from_instruction_stream( context->state.get(), &stream, arena, instance->get_match_statistics(), instance->get_bridge_cache() );
 
-                // Assert that we matched a handler.
-                //
-                fassert( handler && "Failed to match handler. Please report this error with the target." );
+                                                                             if ( !matched_handler )
+                                                                                 return nullptr;
+
+                                                                             return std::move( *matched_handler );
+                                                                         } );
+
+            // Assert that we matched a handler.
+            //
+            fassert( handler && "Failed to match handler. Please report this error with the target." );
 
 #ifdef _DEBUG
-                if ( !handler )
-                    __debugbreak();
+            if ( !handler )
+                __debugbreak();
 #endif
-                // Store the non-owning ptr to the handler, and give ownership of the handler
-                // to vm_instance by adding it to its list.
+            current_handler = handler;
+
+            if ( constructed )
+            {
+                // Record the handler, so that the next run does not have to match it again.
                 //
-                current_handler = handler->get();
-                instance->add_handler( std::move( *handler ) );
+                if ( database )
+                    database->append_handler( instance->rva, current_handler );
             }
             else
             {
-                // Fetch the cached handler.
-                //
-                current_handler = *handler_lookup;
-
                 // We much update the VM state manually if nessecary, as we are fetching a cached handler.
                 //
                 if ( current_handler->descriptor->flags & vm_instruction_updates_state && current_handler->instruction_info->updated_state )
@@ -224,8 +236,13 @@ namespace vmpattack
             uint64_t prev_rolling_key = context->rolling_key;
 
             // Decode the current handler using the context, advancing it.
+            // Handlers whose lifting does not depend on the context after decoding are advanced
+            // over their bridge at the same time.
             //
-            vm_instruction decoded_instruction = current_handler->decode( context );
+            std::optional<uint64_t> next_handler_rva;
+            vm_instruction decoded_instruction = current_handler->descriptor->flags & ( vm_instruction_vmexit | vm_instruction_branch | vm_instruction_creates_basic_block )
+                ? current_handler->decode( context )
+                : current_handler->decode_and_advance( context, &next_handler_rva.emplace() );
 
             std::string vmp_il_text = vtil::format::str( "0x%016x | 0x%016x | 0x%016x | %s", context->vip - preferred_image_base, current_handler_rva, prev_rolling_key, decoded_instruction.to_string().c_str() );
 
@@ -307,9 +324,9 @@ namespace vmpattack
 
                                 // Emit the instruction.
                                 //
-                                std::shared_ptr<instruction>& exit_instruction = *analysis->exit_instruction;
-                                for ( int i = 0; i < exit_instruction->ins.size; i++ )
-                                    block->vemit( exit_instruction->ins.bytes[ i ] );
+                                const instruction* exit_instruction = *analysis->exit_instruction;
+                                for ( int i = 0; i < exit_instruction->size; i++ )
+                                    block->vemit( exit_instruction->bytes[ i ] );
 
                                 // Pin any registers written.
                                 //
@@ -319,7 +336,7 @@ namespace vmpattack
 
                             // Continue lifting via the current basic block.
                             //
-                            lift_internal( analysis->job.vmentry_rva, analysis->job.entry_stub, block );
+                            lift_internal( analysis->job, block, arena );
                             return true;
                         }
                     }
@@ -362,7 +379,7 @@ namespace vmpattack
                         // So we emit a VXCALL, and continue lifting via the current basic block.
                         //
                         block->vxcall( t0 );
-                        lift_internal( analysis->job.vmentry_rva, analysis->job.entry_stub, block );
+                        lift_internal( analysis->job, block, arena );
 
                         return true;
                     }
@@ -432,7 +449,7 @@ namespace vmpattack
                             // by creating a new vm_state.
                             // The new branch's initial rolling key is its initial non-relocated vip.
                             // 
-                            vm_context branch_context = { std::make_unique<vm_state>( *context->state ), branch_rva + preferred_image_base, branch_rva + image_base };
+                            vm_context branch_context = { std::make_unique<vm_state>( *context->state ), branch_rva + preferred_image_base, branch_rva + image_base, get_fetch_bounds(), image_base };
 
                             // Update the newly-created context with the handler's bridge, to resolve the first
                             // handler's rva.
@@ -442,7 +459,7 @@ namespace vmpattack
                             // Recursively lift the next block.
                             // TODO: Multi-thread this part!
                             //
-                            lift_block( instance, next_block, &branch_context, branch_first_handler_rva, explored_blocks );
+                            lift_block( instance, next_block, &branch_context, branch_first_handler_rva, explored_blocks, arena );
                         }
                     }
                 }
@@ -476,12 +493,12 @@ namespace vmpattack
                     // Continue lifting via the newly created block.
                     // Use the current context as we are not changing control flow.
                     //
-                    return lift_block( instance, new_block, context, current_handler->bridge->advance( context ), explored_blocks );
+                    return lift_block( instance, new_block, context, current_handler->bridge->advance( context ), explored_blocks, arena );
                 }
                 break;
             }
 
-            current_handler_rva = current_handler->bridge->advance( context );
+            current_handler_rva = next_handler_rva ? *next_handler_rva : current_handler->bridge->advance( context );
         }
 
         return true;
@@ -495,16 +512,66 @@ namespace vmpattack
         vtil::logger::log<vtil::logger::CON_CYN>( "=> Began Lifting Job for RVA 0x%llx with stub 0x%llx\r\n", job.vmentry_rva, job.entry_stub );
 #endif
 
-        return lift_internal( job.vmentry_rva, job.entry_stub, nullptr );
+        // All temporaries created during the job are owned by its arena, and freed at once when it ends.
+        //
+        job_arena arena;
+
+        return lift_internal( job, nullptr, &arena );
+    }
+
+    // Creates the vm_instances of the scanned lifting jobs, and decrypts all of their entry stubs
+    // up front, in a single batch per vm_instance.
+    // Jobs whose vm_instance cannot be created are left as is.
+    //
+    void vmpattack::prepare_jobs( std::vector<scan_result>& results )
+    {
+        job_arena arena;
+
+        // Group the jobs by vm_instance.
+        //
+        std::vector<lifting_job*> jobs;
+        for ( scan_result& result : results )
+            jobs.push_back( &result.job );
+
+        std::stable_sort( jobs.begin(), jobs.end(), []( const lifting_job* a, const lifting_job* b ) { return a->vmentry_rva < b->vmentry_rva; } );
+
+        std::vector<uint64_t> vips;
+
+        for ( size_t begin = 0, end = 0; begin < jobs.size(); begin = end )
+        {
+            uint64_t vmentry_rva = jobs[ begin ]->vmentry_rva;
+
+            for ( end = begin; end < jobs.size() && jobs[ end ]->vmentry_rva == vmentry_rva; end++ );
+
+            vm_instance* instance = find_or_create_instance( vmentry_rva, &arena );
+
+            if ( !instance )
+                continue;
+
+            vips.clear();
+            for ( size_t i = begin; i < end; i++ )
+                vips.push_back( jobs[ i ]->entry_stub );
+
+            instance->decrypt_entry_stubs( vips, vips );
+
+            for ( size_t i = begin; i < end; i++ )
+                jobs[ i ]->vip = vips[ i - begin ];
+        }
     }
 
     // Performs an analysis on the specified vmentry stub rva, returning relevant information.
     //
     std::optional<vmentry_analysis_result> vmpattack::analyze_entry_stub( uint64_t rva ) const
     {
+        // The stub must lie within executable code of the image. This also rejects the bogus
+        // rvas resolved from VMEXIT destinations and return addresses.
+        //
+        if ( image && !sections.is_executable( rva ) )
+            return {};
+
         // Disassemble at the specified rva, stopping at any branch.
         //
-        instruction_stream stream = disassembler::get().disassemble( image_base, rva, disassembler_none );
+        instruction_buffer instructions = disassembler::get().disassemble( image_base, rva, get_image_end(), disassembler_none );
 
         // TODO: Verify this is correct.
         // In VMProtect 3, only one instruction can cause a vm exit at any single time.
@@ -518,20 +585,20 @@ namespace vmpattack
 
         // Check size validity.
         //
-        if ( stream.instructions.size() > 3 || stream.instructions.size() < 2 )
+        if ( instructions.size() > 3 || instructions.size() < 2 )
             return {};
 
-        std::shared_ptr<instruction> call_ins = stream.instructions[ stream.instructions.size() - 1 ];
-        std::shared_ptr<instruction> push_ins = stream.instructions[ stream.instructions.size() - 2 ];
+        const instruction* call_ins = instructions[ instructions.size() - 1 ];
+        const instruction* push_ins = instructions[ instructions.size() - 2 ];
 
         // Check if call is valid.
         //
-        if ( call_ins->ins.id != X86_INS_CALL || call_ins->operand_type( 0 ) != X86_OP_IMM )
+        if ( call_ins->id != X86_INS_CALL || call_ins->operand_type( 0 ) != X86_OP_IMM )
             return {};
 
         // Check if stub push is valid.
         //
-        if ( push_ins->ins.id != X86_INS_PUSH || push_ins->operand_type( 0 ) != X86_OP_IMM )
+        if ( push_ins->id != X86_INS_PUSH || push_ins->operand_type( 0 ) != X86_OP_IMM )
             return {};
 
         uint64_t entry_stub = push_ins->operand( 0 ).imm;
@@ -539,8 +606,8 @@ namespace vmpattack
 
         // If there's an instruction that caused the VMExit, include it in the analysis data.
         //
-        if ( stream.instructions.size() == 3 )
-            return vmentry_analysis_result { stream.instructions[ 0 ], { entry_stub, vmentry_rva } };
+        if ( instructions.size() == 3 )
+            return vmentry_analysis_result { instructions[ 0 ], { entry_stub, vmentry_rva } };
 
         return vmentry_analysis_result{ { entry_stub, vmentry_rva } };
     }
@@ -552,71 +619,318 @@ namespace vmpattack
         return std::string( name.c_str() );
     };
 
-    // Scans the given instruction vector for VM entries.
+    // Scans the given rva range for VM entries, via their byte signature.
     // Returns a list of results, of [root rva, lifting_job]
     //
-    std::vector<scan_result> vmpattack::scan_for_vmentry( const std::vector<std::unique_ptr<instruction>>& instructions ) const
+    std::vector<scan_result> vmpattack::scan_for_vmentry( uint64_t begin_rva, uint64_t end_rva ) const
     {
         std::vector<scan_result> results = {};
 
-        std::vector<vtil::section_descriptor> potential_vmp_sections = {};
+        // Find all JMP rel32 instructions into a PUSH / CALL stub within a VMP section, directly
+        // in the mapped bytes. Only these survivors are disassembled and analyzed.
+        //
+        std::vector<uint64_t> candidates = find_vmentry_candidates( image->data(), image->size(), begin_rva, end_rva, sections.get_vmp_candidate_ranges() );
+
+        for ( uint64_t rva : candidates )
+        {
+            // Materialize the full instruction for the candidate, making sure it is indeed a JMP IMM.
+            // Candidates are only looked at once, so they are kept out of the instruction cache.
+            //
+            std::optional<instruction> instruction = disassembler::get().decode_uncached( image_base, rva, end_rva - rva );
+
+            if ( !instruction || !instruction->is_uncond_jmp() || instruction->operand( 0 ).type != X86_OP_IMM )
+                continue;
+
+            // Try to analyze the address to verify that it is indeed a VMENTRY stub.
+            //
+            if ( std::optional<vmentry_analysis_result> analysis_result = analyze_entry_stub( instruction->operand( 0 ).imm ) )
+            {
+                // Only accept stubs with no exit instructions.
+                // Even though this should never really happen, just use this sanity check here for good measure.
+                //
+                if ( !analysis_result->exit_instruction )
+                    results.push_back( { instruction->address, analysis_result->job } );
+            }
+        }
+
+        // Return the accumulated scan results.
+        //
+        return results;
+    }
+
+    // Scans the given rva ranges for VM entries in parallel, splitting them into overlapping chunks,
+    // and batching small ones together.
+    // Returns a list of results, of [root rva, lifting_job], deduplicated and sorted by rva.
+    //
+    std::vector<scan_result> vmpattack::scan_for_vmentry( const std::vector<rva_range>& ranges ) const
+    {
+        // The size of a single chunk, and how far past its end each chunk is scanned.
+        // The overlap must be at least the maximum instruction length so that no instruction
+        // straddling a chunk boundary is missed.
+        //
+        const uint64_t chunk_size = 0x100000;
+        const uint64_t chunk_overlap = 16;
 
-        // Lambda to determine whether the given section name is potentially a VMP section.
+        // Split each range into chunks, and group consecutive chunks into batches of at least a chunk's
+        // worth of code, so that the many small function ranges of a guided scan do not each become
+        // a task of their own.
         //
-        auto is_vmp_section = []( const std::string& section_name ) -> bool
+        std::vector<std::vector<rva_range>> batches = {};
+        uint64_t batch_size = 0;
+
+        for ( const rva_range& range : ranges )
         {
-            return section_name.ends_with( "0" ) || section_name.ends_with( "1" );
-        };
+            for ( uint64_t chunk_begin = range.begin; chunk_begin < range.end; chunk_begin += chunk_size )
+            {
+                uint64_t chunk_end = std::min<uint64_t>( chunk_begin + chunk_size + chunk_overlap, range.end );
+
+                if ( batches.empty() || batch_size >= chunk_size )
+                {
+                    batches.emplace_back();
+                    batch_size = 0;
+                }
+
+                batches.back().push_back( { chunk_begin, chunk_end } );
+                batch_size += chunk_end - chunk_begin;
+            }
+        }
+
+        // Scan each batch on the pool. Each worker uses its own thread-local disassembler.
+        //
+        std::vector<std::future<std::vector<scan_result>>> chunk_results;
+
+        for ( std::vector<rva_range>& batch : batches )
+        {
+            chunk_results.push_back( thread_pool::get().enqueue( [this, batch = std::move( batch )]()
+                                                                 {
+                                                                     std::vector<scan_result> batch_results = {};
+
+                                                                     for ( const rva_range& chunk : batch )
+                                                                     {
+                                                                         std::vector<scan_result> chunk_result = scan_for_vmentry( chunk.begin, chunk.end );
+                                                                         batch_results.insert( batch_results.end(), chunk_result.begin(), chunk_result.end() );
+                                                                     }
+
+                                                                     return batch_results;
+                                                                 } ) );
+        }
 
-        // Lambda to determine whether the given rva is within any of the potential VMP sections.
+        // Merge the results of all chunks.
         //
-        auto within_potential_vmp_sections = [&]( uint64_t rva ) -> bool
+        std::vector<scan_result> results = {};
+
+        for ( auto& chunk_result : chunk_results )
         {
-            auto [rva_section, rva_section_size] = image.rva_to_section( rva );
+            std::vector<scan_result> chunk = chunk_result.get();
+            results.insert( results.end(), chunk.begin(), chunk.end() );
+        }
 
-            for ( const vtil::section_descriptor& section : potential_vmp_sections )
-                if ( rva_section.name == section.name )
-                    return true;
+        // Sort by rva, and drop the duplicates found in the overlapping parts of the chunks, so
+        // that the results do not depend on the chunking or scheduling.
+        //
+        std::sort( results.begin(), results.end(), []( const scan_result& a, const scan_result& b ) { return a.rva < b.rva; } );
+        results.erase( std::unique( results.begin(), results.end(), []( const scan_result& a, const scan_result& b ) { return a.rva == b.rva; } ), results.end() );
 
-            return false;
-        };
+        return results;
+    }
 
-        // Enumerate all sections.
+    // Sweeps the given rva range for potential handler entry points, ie. instructions immediately
+    // following one that ends the control flow, whose flow ends in a bridge-shaped tail.
+    // Returns the candidate rvas, in ascending order.
+    //
+    std::vector<uint64_t> vmpattack::find_handler_candidates( uint64_t begin_rva, uint64_t end_rva ) const
+    {
+        // The maximum number of instructions followed from a candidate before giving up on it.
         //
-        for ( const vtil::section_descriptor& section : image )
-            if ( is_vmp_section( sanitize_section_name( section.name ) ) )
-                potential_vmp_sections.push_back( section );
+        const size_t max_handler_length = 1024;
 
-        // Iterate through each instruction.
+        // Handlers are laid out back to back, so they begin right after the RET or JMP that ends
+        // the previous handler, or a piece of it. Only instruction ids are needed to find these.
         //
-        for ( const std::unique_ptr<instruction>& instruction : instructions )
+        std::vector<uint64_t> entry_points = {};
+        bool flow_ended = false;
+
+        disassembler::get_sweep().sweep( image_base, begin_rva, end_rva, [&]( uint64_t rva, x86_insn id )
+                                         {
+                                             if ( flow_ended )
+                                                 entry_points.push_back( rva );
+
+                                             flow_ended = id == X86_INS_RET || id == X86_INS_JMP;
+                                         } );
+
+        std::vector<uint64_t> candidates = {};
+
+        for ( uint64_t entry_point : entry_points )
         {
-            // If instruction is JMP IMM, follow it.
+            // Follow the flow as the handler disassembly would, but never past executable code, as
+            // the sweep may have lost sync and the unconditional jumps may lead anywhere.
+            // Most candidates are not handlers, so they are kept out of the instruction cache.
             //
-            if ( instruction->is_uncond_jmp() && instruction->operand( 0 ).type == X86_OP_IMM )
+            uint64_t rva = entry_point;
+            bool previous_pushes_register = false;
+
+            for ( size_t i = 0; i < max_handler_length; i++ )
             {
-                // Is the potential stub within a VMP section?
+                const section_range* section = sections.lookup( rva );
+
+                if ( !section || !( section->flags & section_flag_execute ) )
+                    break;
+
+                std::optional<instruction> instruction = disassembler::get().decode_uncached( image_base, rva, section->end - rva );
+
+                if ( !instruction )
+                    break;
+
+                rva += instruction->size;
+
+                if ( instruction->is_uncond_jmp() && instruction->operand( 0 ).type == X86_OP_IMM )
+                {
+                    rva = instruction->operand( 0 ).imm;
+                    continue;
+                }
+
+                // Bridges always end by pushing the next handler's address and returning to it. Any
+                // other end of the flow cannot be a handler.
                 //
-                uint64_t potential_vmentry_rva = instruction->operand( 0 ).imm;
-                if ( within_potential_vmp_sections( potential_vmentry_rva ) )
+                if ( instruction->id == X86_INS_RET )
                 {
-                    // Try to analyze the address to verify that it is indeed a VMENTRY stub.
-                    //
-                    if ( std::optional<vmentry_analysis_result> analysis_result = analyze_entry_stub( potential_vmentry_rva ) )
-                    {
-                        // Only accept stubs with no exit instructions.
-                        // Even though this should never really happen, just use this sanity check here for good measure.
-                        //
-                        if ( !analysis_result->exit_instruction )
-                            results.push_back( { instruction->ins.address, analysis_result->job } );
-                    }
+                    if ( previous_pushes_register )
+                        candidates.push_back( entry_point );
+
+                    break;
                 }
+
+                if ( instruction->is_branch() || instruction->id == X86_INS_CALL )
+                    break;
+
+                previous_pushes_register = instruction->id == X86_INS_PUSH && instruction->operand_type( 0 ) == X86_OP_REG;
             }
         }
 
-        // Return the accumulated scan results.
+        return candidates;
+    }
+
+    // Speculatively matches the handlers of the vm_instance at the given candidate rvas, from its initial vm_state.
+    // Returns the handlers that matched and can safely be cached.
+    //
+    std::vector<std::unique_ptr<vm_handler>> vmpattack::harvest_candidates( vm_instance* instance, const std::vector<uint64_t>& candidates ) const
+    {
+        std::vector<std::unique_ptr<vm_handler>> harvested_handlers = {};
+
+        job_arena arena;
+
+        for ( uint64_t candidate : candidates )
+        {
+            // Each candidate is matched from a fresh copy of the initial state, as the candidates are
+            // unrelated to each other.
+            //
+            vm_state state = *instance->get_initial_state();
+
+            std::shared_ptr<const instruction_buffer> instructions = junk_filter_cache::get().fetch( image_base, candidate, get_image_end() );
+            instruction_stream stream = { *instructions };
+
+            // No statistics are passed, as speculative matches say nothing about the instance's actual handlers.
+            //
+            auto handler = vm_handler::from_instruction_stream( &state, &stream, &arena, nullptr, instance->get_bridge_cache() );
+
+            if ( !handler )
+                continue;
+
+            // Handlers that update the vm_state, or exit the VM, are only ever matched lazily, in the
+            // state they are actually reached in, as neither can be verified by their bridge.
+            //
+            if ( ( *handler )->descriptor->flags & ( vm_instruction_updates_state | vm_instruction_vmexit ) )
+                continue;
+
+            harvested_handlers.push_back( std::move( *handler ) );
+        }
+
+        return harvested_handlers;
+    }
+
+    // Pre-discovers the handlers of the vm_instance by matching all candidates within the VMP sections
+    // in parallel, adding every handler found to the instance.
+    // Returns the number of handlers added.
+    //
+    size_t vmpattack::harvest_handlers( vm_instance* instance )
+    {
+        // Without an owned image, there are no sections to harvest from.
         //
-        return results;
+        if ( !image )
+            return 0;
+
+        // The same chunking as the VM entry scan is used, and candidates are matched in small
+        // batches so that expensive handlers are spread across the pool.
+        //
+        const uint64_t chunk_size = 0x100000;
+        const uint64_t chunk_overlap = 16;
+        const size_t batch_size = 64;
+
+        std::vector<std::future<std::vector<uint64_t>>> chunk_candidates;
+
+        for ( const rva_range& range : sections.get_vmp_candidate_ranges() )
+        {
+            for ( uint64_t chunk_begin = range.begin; chunk_begin < range.end; chunk_begin += chunk_size )
+            {
+                uint64_t chunk_end = std::min<uint64_t>( chunk_begin + chunk_size + chunk_overlap, range.end );
+
+                chunk_candidates.push_back( thread_pool::get().enqueue( [this, chunk_begin, chunk_end]()
+                                                                        {
+                                                                            return find_handler_candidates( chunk_begin, chunk_end );
+                                                                        } ) );
+            }
+        }
+
+        // Merge the candidates of all chunks, dropping duplicates from the overlaps and any handler
+        // that is already known.
+        //
+        std::vector<uint64_t> candidates = {};
+
+        for ( auto& chunk_result : chunk_candidates )
+        {
+            std::vector<uint64_t> chunk = chunk_result.get();
+            candidates.insert( candidates.end(), chunk.begin(), chunk.end() );
+        }
+
+        std::sort( candidates.begin(), candidates.end() );
+        candidates.erase( std::unique( candidates.begin(), candidates.end() ), candidates.end() );
+        candidates.erase( std::remove_if( candidates.begin(), candidates.end(), [&]( uint64_t rva ) { return instance->find_handler( rva ).has_value(); } ), candidates.end() );
+
+        std::vector<std::future<std::vector<std::unique_ptr<vm_handler>>>> batch_results;
+
+        for ( size_t i = 0; i < candidates.size(); i += batch_size )
+        {
+            std::vector<uint64_t> batch( candidates.begin() + i, candidates.begin() + std::min( i + batch_size, candidates.size() ) );
+
+            batch_results.push_back( thread_pool::get().enqueue( [this, instance, batch = std::move( batch )]()
+                                                                 {
+                                                                     return harvest_candidates( instance, batch );
+                                                                 } ) );
+        }
+
+        // Add the handlers in candidate order, so that the handler table does not depend on scheduling.
+        //
+        size_t harvested_count = 0;
+
+        for ( auto& batch_result : batch_results )
+        {
+            for ( auto& handler : batch_result.get() )
+            {
+                // The handler may have been reached by a concurrent lift meanwhile, in which case it is dropped.
+                //
+                vm_handler* harvested_handler = handler.get();
+
+                if ( !instance->add_handler( std::move( handler ) ) )
+                    continue;
+
+                if ( database )
+                    database->append_handler( instance->rva, harvested_handler );
+
+                harvested_count++;
+            }
+        }
+
+        return harvested_count;
     }
 
     // Scans the given code section for VM entries.
@@ -624,17 +938,17 @@ namespace vmpattack
     //
     std::vector<scan_result> vmpattack::scan_for_vmentry( const std::string& section_name ) const
     {
-        std::optional<vtil::section_descriptor> target_section = {};
+        const image_section* target_section = nullptr;
 
         std::string sanitized_section_name = sanitize_section_name( section_name );
 
         // Find target section.
         //
-        for ( const vtil::section_descriptor& section : image )
+        for ( const image_section& section : image->get_sections() )
         {
             if ( sanitize_section_name( section.name ) == sanitized_section_name )
             {
-                target_section = section;
+                target_section = &section;
                 break;
             }
         }
@@ -644,13 +958,9 @@ namespace vmpattack
         if ( !target_section )
             return {};
 
-        // Get a vector of instructions in the .text section, starting from the very beginning.
-        //
-        std::vector<std::unique_ptr<instruction>> text_instructions = disassembler::get().disassembly_simple( image_base, target_section->virtual_address, target_section->virtual_address + target_section->virtual_size );
-
-        // Scan the retrieved instructions.
+        // Scan the section, starting from the very beginning.
         //
-        return scan_for_vmentry( text_instructions );
+        return scan_for_vmentry( std::vector<rva_range>{ { target_section->virtual_address, target_section->virtual_address + target_section->virtual_size } } );
     }
 
     // Scans all executable sections for VM entries.
@@ -658,25 +968,174 @@ namespace vmpattack
     //
     std::vector<scan_result> vmpattack::scan_for_vmentry() const
     {
-        std::vector<scan_result> results = {};
+        std::vector<rva_range> ranges = {};
 
         // Enumerate all sections.
         //
-        for ( const vtil::section_descriptor& section : image )
+        for ( const image_section& section : image->get_sections() )
         {
+            // Scan the section, starting from the very beginning.
+            //
             if ( section.execute )
+                ranges.push_back( { section.virtual_address, section.virtual_address + section.virtual_size } );
+        }
+
+        return scan_for_vmentry( ranges );
+    }
+
+    // Scans only the code the image's metadata describes for VM entries: the function bodies
+    // from the exception directory, and the code reachable from the entry point, exports and
+    // TLS callbacks. Relocation, import and IAT ranges are never treated as code.
+    // Images other than AMD64 PE32+ are scanned in all executable sections instead.
+    // Returns a list of results, of [root rva, lifting_job]
+    //
+    std::vector<scan_result> vmpattack::scan_for_vmentry_guided() const
+    {
+        // The exception directory is only laid out as x64 RUNTIME_FUNCTIONs in AMD64 PE32+ images.
+        // Fall back to the linear sweep for any other.
+        //
+        if ( image->get_machine() != image_machine_amd64 || !image->is_pe32_plus() )
+            return scan_for_vmentry();
+
+        image_metadata metadata = image_metadata::from_image( image.get() );
+
+        // Every function body from the exception directory is code.
+        //
+        std::vector<rva_range> code_ranges = metadata.functions;
+
+        // Leaf functions have no unwind information, so follow the control flow from each seed,
+        // decoding linearly until the flow ends. Direct branch targets are queued as new seeds,
+        // unless they are already known to be code, or lie within a VMP section.
+        //
+        std::vector<uint64_t> pending_seeds = metadata.entry_points;
+        std::unordered_set<uint64_t> visited_seeds = {};
+
+        while ( !pending_seeds.empty() )
+        {
+            uint64_t seed = pending_seeds.back();
+            pending_seeds.pop_back();
+
+            if ( !visited_seeds.insert( seed ).second
+                 || ranges_contain( metadata.functions, seed )
+                 || ranges_contain( metadata.data_ranges, seed )
+                 || sections.is_vmp_candidate( seed )
+                 || !sections.is_executable( seed ) )
+                continue;
+
+            const section_range* section = sections.lookup( seed );
+
+            uint64_t rva = seed;
+
+            // Every reachable instruction of the image is decoded here, once, so keep them out of the
+            // instruction cache.
+            //
+            while ( rva < section->end && !ranges_contain( metadata.data_ranges, rva ) )
             {
-                // Get a vector of instructions in the .text section, starting from the very beginning.
+                std::optional<instruction> instruction = disassembler::get().decode_uncached( image_base, rva, section->end - rva );
+
+                if ( !instruction )
+                    break;
+
+                rva += instruction->size;
+
+                // Queue the target of any direct branch or call.
                 //
-                std::vector<std::unique_ptr<instruction>> text_instructions = disassembler::get().disassembly_simple( image_base, section.virtual_address, section.virtual_address + section.virtual_size );
+                if ( ( instruction->is_branch() || instruction->id == X86_INS_CALL ) && instruction->operand_count() == 1 && instruction->operand_type( 0 ) == X86_OP_IMM )
+                    pending_seeds.push_back( instruction->operand( 0 ).imm );
 
-                // Scan the retrieved instructions and concat the result.
+                // Stop where the flow can not fall through.
                 //
-                std::vector<scan_result> section_results = scan_for_vmentry( text_instructions );
-                results.insert( results.end(), section_results.begin(), section_results.end() );
+                if ( instruction->is_uncond_jmp() || instruction->id == X86_INS_RET || instruction->id == X86_INS_INT3 )
+                    break;
             }
+
+            code_ranges.push_back( { seed, rva } );
         }
 
-        return results;
+        // Scan only the discovered code, minus anything known to be data.
+        //
+        normalize_ranges( code_ranges );
+
+        return scan_for_vmentry( subtract_ranges( code_ranges, metadata.data_ranges ) );
+    }
+
+    // Loads a descriptor ordering profile, used as the initial order of every vm_instance created afterwards.
+    // Returns whether or not the profile could be read, and keeps overlapping descriptors in instruction set order.
+    //
+    bool vmpattack::load_match_profile( const std::string& path )
+    {
+        profile_order = load_descriptor_order( path );
+
+        return profile_order.has_value();
+    }
+
+    // Saves a descriptor ordering profile, ordered by the hit rates accumulated across all vm_instances.
+    // Returns whether or not the profile could be written.
+    //
+    bool vmpattack::save_match_profile( const std::string& path )
+    {
+        vm_match_statistics statistics;
+
+        // Keep the loaded profile's order for descriptors that were never matched.
+        //
+        if ( profile_order )
+            statistics.set_order( *profile_order );
+
+        instances.for_each( [&]( const vm_instance* instance ) { statistics.accumulate( *instance->get_match_statistics() ); } );
+
+        statistics.reorder();
+
+        return save_descriptor_order( path, statistics.get_order() );
+    }
+
+    // Formats the descriptor matching statistics accumulated across all vm_instances.
+    //
+    std::string vmpattack::dump_match_statistics()
+    {
+        vm_match_statistics statistics;
+
+        instances.for_each( [&]( const vm_instance* instance ) { statistics.accumulate( *instance->get_match_statistics() ); } );
+
+        statistics.reorder();
+
+        return statistics.dump();
+    }
+
+    // Attaches the persistent analysis database at the specified path, creating it if needed.
+    // All instances and handlers recorded for the owned image are loaded, and any discovered
+    // afterwards are appended.
+    // Returns the number of records loaded, or empty {} if the database could not be opened.
+    //
+    std::optional<size_t> vmpattack::attach_database( const std::string& path )
+    {
+        // Records are keyed by the image's contents, so an image must be owned.
+        //
+        if ( !image )
+            return {};
+
+        auto opened_database = analysis_database::open( path, analysis_database::compute_image_hash( image.get() ) );
+
+        if ( !opened_database )
+            return {};
+
+        database = std::move( *opened_database );
+
+        std::unordered_set<const vm_instance*> known_instances = {};
+        instances.for_each( [&]( const vm_instance* instance ) { known_instances.insert( instance ); } );
+
+        size_t loaded = database->load( &instances );
+
+        // Start off newly loaded instances with the profiled descriptor order, if any.
+        //
+        if ( profile_order )
+        {
+            instances.for_each( [&]( vm_instance* instance )
+                                {
+                                    if ( !known_instances.contains( instance ) )
+                                        instance->get_match_statistics()->set_order( *profile_order );
+                                } );
+        }
+
+        return loaded;
     }
 }
\ No newline at end of file
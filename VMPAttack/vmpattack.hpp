@@ -1,9 +1,12 @@
 #pragma once
 #include "vm_instance.hpp"
 #include "vmentry.hpp"
+#include "mapped_image.hpp"
+#include "entry_signature.hpp"
+#include "section_index.hpp"
+#include "analysis_database.hpp"
+#include "rva_table.hpp"
 #include <vtil/arch>
-#include <mutex>
-#include <vtil/formats>
 
 namespace vmpattack
 {
@@ -12,13 +15,9 @@ namespace vmpattack
     class vmpattack
     {
     private:
-        // The PE image descriptor.
+        // The read-only mapped PE image.
         //
-        const vtil::pe_image image;
-
-        // The mapped PE image buffer.
-        //
-        const std::vector<uint8_t> mapped_image;
+        const std::unique_ptr<mapped_image> image;
 
         // The image's preferred image base.
         //
@@ -28,54 +27,114 @@ namespace vmpattack
         //
         const uint64_t image_base;
 
-        // A mutex to handle shared writes to the cached instances vector.
+        // The interval index over the image's sections, used for all rva classification.
+        // Empty if no image is owned.
+        //
+        const section_index sections;
+
+        // Returns the section index to bounds-check vip fetches against, or nullptr if
+        // there is no owned image to check against.
+        //
+        inline const section_index* get_fetch_bounds() const { return image ? &sections : nullptr; }
+
+        // Returns the rva disassembly must stop at, ie. the end of the owned image, or no bound
+        // if there is no owned image to check against.
+        //
+        inline uint64_t get_image_end() const { return image ? image->size() : UINT64_MAX; }
+
+        // All cached vm_instances, by rva.
+        //
+        rva_table<vm_instance> instances;
+
+        // The descriptor order loaded from a matching profile, applied to each newly created vm_instance.
+        // Empty if no profile was loaded.
         //
-        std::mutex instances_mutex;
+        std::optional<vm_descriptor_order> profile_order;
 
-        // A vector of all cached vm_instances.
+        // The persistent database newly discovered instances and handlers are appended to.
+        // Null if no database is attached.
         //
-        std::vector<std::unique_ptr<vm_instance>> instances;
+        std::unique_ptr<analysis_database> database;
 
-        // Attempts to find a vm_instance for the specified rva. If succeeded, returns
-        // said instance. Otherwise returns nullptr.
+        // Whether or not the handlers of each newly created vm_instance are harvested before it is lifted.
         //
-        vm_instance* lookup_instance( uint64_t rva );
+        bool harvest_on_discovery = false;
 
-        // Adds the specified vm_instance to the cached list, exersizing thread-safe behaviour
-        // in doing so.
+        // Looks up the vm_instance at the rva, creating it if not yet cached.
+        // If another thread is creating the same vm_instance, waits for it instead.
+        // Newly created vm_instances are recorded into the database, and harvested if enabled.
+        // If creation fails, returns nullptr.
         //
-        void add_instance( std::unique_ptr<vm_instance> instance );
+        vm_instance* find_or_create_instance( uint64_t rva, job_arena* arena );
 
         // Lifts a single basic block, given the appropriate information.
         //
-        bool lift_block( vm_instance* instance, vtil::basic_block* block, vm_context* context, uint64_t first_handler_rva, std::vector<vtil::vip_t> explored_blocks );
+        bool lift_block( vm_instance* instance, vtil::basic_block* block, vm_context* context, uint64_t first_handler_rva, std::vector<vtil::vip_t> explored_blocks, job_arena* arena );
 
         // Performs the specified lifting job, returning a raw, unoptimized vtil routine.
         // Optionally takes in a previous block to fork. If null, creates a new block via a new routine.
         // If the passed previous block is not completed, it is completed with a jmp to the newly created block.
+        // All analysis temporaries are allocated from the job's arena.
         //
-        std::optional<vtil::routine*> lift_internal( uint64_t rva, uint64_t stub, vtil::basic_block* block );
+        std::optional<vtil::routine*> lift_internal( const lifting_job& job, vtil::basic_block* block, job_arena* arena );
 
-        // Scans the given instruction vector for VM entries.
+        // Scans the given rva range for VM entries, via their byte signature.
         // Returns a list of results, of [root rva, lifting_job]
         //
-        std::vector<scan_result> scan_for_vmentry( const std::vector<std::unique_ptr<instruction>>& instructions ) const;
+        std::vector<scan_result> scan_for_vmentry( uint64_t begin_rva, uint64_t end_rva ) const;
+
+        // Scans the given rva ranges for VM entries in parallel, splitting them into overlapping chunks,
+        // and batching small ones together.
+        // Returns a list of results, of [root rva, lifting_job], deduplicated and sorted by rva.
+        //
+        std::vector<scan_result> scan_for_vmentry( const std::vector<rva_range>& ranges ) const;
+
+        // Sweeps the given rva range for potential handler entry points, ie. instructions immediately
+        // following one that ends the control flow, whose flow ends in a bridge-shaped tail.
+        // Returns the candidate rvas, in ascending order.
+        //
+        std::vector<uint64_t> find_handler_candidates( uint64_t begin_rva, uint64_t end_rva ) const;
+
+        // Speculatively matches the handlers of the vm_instance at the given candidate rvas, from its initial vm_state.
+        // Returns the handlers that matched and can safely be cached.
+        //
+        std::vector<std::unique_ptr<vm_handler>> harvest_candidates( vm_instance* instance, const std::vector<uint64_t>& candidates ) const;
+
+        // Pre-discovers the handlers of the vm_instance by matching all candidates within the VMP sections
+        // in parallel, adding every handler found to the instance.
+        // Returns the number of handlers added.
+        //
+        size_t harvest_handlers( vm_instance* instance );
 
     public:
         // Constructor.
         //
         vmpattack( uint64_t preferred_image_base, uint64_t image_base )
-            : preferred_image_base( preferred_image_base ), image_base( image_base )
+            : preferred_image_base( preferred_image_base ), image_base( image_base ), sections()
         {}
 
+        // Construct from a mapped image, taking ownership of it.
+        //
+        vmpattack( std::unique_ptr<mapped_image> image );
+
         // Construct from raw image bytes vector.
         //
         vmpattack( const std::vector<uint8_t>& raw_image_bytes );
 
+        // Drops any cached instructions decoded from the image, as the mapping is about to be released.
+        //
+        ~vmpattack();
+
         // Performs the specified lifting job, returning a raw, unoptimized vtil routine.
         //
         std::optional<vtil::routine*> lift( const lifting_job& job );
 
+        // Creates the vm_instances of the scanned lifting jobs, and decrypts all of their entry stubs
+        // up front, in a single batch per vm_instance.
+        // Jobs whose vm_instance cannot be created are left as is.
+        //
+        void prepare_jobs( std::vector<scan_result>& results );
+
         // Performs an analysis on the specified vmentry stub rva, returning relevant information.
         //
         std::optional<vmentry_analysis_result> analyze_entry_stub( uint64_t rva ) const;
@@ -89,5 +148,38 @@ namespace vmpattack
         // Returns a list of results, of [root rva, lifting_job]
         //
         std::vector<scan_result> scan_for_vmentry() const;
+
+        // Scans only the code described by the image's metadata for VM entries: exception directory
+        // function bodies, and code reachable from the entry point, exports and TLS callbacks.
+        // Images other than AMD64 PE32+ are scanned in all executable sections instead.
+        // Returns a list of results, of [root rva, lifting_job]
+        //
+        std::vector<scan_result> scan_for_vmentry_guided() const;
+
+        // Attaches the persistent analysis database at the specified path, creating it if needed.
+        // All instances and handlers recorded for the owned image are loaded, and any discovered
+        // afterwards are appended.
+        // Returns the number of records loaded, or empty {} if the database could not be opened.
+        //
+        std::optional<size_t> attach_database( const std::string& path );
+
+        // Sets whether or not the handlers of each newly discovered vm_instance are harvested from the VMP
+        // sections in parallel, before the instance is first lifted.
+        //
+        inline void set_harvesting( bool enable ) { harvest_on_discovery = enable; }
+
+        // Loads a descriptor ordering profile, used as the initial order of every vm_instance created afterwards.
+        // Returns whether or not the profile could be read, and keeps overlapping descriptors in instruction set order.
+        //
+        bool load_match_profile( const std::string& path );
+
+        // Saves a descriptor ordering profile, ordered by the hit rates accumulated across all vm_instances.
+        // Returns whether or not the profile could be written.
+        //
+        bool save_match_profile( const std::string& path );
+
+        // Formats the descriptor matching statistics accumulated across all vm_instances.
+        //
+        std::string dump_match_statistics();
     };
 }
\ No newline at end of file